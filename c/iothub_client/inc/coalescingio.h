@@ -0,0 +1,36 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef COALESCINGIO_H
+#define COALESCINGIO_H
+
+#ifdef __cplusplus
+#include <cstddef>
+extern "C" {
+#else
+#include <stddef.h>
+#include <stdbool.h>
+#endif /* __cplusplus */
+
+#include "azure_c_shared_utility/xio.h"
+
+/* size_t: largest write the buffered writes are merged into; 0 sends each write on its own. */
+#define COALESCINGIO_OPTION_MAX_WRITE_SIZE  "coalescing_max_write_size"
+/* bool: while true the writes are buffered; setting it to false sends the buffered bytes. */
+#define COALESCINGIO_OPTION_HOLD_WRITES     "coalescing_hold_writes"
+
+typedef struct COALESCINGIO_CONFIG_TAG
+{
+    /* Owned by the coalescing I/O once it is created; destroyed with it. */
+    XIO_HANDLE underlying_io;
+    size_t max_write_size;
+    bool hold_writes;
+} COALESCINGIO_CONFIG;
+
+extern const IO_INTERFACE_DESCRIPTION* coalescingio_get_interface_description(void);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* COALESCINGIO_H */
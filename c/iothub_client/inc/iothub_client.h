@@ -133,6 +133,26 @@ extern "C"
     */
     extern IOTHUB_CLIENT_RESULT IoTHubClient_SetMessageCallback(IOTHUB_CLIENT_HANDLE iotHubClientHandle, IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC messageCallback, void* userContextCallback);
 
+    /**
+    * @brief	Starts the client worker thread so that the transport connects,
+    * 			authenticates and sets up its links (or subscriptions) ahead of
+    * 			the first message, and sets up the callback to be invoked once
+    * 			the connection is ready to carry messages.
+    *
+    * @param	iotHubClientHandle		   	The handle created by a call to the create function.
+    * @param	connectionReadyCallback	   	The callback invoked every time the transport becomes
+    * 										ready, including after a reconnect. Passing @c NULL
+    * 										returns the transport to lazy connection.
+    * @param	userContextCallback			User specified context that will be provided to the
+    * 										callback. This can be @c NULL.
+    *
+    *			@b NOTE: The application behavior is undefined if the user calls
+    *			the ::IoTHubClient_Destroy function from within any callback.
+    *
+    * @return	IOTHUB_CLIENT_OK upon success or an error code upon failure.
+    */
+    extern IOTHUB_CLIENT_RESULT IoTHubClient_SetConnectionReadyCallback(IOTHUB_CLIENT_HANDLE iotHubClientHandle, IOTHUB_CLIENT_CONNECTION_READY_CALLBACK connectionReadyCallback, void* userContextCallback);
+
     /**
     * @brief	This function returns in the out parameter @p lastMessageReceiveTime
     * 			what was the value of the @c time function when the last message was
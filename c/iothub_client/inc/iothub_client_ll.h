@@ -85,6 +85,7 @@ DEFINE_ENUM(IOTHUBMESSAGE_DISPOSITION_RESULT, IOTHUBMESSAGE_DISPOSITION_RESULT_V
 typedef struct IOTHUB_CLIENT_LL_HANDLE_DATA_TAG* IOTHUB_CLIENT_LL_HANDLE;
 typedef void(*IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK)(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback);
 typedef IOTHUBMESSAGE_DISPOSITION_RESULT (*IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC)(IOTHUB_MESSAGE_HANDLE message, void* userContextCallback);
+typedef void(*IOTHUB_CLIENT_CONNECTION_READY_CALLBACK)(void* userContextCallback);
 typedef const void*(*IOTHUB_CLIENT_TRANSPORT_PROVIDER)(void);
 
 /** @brief	This struct captures IoTHub client configuration. */
@@ -245,6 +246,27 @@ extern IOTHUB_CLIENT_RESULT IoTHubClient_LL_GetSendStatus(IOTHUB_CLIENT_LL_HANDL
  */
 extern IOTHUB_CLIENT_RESULT IoTHubClient_LL_SetMessageCallback(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC messageCallback, void* userContextCallback);
 
+/**
+ * @brief	Requests that the transport connects, authenticates and sets up its
+ * 			links (or subscriptions) ahead of the first message instead of
+ * 			lazily on the first send, and sets up the callback to be invoked
+ * 			once the connection is ready to carry messages.
+ *
+ * @param	iotHubClientHandle		   	The handle created by a call to the create function.
+ * @param	connectionReadyCallback	   	The callback invoked from ::IoTHubClient_LL_DoWork
+ * 										every time the transport becomes ready, including
+ * 										after a reconnect. Passing @c NULL returns the
+ * 										transport to lazy connection.
+ * @param	userContextCallback			User specified context that will be provided to the
+ * 										callback. This can be @c NULL.
+ *
+ *			@b NOTE: The application behavior is undefined if the user calls
+ *			the ::IoTHubClient_LL_Destroy function from within any callback.
+ * 
+ * @return	IOTHUB_CLIENT_OK upon success or an error code upon failure.
+ */
+extern IOTHUB_CLIENT_RESULT IoTHubClient_LL_SetConnectionReadyCallback(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, IOTHUB_CLIENT_CONNECTION_READY_CALLBACK connectionReadyCallback, void* userContextCallback);
+
 /**
  * @brief	This function returns in the out parameter @p lastMessageReceiveTime
  * 			what was the value of the @c time function when the last message was
@@ -36,6 +36,9 @@ DEFINE_ENUM(IOTHUB_BATCHSTATE_RESULT, IOTHUB_BATCHSTATE_RESULT_VALUES);
 
 extern void IoTHubClient_LL_SendComplete(IOTHUB_CLIENT_LL_HANDLE handle, PDLIST_ENTRY completed, IOTHUB_BATCHSTATE_RESULT result);
 extern IOTHUBMESSAGE_DISPOSITION_RESULT IoTHubClient_LL_MessageCallback(IOTHUB_CLIENT_LL_HANDLE handle, IOTHUB_MESSAGE_HANDLE message);
+extern void IoTHubClient_LL_ConnectionReady(IOTHUB_CLIENT_LL_HANDLE handle);
+/* creates a byte array message pointing to byteArray without copying it; byteArray must outlive the message (IoTHubMessage_Clone copies it) */
+extern IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromBorrowedByteArray(const unsigned char* byteArray, size_t size);
 
 typedef struct IOTHUB_MESSAGE_LIST_TAG
 {
@@ -25,6 +25,8 @@ typedef int (*pfIoTHubTransport_Subscribe)(IOTHUB_DEVICE_HANDLE handle);
 typedef void (*pfIoTHubTransport_Unsubscribe)(IOTHUB_DEVICE_HANDLE handle);
 typedef void (*pfIoTHubTransport_DoWork)(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle);
 typedef IOTHUB_CLIENT_RESULT(*pfIoTHubTransport_GetSendStatus)(IOTHUB_DEVICE_HANDLE handle, IOTHUB_CLIENT_STATUS *iotHubClientStatus);
+typedef void (*pfIoTHubTransport_EventQueued)(IOTHUB_DEVICE_HANDLE handle);
+typedef IOTHUB_CLIENT_RESULT(*pfIoTHubTransport_SetDeviceOption)(IOTHUB_DEVICE_HANDLE handle, const char *optionName, const void* value);
 
 #define TRANSPORT_PROVIDER_FIELDS                            \
 pfIoTHubTransport_SetOption IoTHubTransport_SetOption;       \
@@ -35,7 +37,9 @@ pfIotHubTransport_Unregister IoTHubTransport_Unregister;      \
 pfIoTHubTransport_Subscribe IoTHubTransport_Subscribe;       \
 pfIoTHubTransport_Unsubscribe IoTHubTransport_Unsubscribe;   \
 pfIoTHubTransport_DoWork IoTHubTransport_DoWork;             \
-pfIoTHubTransport_GetSendStatus IoTHubTransport_GetSendStatus  /*there's an intentional missing ; on this line*/ \
+pfIoTHubTransport_GetSendStatus IoTHubTransport_GetSendStatus; \
+pfIoTHubTransport_EventQueued IoTHubTransport_EventQueued;  /*optional, can be NULL*/ \
+pfIoTHubTransport_SetDeviceOption IoTHubTransport_SetDeviceOption  /*optional, can be NULL. there's an intentional missing ; on this line*/ \
 
 typedef struct TRANSPORT_PROVIDER_TAG
 {
@@ -24,6 +24,7 @@ extern "C"
 
     extern IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_GetSendStatus(IOTHUB_DEVICE_HANDLE handle, IOTHUB_CLIENT_STATUS *iotHubClientStatus);
     extern IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_SetOption(TRANSPORT_LL_HANDLE handle, const char* optionName, const void* value);
+    extern IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_SetDeviceOption(IOTHUB_DEVICE_HANDLE handle, const char* optionName, const void* value);
     extern const void* MQTT_Protocol(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,324 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdlib.h>
+#ifdef _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#endif
+#include "azure_c_shared_utility/gballoc.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "azure_c_shared_utility/iot_logging.h"
+#include "azure_c_shared_utility/xio.h"
+#include "coalescingio.h"
+
+typedef struct PENDING_SEND_COMPLETE_TAG
+{
+    ON_SEND_COMPLETE on_send_complete;
+    void* context;
+} PENDING_SEND_COMPLETE;
+
+// Send completions of the writes merged into one underlying write.
+typedef struct COALESCED_WRITE_TAG
+{
+    PENDING_SEND_COMPLETE* completions;
+    size_t count;
+} COALESCED_WRITE;
+
+typedef struct COALESCING_IO_INSTANCE_TAG
+{
+    XIO_HANDLE underlying_io;
+    size_t max_write_size;
+    bool hold_writes;
+    unsigned char* buffer;
+    size_t length;
+    PENDING_SEND_COMPLETE* completions;
+    size_t completion_count;
+    size_t completion_capacity;
+} COALESCING_IO_INSTANCE;
+
+static void complete_sends(PENDING_SEND_COMPLETE* completions, size_t count, IO_SEND_RESULT send_result)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        completions[i].on_send_complete(completions[i].context, send_result);
+    }
+}
+
+static void on_coalesced_write_complete(void* context, IO_SEND_RESULT send_result)
+{
+    COALESCED_WRITE* write = (COALESCED_WRITE*)context;
+
+    /* Codes_SRS_COALESCINGIO_01_012: [When the underlying send of the merged bytes completes, each write merged into it shall be completed with the result of that send, in the order the writes were made.] */
+    complete_sends(write->completions, write->count, send_result);
+
+    free(write->completions);
+    free(write);
+}
+
+static int flush_coalesced_writes(COALESCING_IO_INSTANCE* coalescing_io)
+{
+    int result;
+    COALESCED_WRITE* write = NULL;
+
+    if (coalescing_io->length == 0)
+    {
+        result = 0;
+    }
+    else if (coalescing_io->completion_count > 0 &&
+        (write = (COALESCED_WRITE*)malloc(sizeof(COALESCED_WRITE))) == NULL)
+    {
+        // The bytes stay buffered for the next flush.
+        LogError("Failed allocating the coalesced write.\r\n");
+        result = __LINE__;
+    }
+    else
+    {
+        if (write != NULL)
+        {
+            write->completions = coalescing_io->completions;
+            write->count = coalescing_io->completion_count;
+
+            coalescing_io->completions = NULL;
+            coalescing_io->completion_count = 0;
+            coalescing_io->completion_capacity = 0;
+        }
+
+        /* Codes_SRS_COALESCINGIO_01_011: [The buffered bytes shall be sent to the underlying I/O with one xio_send call.] */
+        if (xio_send(coalescing_io->underlying_io, coalescing_io->buffer, coalescing_io->length, (write == NULL) ? NULL : on_coalesced_write_complete, write) != 0)
+        {
+            /* Codes_SRS_COALESCINGIO_01_013: [If that xio_send fails, each write merged into it shall be completed with IO_SEND_ERROR.] */
+            LogError("Failed sending the coalesced write.\r\n");
+
+            if (write != NULL)
+            {
+                on_coalesced_write_complete(write, IO_SEND_ERROR);
+            }
+
+            result = __LINE__;
+        }
+        else
+        {
+            result = 0;
+        }
+
+        coalescing_io->length = 0;
+    }
+
+    return result;
+}
+
+static int add_pending_send_complete(COALESCING_IO_INSTANCE* coalescing_io, ON_SEND_COMPLETE on_send_complete, void* context)
+{
+    int result;
+
+    if (coalescing_io->completion_count == coalescing_io->completion_capacity)
+    {
+        size_t new_capacity = (coalescing_io->completion_capacity == 0) ? 8 : coalescing_io->completion_capacity * 2;
+        PENDING_SEND_COMPLETE* completions = (PENDING_SEND_COMPLETE*)realloc(coalescing_io->completions, new_capacity * sizeof(PENDING_SEND_COMPLETE));
+
+        if (completions == NULL)
+        {
+            LogError("Failed growing the coalesced send completions.\r\n");
+            result = __LINE__;
+        }
+        else
+        {
+            coalescing_io->completions = completions;
+            coalescing_io->completion_capacity = new_capacity;
+            result = 0;
+        }
+    }
+    else
+    {
+        result = 0;
+    }
+
+    if (result == 0)
+    {
+        coalescing_io->completions[coalescing_io->completion_count].on_send_complete = on_send_complete;
+        coalescing_io->completions[coalescing_io->completion_count].context = context;
+        coalescing_io->completion_count++;
+    }
+
+    return result;
+}
+
+static CONCRETE_IO_HANDLE coalescingio_create(void* io_create_parameters, LOGGER_LOG logger_log)
+{
+    const COALESCINGIO_CONFIG* config = (const COALESCINGIO_CONFIG*)io_create_parameters;
+    COALESCING_IO_INSTANCE* result;
+
+    (void)logger_log;
+
+    /* Codes_SRS_COALESCINGIO_01_002: [If io_create_parameters is NULL or its underlying_io is NULL, coalescingio_create shall fail and return NULL.] */
+    if (config == NULL || config->underlying_io == NULL)
+    {
+        LogError("Invalid coalescing I/O configuration.\r\n");
+        result = NULL;
+    }
+    /* Codes_SRS_COALESCINGIO_01_003: [If allocating the instance fails, coalescingio_create shall return NULL.] */
+    else if ((result = (COALESCING_IO_INSTANCE*)malloc(sizeof(COALESCING_IO_INSTANCE))) == NULL)
+    {
+        LogError("Failed allocating the coalescing I/O.\r\n");
+    }
+    else
+    {
+        /* Codes_SRS_COALESCINGIO_01_001: [coalescingio_create shall return a handle wrapping the underlying_io of the COALESCINGIO_CONFIG passed in io_create_parameters, with its max_write_size and hold_writes settings; the buffer shall only be allocated by the first buffered write.] */
+        result->underlying_io = config->underlying_io;
+        result->max_write_size = config->max_write_size;
+        result->hold_writes = config->hold_writes;
+        result->buffer = NULL;
+        result->length = 0;
+        result->completions = NULL;
+        result->completion_count = 0;
+        result->completion_capacity = 0;
+    }
+
+    return result;
+}
+
+static void coalescingio_destroy(CONCRETE_IO_HANDLE concrete_io)
+{
+    COALESCING_IO_INSTANCE* coalescing_io = (COALESCING_IO_INSTANCE*)concrete_io;
+
+    if (coalescing_io != NULL)
+    {
+        /* Codes_SRS_COALESCINGIO_01_020: [coalescingio_destroy shall complete the writes still buffered with IO_SEND_CANCELLED, without sending them.] */
+        complete_sends(coalescing_io->completions, coalescing_io->completion_count, IO_SEND_CANCELLED);
+
+        /* Codes_SRS_COALESCINGIO_01_021: [coalescingio_destroy shall destroy the underlying I/O and free all the resources of the instance.] */
+        xio_destroy(coalescing_io->underlying_io);
+        free(coalescing_io->completions);
+        free(coalescing_io->buffer);
+        free(coalescing_io);
+    }
+}
+
+static int coalescingio_open(CONCRETE_IO_HANDLE concrete_io, ON_IO_OPEN_COMPLETE on_io_open_complete, ON_BYTES_RECEIVED on_bytes_received, ON_IO_ERROR on_io_error, void* callback_context)
+{
+    /* Codes_SRS_COALESCINGIO_01_004: [coalescingio_open shall call xio_open on the underlying I/O with the same arguments and return its result.] */
+    return xio_open(((COALESCING_IO_INSTANCE*)concrete_io)->underlying_io, on_io_open_complete, on_bytes_received, on_io_error, callback_context);
+}
+
+static int coalescingio_close(CONCRETE_IO_HANDLE concrete_io, ON_IO_CLOSE_COMPLETE on_io_close_complete, void* callback_context)
+{
+    COALESCING_IO_INSTANCE* coalescing_io = (COALESCING_IO_INSTANCE*)concrete_io;
+
+    /* Codes_SRS_COALESCINGIO_01_005: [coalescingio_close shall send the buffered bytes and then call xio_close on the underlying I/O, returning its result.] */
+    (void)flush_coalesced_writes(coalescing_io);
+
+    return xio_close(coalescing_io->underlying_io, on_io_close_complete, callback_context);
+}
+
+static int coalescingio_send(CONCRETE_IO_HANDLE concrete_io, const void* buffer, size_t size, ON_SEND_COMPLETE on_send_complete, void* callback_context)
+{
+    COALESCING_IO_INSTANCE* coalescing_io = (COALESCING_IO_INSTANCE*)concrete_io;
+    int result;
+
+    /* Codes_SRS_COALESCINGIO_01_008: [If the writes are not held, max_write_size is 0 or size is larger than max_write_size, coalescingio_send shall send the buffered bytes first and then pass the write to the underlying I/O with xio_send.] */
+    if (!coalescing_io->hold_writes || coalescing_io->max_write_size == 0 || size > coalescing_io->max_write_size)
+    {
+        if (flush_coalesced_writes(coalescing_io) != 0)
+        {
+            result = __LINE__;
+        }
+        else
+        {
+            result = xio_send(coalescing_io->underlying_io, buffer, size, on_send_complete, callback_context);
+        }
+    }
+    /* Codes_SRS_COALESCINGIO_01_007: [If the write does not fit in the space left in the buffer, coalescingio_send shall send the buffered bytes before copying it.] */
+    else if (coalescing_io->length + size > coalescing_io->max_write_size &&
+        flush_coalesced_writes(coalescing_io) != 0)
+    {
+        result = __LINE__;
+    }
+    else if (coalescing_io->buffer == NULL &&
+        (coalescing_io->buffer = (unsigned char*)malloc(coalescing_io->max_write_size)) == NULL)
+    {
+        /* Codes_SRS_COALESCINGIO_01_009: [If the buffer cannot be allocated or the send completion cannot be saved, coalescingio_send shall fail and return a non-zero value.] */
+        LogError("Failed allocating the coalescing buffer.\r\n");
+        result = __LINE__;
+    }
+    else if (on_send_complete != NULL &&
+        add_pending_send_complete(coalescing_io, on_send_complete, callback_context) != 0)
+    {
+        result = __LINE__;
+    }
+    else
+    {
+        /* Codes_SRS_COALESCINGIO_01_006: [While the writes are held, coalescingio_send shall copy the bytes into a buffer of max_write_size bytes, keep on_send_complete for when they are sent and return 0.] */
+        (void)memcpy(coalescing_io->buffer + coalescing_io->length, buffer, size);
+        coalescing_io->length += size;
+        result = 0;
+    }
+
+    return result;
+}
+
+static void coalescingio_dowork(CONCRETE_IO_HANDLE concrete_io)
+{
+    COALESCING_IO_INSTANCE* coalescing_io = (COALESCING_IO_INSTANCE*)concrete_io;
+
+    /* Codes_SRS_COALESCINGIO_01_010: [coalescingio_dowork shall send the buffered bytes, call xio_dowork on the underlying I/O and then send the bytes buffered while it ran.] */
+    // Writes made since the last DoWork go out first, then those made in reaction to the bytes received.
+    (void)flush_coalesced_writes(coalescing_io);
+    xio_dowork(coalescing_io->underlying_io);
+    (void)flush_coalesced_writes(coalescing_io);
+}
+
+static int coalescingio_setoption(CONCRETE_IO_HANDLE concrete_io, const char* optionName, const void* value)
+{
+    COALESCING_IO_INSTANCE* coalescing_io = (COALESCING_IO_INSTANCE*)concrete_io;
+    int result;
+
+    /* Codes_SRS_COALESCINGIO_01_014: [If optionName is COALESCINGIO_OPTION_HOLD_WRITES, coalescingio_setoption shall save the bool value; setting it to false shall send the buffered bytes.] */
+    if (strcmp(COALESCINGIO_OPTION_HOLD_WRITES, optionName) == 0)
+    {
+        coalescing_io->hold_writes = *((bool*)value);
+        result = coalescing_io->hold_writes ? 0 : flush_coalesced_writes(coalescing_io);
+    }
+    /* Codes_SRS_COALESCINGIO_01_015: [If optionName is COALESCINGIO_OPTION_MAX_WRITE_SIZE, coalescingio_setoption shall send the buffered bytes, release the buffer and save the size_t value.] */
+    else if (strcmp(COALESCINGIO_OPTION_MAX_WRITE_SIZE, optionName) == 0)
+    {
+        if (flush_coalesced_writes(coalescing_io) != 0)
+        {
+            result = __LINE__;
+        }
+        else
+        {
+            free(coalescing_io->buffer);
+            coalescing_io->buffer = NULL;
+            coalescing_io->max_write_size = *((size_t*)value);
+            result = 0;
+        }
+    }
+    /* Codes_SRS_COALESCINGIO_01_016: [Any other option shall be passed to xio_setoption on the underlying I/O, returning its result.] */
+    else
+    {
+        result = xio_setoption(coalescing_io->underlying_io, optionName, value);
+    }
+
+    return result;
+}
+
+static const IO_INTERFACE_DESCRIPTION coalescing_io_interface_description =
+{
+    coalescingio_create,
+    coalescingio_destroy,
+    coalescingio_open,
+    coalescingio_close,
+    coalescingio_send,
+    coalescingio_dowork,
+    coalescingio_setoption
+};
+
+const IO_INTERFACE_DESCRIPTION* coalescingio_get_interface_description(void)
+{
+    return &coalescing_io_interface_description;
+}
@@ -464,6 +464,50 @@ IOTHUB_CLIENT_RESULT IoTHubClient_SetMessageCallback(IOTHUB_CLIENT_HANDLE iotHub
     return result;
 }
 
+IOTHUB_CLIENT_RESULT IoTHubClient_SetConnectionReadyCallback(IOTHUB_CLIENT_HANDLE iotHubClientHandle, IOTHUB_CLIENT_CONNECTION_READY_CALLBACK connectionReadyCallback, void* userContextCallback)
+{
+    IOTHUB_CLIENT_RESULT result;
+
+    if (iotHubClientHandle == NULL)
+    {
+        /* Codes_SRS_IOTHUBCLIENT_09_010: [If iotHubClientHandle is NULL, IoTHubClient_SetConnectionReadyCallback shall return IOTHUB_CLIENT_INVALID_ARG.] */
+        result = IOTHUB_CLIENT_INVALID_ARG;
+        LogError("NULL iothubClientHandle\r\n");
+    }
+    else
+    {
+        IOTHUB_CLIENT_INSTANCE* iotHubClientInstance = (IOTHUB_CLIENT_INSTANCE*)iotHubClientHandle;
+
+        /* Codes_SRS_IOTHUBCLIENT_09_011: [IoTHubClient_SetConnectionReadyCallback shall be made thread-safe by using the lock created in IoTHubClient_Create.] */
+        if (Lock(iotHubClientInstance->LockHandle) != LOCK_OK)
+        {
+            /* Codes_SRS_IOTHUBCLIENT_09_012: [If acquiring the lock fails, IoTHubClient_SetConnectionReadyCallback shall return IOTHUB_CLIENT_ERROR.] */
+            result = IOTHUB_CLIENT_ERROR;
+            LogError("Could not acquire lock\r\n");
+        }
+        else
+        {
+            /* Codes_SRS_IOTHUBCLIENT_09_013: [IoTHubClient_SetConnectionReadyCallback shall start the worker thread if it was not previously started.] */
+            if ((result = StartWorkerThreadIfNeeded(iotHubClientInstance)) != IOTHUB_CLIENT_OK)
+            {
+                /* Codes_SRS_IOTHUBCLIENT_09_014: [If starting the thread fails, IoTHubClient_SetConnectionReadyCallback shall return IOTHUB_CLIENT_ERROR.] */
+                result = IOTHUB_CLIENT_ERROR;
+                LogError("Could not start worker thread\r\n");
+            }
+            else
+            {
+                /* Codes_SRS_IOTHUBCLIENT_09_015: [IoTHubClient_SetConnectionReadyCallback shall call IoTHubClient_LL_SetConnectionReadyCallback, while passing the IoTHubClient_LL handle created by IoTHubClient_Create and the parameters connectionReadyCallback and userContextCallback.] */
+                result = IoTHubClient_LL_SetConnectionReadyCallback(iotHubClientInstance->IoTHubClientLLHandle, connectionReadyCallback, userContextCallback);
+            }
+
+            /* Codes_SRS_IOTHUBCLIENT_09_011: [IoTHubClient_SetConnectionReadyCallback shall be made thread-safe by using the lock created in IoTHubClient_Create.] */
+            Unlock(iotHubClientInstance->LockHandle);
+        }
+    }
+
+    return result;
+}
+
 IOTHUB_CLIENT_RESULT IoTHubClient_GetLastMessageReceiveTime(IOTHUB_CLIENT_HANDLE iotHubClientHandle, time_t* lastMessageReceiveTime)
 {
     IOTHUB_CLIENT_RESULT result;
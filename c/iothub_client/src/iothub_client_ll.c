@@ -31,6 +31,8 @@ typedef struct IOTHUB_CLIENT_LL_HANDLE_DATA_TAG
     TRANSPORT_PROVIDER_FIELDS;
     IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC messageCallback;
     void* messageUserContextCallback;
+    IOTHUB_CLIENT_CONNECTION_READY_CALLBACK connectionReadyCallback;
+    void* connectionReadyUserContextCallback;
     time_t lastMessageReceiveTime;
     TICK_COUNTER_HANDLE tickCounter; /*shared tickcounter used to track message timeouts in waitingToSend list*/
     uint64_t currentMessageTimeout;
@@ -257,6 +259,8 @@ static void setTransportProtocol(IOTHUB_CLIENT_LL_HANDLE_DATA* handleData, TRANS
 	handleData->IoTHubTransport_Unsubscribe = protocol->IoTHubTransport_Unsubscribe;
 	handleData->IoTHubTransport_DoWork = protocol->IoTHubTransport_DoWork;
 	handleData->IoTHubTransport_GetSendStatus = protocol->IoTHubTransport_GetSendStatus;
+	handleData->IoTHubTransport_EventQueued = protocol->IoTHubTransport_EventQueued;
+	handleData->IoTHubTransport_SetDeviceOption = protocol->IoTHubTransport_SetDeviceOption;
 
 }
 
@@ -296,6 +300,8 @@ IOTHUB_CLIENT_LL_HANDLE IoTHubClient_LL_Create(const IOTHUB_CLIENT_CONFIG* confi
 			setTransportProtocol(handleData, (TRANSPORT_PROVIDER*)config->protocol());
             handleData->messageCallback = NULL;
             handleData->messageUserContextCallback = NULL;
+            handleData->connectionReadyCallback = NULL;
+            handleData->connectionReadyUserContextCallback = NULL;
             handleData->lastMessageReceiveTime = INDEFINITE_TIME;
             /*Codes_SRS_IOTHUBCLIENT_LL_02_006: [IoTHubClient_LL_Create shall populate a structure of type IOTHUBTRANSPORT_CONFIG with the information from config parameter and the previous DLIST and shall pass that to the underlying layer _Create function.]*/
             lowerLayerConfig.upperConfig = config;
@@ -374,6 +380,8 @@ IOTHUB_CLIENT_LL_HANDLE IoTHubClient_LL_CreateWithTransport(const IOTHUB_CLIENT_
 			setTransportProtocol(handleData, (TRANSPORT_PROVIDER*)config->protocol());
 			handleData->messageCallback = NULL;
 			handleData->messageUserContextCallback = NULL;
+			handleData->connectionReadyCallback = NULL;
+			handleData->connectionReadyUserContextCallback = NULL;
 			handleData->lastMessageReceiveTime = INDEFINITE_TIME;
 			handleData->transportHandle = config->transportHandle;
 			/*Codes_SRS_IOTHUBCLIENT_LL_17_006: [IoTHubClient_LL_CreateWithTransport shall call the transport _Register function with the deviceId, DeviceKey and waitingToSend list.]*/
@@ -509,6 +517,11 @@ IOTHUB_CLIENT_RESULT IoTHubClient_LL_SendEventAsync(IOTHUB_CLIENT_LL_HANDLE iotH
                 newEntry->callback = eventConfirmationCallback;
                 newEntry->context = userContextCallback;
                 DList_InsertTailList(&(handleData->waitingToSend), &(newEntry->entry));
+                /*Codes_SRS_IOTHUBCLIENT_LL_09_016: [If the transport provides _EventQueued, IoTHubClient_LL_SendEventAsync shall call it with the device handle after adding the record to waitingToSend.]*/
+                if (handleData->IoTHubTransport_EventQueued != NULL)
+                {
+                    handleData->IoTHubTransport_EventQueued(handleData->deviceHandle);
+                }
                 /*Codes_SRS_IOTHUBCLIENT_LL_02_015: [Otherwise IoTHubClient_LL_SendEventAsync shall succeed and return IOTHUB_CLIENT_OK.] */
                 result = IOTHUB_CLIENT_OK;
             }
@@ -560,6 +573,45 @@ IOTHUB_CLIENT_RESULT IoTHubClient_LL_SetMessageCallback(IOTHUB_CLIENT_LL_HANDLE
     return result;
 }
 
+/*Codes_SRS_IOTHUBCLIENT_LL_09_017: [If the transport provides _SetDeviceOption, the options shall be set by calling it with the device handle instead of calling _SetOption with the transport handle.]*/
+static IOTHUB_CLIENT_RESULT setTransportOption(IOTHUB_CLIENT_LL_HANDLE_DATA* handleData, const char* optionName, const void* value)
+{
+    return (handleData->IoTHubTransport_SetDeviceOption != NULL) ?
+        handleData->IoTHubTransport_SetDeviceOption(handleData->deviceHandle, optionName, value) :
+        handleData->IoTHubTransport_SetOption(handleData->transportHandle, optionName, value);
+}
+
+IOTHUB_CLIENT_RESULT IoTHubClient_LL_SetConnectionReadyCallback(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, IOTHUB_CLIENT_CONNECTION_READY_CALLBACK connectionReadyCallback, void* userContextCallback)
+{
+    IOTHUB_CLIENT_RESULT result;
+    /*Codes_SRS_IOTHUBCLIENT_LL_09_010: [IoTHubClient_LL_SetConnectionReadyCallback shall fail and return IOTHUB_CLIENT_INVALID_ARG if parameter iotHubClientHandle is NULL.]*/
+    if (iotHubClientHandle == NULL)
+    {
+        result = IOTHUB_CLIENT_INVALID_ARG;
+        LOG_ERROR;
+    }
+    else
+    {
+        IOTHUB_CLIENT_LL_HANDLE_DATA* handleData = (IOTHUB_CLIENT_LL_HANDLE_DATA*)iotHubClientHandle;
+        /*Codes_SRS_IOTHUBCLIENT_LL_09_011: [IoTHubClient_LL_SetConnectionReadyCallback shall call the underlying layer's _SetOption function with option "eagerConnect" set to true if connectionReadyCallback is non-NULL and false otherwise.]*/
+        bool eagerConnect = (connectionReadyCallback != NULL);
+        result = setTransportOption(handleData, "eagerConnect", &eagerConnect);
+        if (result != IOTHUB_CLIENT_OK)
+        {
+            /*Codes_SRS_IOTHUBCLIENT_LL_09_012: [If the underlying layer's _SetOption function fails, IoTHubClient_LL_SetConnectionReadyCallback shall return what _SetOption returned and shall keep the previous callback.]*/
+            LOG_ERROR;
+        }
+        else
+        {
+            /*Codes_SRS_IOTHUBCLIENT_LL_09_013: [Otherwise IoTHubClient_LL_SetConnectionReadyCallback shall save connectionReadyCallback and userContextCallback and return IOTHUB_CLIENT_OK.]*/
+            handleData->connectionReadyCallback = connectionReadyCallback;
+            handleData->connectionReadyUserContextCallback = (connectionReadyCallback == NULL) ? NULL : userContextCallback;
+        }
+    }
+
+    return result;
+}
+
 static void DoTimeouts(IOTHUB_CLIENT_LL_HANDLE_DATA* handleData)
 {
     uint64_t nowTick;
@@ -689,6 +741,24 @@ IOTHUBMESSAGE_DISPOSITION_RESULT IoTHubClient_LL_MessageCallback(IOTHUB_CLIENT_L
     return result;
 }
 
+void IoTHubClient_LL_ConnectionReady(IOTHUB_CLIENT_LL_HANDLE handle)
+{
+    /*Codes_SRS_IOTHUBCLIENT_LL_09_014: [If parameter handle is NULL then IoTHubClient_LL_ConnectionReady shall return.]*/
+    if (handle == NULL)
+    {
+        LogError("invalid argument\r\n");
+    }
+    else
+    {
+        IOTHUB_CLIENT_LL_HANDLE_DATA* handleData = (IOTHUB_CLIENT_LL_HANDLE_DATA*)handle;
+        /*Codes_SRS_IOTHUBCLIENT_LL_09_015: [IoTHubClient_LL_ConnectionReady shall invoke the last non-NULL callback set by IoTHubClient_LL_SetConnectionReadyCallback passing the saved userContextCallback.]*/
+        if (handleData->connectionReadyCallback != NULL)
+        {
+            handleData->connectionReadyCallback(handleData->connectionReadyUserContextCallback);
+        }
+    }
+}
+
 IOTHUB_CLIENT_RESULT IoTHubClient_LL_GetLastMessageReceiveTime(IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, time_t* lastMessageReceiveTime)
 {
     IOTHUB_CLIENT_RESULT result;
@@ -751,7 +821,7 @@ IOTHUB_CLIENT_RESULT IoTHubClient_LL_SetOption(IOTHUB_CLIENT_LL_HANDLE iotHubCli
         else
         {
         /*Codes_SRS_IOTHUBCLIENT_LL_02_038: [Otherwise, IoTHubClient_LL shall call the function _SetOption of the underlying transport and return what that function is returning.] */
-        result = handleData->IoTHubTransport_SetOption(handleData->transportHandle, optionName, value);
+        result = setTransportOption(handleData, optionName, value);
 
         if (result != IOTHUB_CLIENT_OK)
         {
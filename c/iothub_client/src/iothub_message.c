@@ -10,6 +10,7 @@
 #include "azure_c_shared_utility/buffer_.h"
 
 #include "iothub_message.h"
+#include "iothub_client_private.h"
 
 DEFINE_ENUM_STRINGS(IOTHUB_MESSAGE_RESULT, IOTHUB_MESSAGE_RESULT_VALUES);
 DEFINE_ENUM_STRINGS(IOTHUBMESSAGE_CONTENT_TYPE, IOTHUBMESSAGE_CONTENT_TYPE_VALUES);
@@ -28,6 +29,9 @@ typedef struct IOTHUB_MESSAGE_HANDLE_DATA_TAG
     MAP_HANDLE properties;
     char* messageId;
     char* correlationId;
+    /*bytes owned by the caller of IoTHubMessage_CreateFromBorrowedByteArray, used instead of value.byteArray when not NULL*/
+    const unsigned char* borrowedBytes;
+    size_t borrowedSize;
 }IOTHUB_MESSAGE_HANDLE_DATA;
 
 static bool ContainsOnlyUsAscii(const char* asciiValue)
@@ -122,12 +126,48 @@ IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromByteArray(const unsigned char* byt
                 result->contentType = IOTHUBMESSAGE_BYTEARRAY;
                 result->messageId = NULL;
                 result->correlationId = NULL;
+                result->borrowedBytes = NULL;
+                result->borrowedSize = 0;
                 /*all is fine, return result*/
             }
         }
     }
     return result;
 }
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromBorrowedByteArray(const unsigned char* byteArray, size_t size)
+{
+    IOTHUB_MESSAGE_HANDLE_DATA* result;
+    if ((byteArray == NULL) || (size == 0))
+    {
+        /*Codes_SRS_IOTHUBMESSAGE_09_002: [If byteArray is NULL or size is zero, IoTHubMessage_CreateFromBorrowedByteArray shall behave as IoTHubMessage_CreateFromByteArray.] */
+        result = IoTHubMessage_CreateFromByteArray(byteArray, size);
+    }
+    else if ((result = malloc(sizeof(IOTHUB_MESSAGE_HANDLE_DATA))) == NULL)
+    {
+        LogError("unable to malloc\r\n");
+        /*Codes_SRS_IOTHUBMESSAGE_09_004: [If there are any errors then IoTHubMessage_CreateFromBorrowedByteArray shall return NULL.] */
+    }
+    /*Codes_SRS_IOTHUBMESSAGE_09_003: [IoTHubMessage_CreateFromBorrowedByteArray shall call Map_Create to create the message properties.] */
+    else if ((result->properties = Map_Create(ValidateAsciiCharactersFilter)) == NULL)
+    {
+        LogError("Map_Create failed\r\n");
+        /*Codes_SRS_IOTHUBMESSAGE_09_004: [If there are any errors then IoTHubMessage_CreateFromBorrowedByteArray shall return NULL.] */
+        free(result);
+        result = NULL;
+    }
+    else
+    {
+        /*Codes_SRS_IOTHUBMESSAGE_09_001: [IoTHubMessage_CreateFromBorrowedByteArray shall create a IOTHUBMESSAGE_BYTEARRAY message whose content points to byteArray without copying it; byteArray shall outlive the message.] */
+        result->contentType = IOTHUBMESSAGE_BYTEARRAY;
+        result->value.byteArray = NULL;
+        result->messageId = NULL;
+        result->correlationId = NULL;
+        result->borrowedBytes = byteArray;
+        result->borrowedSize = size;
+    }
+    return result;
+}
 IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromString(const char* source)
 {
     IOTHUB_MESSAGE_HANDLE_DATA* result;
@@ -164,6 +204,8 @@ IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromString(const char* source)
             result->contentType = IOTHUBMESSAGE_STRING;
             result->messageId = NULL;
             result->correlationId = NULL;
+            result->borrowedBytes = NULL;
+            result->borrowedSize = 0;
         }
     }
     return result;
@@ -194,6 +236,8 @@ IOTHUB_MESSAGE_HANDLE IoTHubMessage_Clone(IOTHUB_MESSAGE_HANDLE iotHubMessageHan
         {
             result->messageId = NULL;
             result->correlationId = NULL;
+            result->borrowedBytes = NULL;
+            result->borrowedSize = 0;
             if (source->messageId != NULL && mallocAndStrcpy_s(&result->messageId, source->messageId) != 0)
             {
                 LogError("unable to Copy messageId\r\n");
@@ -214,7 +258,8 @@ IOTHUB_MESSAGE_HANDLE IoTHubMessage_Clone(IOTHUB_MESSAGE_HANDLE iotHubMessageHan
             else if (source->contentType == IOTHUBMESSAGE_BYTEARRAY)
             {
                 /*Codes_SRS_IOTHUBMESSAGE_02_006: [IoTHubMessage_Clone shall clone to content by a call to BUFFER_clone] */
-                if ((result->value.byteArray = BUFFER_clone(source->value.byteArray)) == NULL)
+                /*Codes_SRS_IOTHUBMESSAGE_09_005: [IoTHubMessage_Clone of a message with borrowed content shall copy the content by a call to BUFFER_create, so the clone owns its content.] */
+                if ((result->value.byteArray = ((source->borrowedBytes != NULL) ? BUFFER_create(source->borrowedBytes, source->borrowedSize) : BUFFER_clone(source->value.byteArray))) == NULL)
                 {
                     /*Codes_SRS_IOTHUBMESSAGE_03_004: [IoTHubMessage_Clone shall return NULL if it fails for any reason.]*/
                     LogError("unable to BUFFER_clone\r\n");
@@ -331,10 +376,19 @@ IOTHUB_MESSAGE_RESULT IoTHubMessage_GetByteArray(IOTHUB_MESSAGE_HANDLE iotHubMes
         }
         else
         {
-            /*Codes_SRS_IOTHUBMESSAGE_01_011: [The pointer shall be obtained by using BUFFER_u_char and it shall be copied in the buffer argument.]*/
-            *buffer = BUFFER_u_char(handleData->value.byteArray);
-            /*Codes_SRS_IOTHUBMESSAGE_01_012: [The size of the associated data shall be obtained by using BUFFER_length and it shall be copied to the size argument.]*/
-            *size = BUFFER_length(handleData->value.byteArray);
+            if (handleData->borrowedBytes != NULL)
+            {
+                /*Codes_SRS_IOTHUBMESSAGE_09_006: [If the message content is borrowed, IoTHubMessage_GetByteArray shall return the borrowed pointer and size.] */
+                *buffer = handleData->borrowedBytes;
+                *size = handleData->borrowedSize;
+            }
+            else
+            {
+                /*Codes_SRS_IOTHUBMESSAGE_01_011: [The pointer shall be obtained by using BUFFER_u_char and it shall be copied in the buffer argument.]*/
+                *buffer = BUFFER_u_char(handleData->value.byteArray);
+                /*Codes_SRS_IOTHUBMESSAGE_01_012: [The size of the associated data shall be obtained by using BUFFER_length and it shall be copied to the size argument.]*/
+                *size = BUFFER_length(handleData->value.byteArray);
+            }
             result = IOTHUB_MESSAGE_OK;
         }
     }
@@ -509,7 +563,11 @@ void IoTHubMessage_Destroy(IOTHUB_MESSAGE_HANDLE iotHubMessageHandle)
         IOTHUB_MESSAGE_HANDLE_DATA* handleData = iotHubMessageHandle;
         if (handleData->contentType == IOTHUBMESSAGE_BYTEARRAY)
         {
-            BUFFER_delete(handleData->value.byteArray);
+            /*Codes_SRS_IOTHUBMESSAGE_09_007: [IoTHubMessage_Destroy shall not free borrowed content.] */
+            if (handleData->borrowedBytes == NULL)
+            {
+                BUFFER_delete(handleData->value.byteArray);
+            }
         }
         else
         {
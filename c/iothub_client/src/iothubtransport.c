@@ -118,6 +118,8 @@ TRANSPORT_HANDLE  IoTHubTransport_Create(IOTHUB_CLIENT_TRANSPORT_PROVIDER protoc
 						result->IoTHubTransport_Unsubscribe = transportProtocol->IoTHubTransport_Unsubscribe;
 						result->IoTHubTransport_DoWork = transportProtocol->IoTHubTransport_DoWork;
 						result->IoTHubTransport_GetSendStatus = transportProtocol->IoTHubTransport_GetSendStatus;
+						result->IoTHubTransport_EventQueued = transportProtocol->IoTHubTransport_EventQueued;
+						result->IoTHubTransport_SetDeviceOption = transportProtocol->IoTHubTransport_SetDeviceOption;
 					}
 				}
 			}
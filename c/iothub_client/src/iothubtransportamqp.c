@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <time.h>
 #include <limits.h>
+#include <stdio.h>
 #include "azure_c_shared_utility/gballoc.h"
 #include "azure_c_shared_utility/crt_abstractions.h"
 #include "azure_c_shared_utility/doublylinkedlist.h"
@@ -17,6 +18,7 @@
 #include "azure_c_shared_utility/strings.h"
 #include "azure_c_shared_utility/urlencode.h"
 #include "azure_c_shared_utility/tlsio.h"
+#include "azure_c_shared_utility/tickcounter.h"
 
 #include "azure_uamqp_c/cbs.h"
 #include "azure_uamqp_c/link.h"
@@ -32,6 +34,7 @@
 #include "iothub_client_private.h"
 #include "iothubtransportamqp.h"
 #include "iothub_client_version.h"
+#include "coalescingio.h"
 
 #define RESULT_OK 0
 #define RESULT_FAILURE 1
@@ -51,6 +54,16 @@
 #define MESSAGE_SENDER_LINK_NAME "sender-link"
 #define MESSAGE_SENDER_SOURCE_ADDRESS "ingress"
 #define MESSAGE_SENDER_MAX_LINK_SIZE UINT64_MAX
+#define DEFAULT_EVENT_ACK_LATENCY_THRESHOLD_MS 2000
+#define INITIAL_EVENT_SEND_WINDOW 4
+#define DEFAULT_RECONNECT_MIN_DELAY_MS 1000
+#define DEFAULT_RECONNECT_MAX_DELAY_MS 60000
+// Message format of the AMQP batch messages accepted by the IoT hub, where each data section carries an encoded AMQP message.
+#define AMQP_BATCHING_FORMAT_CODE 0x80013700
+// Same limit as the HTTP transport batches.
+#define DEFAULT_MAX_EVENT_BATCH_SIZE (255*1024-1)
+// Encoding of the data section descriptor and binary length around each event of a batch.
+#define BATCHED_EVENT_SECTION_OVERHEAD 8
 
 typedef XIO_HANDLE(*TLS_IO_TRANSPORT_PROVIDER)(const char* fqdn, int port);
 
@@ -61,6 +74,35 @@ typedef enum CBS_STATE_TAG
     CBS_STATE_AUTHENTICATED
 } CBS_STATE;
 
+// Output buffer of amqpvalue_encode.
+typedef struct AMQP_ENCODING_BUFFER_TAG
+{
+    unsigned char* bytes;
+    size_t size;
+    size_t length;
+} AMQP_ENCODING_BUFFER;
+
+// Sender link opened in addition to the primary one.
+typedef struct AMQP_EVENT_SENDER_TAG
+{
+    LINK_HANDLE link;
+    MESSAGE_SENDER_HANDLE message_sender;
+} AMQP_EVENT_SENDER;
+
+// Application properties of previously sent events, reused while the following events carry the same properties.
+typedef struct AMQP_PROPERTIES_CACHE_ENTRY_TAG
+{
+    size_t hash;
+    size_t count;
+    char** keys;
+    char** values;
+    // Map set as application properties of the uAMQP messages.
+    AMQP_VALUE map;
+    // Encoded application-properties section of the batched events, encoded on first use.
+    unsigned char* encoded_section;
+    size_t encoded_section_size;
+} AMQP_PROPERTIES_CACHE_ENTRY;
+
 typedef struct AMQP_TRANSPORT_STATE_TAG
 {
     // FQDN of the IoT Hub.
@@ -92,6 +134,9 @@ typedef struct AMQP_TRANSPORT_STATE_TAG
     XIO_HANDLE tls_io;
     // Pointer to the function that creates the TLS I/O (internal use only).
     TLS_IO_TRANSPORT_PROVIDER tls_io_transport_provider;
+    // 'websocket_write_coalescing_size' set by the application, applied again to each TLS I/O created.
+    bool is_websocket_write_coalescing_size_set;
+    size_t websocket_write_coalescing_size;
     // AMQP SASL I/O transport created on top of the TLS I/O layer.
     XIO_HANDLE sasl_io;
     // AMQP SASL I/O mechanism to be used.
@@ -124,10 +169,101 @@ typedef struct AMQP_TRANSPORT_STATE_TAG
     CBS_STATE cbs_state;
     // Time when the current SAS token was created, in seconds since epoch.
     size_t current_sas_token_create_time;
+    // Time when the current SAS token expires, in seconds since epoch.
+    size_t current_sas_token_expiry_time;
+    // Flag that indicates a replacement SAS token has been put to CBS and its result is not known yet.
+    bool is_sas_token_refresh_in_progress;
+    // Time when the last SAS token refresh was attempted, in seconds since epoch.
+    size_t sas_token_refresh_start_time;
+    // Expiry time of the SAS token being put by the refresh in progress, in seconds since epoch.
+    size_t sas_token_refresh_expiry_time;
+    // Number of put-token operations sent to the current CBS instance.
+    size_t put_token_count;
+    // Number of put-token operations of the current CBS instance already completed. CBS answers them in order,
+    // so this is also the sequence number of the last one completed.
+    size_t completed_put_token_count;
+    // Sequence number of the put-token operation whose result is expected, or 0 if none (e.g.: it timed out).
+    size_t awaited_put_token;
     // Mark if device is registered in transport (only one device per transport).
     bool isRegistered;
+    // AMQP session incoming window, applied to the next session created.
+    uint32_t session_incoming_window;
+    // AMQP session outgoing window, applied to the next session created.
+    uint32_t session_outgoing_window;
+    // Maximum number of events sent and not yet settled. Zero disables the event flow control.
+    size_t max_unsettled_events;
+    // Settlement latency above which the event send window is halved, in milliseconds.
+    size_t event_ack_latency_threshold;
+    // Current number of events that can be sent and not yet settled (between 1 and max_unsettled_events).
+    size_t event_send_window;
+    // Number of events sent and not yet settled.
+    size_t unsettled_events;
+    // Number of events settled quickly since the event send window last changed.
+    size_t fast_settlements;
+    // Time the event send window was last halved, in milliseconds.
+    uint64_t last_window_decrease_time;
+    // Clock used to measure settlement latencies; created when the event flow control is enabled.
+    TICK_COUNTER_HANDLE tick_counter;
+    // Pack the pending events into AMQP batch messages.
+    bool event_batching;
+    // Maximum size of an AMQP batch message body, in bytes.
+    size_t max_event_batch_size;
+    // Scratch buffer the batched events are encoded into, kept across events and batches.
+    AMQP_ENCODING_BUFFER batched_event_encoding;
+    // Application properties cache; NULL when disabled.
+    AMQP_PROPERTIES_CACHE_ENTRY* properties_cache;
+    size_t properties_cache_size;
+    // Next entry to be replaced when a new property set is cached.
+    size_t properties_cache_next;
+    // Number of connection attempts that failed since the transport was last authenticated.
+    size_t reconnect_attempts;
+    // Whether the time of the next connection attempt has been chosen.
+    bool is_reconnect_scheduled;
+    // Time of the next connection attempt, in seconds since epoch.
+    size_t next_reconnect_time;
+    // Bounds of the delay between connection attempts, in milliseconds.
+    size_t reconnect_min_delay;
+    size_t reconnect_max_delay;
+    // FNV-1a hash of the device id, mixed with the time to seed the reconnect delay generator.
+    uint32_t device_id_hash;
+    // State of the generator (xorshift32) that picks the random part of the reconnect delay; 0 until seeded.
+    uint32_t reconnect_jitter_state;
+    // AMQP connection idle timeout, in milliseconds. Zero keeps the uAMQP default.
+    size_t connection_idle_timeout;
+    // Number of sender links the events are spread across, the primary one included; applied to the next event sender created.
+    size_t sender_link_count;
+    // Sender links opened in addition to sender_link/message_sender.
+    AMQP_EVENT_SENDER* additional_senders;
+    size_t additional_sender_count;
+    // Sender link used next by the round-robin distribution (0 is the primary link).
+    size_t next_sender_index;
+    // Property whose value selects the sender link of an event, keeping the order of events with the same value; NULL for round-robin.
+    char* sender_partition_property;
+    // Whether IoTHubClient_LL_ConnectionReady is called once the links are open ("eagerConnect" option).
+    bool notify_connection_ready;
+    // Whether the primary sender link and the receiver link have reported MESSAGE_*_STATE_OPEN.
+    bool is_event_sender_open;
+    bool is_message_receiver_open;
+    // Whether readiness was already reported on the current connection.
+    bool is_connection_ready;
 } AMQP_TRANSPORT_INSTANCE;
 
+// Context of an AMQP message sent while the event flow control is enabled.
+typedef struct AMQP_FLOW_CONTROLLED_EVENT_TAG
+{
+    ON_MESSAGE_SEND_COMPLETE on_send_complete;
+    void* on_send_complete_context;
+    AMQP_TRANSPORT_INSTANCE* transport_state;
+    uint64_t send_time;
+} AMQP_FLOW_CONTROLLED_EVENT;
+
+// Events carried by a single AMQP batch message.
+typedef struct AMQP_EVENT_BATCH_TAG
+{
+    IOTHUB_MESSAGE_LIST** events;
+    size_t count;
+} AMQP_EVENT_BATCH;
+
 
 
 // Auxiliary functions
@@ -193,14 +329,17 @@ static void removeEventFromInProgressList(IOTHUB_MESSAGE_LIST* message)
     DList_InitializeListHead(&message->entry);
 }
 
+// Codes_SRS_IOTHUBTRANSPORTAMQP_09_176: [Events rolled back to the waitingToSend list shall be placed ahead of the events still waiting, in the order they were originally sent.]
 static void rollEventBackToWaitList(IOTHUB_MESSAGE_LIST* message, AMQP_TRANSPORT_INSTANCE* transport_state)
 {
     removeEventFromInProgressList(message);
-	DList_InsertTailList(transport_state->waitingToSend, &message->entry);
+    // Inserting before the first waiting event puts the event at the head of the list.
+	DList_InsertTailList(transport_state->waitingToSend->Flink, &message->entry);
 }
 
 static void rollEventsBackToWaitList(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
+    // Walked from the newest event, so the oldest one ends up first in the waitingToSend list.
     PDLIST_ENTRY entry = transport_state->inProgress.Blink;
 
     while (entry != &transport_state->inProgress)
@@ -247,14 +386,149 @@ static void on_message_send_complete(void* context, MESSAGE_SEND_RESULT send_res
     free(message);
 }
 
+static void decreaseEventSendWindow(AMQP_TRANSPORT_INSTANCE* transport_state, uint64_t current_time)
+{
+    // Only once per latency threshold, so a burst of late settlements counts as one congestion signal.
+    if ((current_time - transport_state->last_window_decrease_time) >= transport_state->event_ack_latency_threshold)
+    {
+        transport_state->event_send_window = (transport_state->event_send_window > 1) ? (transport_state->event_send_window / 2) : 1;
+        transport_state->last_window_decrease_time = current_time;
+    }
+    transport_state->fast_settlements = 0;
+}
+
+static void on_flow_controlled_message_send_complete(void* context, MESSAGE_SEND_RESULT send_result)
+{
+    AMQP_FLOW_CONTROLLED_EVENT* event = (AMQP_FLOW_CONTROLLED_EVENT*)context;
+    AMQP_TRANSPORT_INSTANCE* transport_state = event->transport_state;
+    uint64_t current_time;
+
+    if (transport_state->unsettled_events > 0)
+    {
+        transport_state->unsettled_events--;
+    }
+
+    if (tickcounter_get_current_ms(transport_state->tick_counter, &current_time) != 0)
+    {
+        LogError("Failed reading the tick counter; the event send window is not updated.\r\n");
+    }
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_159: [The event send window shall be halved when an event fails or is settled later than 'event_ack_latency_threshold' milliseconds after being sent, at most once per 'event_ack_latency_threshold' milliseconds.]
+    else if ((send_result != MESSAGE_SEND_OK) || ((current_time - event->send_time) > transport_state->event_ack_latency_threshold))
+    {
+        decreaseEventSendWindow(transport_state, current_time);
+    }
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_158: [The event send window shall start at 4 and grow by one every time a full window of events has been settled within 'event_ack_latency_threshold' milliseconds, up to 'max_unsettled_events'.]
+    else if (++transport_state->fast_settlements >= transport_state->event_send_window)
+    {
+        transport_state->fast_settlements = 0;
+        if (transport_state->event_send_window < transport_state->max_unsettled_events)
+        {
+            transport_state->event_send_window++;
+        }
+    }
+
+    event->on_send_complete(event->on_send_complete_context, send_result);
+    free(event);
+}
+
+static int sendFlowControlledMessage(AMQP_TRANSPORT_INSTANCE* transport_state, MESSAGE_SENDER_HANDLE message_sender, MESSAGE_HANDLE amqp_message, ON_MESSAGE_SEND_COMPLETE on_send_complete, void* on_send_complete_context)
+{
+    int result;
+    AMQP_FLOW_CONTROLLED_EVENT* event = (AMQP_FLOW_CONTROLLED_EVENT*)malloc(sizeof(AMQP_FLOW_CONTROLLED_EVENT));
+
+    if (event == NULL)
+    {
+        LogError("Failed allocating the flow control context of the event.\r\n");
+        result = RESULT_FAILURE;
+    }
+    else if (tickcounter_get_current_ms(transport_state->tick_counter, &event->send_time) != 0)
+    {
+        LogError("Failed reading the tick counter.\r\n");
+        free(event);
+        result = RESULT_FAILURE;
+    }
+    else
+    {
+        event->on_send_complete = on_send_complete;
+        event->on_send_complete_context = on_send_complete_context;
+        event->transport_state = transport_state;
+
+        if (messagesender_send(message_sender, amqp_message, on_flow_controlled_message_send_complete, event) != RESULT_OK)
+        {
+            free(event);
+            result = RESULT_FAILURE;
+        }
+        else
+        {
+            transport_state->unsettled_events++;
+            result = RESULT_OK;
+        }
+    }
+
+    return result;
+}
+
+static int sendAMQPMessage(AMQP_TRANSPORT_INSTANCE* transport_state, MESSAGE_SENDER_HANDLE message_sender, MESSAGE_HANDLE amqp_message, ON_MESSAGE_SEND_COMPLETE on_send_complete, void* on_send_complete_context)
+{
+    int result;
+
+    if (transport_state->max_unsettled_events > 0)
+    {
+        result = sendFlowControlledMessage(transport_state, message_sender, amqp_message, on_send_complete, on_send_complete_context);
+    }
+    else if (messagesender_send(message_sender, amqp_message, on_send_complete, on_send_complete_context) != RESULT_OK)
+    {
+        result = RESULT_FAILURE;
+    }
+    else
+    {
+        result = RESULT_OK;
+    }
+
+    return result;
+}
+
+static bool isEventSendWindowOpen(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_157: [If 'max_unsettled_events' is not zero, IoTHubTransportAMQP_DoWork shall not send an event while the number of events sent and not yet settled has reached the event send window.]
+    return (transport_state->max_unsettled_events == 0) || (transport_state->unsettled_events < transport_state->event_send_window);
+}
+
 static void on_put_token_complete(void* context, CBS_OPERATION_RESULT operation_result, unsigned int status_code, const char* status_description)
 {
     AMQP_TRANSPORT_INSTANCE* transportState = (AMQP_TRANSPORT_INSTANCE*)context;
 
-    if (operation_result == CBS_OPERATION_RESULT_OK)
+    transportState->completed_put_token_count++;
+
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_189: [A put-token completion that does not belong to the last put-token operation sent, or that arrives after that operation timed out, shall be ignored.]
+    if (transportState->completed_put_token_count != transportState->awaited_put_token)
+    {
+        LogError("Ignoring the result of a CBS put-token operation that timed out or was superseded (status code %u).\r\n", status_code);
+    }
+    else if (transportState->is_sas_token_refresh_in_progress)
+    {
+        transportState->is_sas_token_refresh_in_progress = false;
+
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_154: [When the refreshed SAS token is accepted by CBS it shall replace the current SAS token; if it is rejected the current SAS token shall remain in use.]
+        if (operation_result == CBS_OPERATION_RESULT_OK)
+        {
+            transportState->current_sas_token_create_time = transportState->sas_token_refresh_start_time;
+            transportState->current_sas_token_expiry_time = transportState->sas_token_refresh_expiry_time;
+        }
+        else
+        {
+            LogError("CBS rejected the refreshed SAS token (status code %u); the current SAS token remains in use.\r\n", status_code);
+        }
+    }
+    else if (operation_result == CBS_OPERATION_RESULT_OK)
     {
         transportState->cbs_state = CBS_STATE_AUTHENTICATED;
     }
+
+    if (transportState->completed_put_token_count == transportState->awaited_put_token)
+    {
+        transportState->awaited_put_token = 0;
+    }
 }
 
 static AMQP_VALUE on_message_received(const void* context, MESSAGE_HANDLE message)
@@ -281,7 +555,8 @@ static AMQP_VALUE on_message_received(const void* context, MESSAGE_HANDLE messag
             }
             else
             {
-                iothub_message = IoTHubMessage_CreateFromByteArray(binary_data.bytes, binary_data.length);
+                // Codes_SRS_IOTHUBTRANSPORTAMQP_09_182: [The callback 'on_message_received' shall create the IOTHUB_MESSAGE using IoTHubMessage_CreateFromBorrowedByteArray(), so the body is not copied; the message is destroyed before the uAMQP message it borrows from.]
+                iothub_message = IoTHubMessage_CreateFromBorrowedByteArray(binary_data.bytes, binary_data.length);
             }
         }
     }
@@ -374,13 +649,29 @@ static void on_amqp_management_state_changed(void* context, AMQP_MANAGEMENT_STAT
     }
 }
 
+// The TLS I/O is destroyed with the connection, so the options saved for it are applied again to each one created.
+static XIO_HANDLE createTlsIo(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    XIO_HANDLE result = transport_state->tls_io_transport_provider(STRING_c_str(transport_state->iotHubHostFqdn), transport_state->iotHubPort);
+
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_188: [Each time the TLS I/O is created, the 'websocket_write_coalescing_size' saved by IoTHubTransportAMQP_SetOption shall be applied to it with xio_setoption; if that fails the error shall be logged and the default size kept.]
+    if (result != NULL &&
+        transport_state->is_websocket_write_coalescing_size_set &&
+        xio_setoption(result, COALESCINGIO_OPTION_MAX_WRITE_SIZE, &transport_state->websocket_write_coalescing_size) != 0)
+    {
+        LogError("Failed applying the WebSocket write coalescing size to the TLS I/O.\r\n");
+    }
+
+    return result;
+}
+
 static int establishConnection(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
     int result;
 
     // Codes_SRS_IOTHUBTRANSPORTAMQP_09_110: [IoTHubTransportAMQP_DoWork shall create the TLS IO using transport_state->io_transport_provider callback function] 
     if (transport_state->tls_io == NULL &&
-        (transport_state->tls_io = transport_state->tls_io_transport_provider(STRING_c_str(transport_state->iotHubHostFqdn), transport_state->iotHubPort)) == NULL)
+        (transport_state->tls_io = createTlsIo(transport_state)) == NULL)
     {
         // Codes_SRS_IOTHUBTRANSPORTAMQP_09_136: [If transport_state->io_transport_provider_callback fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
         result = RESULT_FAILURE;
@@ -419,20 +710,29 @@ static int establishConnection(AMQP_TRANSPORT_INSTANCE* transport_state)
         }
         else
         {
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_175: [If 'connection_idle_timeout' is not zero, IoTHubTransportAMQP_DoWork shall set it on the connection using connection_set_idle_timeout(), so a silent peer is detected.]
+            if (transport_state->connection_idle_timeout > 0 &&
+                connection_set_idle_timeout(transport_state->connection, (milliseconds)transport_state->connection_idle_timeout) != 0)
+            {
+                LogError("Failed to set the AMQP connection idle timeout.\r\n");
+            }
+
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_065: [IoTHubTransportAMQP_DoWork shall apply a default value of UINT_MAX for the parameter 'AMQP incoming window'] 
-            if (session_set_incoming_window(transport_state->session, (uint32_t)DEFAULT_INCOMING_WINDOW_SIZE) != 0)
+            if (session_set_incoming_window(transport_state->session, transport_state->session_incoming_window) != 0)
             {
                 LogError("Failed to set the AMQP incoming window size.\r\n");
             }
 
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_115: [IoTHubTransportAMQP_DoWork shall apply a default value of 100 for the parameter 'AMQP outgoing window'] 
-            if (session_set_outgoing_window(transport_state->session, DEFAULT_OUTGOING_WINDOW_SIZE) != 0)
+            if (session_set_outgoing_window(transport_state->session, transport_state->session_outgoing_window) != 0)
             {
                 LogError("Failed to set the AMQP outgoing window size.\r\n");
             }
 
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_066: [IoTHubTransportAMQP_DoWork shall establish the CBS connection using the cbs_create() AMQP API] 
-            if ((transport_state->cbs = cbs_create(transport_state->session, on_amqp_management_state_changed, NULL)) == NULL)
+            transport_state->connection_state = AMQP_MANAGEMENT_STATE_IDLE;
+
+            if ((transport_state->cbs = cbs_create(transport_state->session, on_amqp_management_state_changed, transport_state)) == NULL)
             {
                 // Codes_SRS_IOTHUBTRANSPORTAMQP_09_067: [If cbs_create() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately] 
                 result = RESULT_FAILURE;
@@ -449,6 +749,10 @@ static int establishConnection(AMQP_TRANSPORT_INSTANCE* transport_state)
             {
                 transport_state->connection_establish_time = getSecondsSinceEpoch();
                 transport_state->cbs_state = CBS_STATE_IDLE;
+                transport_state->is_sas_token_refresh_in_progress = false;
+                transport_state->put_token_count = 0;
+                transport_state->completed_put_token_count = 0;
+                transport_state->awaited_put_token = 0;
                 result = RESULT_OK;
             }
         }
@@ -462,15 +766,10 @@ static int establishConnection(AMQP_TRANSPORT_INSTANCE* transport_state)
     return result;
 }
 
-static int startAuthentication(AMQP_TRANSPORT_INSTANCE* transport_state)
+static int putNewSASToken(AMQP_TRANSPORT_INSTANCE* transport_state, size_t new_expiry_time)
 {
     int result;
 
-    size_t sas_token_create_time = getSecondsSinceEpoch(); // I.e.: NOW, in seconds since epoch.
-
-                                                           // Codes_SRS_IOTHUBTRANSPORTAMQP_09_083: [Each new SAS token created by the transport shall be valid for up to 'sas_token_lifetime' milliseconds from the time of creation]
-    size_t new_expiry_time = sas_token_create_time + (transport_state->sas_token_lifetime / 1000);
-
     STRING_HANDLE newSASToken = SASToken_Create(transport_state->deviceKey, transport_state->devicesPath, transport_state->sasTokenKeyName, new_expiry_time);
 
     if (newSASToken == NULL)
@@ -485,8 +784,8 @@ static int startAuthentication(AMQP_TRANSPORT_INSTANCE* transport_state)
     }
     else
     {
-        transport_state->cbs_state = CBS_STATE_AUTH_IN_PROGRESS;
-        transport_state->current_sas_token_create_time = sas_token_create_time;
+        transport_state->put_token_count++;
+        transport_state->awaited_put_token = transport_state->put_token_count;
         result = RESULT_OK;
     }
 
@@ -499,6 +798,30 @@ static int startAuthentication(AMQP_TRANSPORT_INSTANCE* transport_state)
     return result;
 }
 
+static int startAuthentication(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    int result;
+
+    size_t sas_token_create_time = getSecondsSinceEpoch(); // I.e.: NOW, in seconds since epoch.
+
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_083: [Each new SAS token created by the transport shall be valid for up to 'sas_token_lifetime' milliseconds from the time of creation]
+    size_t new_expiry_time = sas_token_create_time + (transport_state->sas_token_lifetime / 1000);
+
+    if (putNewSASToken(transport_state, new_expiry_time) != RESULT_OK)
+    {
+        result = RESULT_FAILURE;
+    }
+    else
+    {
+        transport_state->cbs_state = CBS_STATE_AUTH_IN_PROGRESS;
+        transport_state->current_sas_token_create_time = sas_token_create_time;
+        transport_state->current_sas_token_expiry_time = new_expiry_time;
+        result = RESULT_OK;
+    }
+
+    return result;
+}
+
 static int verifyAuthenticationTimeout(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
     return ((getSecondsSinceEpoch() - transport_state->current_sas_token_create_time) * 1000 >= transport_state->cbs_request_timeout) ? RESULT_TIMEOUT : RESULT_OK;
@@ -558,18 +881,101 @@ static void attachDeviceClientTypeToLink(LINK_HANDLE link)
     }
 }
 
+static void destroyAdditionalEventSenders(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    size_t i;
+
+    for (i = 0; i < transport_state->additional_sender_count; i++)
+    {
+        messagesender_destroy(transport_state->additional_senders[i].message_sender);
+        link_destroy(transport_state->additional_senders[i].link);
+    }
+
+    free(transport_state->additional_senders);
+    transport_state->additional_senders = NULL;
+    transport_state->additional_sender_count = 0;
+    transport_state->next_sender_index = 0;
+}
+
+static void on_event_sender_state_changed(const void* context, MESSAGE_SENDER_STATE new_state, MESSAGE_SENDER_STATE previous_state)
+{
+    (void)previous_state;
+    ((AMQP_TRANSPORT_INSTANCE*)context)->is_event_sender_open = (new_state == MESSAGE_SENDER_STATE_OPEN);
+}
+
+static void on_message_receiver_state_changed(const void* context, MESSAGE_RECEIVER_STATE new_state, MESSAGE_RECEIVER_STATE previous_state)
+{
+    (void)previous_state;
+    ((AMQP_TRANSPORT_INSTANCE*)context)->is_message_receiver_open = (new_state == MESSAGE_RECEIVER_STATE_OPEN);
+}
+
 static void destroyEventSender(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
     if (transport_state->message_sender != NULL)
     {
+        destroyAdditionalEventSenders(transport_state);
+
         messagesender_destroy(transport_state->message_sender);
         transport_state->message_sender = NULL;
+        transport_state->is_event_sender_open = false;
 
         link_destroy(transport_state->sender_link);
         transport_state->sender_link = NULL;
     }
 }
 
+// Codes_SRS_IOTHUBTRANSPORTAMQP_09_178: [If 'sender_link_count' is greater than 1, IoTHubTransportAMQP_DoWork shall open that many sender links minus one in addition to the primary sender link, named "sender-link-<n>", with the same source, target and settings; a link that fails to open shall be logged and the events spread across the links that opened.]
+static void createAdditionalEventSenders(AMQP_TRANSPORT_INSTANCE* transport_state, AMQP_VALUE source, AMQP_VALUE target)
+{
+    size_t count = transport_state->sender_link_count - 1;
+
+    if ((transport_state->additional_senders = (AMQP_EVENT_SENDER*)malloc(count * sizeof(AMQP_EVENT_SENDER))) == NULL)
+    {
+        LogError("Failed allocating the additional AMQP sender links.\r\n");
+    }
+    else
+    {
+        size_t i;
+
+        for (i = 0; i < count; i++)
+        {
+            AMQP_EVENT_SENDER* sender = &transport_state->additional_senders[transport_state->additional_sender_count];
+            char link_name[sizeof(MESSAGE_SENDER_LINK_NAME) + 24];
+
+            (void)sprintf(link_name, "%s-%lu", MESSAGE_SENDER_LINK_NAME, (unsigned long)(i + 1));
+
+            if ((sender->link = link_create(transport_state->session, link_name, role_sender, source, target)) == NULL)
+            {
+                LogError("Failed creating AMQP link %s.\r\n", link_name);
+                break;
+            }
+
+            if (link_set_max_message_size(sender->link, MESSAGE_SENDER_MAX_LINK_SIZE) != RESULT_OK)
+            {
+                LogError("Failed setting AMQP link max message size.\r\n");
+            }
+
+            attachDeviceClientTypeToLink(sender->link);
+
+            if ((sender->message_sender = messagesender_create(sender->link, NULL, NULL, NULL)) == NULL)
+            {
+                LogError("Could not allocate AMQP message sender for link %s.\r\n", link_name);
+                link_destroy(sender->link);
+                break;
+            }
+            else if (messagesender_open(sender->message_sender) != RESULT_OK)
+            {
+                LogError("Failed opening the AMQP message sender for link %s.\r\n", link_name);
+                messagesender_destroy(sender->message_sender);
+                link_destroy(sender->link);
+                break;
+            }
+
+            transport_state->additional_sender_count++;
+        }
+    }
+}
+
 static int createEventSender(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
     int result = RESULT_FAILURE;
@@ -604,7 +1010,7 @@ static int createEventSender(AMQP_TRANSPORT_INSTANCE* transport_state)
             attachDeviceClientTypeToLink(transport_state->sender_link);
 
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_070: [IoTHubTransportAMQP_DoWork shall create the AMQP message sender using messagesender_create() AMQP API] 
-            if ((transport_state->message_sender = messagesender_create(transport_state->sender_link, NULL, NULL, NULL)) == NULL)
+            if ((transport_state->message_sender = messagesender_create(transport_state->sender_link, on_event_sender_state_changed, transport_state, NULL)) == NULL)
             {
                 // Codes_SRS_IOTHUBTRANSPORTAMQP_09_071: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message sender instance fails to be created, flagging the connection to be re-established] 
                 LogError("Could not allocate AMQP message sender\r\n");
@@ -619,6 +1025,11 @@ static int createEventSender(AMQP_TRANSPORT_INSTANCE* transport_state)
                 }
                 else
                 {
+                    if (transport_state->sender_link_count > 1)
+                    {
+                        createAdditionalEventSenders(transport_state, source, target);
+                    }
+
                     result = RESULT_OK;
                 }
             }
@@ -647,6 +1058,7 @@ static int destroyMessageReceiver(AMQP_TRANSPORT_INSTANCE* transport_state)
         messagereceiver_destroy(transport_state->message_receiver);
 
         transport_state->message_receiver = NULL;
+        transport_state->is_message_receiver_open = false;
 
         link_destroy(transport_state->receiver_link);
 
@@ -698,7 +1110,7 @@ static int createMessageReceiver(AMQP_TRANSPORT_INSTANCE* transport_state, IOTHU
             attachDeviceClientTypeToLink(transport_state->receiver_link);
 
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_077: [IoTHubTransportAMQP_DoWork shall create the AMQP message receiver using messagereceiver_create() AMQP API] 
-            if ((transport_state->message_receiver = messagereceiver_create(transport_state->receiver_link, NULL, NULL)) == NULL)
+            if ((transport_state->message_receiver = messagereceiver_create(transport_state->receiver_link, on_message_receiver_state_changed, transport_state)) == NULL)
             {
                 // Codes_SRS_IOTHUBTRANSPORTAMQP_09_078: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message receiver instance fails to be created, flagging the connection to be re-established] 
                 LogError("Could not allocate AMQP message receiver.\r\n");
@@ -728,193 +1140,886 @@ static int createMessageReceiver(AMQP_TRANSPORT_INSTANCE* transport_state, IOTHU
     return result;
 }
 
-static int addPropertiesTouAMQPMessage(IOTHUB_MESSAGE_HANDLE iothub_message_handle, MESSAGE_HANDLE uamqp_message)
+static void clearPropertiesCacheEntry(AMQP_PROPERTIES_CACHE_ENTRY* entry)
+{
+    size_t i;
+
+    for (i = 0; i < entry->count; i++)
+    {
+        free(entry->keys[i]);
+        free(entry->values[i]);
+    }
+
+    free(entry->keys);
+    free(entry->values);
+    free(entry->encoded_section);
+
+    if (entry->map != NULL)
+    {
+        amqpvalue_destroy(entry->map);
+    }
+
+    entry->hash = 0;
+    entry->count = 0;
+    entry->keys = NULL;
+    entry->values = NULL;
+    entry->map = NULL;
+    entry->encoded_section = NULL;
+    entry->encoded_section_size = 0;
+}
+
+static void destroyPropertiesCache(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    size_t i;
+
+    for (i = 0; i < transport_state->properties_cache_size; i++)
+    {
+        clearPropertiesCacheEntry(&transport_state->properties_cache[i]);
+    }
+
+    free(transport_state->properties_cache);
+    transport_state->properties_cache = NULL;
+    transport_state->properties_cache_size = 0;
+    transport_state->properties_cache_next = 0;
+}
+
+static int createPropertiesCache(AMQP_TRANSPORT_INSTANCE* transport_state, size_t size)
 {
     int result;
-    MAP_HANDLE properties_map;
-    const char* const* propertyKeys;
-    const char* const* propertyValues;
-    size_t propertyCount;
 
-    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_007: [The IoTHub message properties shall be obtained by calling IoTHubMessage_Properties.] */
-    properties_map = IoTHubMessage_Properties(iothub_message_handle);
-    if (properties_map == NULL)
+    destroyPropertiesCache(transport_state);
+
+    if (size == 0)
     {
-        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-        LogError("Failed to get property map from IoTHub message.\r\n");
-        result = __LINE__;
+        result = 0;
     }
-    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_015: [The actual keys and values, as well as the number of properties shall be obtained by calling Map_GetInternals on the handle obtained from IoTHubMessage_Properties.] */
-    else if (Map_GetInternals(properties_map, &propertyKeys, &propertyValues, &propertyCount) != MAP_OK)
+    else if ((transport_state->properties_cache = (AMQP_PROPERTIES_CACHE_ENTRY*)malloc(size * sizeof(AMQP_PROPERTIES_CACHE_ENTRY))) == NULL)
     {
-        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-        LogError("Failed to get the internals of the property map.\r\n");
         result = __LINE__;
     }
     else
     {
-        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_016: [If the number of properties is 0, no uAMQP map shall be created and no application properties shall be set on the uAMQP message.] */
-        if (propertyCount != 0)
+        size_t i;
+
+        for (i = 0; i < size; i++)
         {
-            size_t i;
-            /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_009: [The uAMQP map shall be created by calling amqpvalue_create_map.] */
-            AMQP_VALUE uamqp_map = amqpvalue_create_map();
-            if (uamqp_map == NULL)
-            {
-                /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-                LogError("Failed to create uAMQP map for the properties.\r\n");
-                result = __LINE__;
-            }
-            else
-            {
-                for (i = 0; i < propertyCount; i++)
-                {
-                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_010: [A key uAMQP value shall be created by using amqpvalue_create_string.] */
-                    AMQP_VALUE map_key_value = amqpvalue_create_string(propertyKeys[i]);
-                    if (map_key_value == NULL)
-                    {
-                        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-                        LogError("Failed to create uAMQP property key value.\r\n");
-                        break;
-                    }
+            AMQP_PROPERTIES_CACHE_ENTRY* entry = &transport_state->properties_cache[i];
+            entry->hash = 0;
+            entry->count = 0;
+            entry->keys = NULL;
+            entry->values = NULL;
+            entry->map = NULL;
+            entry->encoded_section = NULL;
+            entry->encoded_section_size = 0;
+        }
 
-                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_011: [A value uAMQP value shall be created by using amqpvalue_create_string.] */
-                    AMQP_VALUE map_value_value = amqpvalue_create_string(propertyValues[i]);
-                    if (map_value_value == NULL)
-                    {
-                        amqpvalue_destroy(map_key_value);
-                        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-                        LogError("Failed to create uAMQP property key value.\r\n");
-                        break;
-                    }
+        transport_state->properties_cache_size = size;
+        result = 0;
+    }
 
-                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_008: [All properties shall be transferred to a uAMQP map.] */
-                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_012: [The key/value pair for the property shall be set into the uAMQP property map by calling amqpvalue_map_set_value.] */
-                    if (amqpvalue_set_map_value(uamqp_map, map_key_value, map_value_value) != 0)
-                    {
-                        amqpvalue_destroy(map_key_value);
-                        amqpvalue_destroy(map_value_value);
-                        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-                        LogError("Failed to create uAMQP property key value.\r\n");
-                        break;
-                    }
+    return result;
+}
 
-                    amqpvalue_destroy(map_key_value);
-                    amqpvalue_destroy(map_value_value);
+#define INITIAL_STRING_HASH 2166136261u
+
+// 32 bit FNV-1a over the string, including its terminating zero, so a key hashes the same on every platform.
+// Unlike djb2, whose last step multiplies by 33, the result is spread over any number of sender links.
+static uint32_t hashString(uint32_t hash, const char* value)
+{
+    do
+    {
+        hash = (hash ^ (unsigned char)*value) * 16777619u;
+    } while (*value++ != '\0');
+
+    return hash;
+}
+
+static size_t hashProperties(const char* const* keys, const char* const* values, size_t count)
+{
+    uint32_t hash = INITIAL_STRING_HASH;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        hash = hashString(hashString(hash, keys[i]), values[i]);
+    }
+
+    return hash;
+}
+
+static AMQP_PROPERTIES_CACHE_ENTRY* findCachedProperties(AMQP_TRANSPORT_INSTANCE* transport_state, size_t hash, const char* const* keys, const char* const* values, size_t count)
+{
+    AMQP_PROPERTIES_CACHE_ENTRY* result = NULL;
+    size_t i;
+
+    for (i = 0; i < transport_state->properties_cache_size && result == NULL; i++)
+    {
+        AMQP_PROPERTIES_CACHE_ENTRY* entry = &transport_state->properties_cache[i];
+
+        if (entry->map != NULL && entry->hash == hash && entry->count == count)
+        {
+            size_t j;
+
+            for (j = 0; j < count; j++)
+            {
+                if (strcmp(entry->keys[j], keys[j]) != 0 ||
+                    strcmp(entry->values[j], values[j]) != 0)
+                {
+                    break;
+                }
+            }
+
+            if (j == count)
+            {
+                result = entry;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Takes ownership of the map when the property set can be cached.
+static AMQP_PROPERTIES_CACHE_ENTRY* cacheProperties(AMQP_TRANSPORT_INSTANCE* transport_state, size_t hash, const char* const* keys, const char* const* values, size_t count, AMQP_VALUE map)
+{
+    AMQP_PROPERTIES_CACHE_ENTRY* result = &transport_state->properties_cache[transport_state->properties_cache_next];
+    size_t i = 0;
+
+    clearPropertiesCacheEntry(result);
+
+    if ((result->keys = (char**)malloc(count * sizeof(char*))) == NULL ||
+        (result->values = (char**)malloc(count * sizeof(char*))) == NULL)
+    {
+        LogError("Failed allocating the cached application properties.\r\n");
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (mallocAndStrcpy_s(&result->keys[i], keys[i]) != 0)
+            {
+                break;
+            }
+            else if (mallocAndStrcpy_s(&result->values[i], values[i]) != 0)
+            {
+                free(result->keys[i]);
+                break;
+            }
+        }
+    }
+
+    if (i < count || result->values == NULL)
+    {
+        result->count = i;
+        clearPropertiesCacheEntry(result);
+        result = NULL;
+    }
+    else
+    {
+        result->hash = hash;
+        result->count = count;
+        result->map = map;
+        transport_state->properties_cache_next = (transport_state->properties_cache_next + 1) % transport_state->properties_cache_size;
+    }
+
+    return result;
+}
+
+// When *cache_entry is set, the map belongs to the application properties cache and must not be destroyed.
+static int createUAMQPPropertiesMap(AMQP_TRANSPORT_INSTANCE* transport_state, IOTHUB_MESSAGE_HANDLE iothub_message_handle, AMQP_VALUE* uamqp_map, AMQP_PROPERTIES_CACHE_ENTRY** cache_entry)
+{
+    int result;
+    MAP_HANDLE properties_map;
+    const char* const* propertyKeys;
+    const char* const* propertyValues;
+    size_t propertyCount;
+    size_t propertiesHash = 0;
+
+    *uamqp_map = NULL;
+    *cache_entry = NULL;
+
+    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_007: [The IoTHub message properties shall be obtained by calling IoTHubMessage_Properties.] */
+    properties_map = IoTHubMessage_Properties(iothub_message_handle);
+    if (properties_map == NULL)
+    {
+        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+        LogError("Failed to get property map from IoTHub message.\r\n");
+        result = __LINE__;
+    }
+    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_015: [The actual keys and values, as well as the number of properties shall be obtained by calling Map_GetInternals on the handle obtained from IoTHubMessage_Properties.] */
+    else if (Map_GetInternals(properties_map, &propertyKeys, &propertyValues, &propertyCount) != MAP_OK)
+    {
+        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+        LogError("Failed to get the internals of the property map.\r\n");
+        result = __LINE__;
+    }
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_169: [If the application properties cache is enabled and an event carries the same properties (same keys and values, in the same order) as a cached property set, the cached uAMQP map shall be used instead of building a new one.]
+    else if (propertyCount != 0 &&
+        transport_state->properties_cache_size > 0 &&
+        (*cache_entry = findCachedProperties(transport_state, (propertiesHash = hashProperties(propertyKeys, propertyValues, propertyCount)), propertyKeys, propertyValues, propertyCount)) != NULL)
+    {
+        *uamqp_map = (*cache_entry)->map;
+        result = 0;
+    }
+    else
+    {
+        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_016: [If the number of properties is 0, no uAMQP map shall be created and no application properties shall be set on the uAMQP message.] */
+        if (propertyCount != 0)
+        {
+            size_t i;
+            /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_009: [The uAMQP map shall be created by calling amqpvalue_create_map.] */
+            AMQP_VALUE map = amqpvalue_create_map();
+            if (map == NULL)
+            {
+                /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+                LogError("Failed to create uAMQP map for the properties.\r\n");
+                result = __LINE__;
+            }
+            else
+            {
+                for (i = 0; i < propertyCount; i++)
+                {
+                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_010: [A key uAMQP value shall be created by using amqpvalue_create_string.] */
+                    AMQP_VALUE map_key_value = amqpvalue_create_string(propertyKeys[i]);
+                    if (map_key_value == NULL)
+                    {
+                        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+                        LogError("Failed to create uAMQP property key value.\r\n");
+                        break;
+                    }
+
+                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_011: [A value uAMQP value shall be created by using amqpvalue_create_string.] */
+                    AMQP_VALUE map_value_value = amqpvalue_create_string(propertyValues[i]);
+                    if (map_value_value == NULL)
+                    {
+                        amqpvalue_destroy(map_key_value);
+                        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+                        LogError("Failed to create uAMQP property key value.\r\n");
+                        break;
+                    }
+
+                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_008: [All properties shall be transferred to a uAMQP map.] */
+                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_012: [The key/value pair for the property shall be set into the uAMQP property map by calling amqpvalue_map_set_value.] */
+                    if (amqpvalue_set_map_value(map, map_key_value, map_value_value) != 0)
+                    {
+                        amqpvalue_destroy(map_key_value);
+                        amqpvalue_destroy(map_value_value);
+                        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+                        LogError("Failed to create uAMQP property key value.\r\n");
+                        break;
+                    }
+
+                    amqpvalue_destroy(map_key_value);
+                    amqpvalue_destroy(map_value_value);
                 }
 
                 if (i < propertyCount)
                 {
+                    amqpvalue_destroy(map);
                     result = __LINE__;
                 }
                 else
                 {
-                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_013: [After all properties have been filled in the uAMQP map, the uAMQP properties map shall be set on the uAMQP message by calling message_set_application_properties.] */
-                    if (message_set_application_properties(uamqp_message, uamqp_map) != 0)
-                    {
-                        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-                        LogError("Failed to transfer the message properties to the uAMQP message.\r\n");
-                        result = __LINE__;
-                    }
-                    else
-                    {
-                        result = 0;
-                    }
+                    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_170: [A property set that is not cached yet shall be cached after its uAMQP map is built, replacing the oldest cached property set when the cache is full; failing to cache it shall not fail the event.]
+                    if (transport_state->properties_cache_size > 0)
+                    {
+                        *cache_entry = cacheProperties(transport_state, propertiesHash, propertyKeys, propertyValues, propertyCount, map);
+                    }
+
+                    *uamqp_map = map;
+                    result = 0;
+                }
+            }
+        }
+        else
+        {
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
+static int addPropertiesTouAMQPMessage(AMQP_TRANSPORT_INSTANCE* transport_state, IOTHUB_MESSAGE_HANDLE iothub_message_handle, MESSAGE_HANDLE uamqp_message)
+{
+    int result;
+    AMQP_VALUE uamqp_map;
+    AMQP_PROPERTIES_CACHE_ENTRY* cache_entry;
+
+    if (createUAMQPPropertiesMap(transport_state, iothub_message_handle, &uamqp_map, &cache_entry) != 0)
+    {
+        result = __LINE__;
+    }
+    else if (uamqp_map == NULL)
+    {
+        result = 0;
+    }
+    else
+    {
+        /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_013: [After all properties have been filled in the uAMQP map, the uAMQP properties map shall be set on the uAMQP message by calling message_set_application_properties.] */
+        if (message_set_application_properties(uamqp_message, uamqp_map) != 0)
+        {
+            /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+            LogError("Failed to transfer the message properties to the uAMQP message.\r\n");
+            result = __LINE__;
+        }
+        else
+        {
+            result = 0;
+        }
+
+        if (cache_entry == NULL)
+        {
+            amqpvalue_destroy(uamqp_map);
+        }
+    }
+
+    return result;
+}
+
+static MESSAGE_SENDER_HANDLE getEventSender(AMQP_TRANSPORT_INSTANCE* transport_state, size_t index)
+{
+    return (index == 0) ? transport_state->message_sender : transport_state->additional_senders[index - 1].message_sender;
+}
+
+static size_t nextRoundRobinSender(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    size_t index = transport_state->next_sender_index;
+
+    transport_state->next_sender_index = (index + 1) % (transport_state->additional_sender_count + 1);
+
+    return index;
+}
+
+static MESSAGE_SENDER_HANDLE selectEventBatchSender(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    // Batches mix partition keys, so with a partition property they all go on the primary link to keep their order.
+    size_t index = (transport_state->additional_sender_count == 0 || transport_state->sender_partition_property != NULL) ? 0 : nextRoundRobinSender(transport_state);
+
+    return getEventSender(transport_state, index);
+}
+
+// Codes_SRS_IOTHUBTRANSPORTAMQP_09_179: [With more than one sender link open, IoTHubTransportAMQP_DoWork shall send each event on the link selected by the hash of its 'sender_partition_property' value if that option is set (events without the property on the primary link), or round-robin otherwise.]
+static MESSAGE_SENDER_HANDLE selectEventSender(AMQP_TRANSPORT_INSTANCE* transport_state, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+    size_t index;
+
+    if (transport_state->additional_sender_count == 0)
+    {
+        index = 0;
+    }
+    else if (transport_state->sender_partition_property != NULL)
+    {
+        MAP_HANDLE properties = IoTHubMessage_Properties(messageHandle);
+        const char* partition_key = (properties == NULL) ? NULL : Map_GetValueFromKey(properties, transport_state->sender_partition_property);
+
+        index = (partition_key == NULL) ? 0 : hashString(INITIAL_STRING_HASH, partition_key) % (transport_state->additional_sender_count + 1);
+    }
+    else
+    {
+        index = nextRoundRobinSender(transport_state);
+    }
+
+    return getEventSender(transport_state, index);
+}
+
+static int sendPendingEvents(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    int result = RESULT_OK;
+    IOTHUB_MESSAGE_LIST* message;
+
+    while (isEventSendWindowOpen(transport_state) &&
+        (message = getNextEventToSend(transport_state)) != NULL)
+    {
+        result = RESULT_FAILURE;
+
+        IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
+        const unsigned char* messageContent;
+        size_t messageContentSize;
+        MESSAGE_HANDLE amqp_message = NULL;
+        bool is_message_error = false;
+
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_086: [IoTHubTransportAMQP_DoWork shall move queued events to an "in-progress" list right before processing them for sending]
+		trackEventInProgress(message, transport_state);
+
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_087: [If the event contains a message of type IOTHUBMESSAGE_BYTEARRAY, IoTHubTransportAMQP_DoWork shall obtain its char* representation and size using IoTHubMessage_GetByteArray()] 
+        if (contentType == IOTHUBMESSAGE_BYTEARRAY &&
+            IoTHubMessage_GetByteArray(message->messageHandle, &messageContent, &messageContentSize) != IOTHUB_MESSAGE_OK)
+        {
+            LogError("Failed getting the BYTE array representation of the event content to be sent.\r\n");
+            is_message_error = true;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_089: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain its char* representation using IoTHubMessage_GetString()] 
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_090: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain the size of its char* representation using strlen()] 
+        else if (contentType == IOTHUBMESSAGE_STRING &&
+            ((messageContent = IoTHubMessage_GetString(message->messageHandle)) == NULL))
+        {
+            LogError("Failed getting the STRING representation of the event content to be sent.\r\n");
+            is_message_error = true;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_092: [If the event contains a message of type IOTHUBMESSAGE_UNKNOWN, IoTHubTransportAMQP_DoWork shall remove the event from the in-progress list and invoke the upper layer callback reporting the error] 
+        else if (contentType == IOTHUBMESSAGE_UNKNOWN)
+        {
+            LogError("Cannot send events with content type IOTHUBMESSAGE_UNKNOWN.\r\n");
+            is_message_error = true;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_093: [IoTHubTransportAMQP_DoWork shall create an amqp message using message_create() uAMQP API] 
+        else if ((amqp_message = message_create()) == NULL)
+        {
+            LogError("Failed allocating the AMQP message for sending the event.\r\n");
+        }
+        else
+        {
+            BINARY_DATA binary_data;
+
+            if (contentType == IOTHUBMESSAGE_STRING)
+            {
+                messageContentSize = strlen(messageContent);
+            }
+
+            binary_data.bytes = messageContent;
+            binary_data.length = messageContentSize;
+
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_095: [IoTHubTransportAMQP_DoWork shall set the AMQP message body using message_add_body_amqp_data() uAMQP API] 
+            if (message_add_body_amqp_data(amqp_message, binary_data) != RESULT_OK)
+            {
+                LogError("Failed setting the body of the AMQP message.\r\n");
+            }
+            else
+            {
+                if (addPropertiesTouAMQPMessage(transport_state, message->messageHandle, amqp_message) != 0)
+                {
+                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
+                    is_message_error = true;
+                }
+                else
+                {
+                    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_097: [IoTHubTransportAMQP_DoWork shall pass the encoded AMQP message to AMQP for sending (along with on_message_send_complete callback) using messagesender_send()] 
+                    if (sendAMQPMessage(transport_state, selectEventSender(transport_state, message->messageHandle), amqp_message, on_message_send_complete, message) != RESULT_OK)
+                    {
+                        LogError("Failed sending the AMQP message.\r\n");
+                    }
+                    else
+                    {
+                        result = RESULT_OK;
+                    }
+                }
+            }
+        }
+
+        if (amqp_message != NULL)
+        {
+            // It can be destroyed because AMQP keeps a clone of the message.
+            message_destroy(amqp_message);
+        }
+
+        if (result != RESULT_OK)
+        {
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_088: [If IoTHubMessage_GetByteArray() fails, IoTHubTransportAMQP_DoWork shall remove the event from the in-progress list and invoke the upper layer callback reporting the error] 
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_091: [If IoTHubMessage_GetString() fails, IoTHubTransportAMQP_DoWork shall remove the event from the in-progress list and invoke the upper layer callback reporting the error] 
+            if (is_message_error)
+            {
+                on_message_send_complete(message, MESSAGE_SEND_ERROR);
+            }
+            else
+            {
+                // Codes_SRS_IOTHUBTRANSPORTAMQP_09_111: [If message_create() fails, IoTHubTransportAMQP_DoWork notify the failure, roll back the event to waitToSent list and return]
+                // Codes_SRS_IOTHUBTRANSPORTAMQP_09_112: [If message_add_body_amqp_data() fails, IoTHubTransportAMQP_DoWork notify the failure, roll back the event to waitToSent list and return]
+                // Codes_SRS_IOTHUBTRANSPORTAMQP_09_113: [If messagesender_send() fails, IoTHubTransportAMQP_DoWork notify the failure, roll back the event to waitToSent list and return]
+                rollEventBackToWaitList(message, transport_state);
+                break;
+            }
+        }
+    }
+
+    return result;
+}
+
+static int getEventBody(IOTHUB_MESSAGE_HANDLE messageHandle, IOTHUBMESSAGE_CONTENT_TYPE contentType, BINARY_DATA* body)
+{
+    int result;
+
+    if (contentType == IOTHUBMESSAGE_BYTEARRAY)
+    {
+        if (IoTHubMessage_GetByteArray(messageHandle, &body->bytes, &body->length) != IOTHUB_MESSAGE_OK)
+        {
+            LogError("Failed getting the BYTE array representation of the event content to be sent.\r\n");
+            result = RESULT_FAILURE;
+        }
+        else
+        {
+            result = RESULT_OK;
+        }
+    }
+    else if (contentType == IOTHUBMESSAGE_STRING)
+    {
+        const char* content = IoTHubMessage_GetString(messageHandle);
+        if (content == NULL)
+        {
+            LogError("Failed getting the STRING representation of the event content to be sent.\r\n");
+            result = RESULT_FAILURE;
+        }
+        else
+        {
+            body->bytes = (const unsigned char*)content;
+            body->length = strlen(content);
+            result = RESULT_OK;
+        }
+    }
+    else
+    {
+        LogError("Cannot send events with content type IOTHUBMESSAGE_UNKNOWN.\r\n");
+        result = RESULT_FAILURE;
+    }
+
+    return result;
+}
+
+static int appendEncodedBytes(void* context, const unsigned char* bytes, size_t length)
+{
+    int result;
+    AMQP_ENCODING_BUFFER* buffer = (AMQP_ENCODING_BUFFER*)context;
+
+    if (length > buffer->size - buffer->length)
+    {
+        result = __LINE__;
+    }
+    else
+    {
+        (void)memcpy(buffer->bytes + buffer->length, bytes, length);
+        buffer->length += length;
+        result = 0;
+    }
+
+    return result;
+}
+
+static int encodeSection(AMQP_VALUE section, AMQP_ENCODING_BUFFER* buffer)
+{
+    return (section == NULL) ? 0 : amqpvalue_encode(section, appendEncodedBytes, buffer);
+}
+
+static int reserveEncodingBuffer(AMQP_ENCODING_BUFFER* buffer, size_t size)
+{
+    int result;
+
+    if (size <= buffer->size)
+    {
+        result = 0;
+    }
+    else
+    {
+        unsigned char* bytes = (unsigned char*)realloc(buffer->bytes, size);
+        if (bytes == NULL)
+        {
+            result = __LINE__;
+        }
+        else
+        {
+            buffer->bytes = bytes;
+            buffer->size = size;
+            result = 0;
+        }
+    }
+
+    return result;
+}
+
+// Encodes an event as an AMQP message made of its application-properties and data sections.
+// The encoding buffer only grows, so steady traffic is encoded without any allocation.
+static int encodeBatchedEvent(AMQP_TRANSPORT_INSTANCE* transport_state, IOTHUB_MESSAGE_HANDLE messageHandle, BINARY_DATA body, AMQP_ENCODING_BUFFER* encoded_event)
+{
+    int result;
+    AMQP_VALUE properties_map;
+    AMQP_PROPERTIES_CACHE_ENTRY* cache_entry;
+
+    if (createUAMQPPropertiesMap(transport_state, messageHandle, &properties_map, &cache_entry) != 0)
+    {
+        result = RESULT_FAILURE;
+    }
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_171: [The encoded application-properties section of a cached property set shall be kept with it and copied into the following batched events with the same properties.]
+    else if (cache_entry != NULL && cache_entry->encoded_section != NULL)
+    {
+        AMQP_VALUE data_section;
+        amqp_binary binary_data;
+        size_t data_size;
+
+        binary_data.bytes = body.bytes;
+        binary_data.length = (uint32_t)body.length;
+
+        if ((data_section = amqpvalue_create_data(binary_data)) == NULL)
+        {
+            LogError("Failed creating the data section of the batched event.\r\n");
+            result = RESULT_FAILURE;
+        }
+        else
+        {
+            if (amqpvalue_get_encoded_size(data_section, &data_size) != 0)
+            {
+                LogError("Failed computing the encoded size of the batched event.\r\n");
+                result = RESULT_FAILURE;
+            }
+            else if (reserveEncodingBuffer(encoded_event, cache_entry->encoded_section_size + data_size) != 0)
+            {
+                LogError("Failed allocating the encoded batched event.\r\n");
+                result = RESULT_FAILURE;
+            }
+            else
+            {
+                (void)memcpy(encoded_event->bytes, cache_entry->encoded_section, cache_entry->encoded_section_size);
+                encoded_event->length = cache_entry->encoded_section_size;
+
+                if (encodeSection(data_section, encoded_event) != 0)
+                {
+                    LogError("Failed encoding the batched event.\r\n");
+                    result = RESULT_FAILURE;
+                }
+                else
+                {
+                    result = RESULT_OK;
+                }
+            }
+
+            amqpvalue_destroy(data_section);
+        }
+    }
+    else
+    {
+        AMQP_VALUE application_properties_section = NULL;
+        AMQP_VALUE data_section;
+        amqp_binary binary_data;
+        size_t properties_size = 0;
+        size_t data_size;
+
+        binary_data.bytes = body.bytes;
+        binary_data.length = (uint32_t)body.length;
+
+        if (properties_map != NULL &&
+            (application_properties_section = amqpvalue_create_application_properties(properties_map)) == NULL)
+        {
+            LogError("Failed creating the application-properties section of the batched event.\r\n");
+            result = RESULT_FAILURE;
+        }
+        else if ((data_section = amqpvalue_create_data(binary_data)) == NULL)
+        {
+            LogError("Failed creating the data section of the batched event.\r\n");
+            result = RESULT_FAILURE;
+        }
+        else
+        {
+            if ((application_properties_section != NULL && amqpvalue_get_encoded_size(application_properties_section, &properties_size) != 0) ||
+                amqpvalue_get_encoded_size(data_section, &data_size) != 0)
+            {
+                LogError("Failed computing the encoded size of the batched event.\r\n");
+                result = RESULT_FAILURE;
+            }
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_168: [The batched events shall be encoded into a buffer owned by the transport instance that is reused across events and only grows; it shall be released by IoTHubTransportAMQP_Destroy.]
+            else if (reserveEncodingBuffer(encoded_event, properties_size + data_size) != 0)
+            {
+                LogError("Failed allocating the encoded batched event.\r\n");
+                result = RESULT_FAILURE;
+            }
+            else
+            {
+                encoded_event->length = 0;
+
+                if (encodeSection(application_properties_section, encoded_event) != 0 ||
+                    encodeSection(data_section, encoded_event) != 0)
+                {
+                    LogError("Failed encoding the batched event.\r\n");
+                    result = RESULT_FAILURE;
+                }
+                else
+                {
+                    if (cache_entry != NULL &&
+                        properties_size > 0 &&
+                        (cache_entry->encoded_section = (unsigned char*)malloc(properties_size)) != NULL)
+                    {
+                        (void)memcpy(cache_entry->encoded_section, encoded_event->bytes, properties_size);
+                        cache_entry->encoded_section_size = properties_size;
+                    }
+
+                    result = RESULT_OK;
+                }
+            }
+
+            amqpvalue_destroy(data_section);
+        }
+
+        if (application_properties_section != NULL)
+        {
+            amqpvalue_destroy(application_properties_section);
+        }
+
+        if (properties_map != NULL && cache_entry == NULL)
+        {
+            amqpvalue_destroy(properties_map);
+        }
+    }
+
+    return result;
+}
+
+static void destroyEventBatch(AMQP_EVENT_BATCH* batch)
+{
+    free(batch->events);
+    free(batch);
+}
+
+static void on_event_batch_send_complete(void* context, MESSAGE_SEND_RESULT send_result)
+{
+    AMQP_EVENT_BATCH* batch = (AMQP_EVENT_BATCH*)context;
+    size_t i;
+
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_165: [When the batch message is settled, each event it carries shall be completed as if it had been sent individually with the batch settlement result.]
+    for (i = 0; i < batch->count; i++)
+    {
+        on_message_send_complete(batch->events[i], send_result);
+    }
+
+    destroyEventBatch(batch);
+}
+
+static int addEventToBatch(AMQP_EVENT_BATCH* batch, IOTHUB_MESSAGE_LIST* message)
+{
+    int result;
+    IOTHUB_MESSAGE_LIST** events = (IOTHUB_MESSAGE_LIST**)realloc(batch->events, (batch->count + 1) * sizeof(IOTHUB_MESSAGE_LIST*));
+
+    if (events == NULL)
+    {
+        LogError("Failed growing the list of batched events.\r\n");
+        result = RESULT_FAILURE;
+    }
+    else
+    {
+        events[batch->count++] = message;
+        batch->events = events;
+        result = RESULT_OK;
+    }
+
+    return result;
+}
+
+static void rollEventBatchBackToWaitList(AMQP_EVENT_BATCH* batch, AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    size_t i;
+
+    for (i = batch->count; i > 0; i--)
+    {
+        rollEventBackToWaitList(batch->events[i - 1], transport_state);
+    }
+
+    batch->count = 0;
+}
+
+// Fills the batch message with as many pending events as fit in max_event_batch_size bytes.
+static int fillEventBatch(AMQP_TRANSPORT_INSTANCE* transport_state, MESSAGE_HANDLE amqp_message, AMQP_EVENT_BATCH* batch)
+{
+    int result = RESULT_OK;
+    size_t batch_size = 0;
+    IOTHUB_MESSAGE_LIST* message;
+
+    while ((message = getNextEventToSend(transport_state)) != NULL)
+    {
+        BINARY_DATA body;
+        AMQP_ENCODING_BUFFER* encoded_event = &transport_state->batched_event_encoding;
+
+        if (getEventBody(message->messageHandle, IoTHubMessage_GetContentType(message->messageHandle), &body) != RESULT_OK)
+        {
+            // The event can never be sent, same as in the non batched path.
+            trackEventInProgress(message, transport_state);
+            on_message_send_complete(message, MESSAGE_SEND_ERROR);
+        }
+        else if (encodeBatchedEvent(transport_state, message->messageHandle, body, encoded_event) != RESULT_OK)
+        {
+            result = RESULT_FAILURE;
+            break;
+        }
+        else
+        {
+            BINARY_DATA batched_event;
+            batched_event.bytes = encoded_event->bytes;
+            batched_event.length = encoded_event->length;
+
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_164: [An AMQP batch message shall not exceed 'max_event_batch_size' bytes, unless it carries a single event.]
+            if (batch->count > 0 &&
+                batch_size + encoded_event->length + BATCHED_EVENT_SECTION_OVERHEAD > transport_state->max_event_batch_size)
+            {
+                break;
+            }
+            else if (message_add_body_amqp_data(amqp_message, batched_event) != RESULT_OK)
+            {
+                LogError("Failed adding the event to the AMQP batch message.\r\n");
+                result = RESULT_FAILURE;
+                break;
+            }
+            else
+            {
+                trackEventInProgress(message, transport_state);
+
+                if (addEventToBatch(batch, message) != RESULT_OK)
+                {
+                    // The batch message body already has the event, so it cannot be sent as is.
+                    rollEventBackToWaitList(message, transport_state);
+                    result = RESULT_FAILURE;
+                    break;
                 }
 
-                amqpvalue_destroy(uamqp_map);
+                batch_size += encoded_event->length + BATCHED_EVENT_SECTION_OVERHEAD;
             }
         }
-        else
-        {
-            result = 0;
-        }
     }
 
     return result;
 }
 
-static int sendPendingEvents(AMQP_TRANSPORT_INSTANCE* transport_state)
+// Codes_SRS_IOTHUBTRANSPORTAMQP_09_163: [If 'event_batching' is enabled, IoTHubTransportAMQP_DoWork shall send the pending events packed as data sections of AMQP batch messages (message format 0x80013700), each data section holding the event encoded as an AMQP message with its application-properties.]
+static int sendPendingEventBatches(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
     int result = RESULT_OK;
-    IOTHUB_MESSAGE_LIST* message;
 
-    while ((message = getNextEventToSend(transport_state)) != NULL)
+    while (isEventSendWindowOpen(transport_state) &&
+        getNextEventToSend(transport_state) != NULL)
     {
-        result = RESULT_FAILURE;
+        AMQP_EVENT_BATCH* batch;
+        MESSAGE_HANDLE amqp_message;
 
-        IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
-        const unsigned char* messageContent;
-        size_t messageContentSize;
-        MESSAGE_HANDLE amqp_message = NULL;
-        bool is_message_error = false;
+        if ((batch = (AMQP_EVENT_BATCH*)malloc(sizeof(AMQP_EVENT_BATCH))) == NULL)
+        {
+            LogError("Failed allocating the AMQP event batch.\r\n");
+            result = RESULT_FAILURE;
+            break;
+        }
 
-        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_086: [IoTHubTransportAMQP_DoWork shall move queued events to an "in-progress" list right before processing them for sending]
-		trackEventInProgress(message, transport_state);
+        batch->events = NULL;
+        batch->count = 0;
 
-        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_087: [If the event contains a message of type IOTHUBMESSAGE_BYTEARRAY, IoTHubTransportAMQP_DoWork shall obtain its char* representation and size using IoTHubMessage_GetByteArray()] 
-        if (contentType == IOTHUBMESSAGE_BYTEARRAY &&
-            IoTHubMessage_GetByteArray(message->messageHandle, &messageContent, &messageContentSize) != IOTHUB_MESSAGE_OK)
+        if ((amqp_message = message_create()) == NULL)
         {
-            LogError("Failed getting the BYTE array representation of the event content to be sent.\r\n");
-            is_message_error = true;
+            LogError("Failed allocating the AMQP batch message.\r\n");
+            result = RESULT_FAILURE;
         }
-        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_089: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain its char* representation using IoTHubMessage_GetString()] 
-        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_090: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain the size of its char* representation using strlen()] 
-        else if (contentType == IOTHUBMESSAGE_STRING &&
-            ((messageContent = IoTHubMessage_GetString(message->messageHandle)) == NULL))
+        else if (message_set_message_format(amqp_message, AMQP_BATCHING_FORMAT_CODE) != 0)
         {
-            LogError("Failed getting the STRING representation of the event content to be sent.\r\n");
-            is_message_error = true;
+            LogError("Failed setting the format of the AMQP batch message.\r\n");
+            result = RESULT_FAILURE;
         }
-        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_092: [If the event contains a message of type IOTHUBMESSAGE_UNKNOWN, IoTHubTransportAMQP_DoWork shall remove the event from the in-progress list and invoke the upper layer callback reporting the error] 
-        else if (contentType == IOTHUBMESSAGE_UNKNOWN)
+        else if (fillEventBatch(transport_state, amqp_message, batch) != RESULT_OK)
         {
-            LogError("Cannot send events with content type IOTHUBMESSAGE_UNKNOWN.\r\n");
-            is_message_error = true;
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_166: [If the batch message fails to be built or sent, its events shall be rolled back to the waitingToSend list.]
+            rollEventBatchBackToWaitList(batch, transport_state);
+            result = RESULT_FAILURE;
         }
-        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_093: [IoTHubTransportAMQP_DoWork shall create an amqp message using message_create() uAMQP API] 
-        else if ((amqp_message = message_create()) == NULL)
+        else if (batch->count > 0 &&
+            sendAMQPMessage(transport_state, selectEventBatchSender(transport_state), amqp_message, on_event_batch_send_complete, batch) != RESULT_OK)
         {
-            LogError("Failed allocating the AMQP message for sending the event.\r\n");
+            LogError("Failed sending the AMQP batch message.\r\n");
+            rollEventBatchBackToWaitList(batch, transport_state);
+            result = RESULT_FAILURE;
         }
         else
         {
-            BINARY_DATA binary_data;
-
-            if (contentType == IOTHUBMESSAGE_STRING)
-            {
-                messageContentSize = strlen(messageContent);
-            }
-
-            binary_data.bytes = messageContent;
-            binary_data.length = messageContentSize;
-
-            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_095: [IoTHubTransportAMQP_DoWork shall set the AMQP message body using message_add_body_amqp_data() uAMQP API] 
-            if (message_add_body_amqp_data(amqp_message, binary_data) != RESULT_OK)
-            {
-                LogError("Failed setting the body of the AMQP message.\r\n");
-            }
-            else
-            {
-                if (addPropertiesTouAMQPMessage(message->messageHandle, amqp_message) != 0)
-                {
-                    /* Codes_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
-                    is_message_error = true;
-                }
-                else
-                {
-                    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_097: [IoTHubTransportAMQP_DoWork shall pass the encoded AMQP message to AMQP for sending (along with on_message_send_complete callback) using messagesender_send()] 
-                    if (messagesender_send(transport_state->message_sender, amqp_message, on_message_send_complete, message) != RESULT_OK)
-                    {
-                        LogError("Failed sending the AMQP message.\r\n");
-                    }
-                    else
-                    {
-                        result = RESULT_OK;
-                    }
-                }
-            }
+            result = RESULT_OK;
         }
 
         if (amqp_message != NULL)
@@ -923,37 +2028,157 @@ static int sendPendingEvents(AMQP_TRANSPORT_INSTANCE* transport_state)
             message_destroy(amqp_message);
         }
 
+        if (result != RESULT_OK || batch->count == 0)
+        {
+            destroyEventBatch(batch);
+        }
+
         if (result != RESULT_OK)
         {
-            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_088: [If IoTHubMessage_GetByteArray() fails, IoTHubTransportAMQP_DoWork shall remove the event from the in-progress list and invoke the upper layer callback reporting the error] 
-            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_091: [If IoTHubMessage_GetString() fails, IoTHubTransportAMQP_DoWork shall remove the event from the in-progress list and invoke the upper layer callback reporting the error] 
-            if (is_message_error)
-            {
-                on_message_send_complete(message, MESSAGE_SEND_ERROR);
-            }
-            else
-            {
-                // Codes_SRS_IOTHUBTRANSPORTAMQP_09_111: [If message_create() fails, IoTHubTransportAMQP_DoWork notify the failure, roll back the event to waitToSent list and return]
-                // Codes_SRS_IOTHUBTRANSPORTAMQP_09_112: [If message_add_body_amqp_data() fails, IoTHubTransportAMQP_DoWork notify the failure, roll back the event to waitToSent list and return]
-                // Codes_SRS_IOTHUBTRANSPORTAMQP_09_113: [If messagesender_send() fails, IoTHubTransportAMQP_DoWork notify the failure, roll back the event to waitToSent list and return]
-                rollEventBackToWaitList(message, transport_state);
-                break;
-            }
+            break;
+        }
+    }
+
+    return result;
+}
+
+static bool isSasTokenRefreshRequired(AMQP_TRANSPORT_INSTANCE* transport_state, size_t current_time)
+{
+    return ((current_time - transport_state->current_sas_token_create_time) >= (transport_state->sas_token_refresh_time / 1000)) ? true : false;
+}
+
+// Puts a replacement SAS token while the link stays authenticated. Only fails once the current SAS token has expired.
+static int refreshAuthentication(AMQP_TRANSPORT_INSTANCE* transport_state)
+{
+    int result;
+    size_t current_time = getSecondsSinceEpoch();
+
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_155: [If CBS does not answer the refresh within 'cbs_request_timeout' milliseconds, the refresh shall be considered failed.]
+    if (transport_state->is_sas_token_refresh_in_progress &&
+        (current_time - transport_state->sas_token_refresh_start_time) * 1000 >= transport_state->cbs_request_timeout)
+    {
+        LogError("SAS token refresh timed out; the current SAS token remains in use.\r\n");
+        transport_state->is_sas_token_refresh_in_progress = false;
+        transport_state->awaited_put_token = 0;
+    }
+
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_082: [IoTHubTransportAMQP_DoWork shall refresh the SAS token if the current token has been used for more than 'sas_token_refresh_time' milliseconds]
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_153: [While a refreshed SAS token is put to CBS the transport shall remain authenticated and keep sending events; a failed refresh shall be retried no sooner than 'cbs_request_timeout' milliseconds after the previous attempt.]
+    if (!transport_state->is_sas_token_refresh_in_progress &&
+        isSasTokenRefreshRequired(transport_state, current_time) &&
+        (current_time - transport_state->sas_token_refresh_start_time) * 1000 >= transport_state->cbs_request_timeout)
+    {
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_083: [Each new SAS token created by the transport shall be valid for up to 'sas_token_lifetime' milliseconds from the time of creation]
+        size_t new_expiry_time = current_time + (transport_state->sas_token_lifetime / 1000);
+
+        transport_state->sas_token_refresh_start_time = current_time;
+        transport_state->sas_token_refresh_expiry_time = new_expiry_time;
+
+        if (putNewSASToken(transport_state, new_expiry_time) == RESULT_OK)
+        {
+            transport_state->is_sas_token_refresh_in_progress = true;
         }
     }
 
+    // Codes_SRS_IOTHUBTRANSPORTAMQP_09_156: [If the current SAS token has expired and no refresh has succeeded, IoTHubTransportAMQP_DoWork shall fail and trigger a connection retry.]
+    if (current_time >= transport_state->current_sas_token_expiry_time)
+    {
+        LogError("The SAS token has expired and could not be refreshed.\r\n");
+        result = RESULT_FAILURE;
+    }
+    else
+    {
+        result = RESULT_OK;
+    }
+
     return result;
 }
 
-static bool isSasTokenRefreshRequired(AMQP_TRANSPORT_INSTANCE* transport_state)
+// Seeded per device the first time it is needed, so devices and processes disconnected together
+// do not draw the same delays, as they would from rand() without srand.
+static uint32_t getNextReconnectJitter(AMQP_TRANSPORT_INSTANCE* transport_state, size_t current_time)
+{
+    uint32_t x = transport_state->reconnect_jitter_state;
+
+    if (x == 0)
+    {
+        x = transport_state->device_id_hash ^ (uint32_t)current_time;
+
+        if (x == 0)
+        {
+            // xorshift never leaves 0.
+            x = 1;
+        }
+    }
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    transport_state->reconnect_jitter_state = x;
+
+    return x;
+}
+
+static size_t getReconnectDelay(AMQP_TRANSPORT_INSTANCE* transport_state, size_t current_time)
+{
+    size_t delay = transport_state->reconnect_min_delay;
+    size_t i;
+
+    for (i = 1; i < transport_state->reconnect_attempts && delay < transport_state->reconnect_max_delay; i++)
+    {
+        delay = (delay > transport_state->reconnect_max_delay / 2) ? transport_state->reconnect_max_delay : delay * 2;
+    }
+
+    if (delay > transport_state->reconnect_max_delay)
+    {
+        delay = transport_state->reconnect_max_delay;
+    }
+
+    // Half of the delay is random, so devices disconnected together do not reconnect together.
+    return delay / 2 + (size_t)getNextReconnectJitter(transport_state, current_time) % (delay / 2 + 1);
+}
+
+// Codes_SRS_IOTHUBTRANSPORTAMQP_09_173: [After a failed connection, IoTHubTransportAMQP_DoWork shall wait before reconnecting for a random delay between half and all of 'reconnect_min_delay' doubled for each further consecutive failure, up to 'reconnect_max_delay'. The random part shall be drawn from a generator seeded per transport from its device id and the time of the first failure.]
+static bool isWaitingToReconnect(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
-    return ((getSecondsSinceEpoch() - transport_state->current_sas_token_create_time) >= (transport_state->sas_token_refresh_time / 1000)) ? true : false;
+    bool result;
+
+    if (transport_state->connection != NULL || transport_state->reconnect_attempts == 0)
+    {
+        result = false;
+    }
+    else
+    {
+        size_t current_time = getSecondsSinceEpoch();
+
+        if (!transport_state->is_reconnect_scheduled)
+        {
+            transport_state->next_reconnect_time = current_time + (getReconnectDelay(transport_state, current_time) + 999) / 1000;
+            transport_state->is_reconnect_scheduled = true;
+        }
+
+        result = (current_time < transport_state->next_reconnect_time);
+    }
+
+    return result;
 }
 
 static void prepareForConnectionRetry(AMQP_TRANSPORT_INSTANCE* transport_state)
 {
     destroyConnection(transport_state);
     rollEventsBackToWaitList(transport_state);
+
+    transport_state->reconnect_attempts++;
+    transport_state->is_reconnect_scheduled = false;
+    transport_state->is_connection_ready = false;
+
+    // The events rolled back are no longer unsettled; a new connection starts with a small window again.
+    transport_state->unsettled_events = 0;
+    transport_state->fast_settlements = 0;
+    if (transport_state->event_send_window > INITIAL_EVENT_SEND_WINDOW)
+    {
+        transport_state->event_send_window = INITIAL_EVENT_SEND_WINDOW;
+    }
 }
 
 
@@ -1036,6 +2261,13 @@ static TRANSPORT_LL_HANDLE IoTHubTransportAMQP_Create(const IOTHUBTRANSPORT_CONF
             transport_state->cbs = NULL;
             transport_state->cbs_state = CBS_STATE_IDLE;
             transport_state->current_sas_token_create_time = 0;
+            transport_state->current_sas_token_expiry_time = 0;
+            transport_state->is_sas_token_refresh_in_progress = false;
+            transport_state->sas_token_refresh_start_time = 0;
+            transport_state->sas_token_refresh_expiry_time = 0;
+            transport_state->put_token_count = 0;
+            transport_state->completed_put_token_count = 0;
+            transport_state->awaited_put_token = 0;
             transport_state->connection = NULL;
             transport_state->connection_state = AMQP_MANAGEMENT_STATE_IDLE;
             transport_state->connection_establish_time = 0;
@@ -1050,7 +2282,43 @@ static TRANSPORT_LL_HANDLE IoTHubTransportAMQP_Create(const IOTHUBTRANSPORT_CONF
             transport_state->session = NULL;
             transport_state->tls_io = NULL;
             transport_state->tls_io_transport_provider = getTLSIOTransport;
+            transport_state->is_websocket_write_coalescing_size_set = false;
+            transport_state->websocket_write_coalescing_size = 0;
             transport_state->isRegistered = false;
+            transport_state->session_incoming_window = (uint32_t)DEFAULT_INCOMING_WINDOW_SIZE;
+            transport_state->session_outgoing_window = DEFAULT_OUTGOING_WINDOW_SIZE;
+            transport_state->max_unsettled_events = 0;
+            transport_state->event_ack_latency_threshold = DEFAULT_EVENT_ACK_LATENCY_THRESHOLD_MS;
+            transport_state->event_send_window = INITIAL_EVENT_SEND_WINDOW;
+            transport_state->unsettled_events = 0;
+            transport_state->fast_settlements = 0;
+            transport_state->last_window_decrease_time = 0;
+            transport_state->tick_counter = NULL;
+            transport_state->event_batching = false;
+            transport_state->max_event_batch_size = DEFAULT_MAX_EVENT_BATCH_SIZE;
+            transport_state->batched_event_encoding.bytes = NULL;
+            transport_state->batched_event_encoding.size = 0;
+            transport_state->batched_event_encoding.length = 0;
+            transport_state->properties_cache = NULL;
+            transport_state->properties_cache_size = 0;
+            transport_state->properties_cache_next = 0;
+            transport_state->reconnect_attempts = 0;
+            transport_state->is_reconnect_scheduled = false;
+            transport_state->next_reconnect_time = 0;
+            transport_state->reconnect_min_delay = DEFAULT_RECONNECT_MIN_DELAY_MS;
+            transport_state->reconnect_max_delay = DEFAULT_RECONNECT_MAX_DELAY_MS;
+            transport_state->device_id_hash = hashString(INITIAL_STRING_HASH, config->upperConfig->deviceId);
+            transport_state->reconnect_jitter_state = 0;
+            transport_state->connection_idle_timeout = 0;
+            transport_state->sender_link_count = 1;
+            transport_state->additional_senders = NULL;
+            transport_state->additional_sender_count = 0;
+            transport_state->next_sender_index = 0;
+            transport_state->sender_partition_property = NULL;
+            transport_state->notify_connection_ready = false;
+            transport_state->is_event_sender_open = false;
+            transport_state->is_message_receiver_open = false;
+            transport_state->is_connection_ready = false;
 
             transport_state->waitingToSend = config->waitingToSend;
             DList_InitializeListHead(&transport_state->inProgress);
@@ -1166,6 +2434,15 @@ static void IoTHubTransportAMQP_Destroy(TRANSPORT_LL_HANDLE handle)
         // Codes_SRS_IOTHUBTRANSPORTAMQP_09_036 : [IoTHubTransportAMQP_Destroy shall return the remaining items in inProgress to waitingToSend list.]
         rollEventsBackToWaitList(transport_state);
 
+        if (transport_state->tick_counter != NULL)
+        {
+            tickcounter_destroy(transport_state->tick_counter);
+        }
+
+        free(transport_state->batched_event_encoding.bytes);
+        free(transport_state->sender_partition_property);
+        destroyPropertiesCache(transport_state);
+
         // Codes_SRS_IOTHUBTRANSPORTAMQP_09_150: [IoTHubTransportAMQP_Destroy shall destroy the transport instance]
         free(transport_state);
     }
@@ -1191,16 +2468,25 @@ static void IoTHubTransportAMQP_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT
         // Codes_SRS_IOTHUBTRANSPORTAMQP_09_147: [IoTHubTransportAMQP_DoWork shall save a reference to the client handle in transport_state->iothub_client_handle]
         transport_state->iothub_client_handle = iotHubClientHandle;
 
+        if (isWaitingToReconnect(transport_state))
+        {
+            // Nothing to do until the reconnect delay expires.
+        }
         // Codes_SRS_IOTHUBTRANSPORTAMQP_09_055: [If the transport handle has a NULL connection, IoTHubTransportAMQP_DoWork shall instantiate and initialize the AMQP components and establish the connection] 
-        if (transport_state->connection == NULL &&
+        else if (transport_state->connection == NULL &&
             establishConnection(transport_state) != RESULT_OK)
         {
             LogError("AMQP transport failed to establish connection with service.\r\n");
             trigger_connection_retry = true;
         }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_174: [If the CBS link reports an error, IoTHubTransportAMQP_DoWork shall tear down the connection and trigger a connection retry.]
+        else if (transport_state->connection_state == AMQP_MANAGEMENT_STATE_ERROR)
+        {
+            LogError("AMQP connection with the IoT hub failed.\r\n");
+            trigger_connection_retry = true;
+        }
         // Codes_SRS_IOTHUBTRANSPORTAMQP_09_081: [IoTHubTransportAMQP_DoWork shall put a new SAS token if the one has not been out already, or if the previous one failed to be put due to timeout of cbs_put_token().]
-        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_082: [IoTHubTransportAMQP_DoWork shall refresh the SAS token if the current token has been used for more than 'sas_token_refresh_time' milliseconds]
-        else if ((transport_state->cbs_state == CBS_STATE_IDLE || isSasTokenRefreshRequired(transport_state)) &&
+        else if (transport_state->cbs_state == CBS_STATE_IDLE &&
             startAuthentication(transport_state) != RESULT_OK)
         {
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_146: [If the SAS token fails to be sent to CBS (cbs_put_token), IoTHubTransportAMQP_DoWork shall fail and exit immediately]
@@ -1214,8 +2500,15 @@ static void IoTHubTransportAMQP_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT
             LogError("AMQP transport authentication timed out.\r\n");
             trigger_connection_retry = true;
         }
+        else if (transport_state->cbs_state == CBS_STATE_AUTHENTICATED &&
+            refreshAuthentication(transport_state) != RESULT_OK)
+        {
+            trigger_connection_retry = true;
+        }
         else if (transport_state->cbs_state == CBS_STATE_AUTHENTICATED)
         {
+            transport_state->reconnect_attempts = 0;
+
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_121: [IoTHubTransportAMQP_DoWork shall create an AMQP message_receiver if transport_state->message_receive is NULL and transport_state->receive_messages is true] 
             if (transport_state->receive_messages == true &&
                 transport_state->message_receiver == NULL &&
@@ -1238,17 +2531,28 @@ static void IoTHubTransportAMQP_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT
                 LogError("Failed creating AMQP transport event sender.\r\n");
                 trigger_connection_retry = true;
             }
-            else if (sendPendingEvents(transport_state) != RESULT_OK)
+            else if ((transport_state->event_batching ? sendPendingEventBatches(transport_state) : sendPendingEvents(transport_state)) != RESULT_OK)
             {
                 LogError("AMQP transport failed sending events.\r\n");
             }
+
+            // Codes_SRS_IOTHUBTRANSPORTAMQP_09_187: [If 'eagerConnect' is set, IoTHubTransportAMQP_DoWork shall call IoTHubClient_LL_ConnectionReady() once per connection, as soon as the event sender (and the message receiver, if subscribed) report they are open.]
+            if (!trigger_connection_retry &&
+                transport_state->notify_connection_ready &&
+                !transport_state->is_connection_ready &&
+                transport_state->is_event_sender_open &&
+                (!transport_state->receive_messages || transport_state->is_message_receiver_open))
+            {
+                transport_state->is_connection_ready = true;
+                IoTHubClient_LL_ConnectionReady(iotHubClientHandle);
+            }
         }
 
         if (trigger_connection_retry)
         {
             prepareForConnectionRetry(transport_state);
         }
-        else
+        else if (transport_state->connection != NULL)
         {
             // Codes_SRS_IOTHUBTRANSPORTAMQP_09_103: [IoTHubTransportAMQP_DoWork shall invoke connection_dowork() on AMQP for triggering sending and receiving messages] 
             connection_dowork(transport_state->connection);
@@ -1366,11 +2670,150 @@ static IOTHUB_CLIENT_RESULT IoTHubTransportAMQP_SetOption(TRANSPORT_LL_HANDLE ha
             transport_state->cbs_request_timeout = *((size_t*)value);
             result = IOTHUB_CLIENT_OK;
         }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_160: [IoTHubTransportAMQP_SetOption shall save the value if the option name is "session_incoming_window" or "session_outgoing_window", returning IOTHUB_CLIENT_OK. The values apply to the next AMQP session created.]
+        else if (strcmp("session_incoming_window", option) == 0)
+        {
+            transport_state->session_incoming_window = *((uint32_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        else if (strcmp("session_outgoing_window", option) == 0)
+        {
+            transport_state->session_outgoing_window = *((uint32_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_161: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "max_unsettled_events", returning IOTHUB_CLIENT_OK. A non-zero value enables the event flow control and shall create the tick counter if it does not exist yet; if tickcounter_create fails IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.]
+        else if (strcmp("max_unsettled_events", option) == 0)
+        {
+            size_t max_unsettled_events = *((size_t*)value);
+
+            if (max_unsettled_events > 0 &&
+                transport_state->tick_counter == NULL &&
+                (transport_state->tick_counter = tickcounter_create()) == NULL)
+            {
+                result = IOTHUB_CLIENT_ERROR;
+                LogError("Failed creating the tick counter for the event flow control.\r\n");
+            }
+            else
+            {
+                transport_state->max_unsettled_events = max_unsettled_events;
+                if (transport_state->event_send_window > max_unsettled_events)
+                {
+                    transport_state->event_send_window = (max_unsettled_events > 0) ? max_unsettled_events : INITIAL_EVENT_SEND_WINDOW;
+                }
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_167: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "event_batching" (bool) or "max_event_batch_size" (size_t, in bytes), returning IOTHUB_CLIENT_OK.]
+        else if (strcmp("event_batching", option) == 0)
+        {
+            transport_state->event_batching = *((bool*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        else if (strcmp("max_event_batch_size", option) == 0)
+        {
+            transport_state->max_event_batch_size = *((size_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_172: [IoTHubTransportAMQP_SetOption shall replace the application properties cache with an empty one holding up to the given number of property sets if the option name is "application_properties_cache_size", returning IOTHUB_CLIENT_OK; zero disables the cache. If the cache cannot be allocated IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.]
+        else if (strcmp("application_properties_cache_size", option) == 0)
+        {
+            if (createPropertiesCache(transport_state, *((size_t*)value)) != 0)
+            {
+                result = IOTHUB_CLIENT_ERROR;
+                LogError("Failed creating the application properties cache.\r\n");
+            }
+            else
+            {
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_177: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "reconnect_min_delay", "reconnect_max_delay" or "connection_idle_timeout" (size_t, in milliseconds), returning IOTHUB_CLIENT_OK.]
+        else if (strcmp("reconnect_min_delay", option) == 0)
+        {
+            transport_state->reconnect_min_delay = *((size_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        else if (strcmp("reconnect_max_delay", option) == 0)
+        {
+            transport_state->reconnect_max_delay = *((size_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        else if (strcmp("connection_idle_timeout", option) == 0)
+        {
+            transport_state->connection_idle_timeout = *((size_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_180: [IoTHubTransportAMQP_SetOption shall save the value if the option name is "sender_link_count" (size_t, at least 1), returning IOTHUB_CLIENT_OK; it applies to the next event sender created. A value of 0 shall be rejected with IOTHUB_CLIENT_INVALID_ARG.]
+        else if (strcmp("sender_link_count", option) == 0)
+        {
+            if (*((size_t*)value) == 0)
+            {
+                result = IOTHUB_CLIENT_INVALID_ARG;
+                LogError("Invalid AMQP sender link count (0).\r\n");
+            }
+            else
+            {
+                transport_state->sender_link_count = *((size_t*)value);
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_181: [IoTHubTransportAMQP_SetOption shall save a copy of the value if the option name is "sender_partition_property" (const char*), returning IOTHUB_CLIENT_OK; an empty string restores the round-robin distribution. If the copy fails IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.]
+        else if (strcmp("sender_partition_property", option) == 0)
+        {
+            char* sender_partition_property = NULL;
+
+            if (*((const char*)value) != '\0' &&
+                mallocAndStrcpy_s(&sender_partition_property, (const char*)value) != 0)
+            {
+                result = IOTHUB_CLIENT_ERROR;
+                LogError("Failed saving the sender partition property.\r\n");
+            }
+            else
+            {
+                free(transport_state->sender_partition_property);
+                transport_state->sender_partition_property = sender_partition_property;
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_186: [IoTHubTransportAMQP_SetOption shall save the value if the option name is "eagerConnect" (bool), returning IOTHUB_CLIENT_OK.]
+        else if (strcmp("eagerConnect", option) == 0)
+        {
+            transport_state->notify_connection_ready = *((bool*)value);
+            transport_state->is_connection_ready = false;
+            result = IOTHUB_CLIENT_OK;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_162: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "event_ack_latency_threshold", returning IOTHUB_CLIENT_OK.]
+        else if (strcmp("event_ack_latency_threshold", option) == 0)
+        {
+            transport_state->event_ack_latency_threshold = *((size_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        // Codes_SRS_IOTHUBTRANSPORTAMQP_09_185: [IoTHubTransportAMQP_SetOption shall apply the value if the option name is "websocket_write_coalescing_size" (size_t, in bytes) on AMQP over WebSockets, sending the bytes already buffered first; zero disables the coalescing. The value shall be saved once applied, to be applied again to the TLS I/O created on each reconnection.]
+        else if (strcmp("websocket_write_coalescing_size", option) == 0)
+        {
+            if (transport_state->tls_io == NULL &&
+                (transport_state->tls_io = createTlsIo(transport_state)) == NULL)
+            {
+                result = IOTHUB_CLIENT_ERROR;
+                LogError("Failed to obtain a TLS I/O transport layer.\r\n");
+            }
+            else if (xio_setoption(transport_state->tls_io, COALESCINGIO_OPTION_MAX_WRITE_SIZE, value) != 0)
+            {
+                result = IOTHUB_CLIENT_ERROR;
+                LogError("Failed applying the WebSocket write coalescing size (AMQP over WebSockets only).\r\n");
+            }
+            else
+            {
+                transport_state->websocket_write_coalescing_size = *((size_t*)value);
+                transport_state->is_websocket_write_coalescing_size_set = true;
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
         // Codes_SRS_IOTHUBTRANSPORTAMQP_09_047: [If the option name does not match one of the options handled by this module, then IoTHubTransportAMQP_SetOption shall get  the handle to the XIO and invoke the xio_setoption passing down the option name and value parameters.] 
         else
         {
             if (transport_state->tls_io == NULL &&
-                (transport_state->tls_io = transport_state->tls_io_transport_provider(STRING_c_str(transport_state->iotHubHostFqdn), transport_state->iotHubPort)) == NULL)
+                (transport_state->tls_io = createTlsIo(transport_state)) == NULL)
             {
                 result = IOTHUB_CLIENT_ERROR;
                 LogError("Failed to obtain a TLS I/O transport layer.\r\n");
@@ -1467,7 +2910,9 @@ static TRANSPORT_PROVIDER thisTransportProvider = {
     IoTHubTransportAMQP_Subscribe,
     IoTHubTransportAMQP_Unsubscribe,
     IoTHubTransportAMQP_DoWork,
-    IoTHubTransportAMQP_GetSendStatus
+    IoTHubTransportAMQP_GetSendStatus,
+    NULL, /* pfIoTHubTransport_EventQueued IoTHubTransport_EventQueued, the devices are visited by every DoWork */
+    NULL /* pfIoTHubTransport_SetDeviceOption IoTHubTransport_SetDeviceOption, options apply to the device of the transport */
 };
 
 extern const void* AMQP_Protocol(void)
@@ -3,17 +3,38 @@
 
 #include "iothubtransportamqp_websockets.h"
 #include "azure_uamqp_c/wsio.h"
+#include "coalescingio.h"
 #include "iothubtransportamqp.c"
 
 #define DEFAULT_WS_PROTOCOL_NAME "AMQPWSB10"
 #define DEFAULT_WS_RELATIVE_PATH "/$iothub/websocket"
 #define DEFAULT_WS_PORT 443
+// Largest coalesced write; leaves room for the WebSocket frame header within one 16KB TLS record.
+#define DEFAULT_WS_WRITE_COALESCING_SIZE (16 * 1024 - 16)
 
 XIO_HANDLE getWebSocketsIOTransport(const char* fqdn, int port, const char* certificates)
 {
 	WSIO_CONFIG ws_io_config = { fqdn, port, DEFAULT_WS_PROTOCOL_NAME, DEFAULT_WS_RELATIVE_PATH, true, certificates };
+	XIO_HANDLE result;
 
-	return xio_create(wsio_get_interface_description(), &ws_io_config, NULL);
+	if ((result = xio_create(wsio_get_interface_description(), &ws_io_config, NULL)) != NULL)
+	{
+		// Codes_SRS_IOTHUBTRANSPORTAMQP_09_183: [When using AMQP over WebSockets, the bytes written by the AMQP stack shall be copied into a buffer of up to 'websocket_write_coalescing_size' bytes instead of being sent as one WebSocket frame each; writes larger than the buffer shall be sent directly, after the buffered bytes.]
+		// Codes_SRS_IOTHUBTRANSPORTAMQP_09_184: [The coalesced bytes shall be written to WSIO as one send when the next write would exceed 'websocket_write_coalescing_size', and before and after the WSIO layer does its work on each DoWork; each merged write shall be completed with the result of that send.]
+		COALESCINGIO_CONFIG coalescing_io_config = { result, DEFAULT_WS_WRITE_COALESCING_SIZE, true };
+		XIO_HANDLE coalescing_io = xio_create(coalescingio_get_interface_description(), &coalescing_io_config, NULL);
+
+		if (coalescing_io == NULL)
+		{
+			LogError("Failed creating the WebSocket write coalescing layer; sending each frame on its own.\r\n");
+		}
+		else
+		{
+			result = coalescing_io;
+		}
+	}
+
+	return result;
 }
 static TRANSPORT_LL_HANDLE IoTHubTransportAMQP_Create_WebSocketsOverTls(const IOTHUBTRANSPORT_CONFIG* config)
 {
@@ -37,7 +58,9 @@ static TRANSPORT_PROVIDER thisTransportProvider_WebSocketsOverTls = {
 	IoTHubTransportAMQP_Subscribe,
 	IoTHubTransportAMQP_Unsubscribe,
 	IoTHubTransportAMQP_DoWork,
-	IoTHubTransportAMQP_GetSendStatus
+	IoTHubTransportAMQP_GetSendStatus,
+	NULL, /* pfIoTHubTransport_EventQueued IoTHubTransport_EventQueued, the devices are visited by every DoWork */
+	NULL /* pfIoTHubTransport_SetDeviceOption IoTHubTransport_SetDeviceOption, options apply to the device of the transport */
 };
 
 extern const void* AMQP_Protocol_over_WebSocketsTls(void)
@@ -2,6 +2,8 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
 #ifdef _CRTDBG_MAP_ALLOC
 #include <crtdbg.h>
 #endif
@@ -24,6 +26,14 @@
 #include "azure_c_shared_utility/vector.h"
 #include "azure_c_shared_utility/httpheaders.h"
 #include "azure_c_shared_utility/agenttime.h"
+#include "azure_c_shared_utility/crt_abstractions.h"
+#include "azure_c_shared_utility/sha.h"
+#include "azure_c_shared_utility/xio.h"
+#include "azure_c_shared_utility/tlsio.h"
+#include "azure_c_shared_utility/platform.h"
+#ifdef USE_HTTP_COMPRESSION
+#include "zlib.h"
+#endif
 
 #define IOTHUB_APP_PREFIX "iothub-app-"
 const char* IOTHUB_MESSAGE_ID = "iothub-messageid";
@@ -41,8 +51,37 @@ const char* IOTHUB_CORRELATION_ID = "iothub-correlationid";
 #define MAXIMUM_PAYLOAD_OVERHEAD 384
 #define MAXIMUM_PROPERTY_OVERHEAD 16
 
+/*DEFAULT_SCHEDULING_QUANTUM is the number of bytes of events a device earns per DoWork round when ready set scheduling is used*/
+/*the default is much smaller than the biggest request, so a device sending big events (or batches) sends less often than a device sending small ones*/
+#define DEFAULT_SCHEDULING_QUANTUM ((size_t)16*1024)
+
+/*DEFAULT_SAS_TOKEN_LIFETIME is the validity in seconds of a SAS token produced by the token cache (same as HTTPAPIEX_SAS)*/
+#define DEFAULT_SAS_TOKEN_LIFETIME ((unsigned int)3600)
+#define HMAC_SHA256_BLOCK_SIZE 64
+
+/*batched events compression (option "BatchCompression", only available when built with USE_HTTP_COMPRESSION)*/
+#define DEFAULT_COMPRESSION_LEVEL 6
+#define COMPRESSION_WINDOW_BITS (15 + 16) /*15 is the largest window, +16 produces a gzip wrapper*/
+#define COMPRESSION_MEMORY_LEVEL 8
+#define COMPRESSION_STORED_BLOCK_SIZE 16383 /*deflate never needs more than 5 bytes more per this many input bytes*/
+#define COMPRESSION_FINISH_OVERHEAD 16 /*closing ']', final empty block and gzip trailer*/
+#define COMPRESSION_PROBE_INTERVAL 16 /*number of batches sent uncompressed after a batch that did not compress well*/
+
+/*pipelined connection (option "Pipelining")*/
+#define DEFAULT_PIPELINE_DEPTH 8
+#define PIPELINE_PORT 443
+#define PIPELINE_RESPONSE_TIMEOUT 60 /*seconds the oldest request waits for its response before the connection is considered broken*/
+#define PIPELINE_RECONNECT_DELAY 5 /*seconds between a connection error and the next attempt to open the connection*/
+#define PIPELINE_MAXIMUM_LINE_SIZE 8192 /*status line, header line or chunk size line of a response*/
+
 /*forward declaration*/
 static int appendMapToJSON(STRING_HANDLE existing, const char* const* keys, const char* const* values, size_t count);
+struct HTTPTRANSPORT_HANDLE_DATA_TAG;
+struct HTTPTRANSPORT_PERDEVICE_DATA_TAG;
+static int enqueuePipelinedDisposition(struct HTTPTRANSPORT_HANDLE_DATA_TAG* handleData, struct HTTPTRANSPORT_PERDEVICE_DATA_TAG* deviceData, const char* ETag, const char* relativePathSuffix, HTTPAPI_REQUEST_TYPE requestType);
+struct HTTPTRANSPORT_PIPELINE_TAG;
+static void forgetPipelinedDevice(struct HTTPTRANSPORT_PIPELINE_TAG* pipeline, struct HTTPTRANSPORT_PERDEVICE_DATA_TAG* deviceData);
+static void destroyPipeline(struct HTTPTRANSPORT_HANDLE_DATA_TAG* handleData);
 
 /*Codes_SRS_TRANSPORTMULTITHTTP_17_125: [This function shall return a pointer to a structure of type TRANSPORT_PROVIDER having the following values for its fields:] */
 static TRANSPORT_PROVIDER thisTransportProvider =
@@ -55,7 +94,9 @@ static TRANSPORT_PROVIDER thisTransportProvider =
     IoTHubTransportHttp_Subscribe, /*pfIoTHubTransport_Subscribe IoTHubTransport_Subscribe;                                            */
     IoTHubTransportHttp_Unsubscribe, /*pfIoTHubTransport_Unsubscribe IoTHubTransport_Unsubscribe;                                        */
     IoTHubTransportHttp_DoWork, /*pfIoTHubTransport_DoWork IoTHubTransport_DoWork; */
-    IoTHubTransportHttp_GetSendStatus /* pfIoTHubTransport_GetSendStatus IoTHubTransport_GetSendStatus */
+    IoTHubTransportHttp_GetSendStatus, /* pfIoTHubTransport_GetSendStatus IoTHubTransport_GetSendStatus */
+    IoTHubTransportHttp_EventQueued, /* pfIoTHubTransport_EventQueued IoTHubTransport_EventQueued */
+    NULL /* pfIoTHubTransport_SetDeviceOption IoTHubTransport_SetDeviceOption, options apply to every device of the transport */
 };
 
 const void* HTTP_Protocol(void)
@@ -70,9 +111,75 @@ typedef struct HTTPTRANSPORT_HANDLE_DATA_TAG
     HTTPAPIEX_HANDLE httpApiExHandle;
     bool doBatchedTransfers;
     unsigned int getMinimumPollingTime;
+    bool useSasTokenCache;
+    unsigned int sasTokenLifetime;
 	VECTOR_HANDLE perDeviceList;
+    /*ready set scheduling (option "ReadySetScheduling")*/
+    bool useReadySetScheduling;
+    size_t schedulingQuantum; /*bytes of event payload a device earns per round (deficit round robin)*/
+    size_t nextEventDevice; /*index in perDeviceList where the next pipelined round starts*/
+    DLIST_ENTRY activeDevices; /*devices that had events queued since they were last found without events, in the order they are served*/
+    struct HTTPTRANSPORT_PERDEVICE_DATA_TAG** pollHeap; /*subscribed devices, min-heap on pollDeadline*/
+    size_t pollHeapSize;
+    size_t pollHeapCapacity;
+    bool isPollHeapDirty; /*set whenever devices or their subscriptions change, the heap is rebuilt by the next DoWork*/
+    bool reuseRequestResources; /*option "ReuseRequestResources"*/
+    bool useBatchCompression; /*option "BatchCompression"*/
+    int compressionLevel; /*option "CompressionLevel"*/
+    /*pipelined connection (option "Pipelining")*/
+    bool usePipelining;
+    size_t pipelineDepth; /*maximum number of requests waiting for their response*/
+    char* pipelineTrustedCerts;
+    struct HTTPTRANSPORT_PIPELINE_TAG* pipeline; /*created by the first pipelined DoWork*/
+#ifdef USE_HTTP_COMPRESSION
+    struct HTTPTRANSPORT_COMPRESSOR_TAG* compressor; /*created by the first compressed batch*/
+#endif
+    bool eagerConnect; /*option "eagerConnect", devices are told when the transport can carry their requests*/
+    bool isConnectionOpen; /*the last HTTPAPIEX request has been answered, so HTTPAPIEX holds an open connection*/
 }HTTPTRANSPORT_HANDLE_DATA;
 
+/*holds the last SAS token of a device together with the HMAC-SHA256 states obtained after absorbing (key^ipad) and (key^opad)*/
+/*so that renewing a token only costs hashing the string to sign*/
+typedef struct HTTPTRANSPORT_SAS_TOKEN_CACHE_TAG
+{
+    bool isKeyStateComputed;
+    USHAContext innerKeyState;
+    USHAContext outerKeyState;
+    STRING_HANDLE uriResource;
+    STRING_HANDLE token;
+    size_t renewalTime; /*seconds since epoch after which token shall be renewed*/
+    size_t expiryTime; /*seconds since epoch after which token is not accepted anymore by the service*/
+    uint32_t jitterState; /*state of the generator that picks the renewal time, 0 until seeded*/
+} HTTPTRANSPORT_SAS_TOKEN_CACHE;
+
+/*a character buffer that only grows, used to build strings without allocating once it has reached its working size*/
+typedef struct HTTPTRANSPORT_SCRATCH_TAG
+{
+    char* buffer;
+    size_t capacity;
+} HTTPTRANSPORT_SCRATCH;
+
+#ifdef USE_HTTP_COMPRESSION
+/*gzip stream of the transport. Devices build their batches one at a time, so they all use the same stream and output*/
+typedef struct HTTPTRANSPORT_COMPRESSOR_TAG
+{
+    bool isStreamInitialized;
+    int streamLevel; /*level the stream has been initialized with*/
+    z_stream stream;
+    HTTPTRANSPORT_SCRATCH output; /*compressed copy of the last payload made by makePayload, valid until the next one*/
+    size_t pendingInput; /*bytes given to deflate since the last flush, their compressed size is not yet known*/
+} HTTPTRANSPORT_COMPRESSOR;
+
+/*compression state of a device*/
+typedef struct HTTPTRANSPORT_COMPRESSION_TAG
+{
+    bool isPayloadCompressed; /*true when the last payload made by makePayload for the device has a compressed copy in the output of the compressor*/
+    size_t payloadMessagesSize; /*message size (as computed for uncompressed batches) of the items in the last payload*/
+    size_t batchesToSkip; /*batches to be sent uncompressed before trying compression again*/
+    HTTP_HEADERS_HANDLE requestHeaders; /*event HTTP request headers + "Content-Encoding: gzip"*/
+} HTTPTRANSPORT_COMPRESSION;
+#endif
+
 typedef struct HTTPTRANSPORT_PERDEVICE_DATA_TAG
 {
 	HTTPTRANSPORT_HANDLE_DATA* transportHandle;
@@ -85,15 +192,96 @@ typedef struct HTTPTRANSPORT_PERDEVICE_DATA_TAG
     HTTP_HEADERS_HANDLE messageHTTPrequestHeaders;
     STRING_HANDLE abandonHTTPrelativePathBegin;
     HTTPAPIEX_SAS_HANDLE sasObject;
+    HTTPTRANSPORT_SAS_TOKEN_CACHE sasTokenCache;
     bool DoWork_PullMessage;
     time_t lastPollTime;
 	bool isFirstPoll;
+    double pollDeadline; /*seconds since epoch of the next allowed GET, used by ready set scheduling*/
+    size_t eventDeficit; /*bytes this device may still send in the current round, used by ready set scheduling*/
+    size_t eventCost; /*bytes of the next event of the device, computed at the beginning of a round*/
+    bool isActive; /*the device is in the activeDevices list of the transport*/
+    DLIST_ENTRY activeEntry;
+    /*request resources kept from one DoWork to the next when the option "ReuseRequestResources" is set, created on first use*/
+    BUFFER_HANDLE requestContent;
+    BUFFER_HANDLE responseContent;
+    HTTP_HEADERS_HANDLE singleEventHeaders;
+    HTTPTRANSPORT_SCRATCH singleEventHeadersSignature; /*property names (and message id / correlation id presence) singleEventHeaders has been built for*/
+    HTTPTRANSPORT_SCRATCH propertyHeaderName;
+    HTTP_HEADERS_HANDLE abandonHTTPrequestHeaders;
+    HTTPTRANSPORT_SCRATCH abandonHTTPrelativePath;
+#ifdef USE_HTTP_COMPRESSION
+    HTTPTRANSPORT_COMPRESSION compression;
+#endif
+    size_t pipelinedEvents; /*event requests of this device waiting for their response on the pipelined connection*/
+    bool isPollPipelined; /*a GET of this device is waiting for its response on the pipelined connection*/
+    bool isConnectionReadyReported; /*IoTHubClient_LL_ConnectionReady has been called for the current connection*/
 
 	IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle;
     PDLIST_ENTRY waitingToSend;
     DLIST_ENTRY eventConfirmations; /*holds items for event confirmations*/
 } HTTPTRANSPORT_PERDEVICE_DATA;
 
+#define PIPELINE_STATE_VALUES \
+    PIPELINE_CLOSED, \
+    PIPELINE_OPENING, \
+    PIPELINE_OPEN, \
+    PIPELINE_ERROR
+DEFINE_ENUM(PIPELINE_STATE, PIPELINE_STATE_VALUES);
+
+#define RESPONSE_PARSER_STATE_VALUES \
+    RESPONSE_STATUS_LINE, \
+    RESPONSE_HEADERS, \
+    RESPONSE_BODY, \
+    RESPONSE_BODY_UNTIL_CLOSE, \
+    RESPONSE_CHUNK_SIZE, \
+    RESPONSE_CHUNK_DATA, \
+    RESPONSE_CHUNK_DATA_END, \
+    RESPONSE_TRAILERS
+DEFINE_ENUM(RESPONSE_PARSER_STATE, RESPONSE_PARSER_STATE_VALUES);
+
+#define PIPELINED_REQUEST_KIND_VALUES \
+    PIPELINED_EVENT, \
+    PIPELINED_POLL, \
+    PIPELINED_DISPOSITION
+DEFINE_ENUM(PIPELINED_REQUEST_KIND, PIPELINED_REQUEST_KIND_VALUES);
+
+typedef struct HTTPTRANSPORT_PIPELINED_REQUEST_TAG
+{
+    DLIST_ENTRY entry;
+    PIPELINED_REQUEST_KIND kind;
+    HTTPTRANSPORT_PERDEVICE_DATA* deviceData; /*NULL once the device has been unregistered*/
+    DLIST_ENTRY events; /*the IOTHUB_MESSAGE_LIST items sent by a PIPELINED_EVENT request*/
+    time_t sendTime;
+    unsigned int statusCode;
+    HTTP_HEADERS_HANDLE responseHeaders; /*only for PIPELINED_POLL*/
+    BUFFER_HANDLE responseContent; /*only for PIPELINED_POLL*/
+} HTTPTRANSPORT_PIPELINED_REQUEST;
+
+/*a keep-alive HTTP/1.1 connection on which requests are sent without waiting for the previous responses. Responses come back in request order*/
+typedef struct HTTPTRANSPORT_PIPELINE_TAG
+{
+    PIPELINE_STATE state;
+    XIO_HANDLE xio;
+    time_t nextOpenTime;
+    DLIST_ENTRY inFlight; /*requests sent, in the order their responses are expected*/
+    size_t inFlightCount;
+    DLIST_ENTRY completed; /*requests that have their response, processed by the next DoWork*/
+    bool isProcessingResponses; /*abandon/accept/reject are pipelined while true*/
+    HTTPTRANSPORT_SCRATCH request;
+    size_t requestSize;
+    /*response parser*/
+    RESPONSE_PARSER_STATE parserState;
+    HTTPTRANSPORT_SCRATCH line;
+    size_t lineSize;
+    HTTPTRANSPORT_SCRATCH body;
+    size_t bodySize;
+    size_t remaining; /*bytes left in the body or in the current chunk*/
+    unsigned int statusCode;
+    bool hasContentLength;
+    bool isChunked;
+    bool isConnectionClose;
+} HTTPTRANSPORT_PIPELINE;
+
 static void destroy_eventHTTPrelativePath(HTTPTRANSPORT_PERDEVICE_DATA* handleData)
 {
     STRING_delete(handleData->eventHTTPrelativePath);
@@ -439,1438 +627,3747 @@ static bool create_deviceKey(HTTPTRANSPORT_PERDEVICE_DATA* handleData, const cha
 	return result;
 }
 
-/*
-* List queries  Find by handle and find by device name
-*/
-
-/*Codes_SRS_TRANSPORTMULTITHTTP_17_137: [ IoTHubTransportHttp_Register shall search the devices list for any device matching name deviceId. If deviceId is found it shall return NULL. ]*/
-bool findDeviceHandle(const void* element, const void* value)
-{
-	bool result;
-	/* data stored at element is device handle */
-	const IOTHUB_DEVICE_HANDLE * guess = (const IOTHUB_DEVICE_HANDLE *)element;
-	const IOTHUB_DEVICE_HANDLE match = (const IOTHUB_DEVICE_HANDLE)value;
-	result = (*guess == match) ? true : false;
-	return result;
-}
-
-static bool findDeviceById(const void* element, const void* value)
-{
-	bool result;
-	const char* deviceId = (const char *)value;
-	const HTTPTRANSPORT_PERDEVICE_DATA * perDeviceElement = *(const HTTPTRANSPORT_PERDEVICE_DATA **)element;
-
-	result = (strcmp(STRING_c_str(perDeviceElement->deviceId), deviceId) == 0);
-
-    return result;
-}
-
-IOTHUB_DEVICE_HANDLE IoTHubTransportHttp_Register(TRANSPORT_LL_HANDLE handle, const char* deviceId, const char* deviceKey, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, PDLIST_ENTRY waitingToSend)
-{
-	HTTPTRANSPORT_PERDEVICE_DATA* result;
-	if (handle == NULL)
-	{
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_142: [ If handle is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
-		LogError("Transport handle is NULL");
-		result = NULL;
-	}
-	else if (deviceId == NULL || deviceKey == NULL || waitingToSend == NULL || iotHubClientHandle == NULL)
-	{
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_015: [ If parameter deviceKey is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_014: [ If parameter deviceId is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_016: [ If parameter waitingToSend is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_143: [ If parameter iotHubClientHandle is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
-		LogError("All parameters must be non-NULL");
-		result = NULL;
-	}
-	else
-	{
-		HTTPTRANSPORT_HANDLE_DATA* handleData = (HTTPTRANSPORT_HANDLE_DATA*)handle;
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_137: [ IoTHubTransportHttp_Register shall search the devices list for any device matching name deviceId. If deviceId is found it shall return NULL. ]*/
-		void* listItem = VECTOR_find_if(handleData->perDeviceList, findDeviceById, deviceId);
-		if (listItem != NULL)
-		{
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_137: [ IoTHubTransportHttp_Register shall search the devices list for any device matching name deviceId. If deviceId is found it shall return NULL. ]*/
-			LogError("Transport already has device registered by id: [%s]", deviceId);
-			result = NULL;
-		}
-		else
-		{
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_038: [ Otherwise, IoTHubTransportHttp_Register shall allocate the IOTHUB_DEVICE_HANDLE structure. ]*/
-			bool was_resultCreated_ok = ((result = malloc(sizeof(HTTPTRANSPORT_PERDEVICE_DATA))) != NULL);
-			bool was_create_deviceId_ok = was_resultCreated_ok && create_deviceId(result, deviceId);
-			bool was_create_deviceKey_ok = was_create_deviceId_ok && create_deviceKey(result, deviceKey);
-			bool was_eventHTTPrelativePath_ok = was_create_deviceKey_ok && create_eventHTTPrelativePath(result, deviceId);
-			bool was_messageHTTPrelativePath_ok = was_eventHTTPrelativePath_ok && create_messageHTTPrelativePath(result, deviceId);
-			bool was_eventHTTPrequestHeaders_ok = was_messageHTTPrelativePath_ok && create_eventHTTPrequestHeaders(result, deviceId);
-			bool was_messageHTTPrequestHeaders_ok = was_eventHTTPrequestHeaders_ok && create_messageHTTPrequestHeaders(result);
-			bool was_abandonHTTPrelativePathBegin_ok = was_messageHTTPrequestHeaders_ok && create_abandonHTTPrelativePathBegin(result, deviceId);
-			bool was_sasObject_ok = was_abandonHTTPrelativePathBegin_ok && create_deviceSASObject(result, handleData->hostName, deviceId, deviceKey);
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_041: [ IoTHubTransportHttp_Register shall call VECTOR_push_back to store the new device information. ]*/
-			bool was_list_add_ok = was_sasObject_ok && (VECTOR_push_back(handleData->perDeviceList, &result, 1) == 0);
-
-			if (was_list_add_ok)
-			{
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_043: [ Upon success, IoTHubTransportHttp_Register shall store the transport handle, iotHubClientHandle, and the waitingToSend queue in the device handle return a non-NULL value. ]*/
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_040: [ IoTHubTransportHttp_Register shall put event HTTP relative path, message HTTP relative path, event HTTP request headers, message HTTP request headers, abandonHTTPrelativePathBegin, HTTPAPIEX_SAS_HANDLE, and the device handle into a device structure. ]*/
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_128: [ IoTHubTransportHttp_Register shall mark this device as unsubscribed. ]*/
-				result->DoWork_PullMessage = false;
-				result->isFirstPoll = true;
-				result->iotHubClientHandle = iotHubClientHandle;
-				result->waitingToSend = waitingToSend;
-				DList_InitializeListHead(&(result->eventConfirmations));
-				result->transportHandle = handle;
-			}
-			else
-			{
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_042: [ If the list_add fails then IoTHubTransportHttp_Register shall fail and return NULL. ]*/
-				if (was_sasObject_ok) destroy_SASObject(result);
-				if (was_abandonHTTPrelativePathBegin_ok) destroy_abandonHTTPrelativePathBegin(result);
-				if (was_messageHTTPrelativePath_ok) destroy_messageHTTPrelativePath(result);
-				if (was_eventHTTPrequestHeaders_ok) destroy_eventHTTPrequestHeaders(result);
-				if (was_messageHTTPrequestHeaders_ok) destroy_messageHTTPrequestHeaders(result);
-				if (was_eventHTTPrelativePath_ok) destroy_eventHTTPrelativePath(result);
-				if (was_create_deviceId_ok) destroy_deviceId(result);
-				if (was_create_deviceKey_ok) destroy_deviceKey(result);
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_039: [ If the allocating the device handle fails then IoTHubTransportHttp_Register shall fail and return NULL. ] */
-				if (was_resultCreated_ok) free(result);
-				result = NULL;
-			}
-		}
-		
-	}
-	return (IOTHUB_DEVICE_HANDLE)result;
-}
-
-
-static void destroy_perDeviceData(HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem)
-{
-	destroy_deviceId(perDeviceItem);
-	destroy_deviceKey(perDeviceItem);
-	destroy_eventHTTPrelativePath(perDeviceItem);
-	destroy_messageHTTPrelativePath(perDeviceItem);
-	destroy_eventHTTPrequestHeaders(perDeviceItem);
-	destroy_messageHTTPrequestHeaders(perDeviceItem);
-	destroy_abandonHTTPrelativePathBegin(perDeviceItem);
-	destroy_SASObject(perDeviceItem);
-}
-
-static IOTHUB_DEVICE_HANDLE* get_perDeviceDataItem(IOTHUB_DEVICE_HANDLE deviceHandle)
-{
-	HTTPTRANSPORT_PERDEVICE_DATA* deviceHandleData = (HTTPTRANSPORT_PERDEVICE_DATA*)deviceHandle;
-	IOTHUB_DEVICE_HANDLE* listItem;
-
-	HTTPTRANSPORT_HANDLE_DATA* handleData = deviceHandleData->transportHandle;
-
-	listItem = VECTOR_find_if(handleData->perDeviceList, findDeviceHandle, deviceHandle);
-	if (listItem == NULL)
-	{
-		LogError("device handle not found in transport device list");
-		listItem = NULL;
-	}
-	else
-	{
-		/* sucessfully found device in list. */
-	}
-
-	return listItem;
-}
-
-void IoTHubTransportHttp_Unregister(IOTHUB_DEVICE_HANDLE deviceHandle)
+static void destroy_sasTokenCache(HTTPTRANSPORT_PERDEVICE_DATA* handleData)
 {
-	if (deviceHandle == NULL)
-	{
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_044: [ If deviceHandle is NULL, then IoTHubTransportHttp_Unregister shall do nothing. ]*/
-		LogError("Unregister a NULL device handle");
-	}
-	else
-	{
-		HTTPTRANSPORT_PERDEVICE_DATA* deviceHandleData = (HTTPTRANSPORT_PERDEVICE_DATA*)deviceHandle;
-		HTTPTRANSPORT_HANDLE_DATA* handleData = deviceHandleData->transportHandle;
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_045: [ IoTHubTransportHttp_Unregister shall locate deviceHandle in the transport device list by calling list_find_if. ]*/
-		IOTHUB_DEVICE_HANDLE* listItem = get_perDeviceDataItem(deviceHandle);
-		if (listItem == NULL)
-		{
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_046: [ If the device structure is not found, then this function shall fail and do nothing. ]*/
-			LogError("Device Handle [%p] not found in transport", deviceHandle);
-		}
-		else
-		{
-			HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA *)(*listItem);
-
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_047: [ IoTHubTransportHttp_Unregister shall free all the resources used in the device structure. ]*/
-			destroy_perDeviceData(perDeviceItem);
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_048: [ IoTHubTransportHttp_Unregister shall call list_remove to remove device from devices list. ]*/
-			VECTOR_erase(handleData->perDeviceList, listItem, 1);
-			free(deviceHandleData);
-		}
-	}
-
-	return;
+    /*the cache is populated lazily, only when the option "SasTokenCache" is in effect*/
+    if (handleData->sasTokenCache.token != NULL)
+    {
+        STRING_delete(handleData->sasTokenCache.token);
+        handleData->sasTokenCache.token = NULL;
+    }
+    if (handleData->sasTokenCache.uriResource != NULL)
+    {
+        STRING_delete(handleData->sasTokenCache.uriResource);
+        handleData->sasTokenCache.uriResource = NULL;
+    }
+    /*do not leave key derived material around*/
+    (void)memset(&handleData->sasTokenCache.innerKeyState, 0, sizeof(handleData->sasTokenCache.innerKeyState));
+    (void)memset(&handleData->sasTokenCache.outerKeyState, 0, sizeof(handleData->sasTokenCache.outerKeyState));
+    handleData->sasTokenCache.isKeyStateComputed = false;
 }
 
-
-/*Codes_SRS_TRANSPORTMULTITHTTP_17_005: [Otherwise, IoTHubTransportHttp_Create shall create an immutable string (further called hostname) containing config->upperConfig->iotHubName + config->upperConfig->iotHubSuffix.]*/
-static void destroy_hostName(HTTPTRANSPORT_HANDLE_DATA* handleData)
+static void init_sasTokenCache(HTTPTRANSPORT_PERDEVICE_DATA* handleData)
 {
-	STRING_delete(handleData->hostName);
-	handleData->hostName = NULL;
+    handleData->sasTokenCache.isKeyStateComputed = false;
+    handleData->sasTokenCache.uriResource = NULL;
+    handleData->sasTokenCache.token = NULL;
+    handleData->sasTokenCache.renewalTime = 0;
+    handleData->sasTokenCache.expiryTime = 0;
+    handleData->sasTokenCache.jitterState = 0;
 }
 
-/*Codes_SRS_TRANSPORTMULTITHTTP_17_005: [Otherwise, IoTHubTransportHttp_Create shall create an immutable string (further called hostname) containing config->upperConfig->iotHubName + config->upperConfig->iotHubSuffix.]*/
-static bool create_hostName(HTTPTRANSPORT_HANDLE_DATA* handleData, const IOTHUBTRANSPORT_CONFIG* config)
+/*computes the HMAC-SHA256 states after the first block of the inner and outer hashes (RFC 2104). These depend only on the key.*/
+static int computeSasKeyState(HTTPTRANSPORT_SAS_TOKEN_CACHE* cache, STRING_HANDLE deviceKey)
 {
-    bool result;
-    handleData->hostName = STRING_construct(config->upperConfig->iotHubName);
-    if (handleData->hostName == NULL)
+    int result;
+    BUFFER_HANDLE decodedKey = Base64_Decoder(STRING_c_str(deviceKey));
+    if (decodedKey == NULL)
     {
-        result = false;
+        LogError("unable to Base64_Decoder the device key\r\n");
+        result = __LINE__;
     }
     else
     {
-        if ((STRING_concat(handleData->hostName, ".") != 0) ||
-            (STRING_concat(handleData->hostName, config->upperConfig->iotHubSuffix) != 0))
+        uint8_t keyBlock[HMAC_SHA256_BLOCK_SIZE];
+        uint8_t padBlock[HMAC_SHA256_BLOCK_SIZE];
+        const unsigned char* key = BUFFER_u_char(decodedKey);
+        size_t keyLength = BUFFER_length(decodedKey);
+        size_t i;
+
+        (void)memset(keyBlock, 0, sizeof(keyBlock));
+        if (keyLength > HMAC_SHA256_BLOCK_SIZE)
         {
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_006: [ If creating the hostname fails then IoTHubTransportHttp_Create shall fail and return NULL. ] */
-            destroy_hostName(handleData);
-            result = false;
+            /*keys longer than the block size are hashed first*/
+            USHAContext keyContext;
+            if ((USHAReset(&keyContext, SHA256) != shaSuccess) ||
+                (USHAInput(&keyContext, key, (unsigned int)keyLength) != shaSuccess) ||
+                (USHAResult(&keyContext, keyBlock) != shaSuccess))
+            {
+                keyLength = 0;
+            }
+            else
+            {
+                keyLength = SHA256HashSize;
+            }
         }
         else
         {
-            result = true;
+            (void)memcpy(keyBlock, key, keyLength);
+        }
+
+        if (keyLength == 0)
+        {
+            LogError("unable to hash the device key\r\n");
+            result = __LINE__;
         }
+        else
+        {
+            for (i = 0; i < HMAC_SHA256_BLOCK_SIZE; i++)
+            {
+                padBlock[i] = keyBlock[i] ^ 0x36;
+            }
+            if ((USHAReset(&cache->innerKeyState, SHA256) != shaSuccess) ||
+                (USHAInput(&cache->innerKeyState, padBlock, HMAC_SHA256_BLOCK_SIZE) != shaSuccess))
+            {
+                LogError("unable to compute the inner HMAC state\r\n");
+                result = __LINE__;
+            }
+            else
+            {
+                for (i = 0; i < HMAC_SHA256_BLOCK_SIZE; i++)
+                {
+                    padBlock[i] = keyBlock[i] ^ 0x5c;
+                }
+                if ((USHAReset(&cache->outerKeyState, SHA256) != shaSuccess) ||
+                    (USHAInput(&cache->outerKeyState, padBlock, HMAC_SHA256_BLOCK_SIZE) != shaSuccess))
+                {
+                    LogError("unable to compute the outer HMAC state\r\n");
+                    result = __LINE__;
+                }
+                else
+                {
+                    cache->isKeyStateComputed = true;
+                    result = 0;
+                }
+            }
+            (void)memset(padBlock, 0, sizeof(padBlock));
+        }
+        (void)memset(keyBlock, 0, sizeof(keyBlock));
+        BUFFER_delete(decodedKey);
     }
     return result;
 }
 
-/*Codes_SRS_TRANSPORTMULTITHTTP_17_007: [Otherwise, IoTHubTransportHttp_Create shall create a HTTPAPIEX_HANDLE by a call to HTTPAPIEX_Create passing for hostName the hostname so far constructed by IoTHubTransportHttp_Create.]*/
-static void destroy_httpApiExHandle(HTTPTRANSPORT_HANDLE_DATA* handleData)
-{
-	HTTPAPIEX_Destroy(handleData->httpApiExHandle);
-	handleData->httpApiExHandle = NULL;
-}
-
-/*Codes_SRS_TRANSPORTMULTITHTTP_17_007: [ IoTHubTransportHttp_Create shall create a HTTPAPIEX_HANDLE by a call to HTTPAPIEX_Create passing for hostName the hostname so far constructed by IoTHubTransportHttp_Create. ]*/
-static bool create_httpApiExHandle(HTTPTRANSPORT_HANDLE_DATA* handleData, const IOTHUBTRANSPORT_CONFIG* config)
+/*produces the same token as SASToken_Create: "SharedAccessSignature sr=" + uriResource + "&sig=" + URL_ENCODE(BASE64(HMAC)) + "&se=" + expiry + "&skn="*/
+static STRING_HANDLE createCachedSasToken(HTTPTRANSPORT_SAS_TOKEN_CACHE* cache, size_t expiry)
 {
-    bool result;
-    (void)config;
-	handleData->httpApiExHandle = HTTPAPIEX_Create(STRING_c_str(handleData->hostName));
-	if (handleData->httpApiExHandle == NULL)
-	{
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_008: [ If creating the HTTPAPIEX_HANDLE fails then IoTHubTransportHttp_Create shall fail and return NULL. ] */
-		result = false;
-	}
-	else
-	{
-		result = true;
-	}
-	return result;
-}
-
-static void destroy_perDeviceList(HTTPTRANSPORT_HANDLE_DATA* handleData)
-{
-	VECTOR_destroy(handleData->perDeviceList);
-	handleData->perDeviceList = NULL;
-}
-
-/*Codes_SRS_TRANSPORTMULTITHTTP_17_009: [ IoTHubTransportHttp_Create shall call list_create to create a list of registered devices. ]*/
-static bool create_perDeviceList(HTTPTRANSPORT_HANDLE_DATA* handleData)
-{
-	bool result;
-	handleData->perDeviceList = VECTOR_create(sizeof(IOTHUB_DEVICE_HANDLE));
-	if (handleData == NULL || handleData->perDeviceList == NULL)
-	{
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_010: [ If creating the list fails, then IoTHubTransportHttp_Create shall fail and return NULL. ]*/
-		result = false;
-	}
-	else
-	{
-		result = true;
-	}
-	return result;
-}
-
-
-TRANSPORT_LL_HANDLE IoTHubTransportHttp_Create(const IOTHUBTRANSPORT_CONFIG* config)
-{
-    HTTPTRANSPORT_HANDLE_DATA* result;
-    if (config == NULL)
-    {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_001: [If parameter config is NULL, then IoTHubTransportHttp_Create shall return NULL.]*/
-        LogError("invalid arg (configuration is missing)\r\n");
-        result = NULL;
-    }
-    else if (config->upperConfig == NULL)
-    {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_002: [ If field transportConfig is NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
-        LogError("invalid arg (upperConfig is NULL)\r\n");
-        result = NULL;
-    }
-    else if (config->upperConfig->protocol == NULL)
-    {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_003: [ If fields protocol, iotHubName or iotHubSuffix in transportConfig are NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
-        LogError("invalid arg (protocol is NULL)\r\n");
-        result = NULL;
-    }
-    else if (config->upperConfig->iotHubName == NULL)
+    STRING_HANDLE result;
+    char expiryAsString[32];
+    if (size_tToString(expiryAsString, sizeof(expiryAsString), expiry) != 0)
     {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_003: [ If fields protocol, iotHubName or iotHubSuffix in transportConfig are NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
-        LogError("invalid arg (iotHubName is NULL)\r\n");
-        result = NULL;
-    }
-    else if (config->upperConfig->iotHubSuffix == NULL)
-    {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_003: [ If fields protocol, iotHubName or iotHubSuffix in transportConfig are NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
-        LogError("invalid arg (iotHubSuffix is NULL)\r\n");
+        LogError("unable to size_tToString\r\n");
         result = NULL;
     }
     else
     {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_130: [ IoTHubTransportHttp_Create shall allocate memory for the handle. ]*/
-        result = (HTTPTRANSPORT_HANDLE_DATA*)malloc(sizeof(HTTPTRANSPORT_HANDLE_DATA));
-        if (result == NULL)
+        /*working on copies keeps the precomputed states intact for the next renewal*/
+        USHAContext inner = cache->innerKeyState;
+        USHAContext outer = cache->outerKeyState;
+        uint8_t digest[USHAMaxHashSize];
+        if ((USHAInput(&inner, (const uint8_t*)STRING_c_str(cache->uriResource), (unsigned int)STRING_length(cache->uriResource)) != shaSuccess) ||
+            (USHAInput(&inner, (const uint8_t*)"\n", 1) != shaSuccess) ||
+            (USHAInput(&inner, (const uint8_t*)expiryAsString, (unsigned int)strlen(expiryAsString)) != shaSuccess) ||
+            (USHAResult(&inner, digest) != shaSuccess) ||
+            (USHAInput(&outer, digest, SHA256HashSize) != shaSuccess) ||
+            (USHAResult(&outer, digest) != shaSuccess))
         {
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_131: [ If allocation fails, IoTHubTransportHttp_Create shall fail and return NULL. ]*/
-            LogError("unable to malloc\r\n");
+            LogError("unable to compute the SAS token signature\r\n");
+            result = NULL;
         }
         else
         {
-			bool was_hostName_ok = create_hostName(result, config);
-            bool was_httpApiExHandle_ok = was_hostName_ok && create_httpApiExHandle(result, config);
-			bool was_perDeviceList_ok = was_httpApiExHandle_ok && create_perDeviceList(result);
-
-
-            if (was_perDeviceList_ok)
+            STRING_HANDLE base64Signature = Base64_Encode_Bytes(digest, SHA256HashSize);
+            if (base64Signature == NULL)
             {
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_011: [ Otherwise, IoTHubTransportHttp_Create shall succeed and return a non-NULL value. ]*/
-                result->doBatchedTransfers = false;
-                result->getMinimumPollingTime = DEFAULT_GETMINIMUMPOLLINGTIME;
+                LogError("unable to Base64_Encode_Bytes\r\n");
+                result = NULL;
             }
             else
             {
-                if (was_httpApiExHandle_ok) destroy_httpApiExHandle(result);
-				if (was_hostName_ok) destroy_hostName(result);
-
-                free(result);
-                result = NULL;
+                STRING_HANDLE urlEncodedSignature = URL_EncodeString(STRING_c_str(base64Signature));
+                if (urlEncodedSignature == NULL)
+                {
+                    LogError("unable to URL_EncodeString\r\n");
+                    result = NULL;
+                }
+                else
+                {
+                    result = STRING_construct("SharedAccessSignature sr=");
+                    if (result == NULL)
+                    {
+                        LogError("unable to STRING_construct\r\n");
+                    }
+                    else if (!(
+                        (STRING_concat_with_STRING(result, cache->uriResource) == 0) &&
+                        (STRING_concat(result, "&sig=") == 0) &&
+                        (STRING_concat_with_STRING(result, urlEncodedSignature) == 0) &&
+                        (STRING_concat(result, "&se=") == 0) &&
+                        (STRING_concat(result, expiryAsString) == 0) &&
+                        (STRING_concat(result, "&skn=") == 0)
+                        ))
+                    {
+                        LogError("unable to STRING_concat\r\n");
+                        STRING_delete(result);
+                        result = NULL;
+                    }
+                    else
+                    {
+                        /*all is fine*/
+                    }
+                    STRING_delete(urlEncodedSignature);
+                }
+                STRING_delete(base64Signature);
             }
         }
+        (void)memset(digest, 0, sizeof(digest));
     }
     return result;
 }
 
-void IoTHubTransportHttp_Destroy(TRANSPORT_LL_HANDLE handle)
-{
-	/*Codes_SRS_TRANSPORTMULTITHTTP_17_012: [ IoTHubTransportHttp_Destroy shall do nothing is handle is NULL. ]*/
-    if (handle != NULL)
-    {
-		HTTPTRANSPORT_HANDLE_DATA* handleData = (HTTPTRANSPORT_HANDLE_DATA*)handle;
-		IOTHUB_DEVICE_HANDLE* listItem;
-
-		size_t deviceListSize = VECTOR_size(handleData->perDeviceList);
-
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_013: [ Otherwise, IoTHubTransportHttp_Destroy shall free all the resources currently in use. ]*/
-		for (size_t i = 0; i < deviceListSize; i++)
-		{
-			listItem = VECTOR_element(handleData->perDeviceList, i);
-			HTTPTRANSPORT_PERDEVICE_DATA* perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA*)(*listItem);
-			destroy_perDeviceData(perDeviceItem);
-			free(perDeviceItem);
-		}
-
-        destroy_hostName(handle);
-        destroy_httpApiExHandle(handle);
-		destroy_perDeviceList(handle);
-        free(handle);
-    }
-}
-
-int IoTHubTransportHttp_Subscribe(IOTHUB_DEVICE_HANDLE handle)
+/*builds the same scope as HTTPAPIEX_SAS: hostname + "/devices/" + URL_ENCODED(deviceId)*/
+static int createSasTokenScope(HTTPTRANSPORT_SAS_TOKEN_CACHE* cache, STRING_HANDLE hostName, STRING_HANDLE deviceId)
 {
     int result;
-    if (handle == NULL)
+    STRING_HANDLE urlEncodedDeviceId = URL_EncodeString(STRING_c_str(deviceId));
+    if (urlEncodedDeviceId == NULL)
     {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_103: [ If parameter deviceHandle is NULL then IoTHubTransportHttp_Subscribe shall fail and return a non-zero value. ]*/
-        LogError("invalid arg passed to IoTHubTransportHttp_Subscribe\r\n");
+        LogError("unable to URL_EncodeString\r\n");
         result = __LINE__;
     }
     else
     {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_104: [ IoTHubTransportHttp_Subscribe shall locate deviceHandle in the transport device list by calling list_find_if. ]*/
-		IOTHUB_DEVICE_HANDLE* listItem = get_perDeviceDataItem(handle);
-
-		if (listItem == NULL)
-		{
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_105: [ If the device structure is not found, then this function shall fail and return a non-zero value. ]*/
-			LogError("did not find device in transport handle");
-			result = __LINE__;
-		}
-		else
-		{
-			HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem;
-
-			perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA *)(*listItem);
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_106: [ Otherwise, IoTHubTransportHttp_Subscribe shall set the device so that subsequent calls to DoWork should execute HTTP requests. ]*/
-			perDeviceItem->DoWork_PullMessage = true;
-		}
-        result = 0;
+        cache->uriResource = STRING_clone(hostName);
+        if (cache->uriResource == NULL)
+        {
+            LogError("unable to STRING_clone\r\n");
+            result = __LINE__;
+        }
+        else if ((STRING_concat(cache->uriResource, "/devices/") != 0) ||
+            (STRING_concat_with_STRING(cache->uriResource, urlEncodedDeviceId) != 0))
+        {
+            LogError("unable to STRING_concat\r\n");
+            STRING_delete(cache->uriResource);
+            cache->uriResource = NULL;
+            result = __LINE__;
+        }
+        else
+        {
+            result = 0;
+        }
+        STRING_delete(urlEncodedDeviceId);
     }
     return result;
 }
 
-void IoTHubTransportHttp_Unsubscribe(IOTHUB_DEVICE_HANDLE handle)
+/*returns the next value of the renewal jitter generator of a device (xorshift32). The generator is seeded the first time from a FNV-1a hash of the device id mixed with the time*/
+/*so that devices sharing a transport, and processes started together, do not pick the same renewal times as rand() without srand would*/
+static uint32_t getNextSasTokenJitter(HTTPTRANSPORT_SAS_TOKEN_CACHE* cache, STRING_HANDLE deviceId, time_t timeNow)
 {
-	/*Codes_SRS_TRANSPORTMULTITHTTP_17_107: [ If parameter deviceHandle is NULL then IoTHubTransportHttp_Unsubscribe shall fail do nothing. ]*/
-    if (handle != NULL)
+    uint32_t x = cache->jitterState;
+    if (x == 0)
     {
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_108: [ IoTHubTransportHttp_Unsubscribe shall locate deviceHandle in the transport device list by calling list_find_if. ]*/
-		IOTHUB_DEVICE_HANDLE* listItem = get_perDeviceDataItem(handle);
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_109: [ If the device structure is not found, then this function shall fail and do nothing. ]*/
-		if (listItem != NULL)
-		{
-			HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA *)(*listItem);
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_110: [ Otherwise, IoTHubTransportHttp_Subscribe shall set the device so that subsequent calls to DoWork shall not execute HTTP requests. ]*/
-			perDeviceItem->DoWork_PullMessage = false;
-    }
-		else
-		{
-			LogError("Device not found to unsuscribe.\r\n");
-}
+        const char* id = STRING_c_str(deviceId);
+        x = 2166136261u;
+        if (id != NULL)
+        {
+            while (*id != '\0')
+            {
+                x = (x ^ (unsigned char)(*id)) * 16777619u;
+                id++;
+            }
+        }
+        x ^= (uint32_t)timeNow;
+        if (x == 0)
+        {
+            /*xorshift never leaves 0*/
+            x = 1;
+        }
     }
-	else
-	{
-		LogError("Null handle passed to Unsuscribe.\r\n");
-	}
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cache->jitterState = x;
+    return x;
 }
 
-/*produces a representation of the properties, if they exist*/
-/*if they do not exist, produces ""*/
-static int concat_Properties(STRING_HANDLE existing, MAP_HANDLE map, size_t* propertiesMessageSizeContribution)
+/*returns the cached SAS token of the device, renewing it when the renewal time has passed*/
+static const char* getCachedSasToken(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData)
 {
-    int result;
-    const char*const* keys;
-    const char*const* values;
-    size_t count;
-    if (Map_GetInternals(map, &keys, &values, &count) != MAP_OK)
+    const char* result;
+    HTTPTRANSPORT_SAS_TOKEN_CACHE* cache = &deviceData->sasTokenCache;
+    time_t timeNow = get_time(NULL);
+    if (timeNow == (time_t)(-1))
     {
-        result = __LINE__;
-        LogError("error while Map_GetInternals\r\n");
+        LogError("time is not available, unable to produce a SAS token\r\n");
+        result = NULL;
     }
     else
     {
-
-        if (count == 0)
+        size_t secondsSinceEpoch = (size_t)get_difftime(timeNow, (time_t)0);
+        if ((cache->token != NULL) && (secondsSinceEpoch < cache->renewalTime))
         {
-            /*Codes_SRS_TRANSPORTMULTITHTTP_17_064: [If IoTHubMessage does not have properties, then "properties":{...} shall be missing from the payload*/
-            /*no properties - do nothing with existing*/
-            result = 0;
-            *propertiesMessageSizeContribution = 0;
+            /*steady state: no crypto, the token is only copied into the "Authorization" header*/
+            result = STRING_c_str(cache->token);
+        }
+        else if ((cache->uriResource == NULL) && (createSasTokenScope(cache, handleData->hostName, deviceData->deviceId) != 0))
+        {
+            LogError("unable to build the SAS token scope\r\n");
+            result = NULL;
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_147: [ The first time a token is needed, the transport shall decode the device key and compute the SHA-256 states after absorbing (key XOR ipad) and (key XOR opad). These states shall be reused for every later token of the device. ]*/
+        else if (!cache->isKeyStateComputed && (computeSasKeyState(cache, deviceData->deviceKey) != 0))
+        {
+            LogError("unable to precompute the HMAC key state\r\n");
+            result = NULL;
         }
         else
         {
-            /*Codes_SRS_TRANSPORTMULTITHTTP_17_058: [If IoTHubMessage has properties, then they shall be serialized at the same level as "body" using the following pattern: "properties":{"iothub-app-name1":"value1","iothub-app-name2":"value2*/
-            if (STRING_concat(existing, ",\"properties\":") != 0)
-            {
-                /*go ahead and return it*/
-                result = __LINE__;
-                LogError("failed STRING_concat\r\n");
-            }
-            else if (appendMapToJSON(existing, keys, values, count) != 0)
+            unsigned int lifetime = handleData->sasTokenLifetime;
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_148: [ The token shall have the same format as the one produced by SASToken_Create for the scope hostname + "/devices/" + URL_ENCODED(deviceId) and an empty key name. ]*/
+            STRING_HANDLE newToken = createCachedSasToken(cache, secondsSinceEpoch + lifetime);
+            if (newToken == NULL)
             {
-                result = __LINE__;
-                LogError("unable to append the properties\r\n");
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_150: [ If renewing the token fails, the previous token shall be used as long as it has not expired. ]*/
+                result = ((cache->token != NULL) && (secondsSinceEpoch < cache->expiryTime)) ? STRING_c_str(cache->token) : NULL;
             }
             else
             {
-                /*all is fine*/
-                size_t i;
-                *propertiesMessageSizeContribution = 0;
-                for (i = 0;i < count;i++)
+                if (cache->token != NULL)
                 {
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_063: [Every property name shall add to the message size the length of the property name + the length of the property value + 16 bytes.] */
-                    *propertiesMessageSizeContribution += (strlen(keys[i]) + strlen(values[i]) + MAXIMUM_PROPERTY_OVERHEAD);
+                    STRING_delete(cache->token);
                 }
-                result = 0;
+                cache->token = newToken;
+                cache->expiryTime = secondsSinceEpoch + lifetime;
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_149: [ The token shall be reused until a renewal time chosen at random between 1/2 and 3/4 of its lifetime. ]*/
+                /*the random part keeps devices sharing a transport from renewing in lockstep*/
+                cache->renewalTime = secondsSinceEpoch + lifetime / 2 + (size_t)(getNextSasTokenJitter(cache, deviceData->deviceId, timeNow) % (lifetime / 4 + 1));
+                result = STRING_c_str(cache->token);
             }
         }
     }
     return result;
 }
 
-/*produces a JSON representation of the map : {"a": "value_of_a","b":"value_of_b"}*/
-static int appendMapToJSON(STRING_HANDLE existing, const char* const* keys, const char* const* values, size_t count) /*under consideration: move to MAP module when it has more than 1 user*/
+/*executes an HTTP request on behalf of a device. Uses the SAS token cache when the option "SasTokenCache" has been set, otherwise HTTPAPIEX_SAS*/
+static HTTPAPIEX_RESULT executeDeviceRequest(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, HTTPAPI_REQUEST_TYPE requestType, const char* relativePath, HTTP_HEADERS_HANDLE requestHttpHeadersHandle, BUFFER_HANDLE requestContent, unsigned int* statusCode, HTTP_HEADERS_HANDLE responseHttpHeadersHandle, BUFFER_HANDLE responseContent)
 {
-    int result;
-    if (STRING_concat(existing, "{") != 0)
+    HTTPAPIEX_RESULT result;
+    if (!handleData->useSasTokenCache)
     {
-        /*go on and return it*/
-        result = __LINE__;
-        LogError("STRING_construct failed\r\n");
+        result = HTTPAPIEX_SAS_ExecuteRequest(deviceData->sasObject, handleData->httpApiExHandle, requestType, relativePath, requestHttpHeadersHandle, requestContent, statusCode, responseHttpHeadersHandle, responseContent);
     }
     else
     {
-        size_t i;
-        for (i = 0; i < count; i++)
-        {
-            if (!(
-                (STRING_concat(existing, (i == 0) ? "\"" IOTHUB_APP_PREFIX : ",\"" IOTHUB_APP_PREFIX) == 0) &&
-                (STRING_concat(existing, keys[i]) == 0) &&
-                (STRING_concat(existing, "\":\"") == 0) &&
-                (STRING_concat(existing, values[i]) == 0) &&
-                (STRING_concat(existing, "\"") == 0)
-                ))
-            {
-                LogError("unable to STRING_concat\r\n");
-                break;
-            }
-        }
-
-        if (i < count)
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_151: [ The "Authorization" request header shall be replaced with the token by a call to HTTPHeaders_ReplaceHeaderNameValuePair. If there is no token or the header cannot be replaced then the request shall be considered as failed by HTTPAPIEX. ]*/
+        const char* sasToken = getCachedSasToken(handleData, deviceData);
+        if (sasToken == NULL)
         {
-            result = __LINE__;
-            /*error, let it go through*/
+            result = HTTPAPIEX_ERROR;
         }
-        else if (STRING_concat(existing, "}") != 0)
+        else if (HTTPHeaders_ReplaceHeaderNameValuePair(requestHttpHeadersHandle, "Authorization", sasToken) != HTTP_HEADERS_OK)
         {
-            result = __LINE__;
-            LogError("unable to STRING_concat\r\n");
+            LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
+            result = HTTPAPIEX_ERROR;
         }
         else
         {
-            /*all is fine*/
-            result = 0;
+            result = HTTPAPIEX_ExecuteRequest(handleData->httpApiExHandle, requestType, relativePath, requestHttpHeadersHandle, requestContent, statusCode, responseHttpHeadersHandle, responseContent);
         }
     }
+    handleData->isConnectionOpen = (result == HTTPAPIEX_OK);
     return result;
 }
 
-/*makes the following string:{"body":"base64 encoding of the message content"[,"properties":{"a":"valueOfA"}]}*/
-/*return NULL if there was a failure, or a non-NULL STRING_HANDLE that contains the intended data*/
-static STRING_HANDLE make1EventJSONitem(PDLIST_ENTRY item, size_t *messageSizeContribution)
+static void destroy_scratch(HTTPTRANSPORT_SCRATCH* scratch)
 {
-    STRING_HANDLE result; /*temp wants to contain :{"body":"base64 encoding of the message content"[,"properties":{"a":"valueOfA"}]}*/
-    IOTHUB_MESSAGE_LIST* message = containingRecord(item, IOTHUB_MESSAGE_LIST, entry);
-    IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
-    
-    switch (contentType)
+    if (scratch->buffer != NULL)
     {
-    case IOTHUBMESSAGE_BYTEARRAY:
+        free(scratch->buffer);
+        scratch->buffer = NULL;
+    }
+    scratch->capacity = 0;
+}
+
+/*makes sure scratch can hold size characters. Only reallocates when the scratch has to grow (by doubling)*/
+static int reserveScratch(HTTPTRANSPORT_SCRATCH* scratch, size_t size)
+{
+    int result;
+    if (size <= scratch->capacity)
     {
-        result = STRING_construct("{\"body\":\"");
-        if (result == NULL)
+        result = 0;
+    }
+    else
+    {
+        size_t newCapacity = (scratch->capacity * 2 > size) ? scratch->capacity * 2 : size;
+        char* newBuffer = (char*)realloc(scratch->buffer, newCapacity);
+        if (newBuffer == NULL)
         {
-            LogError("unable to STRING_construct\r\n");
+            LogError("unable to realloc\r\n");
+            result = __LINE__;
         }
         else
         {
-            const unsigned char* source;
-            size_t size;
+            scratch->buffer = newBuffer;
+            scratch->capacity = newCapacity;
+            result = 0;
+        }
+    }
+    return result;
+}
 
-            if (IoTHubMessage_GetByteArray(message->messageHandle, &source, &size) != IOTHUB_MESSAGE_OK)
-            {
-                LogError("unable to get the data for the message.\r\n");
-                STRING_delete(result);
-                result = NULL;
-            }
-            else
-            {
-                STRING_HANDLE encoded = Base64_Encode_Bytes(source, size);
-                if (encoded == NULL)
-                {
-                    LogError("unable to Base64_Encode_Bytes.\r\n");
-                    STRING_delete(result);
-                    result = NULL;
-                }
-                else
-                {
-                    size_t propertiesSize;
-                    if (!(
-                        (STRING_concat_with_STRING(result, encoded) == 0) &&
-                        (STRING_concat(result, "\"") == 0) && /*\" because closing value*/
-                        (concat_Properties(result, IoTHubMessage_Properties(message->messageHandle), &propertiesSize) == 0) &&
-                        (STRING_concat(result, "},") == 0) /*the last comma shall be replaced by a ']' by DaCr's suggestion (which is awesome enough to receive credits in the source code)*/
-                        ))
-                    {
-                        STRING_delete(result);
-                        result = NULL;
-                        LogError("unable to STRING_concat_with_STRING.\r\n");
-                    }
-                    else
-                    {
-                        /*all is fine... */
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_062: [The message size is computed from the length of the payload + 384.] */
-                        *messageSizeContribution = size + MAXIMUM_PAYLOAD_OVERHEAD + propertiesSize;
-                    }
-                    STRING_delete(encoded);
-                }
-            }
+static void init_requestResources(HTTPTRANSPORT_PERDEVICE_DATA* handleData)
+{
+    handleData->requestContent = NULL;
+    handleData->responseContent = NULL;
+    handleData->singleEventHeaders = NULL;
+    handleData->singleEventHeadersSignature.buffer = NULL;
+    handleData->singleEventHeadersSignature.capacity = 0;
+    handleData->propertyHeaderName.buffer = NULL;
+    handleData->propertyHeaderName.capacity = 0;
+    handleData->abandonHTTPrequestHeaders = NULL;
+    handleData->abandonHTTPrelativePath.buffer = NULL;
+    handleData->abandonHTTPrelativePath.capacity = 0;
+}
+
+static void destroy_requestResources(HTTPTRANSPORT_PERDEVICE_DATA* handleData)
+{
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_162: [ The reusable request resources of a device shall be freed when the device is unregistered or the transport is destroyed. ]*/
+    if (handleData->requestContent != NULL)
+    {
+        BUFFER_delete(handleData->requestContent);
+        handleData->requestContent = NULL;
+    }
+    if (handleData->responseContent != NULL)
+    {
+        BUFFER_delete(handleData->responseContent);
+        handleData->responseContent = NULL;
+    }
+    if (handleData->singleEventHeaders != NULL)
+    {
+        HTTPHeaders_Free(handleData->singleEventHeaders);
+        handleData->singleEventHeaders = NULL;
+    }
+    if (handleData->abandonHTTPrequestHeaders != NULL)
+    {
+        HTTPHeaders_Free(handleData->abandonHTTPrequestHeaders);
+        handleData->abandonHTTPrequestHeaders = NULL;
+    }
+    destroy_scratch(&(handleData->singleEventHeadersSignature));
+    destroy_scratch(&(handleData->propertyHeaderName));
+    destroy_scratch(&(handleData->abandonHTTPrelativePath));
+}
+
+/*returns the buffer to be used for a request or response content. With "ReuseRequestResources" it is the device's buffer (created on first use), otherwise a new buffer*/
+static BUFFER_HANDLE acquireBuffer(HTTPTRANSPORT_HANDLE_DATA* handleData, BUFFER_HANDLE* deviceBuffer)
+{
+    BUFFER_HANDLE result;
+    if (!handleData->reuseRequestResources)
+    {
+        result = BUFFER_new();
+    }
+    else
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_159: [ When "ReuseRequestResources" is set, the content buffers of event requests and of message polls shall be created once per device and reused by the following requests. ]*/
+        if (*deviceBuffer == NULL)
+        {
+            *deviceBuffer = BUFFER_new();
         }
-        break;
+        result = *deviceBuffer;
     }
-    /*Codes_SRS_TRANSPORTMULTITHTTP_17_057: [If a messages to be send has type IOTHUBMESSAGE_STRING, then its serialization shall be {"body":"JSON encoding of the string", "base64Encoded":false}] */
-    case IOTHUBMESSAGE_STRING:
+    return result;
+}
+
+static void releaseBuffer(BUFFER_HANDLE* deviceBuffer, BUFFER_HANDLE buffer)
+{
+    if (buffer != *deviceBuffer)
     {
-        result = STRING_construct("{\"body\":");
-        if (result == NULL)
+        BUFFER_delete(buffer);
+    }
+}
+
+/*checks if the signature of the cached single event headers is exactly the property names of the message followed by the message id / correlation id presence*/
+static bool isSingleEventHeadersSignatureMatching(const HTTPTRANSPORT_SCRATCH* signature, const char* const* keys, size_t count, bool hasMessageId, bool hasCorrelationId)
+{
+    bool result = true;
+    const char* current = signature->buffer;
+    size_t i;
+    for (i = 0; (i < count) && result; i++)
+    {
+        size_t keyLength = strlen(keys[i]);
+        if ((strncmp(current, keys[i], keyLength) != 0) || (current[keyLength] != '\n'))
         {
-            LogError("unable to STRING_construct\r\n");
+            result = false;
         }
         else
         {
-            const char* source = IoTHubMessage_GetString(message->messageHandle);
-            if (source == NULL)
+            current += keyLength + 1;
+        }
+    }
+    return result &&
+        (current[0] == (hasMessageId ? 'M' : '-')) &&
+        (current[1] == (hasCorrelationId ? 'C' : '-')) &&
+        (current[2] == '\0');
+}
+
+/*returns the headers for sending one event. With "ReuseRequestResources" these are the device's single event headers, rebuilt only when the set of header names changes*/
+static HTTP_HEADERS_HANDLE acquireSingleEventHeaders(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, IOTHUB_MESSAGE_HANDLE messageHandle)
+{
+    HTTP_HEADERS_HANDLE result;
+    if (!handleData->reuseRequestResources)
+    {
+        result = HTTPHeaders_Clone(deviceData->eventHTTPrequestHeaders);
+    }
+    else
+    {
+        MAP_HANDLE map = IoTHubMessage_Properties(messageHandle);
+        const char*const* keys;
+        const char*const* values;
+        size_t count;
+        bool hasMessageId = (IoTHubMessage_GetMessageId(messageHandle) != NULL);
+        bool hasCorrelationId = (IoTHubMessage_GetCorrelationId(messageHandle) != NULL);
+        if (Map_GetInternals(map, &keys, &values, &count) != MAP_OK)
+        {
+            LogError("unable to Map_GetInternals\r\n");
+            result = NULL;
+        }
+        else if ((deviceData->singleEventHeaders != NULL) && isSingleEventHeadersSignatureMatching(&(deviceData->singleEventHeadersSignature), keys, count, hasMessageId, hasCorrelationId))
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_160: [ When "ReuseRequestResources" is set, the headers of a single event shall be the device's single event headers. They shall be recreated as a clone of the event HTTP request headers only when the message has a different set of property names, message id or correlation id than the previous message. ]*/
+            result = deviceData->singleEventHeaders;
+        }
+        else
+        {
+            size_t signatureSize = 3;
+            size_t i;
+            for (i = 0; i < count; i++)
+            {
+                signatureSize += strlen(keys[i]) + 1;
+            }
+
+            if (deviceData->singleEventHeaders != NULL)
+            {
+                HTTPHeaders_Free(deviceData->singleEventHeaders);
+                deviceData->singleEventHeaders = NULL;
+            }
+
+            if (reserveScratch(&(deviceData->singleEventHeadersSignature), signatureSize) != 0)
             {
-                LogError("unable to IoTHubMessage_GetString\r\n");
-                STRING_delete(result);
                 result = NULL;
             }
+            else if ((result = HTTPHeaders_Clone(deviceData->eventHTTPrequestHeaders)) == NULL)
+            {
+                LogError("HTTPHeaders_Clone failed\r\n");
+            }
             else
             {
-                STRING_HANDLE asJson = STRING_new_JSON(source);
-                if (asJson == NULL)
-                {
-                    LogError("unable to STRING_new_JSON\r\n");
-                    STRING_delete(result);
-                    result = NULL;
-                }
-                else
+                char* current = deviceData->singleEventHeadersSignature.buffer;
+                for (i = 0; i < count; i++)
                 {
-                    size_t propertiesSize;
-                    if (!(
-                        (STRING_concat_with_STRING(result, asJson) == 0) &&
-                        (STRING_concat(result, ",\"base64Encoded\":false") == 0) &&
-                        (concat_Properties(result, IoTHubMessage_Properties(message->messageHandle), &propertiesSize) == 0) &&
-                        (STRING_concat(result, "},") == 0) /*the last comma shall be replaced by a ']' by DaCr's suggestion (which is awesome enough to receive credits in the source code)*/
-                        ))
-                    {
-                        LogError("unable to STRING_concat_with_STRING");
-                        STRING_delete(result);
-                        result = NULL;
-                    }
-                    else
-                    {
-                        /*result has the intended content*/
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_062: [The message size is computed from the length of the payload + 384.] */
-                        *messageSizeContribution = strlen(source) + MAXIMUM_PAYLOAD_OVERHEAD + propertiesSize;
-                    }
-                    STRING_delete(asJson);
+                    size_t keyLength = strlen(keys[i]);
+                    (void)memcpy(current, keys[i], keyLength);
+                    current[keyLength] = '\n';
+                    current += keyLength + 1;
                 }
+                current[0] = hasMessageId ? 'M' : '-';
+                current[1] = hasCorrelationId ? 'C' : '-';
+                current[2] = '\0';
+                deviceData->singleEventHeaders = result;
             }
         }
-        break;
     }
-    default:
+    return result;
+}
+
+static void releaseSingleEventHeaders(HTTPTRANSPORT_PERDEVICE_DATA* deviceData, HTTP_HEADERS_HANDLE headers)
+{
+    if (headers != deviceData->singleEventHeaders)
     {
-        LogError("an unknown message type was encountered (%d)\r\n", contentType);
-        result = NULL; /*unknown message type*/
-        break;
+        HTTPHeaders_Free(headers);
+    }
+}
+
+/*writes "iothub-app-"+name in the device's scratch*/
+static const char* makePropertyHeaderName(HTTPTRANSPORT_PERDEVICE_DATA* deviceData, const char* name)
+{
+    const char* result;
+    size_t prefixLength = sizeof(IOTHUB_APP_PREFIX) - 1;
+    size_t nameLength = strlen(name);
+    if (reserveScratch(&(deviceData->propertyHeaderName), prefixLength + nameLength + 1) != 0)
+    {
+        result = NULL;
     }
+    else
+    {
+        (void)memcpy(deviceData->propertyHeaderName.buffer, IOTHUB_APP_PREFIX, prefixLength);
+        (void)memcpy(deviceData->propertyHeaderName.buffer + prefixLength, name, nameLength + 1);
+        result = deviceData->propertyHeaderName.buffer;
     }
     return result;
 }
 
-#define MAKE_PAYLOAD_RESULT_VALUES \
-    MAKE_PAYLOAD_OK, /*returned when there is a payload to be later send by HTTP*/ \
-    MAKE_PAYLOAD_NO_ITEMS, /*returned when there are no items to be send*/ \
-    MAKE_PAYLOAD_ERROR, /*returned when there were errors*/ \
-    MAKE_PAYLOAD_FIRST_ITEM_DOES_NOT_FIT /*returned when the first item doesn't fit*/
+#ifdef USE_HTTP_COMPRESSION
+static void init_compression(HTTPTRANSPORT_PERDEVICE_DATA* handleData)
+{
+    handleData->compression.isPayloadCompressed = false;
+    handleData->compression.payloadMessagesSize = 0;
+    handleData->compression.batchesToSkip = 0;
+    handleData->compression.requestHeaders = NULL;
+}
 
-DEFINE_ENUM(MAKE_PAYLOAD_RESULT, MAKE_PAYLOAD_RESULT_VALUES);
+static void destroy_compression(HTTPTRANSPORT_PERDEVICE_DATA* handleData)
+{
+    if (handleData->compression.requestHeaders != NULL)
+    {
+        HTTPHeaders_Free(handleData->compression.requestHeaders);
+        handleData->compression.requestHeaders = NULL;
+    }
+}
 
-/*this function assembles several {"body":"base64 encoding of the message content"," base64Encoded": true} into 1 payload*/
-/*Codes_SRS_TRANSPORTMULTITHTTP_17_056: [IoTHubTransportHttp_DoWork shall build the following string:[{"body":"base64 encoding of the message1 content"},{"body":"base64 encoding of the message2 content"}...]]*/
-static MAKE_PAYLOAD_RESULT makePayload(HTTPTRANSPORT_PERDEVICE_DATA* deviceData, STRING_HANDLE* payload)
+/*returns the compressor of the transport, creating it the first time a batch is compressed*/
+static HTTPTRANSPORT_COMPRESSOR* getCompressor(HTTPTRANSPORT_HANDLE_DATA* handleData)
 {
-    MAKE_PAYLOAD_RESULT result;
-    size_t allMessagesSize = 0;
-    *payload = STRING_construct("[");
-    if (*payload == NULL)
+    if (handleData->compressor == NULL)
     {
-        LogError("unable to STRING_construct\r\n");
-        result = MAKE_PAYLOAD_ERROR;
+        HTTPTRANSPORT_COMPRESSOR* compressor = (HTTPTRANSPORT_COMPRESSOR*)malloc(sizeof(HTTPTRANSPORT_COMPRESSOR));
+        if (compressor == NULL)
+        {
+            LogError("unable to malloc\r\n");
+        }
+        else
+        {
+            compressor->isStreamInitialized = false;
+            compressor->streamLevel = 0;
+            compressor->output.buffer = NULL;
+            compressor->output.capacity = 0;
+            compressor->pendingInput = 0;
+            handleData->compressor = compressor;
+        }
+    }
+    return handleData->compressor;
+}
+
+static void destroy_compressor(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    if (handleData->compressor != NULL)
+    {
+        if (handleData->compressor->isStreamInitialized)
+        {
+            (void)deflateEnd(&(handleData->compressor->stream));
+        }
+        destroy_scratch(&(handleData->compressor->output));
+        free(handleData->compressor);
+        handleData->compressor = NULL;
+    }
+}
+
+/*largest size deflate can produce for size bytes of input*/
+static size_t getCompressedSizeBound(size_t size)
+{
+    return size + 5 * (size / COMPRESSION_STORED_BLOCK_SIZE + 1);
+}
+
+static int compressPayloadBytes(HTTPTRANSPORT_COMPRESSOR* compressor, const char* source, size_t size, int flush)
+{
+    int result;
+    int deflateResult;
+    compressor->stream.next_in = (Bytef*)source;
+    compressor->stream.avail_in = (uInt)size;
+    deflateResult = deflate(&(compressor->stream), flush);
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_192: [ The compressed payload shall only be complete when deflate with Z_FINISH returns Z_STREAM_END. Otherwise the output buffer, which is as big as the message size limit, is full and the compressed payload cannot be completed. ]*/
+    if (((deflateResult != Z_OK) && (deflateResult != Z_STREAM_END)) ||
+        (compressor->stream.avail_in != 0) ||
+        ((flush == Z_FINISH) && (deflateResult != Z_STREAM_END)))
+    {
+        LogError("unable to deflate (%d)\r\n", deflateResult);
+        result = __LINE__;
     }
     else
     {
-        bool isFirst = true;
-        PDLIST_ENTRY actual;
-        bool keepGoing = true; /*keepGoing gets sometimes to false from within the loop*/
-        /*either all the items enter the list or only some*/
-        result = MAKE_PAYLOAD_OK; /*optimistically initializing it*/
-        while (keepGoing && ((actual = deviceData->waitingToSend->Flink) != deviceData->waitingToSend))
+        compressor->pendingInput = (flush == Z_NO_FLUSH) ? compressor->pendingInput + size : 0;
+        result = 0;
+    }
+    return result;
+}
+
+/*prepares the gzip stream of the transport for a new batch of the device. Returns false when this batch shall not be compressed*/
+static bool startCompressedPayload(HTTPTRANSPORT_PERDEVICE_DATA* deviceData)
+{
+    bool result;
+    HTTPTRANSPORT_COMPRESSION* compression = &(deviceData->compression);
+    int level = deviceData->transportHandle->compressionLevel;
+    compression->isPayloadCompressed = false;
+
+    if (!deviceData->transportHandle->useBatchCompression)
+    {
+        result = false;
+    }
+    else if (compression->batchesToSkip > 0)
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_169: [ If the compressed payload is not smaller than 90% of the JSON payload, the JSON payload shall be sent instead when it fits the message size limit, and the next 16 batches of the device shall not be compressed. ]*/
+        compression->batchesToSkip--;
+        result = false;
+    }
+    else
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_187: [ The gzip stream and its output buffer shall be created once per transport, by the first batch that is compressed, and be used by the batches of every device. ]*/
+        HTTPTRANSPORT_COMPRESSOR* compressor = getCompressor(deviceData->transportHandle);
+        if ((compressor != NULL) && compressor->isStreamInitialized && (compressor->streamLevel != level))
         {
-            size_t messageSize;
-            STRING_HANDLE temp = make1EventJSONitem(actual, &messageSize);
-            if (isFirst)
+            (void)deflateEnd(&(compressor->stream));
+            compressor->isStreamInitialized = false;
+        }
+
+        if ((compressor != NULL) && !compressor->isStreamInitialized)
+        {
+            compressor->stream.zalloc = Z_NULL;
+            compressor->stream.zfree = Z_NULL;
+            compressor->stream.opaque = Z_NULL;
+            if (deflateInit2(&(compressor->stream), level, Z_DEFLATED, COMPRESSION_WINDOW_BITS, COMPRESSION_MEMORY_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
             {
-                isFirst = false;
-                /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
-                if (temp == NULL) /*first item failed to create, nothing to send*/
-                {
-                    result = MAKE_PAYLOAD_ERROR;
-                    STRING_delete(*payload);
-                    *payload = NULL;
-                    keepGoing = false;
-                }
-                else
-                {
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_065: [If the oldest message in waitingToSend causes the message size to exceed the message size limit then it shall be removed from waitingToSend, and IoTHubClient_LL_SendComplete shall be called. Parameter PDLIST_ENTRY completed shall point to a list containing only the oldest item, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_FAILED.]*/
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_061: [The message size shall be limited to 255KB - 1 byte.]*/
-                    if (messageSize > MAXIMUM_MESSAGE_SIZE)
-                    {
-                        PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
-                        DList_InsertTailList(&(deviceData->eventConfirmations), head);
-                        result = MAKE_PAYLOAD_FIRST_ITEM_DOES_NOT_FIT;
-                        STRING_delete(*payload);
-                        *payload = NULL;
-                        keepGoing = false;
-                    }
-                    else
-                    {
-                        if (STRING_concat_with_STRING(*payload, temp) != 0)
-                        {
-                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
-                            result = MAKE_PAYLOAD_ERROR;
-                            STRING_delete(*payload);
-                            *payload = NULL;
-                            keepGoing = false;
-                        }
-                        else
-                        {
-                            /*first item was put nicely in the payload*/
-                            PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
-                            DList_InsertTailList(&(deviceData->eventConfirmations), head);
-                            allMessagesSize += messageSize;
-                        }
-                    }
-                    STRING_delete(temp);
-                }
+                LogError("unable to deflateInit2\r\n");
             }
             else
             {
-                /*there is at least 1 item already in the payload*/
-                if (temp == NULL)
-                {
-                    /*there are multiple payloads encoded, the last one had an internal error, just go with those - closing the payload happens "after the loop"*/
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_066: [If at any point during construction of the string there are errors, IoTHubTransportHttp_DoWork shall use the so far constructed string as payload.]*/
-                    result = MAKE_PAYLOAD_OK;
-                    keepGoing = false;
-                }
-                else
-                {
-                    if (allMessagesSize + messageSize > MAXIMUM_MESSAGE_SIZE)
-                    {
-                        /*this item doesn't make it to the payload, but the payload is valid so far*/
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_066: [If at any point during construction of the string there are errors, IoTHubTransportHttp_DoWork shall use the so far constructed string as payload.]*/
-                        result = MAKE_PAYLOAD_OK;
-                        keepGoing = false;
-                    }
-                    else if (STRING_concat_with_STRING(*payload, temp) != 0)
-                    {
-                        /*should still send what there is so far...*/
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_066: [If at any point during construction of the string there are errors, IoTHubTransportHttp_DoWork shall use the so far constructed string as payload.]*/
-                        result = MAKE_PAYLOAD_OK;
-                        keepGoing = false;
-                    }
-                    else
-                    {
-                        /*cool, the payload made it there, let's continue... */
-                        PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
-                        DList_InsertTailList(&(deviceData->eventConfirmations), head);
-                        allMessagesSize += messageSize;
-                    }
-                    STRING_delete(temp);
-                }
+                compressor->isStreamInitialized = true;
+                compressor->streamLevel = level;
             }
         }
 
-        /*closing the payload*/
-        if (result == MAKE_PAYLOAD_OK)
+        if ((compression->requestHeaders == NULL) &&
+            ((compression->requestHeaders = HTTPHeaders_Clone(deviceData->eventHTTPrequestHeaders)) != NULL) &&
+            !(
+                (HTTPHeaders_ReplaceHeaderNameValuePair(compression->requestHeaders, CONTENT_TYPE, APPLICATION_VND_MICROSOFT_IOTHUB_JSON) == HTTP_HEADERS_OK) &&
+                (HTTPHeaders_ReplaceHeaderNameValuePair(compression->requestHeaders, "Content-Encoding", "gzip") == HTTP_HEADERS_OK)
+            ))
         {
-            ((char*)STRING_c_str(*payload))[STRING_length(*payload) - 1] = ']'; /*TODO - do this in STRING_HANDLE*/
+            HTTPHeaders_Free(compression->requestHeaders);
+            compression->requestHeaders = NULL;
+        }
+
+        if ((compressor == NULL) ||
+            !compressor->isStreamInitialized ||
+            (compression->requestHeaders == NULL) ||
+            (reserveScratch(&(compressor->output), MAXIMUM_MESSAGE_SIZE) != 0) ||
+            (deflateReset(&(compressor->stream)) != Z_OK))
+        {
+            LogError("unable to prepare compression, the batch is sent uncompressed\r\n");
+            result = false;
         }
         else
         {
-            /*no need to close anything*/
+            compressor->stream.next_out = (Bytef*)compressor->output.buffer;
+            compressor->stream.avail_out = (uInt)compressor->output.capacity;
+            compressor->pendingInput = 0;
+            result = (compressPayloadBytes(compressor, "[", 1, Z_NO_FLUSH) == 0);
         }
     }
     return result;
 }
 
-static void reversePutListBackIn(PDLIST_ENTRY source, PDLIST_ENTRY destination)
-{
-    /*this function takes a list, and inserts it in another list. When done in the context of this file, it reverses the effects of a not-able-to-send situation*/
-    DList_AppendTailList(destination->Flink, source);
-    DList_RemoveEntryList(source);
-    DList_InitializeListHead(source);
-}
-
-static void DoEvent(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_168: [ When the batch is compressed, the message size limit shall apply to the compressed bytes: an item shall be added to the batch only if the compressed size so far plus the largest size deflate can produce for the not yet flushed bytes and the item is within the limit. ]*/
+static bool isFittingCompressedPayload(HTTPTRANSPORT_COMPRESSOR* compressor, size_t itemSize)
 {
-
-    if (DList_IsListEmpty(deviceData->waitingToSend))
+    bool result;
+    if (compressor->stream.total_out + getCompressedSizeBound(compressor->pendingInput + itemSize) + COMPRESSION_FINISH_OVERHEAD <= MAXIMUM_MESSAGE_SIZE)
     {
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_060: [If the list is empty then IoTHubTransportHttp_DoWork shall proceed to the following action.] */
+        result = true;
+    }
+    else if (compressor->pendingInput == 0)
+    {
+        result = false;
     }
     else
     {
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_053: [If option SetBatching is true then _Dowork shall send batched event message as specced below.] */
-        if (handleData->doBatchedTransfers)
-        {
-            /*Codes_SRS_TRANSPORTMULTITHTTP_17_054: [Request HTTP headers shall have the value of "Content-Type" created or updated to "application/vnd.microsoft.iothub.json" by a call to HTTPHeaders_ReplaceHeaderNameValuePair.] */
-            if (HTTPHeaders_ReplaceHeaderNameValuePair(deviceData->eventHTTPrequestHeaders, CONTENT_TYPE, APPLICATION_VND_MICROSOFT_IOTHUB_JSON) != HTTP_HEADERS_OK)
-            {
-                /*Codes_SRS_TRANSPORTMULTITHTTP_17_055: [If updating Content-Type fails for any reason, then _DoWork shall advance to the next action.] */
-                LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
-            }
-            else
-            {
-                /*Codes_SRS_TRANSPORTMULTITHTTP_17_059: [It shall inspect the "waitingToSend" DLIST passed in config structure.] */
-                STRING_HANDLE payload;
-                switch (makePayload(deviceData, &payload))
-                {
-                case MAKE_PAYLOAD_OK:
-                {
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_068: [Once a final payload has been obtained, IoTHubTransportHttp_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest passing the following parameters:] */
-                    BUFFER_HANDLE temp = BUFFER_new();
-                    if (temp == NULL)
-                    {
-                        LogError("unable to BUFFER_new\r\n");
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
-                        reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
-                    }
-                    else
-                    {
-                        if (BUFFER_build(temp, (const unsigned char*)STRING_c_str(payload), STRING_length(payload)) != 0)
-                        {
-                            LogError("unable to BUFFER_build\r\n");
-                            //items go back to waitingToSend
-                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
-                            reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
-                        }
-                        else
-                        {
-                            unsigned int statusCode;
-                            HTTPAPIEX_RESULT r;
-                            if ((r = HTTPAPIEX_SAS_ExecuteRequest(
-								deviceData->sasObject,
-                                handleData->httpApiExHandle,
-                                HTTPAPI_REQUEST_POST,
-                                STRING_c_str(deviceData->eventHTTPrelativePath),
-								deviceData->eventHTTPrequestHeaders,
-                                temp,
-                                &statusCode,
-                                NULL,
-                                NULL
-                                )) != HTTPAPIEX_OK)
-                            {
-                                LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
-                                //items go back to waitingToSend
-                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_069: [if HTTPAPIEX_SAS_ExecuteRequest fails or the http status code >=300 then IoTHubTransportHttp_DoWork shall not do any other action (it is assumed at the next _DoWork it shall be retried).] */
-                                reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
-                            }
-                            else
-                            {
-                                if (statusCode < 300)
-                                {
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_070: [If HTTPAPIEX_SAS_ExecuteRequest does not fail and http status code <300 then IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_SendComplete. Parameter PDLIST_ENTRY completed shall point to a list containing all the items batched, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_SUCESS. The batched items shall be removed from waitingToSend.] */
-                                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_SUCCESS);
-                                }
-                                else
-                                {
-                                    //items go back to waitingToSend
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_069: [if HTTPAPIEX_SAS_ExecuteRequest fails or the http status code >=300 then IoTHubTransportHttp_DoWork shall not do any other action (it is assumed at the next _DoWork it shall be retried).] */
-                                    LogError("unexpected HTTP status code (%u)\r\n", statusCode);
-                                    reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
-                                }
-                            }
-                        }
-                        BUFFER_delete(temp);
-                    }
-                    STRING_delete(payload);
-                    break;
-                }
-                case MAKE_PAYLOAD_FIRST_ITEM_DOES_NOT_FIT:
-                {
-                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
-                    break;
-                }
-                case MAKE_PAYLOAD_ERROR:
-                {
-                    LogError("unrecoverable errors while building a batch message\r\n");
-                    break;
-                }
-                case MAKE_PAYLOAD_NO_ITEMS:
-                {
-                    /*do nothing*/
-                    break;
-                }
-                default:
-                {
-                    LogError("internal error: switch's default branch reached when never intended\r\n");
-                    break;
-                }
-                }
-            }
-        }
-        else
-        {
-            const unsigned char* messageContent=NULL;
-            size_t messageSize=0;
-            size_t originalMessageSize=0;
-            IOTHUB_MESSAGE_LIST* message = containingRecord(deviceData->waitingToSend->Flink, IOTHUB_MESSAGE_LIST, entry);
-            IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
+        /*flushing makes the compressed size of everything so far known, which is usually far below the bound*/
+        result = (compressPayloadBytes(compressor, NULL, 0, Z_SYNC_FLUSH) == 0) &&
+            (compressor->stream.total_out + getCompressedSizeBound(itemSize) + COMPRESSION_FINISH_OVERHEAD <= MAXIMUM_MESSAGE_SIZE);
+    }
+    return result;
+}
 
-            /*Codes_SRS_TRANSPORTMULTITHTTP_17_073: [The message size is computed from the length of the payload + 384.]*/
-            if (!(
-                (((contentType == IOTHUBMESSAGE_BYTEARRAY) && 
-                    (IoTHubMessage_GetByteArray(message->messageHandle, &messageContent, &originalMessageSize)==IOTHUB_MESSAGE_OK)) ? (messageSize= originalMessageSize + MAXIMUM_PAYLOAD_OVERHEAD, 1): 0)
-                
-                ||
+/*adds to the compressed payload an item as produced by make1EventJSONitem (that is, ending in ',')*/
+static int compressPayloadItem(HTTPTRANSPORT_COMPRESSOR* compressor, STRING_HANDLE item, bool isFirst)
+{
+    return (
+        (isFirst || (compressPayloadBytes(compressor, ",", 1, Z_NO_FLUSH) == 0)) &&
+        (compressPayloadBytes(compressor, STRING_c_str(item), STRING_length(item) - 1, Z_NO_FLUSH) == 0)
+        ) ? 0 : __LINE__;
+}
+#endif
 
-                ((contentType == IOTHUBMESSAGE_STRING) && (
-                    messageContent = (const unsigned char*)IoTHubMessage_GetString(message->messageHandle), 
-                    (messageSize = MAXIMUM_PAYLOAD_OVERHEAD + (originalMessageSize = ((messageContent == NULL)?0:strlen((const char*)messageContent)))), 
-                    messageContent!=NULL)
-                    )
-                ))
-            {
-                LogError("unable to get the message content\r\n");
-                /*go on...*/
-            }
-            else
-            {
-                /*Codes_SRS_TRANSPORTMULTITHTTP_17_075: [If the oldest message in waitingToSend causes the message to exceed the message size limit then it shall be removed from waitingToSend, and IoTHubClient_LL_SendComplete shall be called. Parameter PDLIST_ENTRY completed shall point to a list containing only the oldest item, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_FAILED.]*/
-                /*Codes_SRS_TRANSPORTMULTITHTTP_17_072: [The message size shall be limited to 255KB -1 bytes.] */
-                if (messageSize > MAXIMUM_MESSAGE_SIZE)
-                {
-                    PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
-                    DList_InsertTailList(&(deviceData->eventConfirmations), head);
-                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
-                }
-                else
-                {
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_071: [If option SetBatching is false then _Dowork shall send individual event message as specced below.] */
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_076: [A clone of the event HTTP request headers shall be created.]*/
-                    HTTP_HEADERS_HANDLE clonedEventHTTPrequestHeaders = HTTPHeaders_Clone(deviceData->eventHTTPrequestHeaders);
-                    if (clonedEventHTTPrequestHeaders == NULL)
-                    {
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
-                        LogError("HTTPHeaders_Clone failed\r\n");
-                    }
-                    else
-                    {
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_077: [The cloned HTTP headers shall have the HTTP header "Content-Type" set to "application/octet-stream".] */
-                        if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, CONTENT_TYPE, APPLICATION_OCTET_STREAM) != HTTP_HEADERS_OK)
-                        {
-                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
-                            LogError("HTTPHeaders_ReplaceHeaderNameValuePair failed\r\n");
-                        }
-                        else
-                        {
-                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_078: [Every message property "property":"value" shall be added to the HTTP headers as an individual header "iothub-app-property":"value".] */
-                            MAP_HANDLE map = IoTHubMessage_Properties(message->messageHandle);
-                            const char*const* keys;
-                            const char*const* values;
-                            size_t count;
-                            if (Map_GetInternals(map, &keys, &values, &count) != MAP_OK)
-                            {
-                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_078: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
-                                LogError("unable to Map_GetInternals\r\n");
-                            }
-                            else
-                            {
-                                size_t i;
-                                bool goOn = true;
-                                const char* msgId;
-                                const char* corrId;
-                                
+/*
+* List queries  Find by handle and find by device name
+*/
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_137: [ IoTHubTransportHttp_Register shall search the devices list for any device matching name deviceId. If deviceId is found it shall return NULL. ]*/
+bool findDeviceHandle(const void* element, const void* value)
+{
+	bool result;
+	/* data stored at element is device handle */
+	const IOTHUB_DEVICE_HANDLE * guess = (const IOTHUB_DEVICE_HANDLE *)element;
+	const IOTHUB_DEVICE_HANDLE match = (const IOTHUB_DEVICE_HANDLE)value;
+	result = (*guess == match) ? true : false;
+	return result;
+}
+
+static bool findDeviceById(const void* element, const void* value)
+{
+	bool result;
+	const char* deviceId = (const char *)value;
+	const HTTPTRANSPORT_PERDEVICE_DATA * perDeviceElement = *(const HTTPTRANSPORT_PERDEVICE_DATA **)element;
+
+	result = (strcmp(STRING_c_str(perDeviceElement->deviceId), deviceId) == 0);
+
+    return result;
+}
+
+IOTHUB_DEVICE_HANDLE IoTHubTransportHttp_Register(TRANSPORT_LL_HANDLE handle, const char* deviceId, const char* deviceKey, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, PDLIST_ENTRY waitingToSend)
+{
+	HTTPTRANSPORT_PERDEVICE_DATA* result;
+	if (handle == NULL)
+	{
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_142: [ If handle is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
+		LogError("Transport handle is NULL");
+		result = NULL;
+	}
+	else if (deviceId == NULL || deviceKey == NULL || waitingToSend == NULL || iotHubClientHandle == NULL)
+	{
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_015: [ If parameter deviceKey is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_014: [ If parameter deviceId is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_016: [ If parameter waitingToSend is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_143: [ If parameter iotHubClientHandle is NULL, then IoTHubTransportHttp_Register shall return NULL. ]*/
+		LogError("All parameters must be non-NULL");
+		result = NULL;
+	}
+	else
+	{
+		HTTPTRANSPORT_HANDLE_DATA* handleData = (HTTPTRANSPORT_HANDLE_DATA*)handle;
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_137: [ IoTHubTransportHttp_Register shall search the devices list for any device matching name deviceId. If deviceId is found it shall return NULL. ]*/
+		void* listItem = VECTOR_find_if(handleData->perDeviceList, findDeviceById, deviceId);
+		if (listItem != NULL)
+		{
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_137: [ IoTHubTransportHttp_Register shall search the devices list for any device matching name deviceId. If deviceId is found it shall return NULL. ]*/
+			LogError("Transport already has device registered by id: [%s]", deviceId);
+			result = NULL;
+		}
+		else
+		{
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_038: [ Otherwise, IoTHubTransportHttp_Register shall allocate the IOTHUB_DEVICE_HANDLE structure. ]*/
+			bool was_resultCreated_ok = ((result = malloc(sizeof(HTTPTRANSPORT_PERDEVICE_DATA))) != NULL);
+			bool was_create_deviceId_ok = was_resultCreated_ok && create_deviceId(result, deviceId);
+			bool was_create_deviceKey_ok = was_create_deviceId_ok && create_deviceKey(result, deviceKey);
+			bool was_eventHTTPrelativePath_ok = was_create_deviceKey_ok && create_eventHTTPrelativePath(result, deviceId);
+			bool was_messageHTTPrelativePath_ok = was_eventHTTPrelativePath_ok && create_messageHTTPrelativePath(result, deviceId);
+			bool was_eventHTTPrequestHeaders_ok = was_messageHTTPrelativePath_ok && create_eventHTTPrequestHeaders(result, deviceId);
+			bool was_messageHTTPrequestHeaders_ok = was_eventHTTPrequestHeaders_ok && create_messageHTTPrequestHeaders(result);
+			bool was_abandonHTTPrelativePathBegin_ok = was_messageHTTPrequestHeaders_ok && create_abandonHTTPrelativePathBegin(result, deviceId);
+			bool was_sasObject_ok = was_abandonHTTPrelativePathBegin_ok && create_deviceSASObject(result, handleData->hostName, deviceId, deviceKey);
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_041: [ IoTHubTransportHttp_Register shall call VECTOR_push_back to store the new device information. ]*/
+			bool was_list_add_ok = was_sasObject_ok && (VECTOR_push_back(handleData->perDeviceList, &result, 1) == 0);
+
+			if (was_list_add_ok)
+			{
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_043: [ Upon success, IoTHubTransportHttp_Register shall store the transport handle, iotHubClientHandle, and the waitingToSend queue in the device handle return a non-NULL value. ]*/
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_040: [ IoTHubTransportHttp_Register shall put event HTTP relative path, message HTTP relative path, event HTTP request headers, message HTTP request headers, abandonHTTPrelativePathBegin, HTTPAPIEX_SAS_HANDLE, and the device handle into a device structure. ]*/
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_128: [ IoTHubTransportHttp_Register shall mark this device as unsubscribed. ]*/
+				result->DoWork_PullMessage = false;
+				result->isFirstPoll = true;
+				init_sasTokenCache(result);
+				result->pollDeadline = 0;
+				result->eventDeficit = 0;
+				result->eventCost = 0;
+				result->isActive = false;
+				handleData->isPollHeapDirty = true;
+				init_requestResources(result);
+				result->pipelinedEvents = 0;
+				result->isPollPipelined = false;
+				result->isConnectionReadyReported = false;
+#ifdef USE_HTTP_COMPRESSION
+				init_compression(result);
+#endif
+				result->iotHubClientHandle = iotHubClientHandle;
+				result->waitingToSend = waitingToSend;
+				DList_InitializeListHead(&(result->eventConfirmations));
+				result->transportHandle = handle;
+			}
+			else
+			{
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_042: [ If the list_add fails then IoTHubTransportHttp_Register shall fail and return NULL. ]*/
+				if (was_sasObject_ok) destroy_SASObject(result);
+				if (was_abandonHTTPrelativePathBegin_ok) destroy_abandonHTTPrelativePathBegin(result);
+				if (was_messageHTTPrelativePath_ok) destroy_messageHTTPrelativePath(result);
+				if (was_eventHTTPrequestHeaders_ok) destroy_eventHTTPrequestHeaders(result);
+				if (was_messageHTTPrequestHeaders_ok) destroy_messageHTTPrequestHeaders(result);
+				if (was_eventHTTPrelativePath_ok) destroy_eventHTTPrelativePath(result);
+				if (was_create_deviceId_ok) destroy_deviceId(result);
+				if (was_create_deviceKey_ok) destroy_deviceKey(result);
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_039: [ If the allocating the device handle fails then IoTHubTransportHttp_Register shall fail and return NULL. ] */
+				if (was_resultCreated_ok) free(result);
+				result = NULL;
+			}
+		}
+		
+	}
+	return (IOTHUB_DEVICE_HANDLE)result;
+}
+
+
+static void destroy_perDeviceData(HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem)
+{
+	destroy_deviceId(perDeviceItem);
+	destroy_deviceKey(perDeviceItem);
+	destroy_eventHTTPrelativePath(perDeviceItem);
+	destroy_messageHTTPrelativePath(perDeviceItem);
+	destroy_eventHTTPrequestHeaders(perDeviceItem);
+	destroy_messageHTTPrequestHeaders(perDeviceItem);
+	destroy_abandonHTTPrelativePathBegin(perDeviceItem);
+	destroy_SASObject(perDeviceItem);
+	destroy_sasTokenCache(perDeviceItem);
+	destroy_requestResources(perDeviceItem);
+#ifdef USE_HTTP_COMPRESSION
+	destroy_compression(perDeviceItem);
+#endif
+}
+
+static IOTHUB_DEVICE_HANDLE* get_perDeviceDataItem(IOTHUB_DEVICE_HANDLE deviceHandle)
+{
+	HTTPTRANSPORT_PERDEVICE_DATA* deviceHandleData = (HTTPTRANSPORT_PERDEVICE_DATA*)deviceHandle;
+	IOTHUB_DEVICE_HANDLE* listItem;
+
+	HTTPTRANSPORT_HANDLE_DATA* handleData = deviceHandleData->transportHandle;
+
+	listItem = VECTOR_find_if(handleData->perDeviceList, findDeviceHandle, deviceHandle);
+	if (listItem == NULL)
+	{
+		LogError("device handle not found in transport device list");
+		listItem = NULL;
+	}
+	else
+	{
+		/* sucessfully found device in list. */
+	}
+
+	return listItem;
+}
+
+void IoTHubTransportHttp_Unregister(IOTHUB_DEVICE_HANDLE deviceHandle)
+{
+	if (deviceHandle == NULL)
+	{
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_044: [ If deviceHandle is NULL, then IoTHubTransportHttp_Unregister shall do nothing. ]*/
+		LogError("Unregister a NULL device handle");
+	}
+	else
+	{
+		HTTPTRANSPORT_PERDEVICE_DATA* deviceHandleData = (HTTPTRANSPORT_PERDEVICE_DATA*)deviceHandle;
+		HTTPTRANSPORT_HANDLE_DATA* handleData = deviceHandleData->transportHandle;
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_045: [ IoTHubTransportHttp_Unregister shall locate deviceHandle in the transport device list by calling list_find_if. ]*/
+		IOTHUB_DEVICE_HANDLE* listItem = get_perDeviceDataItem(deviceHandle);
+		if (listItem == NULL)
+		{
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_046: [ If the device structure is not found, then this function shall fail and do nothing. ]*/
+			LogError("Device Handle [%p] not found in transport", deviceHandle);
+		}
+		else
+		{
+			HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA *)(*listItem);
+
+			if (handleData->pipeline != NULL)
+			{
+				forgetPipelinedDevice(handleData->pipeline, perDeviceItem);
+			}
+			if (perDeviceItem->isActive)
+			{
+				(void)DList_RemoveEntryList(&(perDeviceItem->activeEntry));
+			}
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_047: [ IoTHubTransportHttp_Unregister shall free all the resources used in the device structure. ]*/
+			destroy_perDeviceData(perDeviceItem);
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_048: [ IoTHubTransportHttp_Unregister shall call list_remove to remove device from devices list. ]*/
+			VECTOR_erase(handleData->perDeviceList, listItem, 1);
+			handleData->isPollHeapDirty = true;
+			free(deviceHandleData);
+		}
+	}
+
+	return;
+}
+
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_005: [Otherwise, IoTHubTransportHttp_Create shall create an immutable string (further called hostname) containing config->upperConfig->iotHubName + config->upperConfig->iotHubSuffix.]*/
+static void destroy_hostName(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+	STRING_delete(handleData->hostName);
+	handleData->hostName = NULL;
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_005: [Otherwise, IoTHubTransportHttp_Create shall create an immutable string (further called hostname) containing config->upperConfig->iotHubName + config->upperConfig->iotHubSuffix.]*/
+static bool create_hostName(HTTPTRANSPORT_HANDLE_DATA* handleData, const IOTHUBTRANSPORT_CONFIG* config)
+{
+    bool result;
+    handleData->hostName = STRING_construct(config->upperConfig->iotHubName);
+    if (handleData->hostName == NULL)
+    {
+        result = false;
+    }
+    else
+    {
+        if ((STRING_concat(handleData->hostName, ".") != 0) ||
+            (STRING_concat(handleData->hostName, config->upperConfig->iotHubSuffix) != 0))
+        {
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_006: [ If creating the hostname fails then IoTHubTransportHttp_Create shall fail and return NULL. ] */
+            destroy_hostName(handleData);
+            result = false;
+        }
+        else
+        {
+            result = true;
+        }
+    }
+    return result;
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_007: [Otherwise, IoTHubTransportHttp_Create shall create a HTTPAPIEX_HANDLE by a call to HTTPAPIEX_Create passing for hostName the hostname so far constructed by IoTHubTransportHttp_Create.]*/
+static void destroy_httpApiExHandle(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+	HTTPAPIEX_Destroy(handleData->httpApiExHandle);
+	handleData->httpApiExHandle = NULL;
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_007: [ IoTHubTransportHttp_Create shall create a HTTPAPIEX_HANDLE by a call to HTTPAPIEX_Create passing for hostName the hostname so far constructed by IoTHubTransportHttp_Create. ]*/
+static bool create_httpApiExHandle(HTTPTRANSPORT_HANDLE_DATA* handleData, const IOTHUBTRANSPORT_CONFIG* config)
+{
+    bool result;
+    (void)config;
+	handleData->httpApiExHandle = HTTPAPIEX_Create(STRING_c_str(handleData->hostName));
+	if (handleData->httpApiExHandle == NULL)
+	{
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_008: [ If creating the HTTPAPIEX_HANDLE fails then IoTHubTransportHttp_Create shall fail and return NULL. ] */
+		result = false;
+	}
+	else
+	{
+		result = true;
+	}
+	return result;
+}
+
+static void destroy_perDeviceList(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+	VECTOR_destroy(handleData->perDeviceList);
+	handleData->perDeviceList = NULL;
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_009: [ IoTHubTransportHttp_Create shall call list_create to create a list of registered devices. ]*/
+static bool create_perDeviceList(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+	bool result;
+	handleData->perDeviceList = VECTOR_create(sizeof(IOTHUB_DEVICE_HANDLE));
+	if (handleData == NULL || handleData->perDeviceList == NULL)
+	{
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_010: [ If creating the list fails, then IoTHubTransportHttp_Create shall fail and return NULL. ]*/
+		result = false;
+	}
+	else
+	{
+		result = true;
+	}
+	return result;
+}
+
+
+TRANSPORT_LL_HANDLE IoTHubTransportHttp_Create(const IOTHUBTRANSPORT_CONFIG* config)
+{
+    HTTPTRANSPORT_HANDLE_DATA* result;
+    if (config == NULL)
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_001: [If parameter config is NULL, then IoTHubTransportHttp_Create shall return NULL.]*/
+        LogError("invalid arg (configuration is missing)\r\n");
+        result = NULL;
+    }
+    else if (config->upperConfig == NULL)
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_002: [ If field transportConfig is NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
+        LogError("invalid arg (upperConfig is NULL)\r\n");
+        result = NULL;
+    }
+    else if (config->upperConfig->protocol == NULL)
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_003: [ If fields protocol, iotHubName or iotHubSuffix in transportConfig are NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
+        LogError("invalid arg (protocol is NULL)\r\n");
+        result = NULL;
+    }
+    else if (config->upperConfig->iotHubName == NULL)
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_003: [ If fields protocol, iotHubName or iotHubSuffix in transportConfig are NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
+        LogError("invalid arg (iotHubName is NULL)\r\n");
+        result = NULL;
+    }
+    else if (config->upperConfig->iotHubSuffix == NULL)
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_003: [ If fields protocol, iotHubName or iotHubSuffix in transportConfig are NULL, then IoTHubTransportHttp_Create shall return NULL. ]*/
+        LogError("invalid arg (iotHubSuffix is NULL)\r\n");
+        result = NULL;
+    }
+    else
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_130: [ IoTHubTransportHttp_Create shall allocate memory for the handle. ]*/
+        result = (HTTPTRANSPORT_HANDLE_DATA*)malloc(sizeof(HTTPTRANSPORT_HANDLE_DATA));
+        if (result == NULL)
+        {
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_131: [ If allocation fails, IoTHubTransportHttp_Create shall fail and return NULL. ]*/
+            LogError("unable to malloc\r\n");
+        }
+        else
+        {
+			bool was_hostName_ok = create_hostName(result, config);
+            bool was_httpApiExHandle_ok = was_hostName_ok && create_httpApiExHandle(result, config);
+			bool was_perDeviceList_ok = was_httpApiExHandle_ok && create_perDeviceList(result);
+
+
+            if (was_perDeviceList_ok)
+            {
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_011: [ Otherwise, IoTHubTransportHttp_Create shall succeed and return a non-NULL value. ]*/
+                result->doBatchedTransfers = false;
+                result->getMinimumPollingTime = DEFAULT_GETMINIMUMPOLLINGTIME;
+                result->useSasTokenCache = false;
+                result->sasTokenLifetime = DEFAULT_SAS_TOKEN_LIFETIME;
+                result->useReadySetScheduling = false;
+                result->schedulingQuantum = DEFAULT_SCHEDULING_QUANTUM;
+                result->nextEventDevice = 0;
+                DList_InitializeListHead(&(result->activeDevices));
+                result->pollHeap = NULL;
+                result->pollHeapSize = 0;
+                result->pollHeapCapacity = 0;
+                result->isPollHeapDirty = true;
+                result->reuseRequestResources = false;
+                result->useBatchCompression = false;
+                result->compressionLevel = DEFAULT_COMPRESSION_LEVEL;
+                result->usePipelining = false;
+                result->pipelineDepth = DEFAULT_PIPELINE_DEPTH;
+                result->pipelineTrustedCerts = NULL;
+                result->pipeline = NULL;
+#ifdef USE_HTTP_COMPRESSION
+                result->compressor = NULL;
+#endif
+                result->eagerConnect = false;
+                result->isConnectionOpen = false;
+            }
+            else
+            {
+                if (was_httpApiExHandle_ok) destroy_httpApiExHandle(result);
+				if (was_hostName_ok) destroy_hostName(result);
+
+                free(result);
+                result = NULL;
+            }
+        }
+    }
+    return result;
+}
+
+void IoTHubTransportHttp_Destroy(TRANSPORT_LL_HANDLE handle)
+{
+	/*Codes_SRS_TRANSPORTMULTITHTTP_17_012: [ IoTHubTransportHttp_Destroy shall do nothing is handle is NULL. ]*/
+    if (handle != NULL)
+    {
+		HTTPTRANSPORT_HANDLE_DATA* handleData = (HTTPTRANSPORT_HANDLE_DATA*)handle;
+		IOTHUB_DEVICE_HANDLE* listItem;
+
+		size_t deviceListSize = VECTOR_size(handleData->perDeviceList);
+
+		if (handleData->pipeline != NULL)
+		{
+			destroyPipeline(handleData);
+		}
+		if (handleData->pipelineTrustedCerts != NULL)
+		{
+			free(handleData->pipelineTrustedCerts);
+		}
+
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_013: [ Otherwise, IoTHubTransportHttp_Destroy shall free all the resources currently in use. ]*/
+		for (size_t i = 0; i < deviceListSize; i++)
+		{
+			listItem = VECTOR_element(handleData->perDeviceList, i);
+			HTTPTRANSPORT_PERDEVICE_DATA* perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA*)(*listItem);
+			destroy_perDeviceData(perDeviceItem);
+			free(perDeviceItem);
+		}
+
+        destroy_hostName(handle);
+        destroy_httpApiExHandle(handle);
+		destroy_perDeviceList(handle);
+		if (handleData->pollHeap != NULL)
+		{
+			free(handleData->pollHeap);
+		}
+#ifdef USE_HTTP_COMPRESSION
+		destroy_compressor(handleData);
+#endif
+        free(handle);
+    }
+}
+
+int IoTHubTransportHttp_Subscribe(IOTHUB_DEVICE_HANDLE handle)
+{
+    int result;
+    if (handle == NULL)
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_103: [ If parameter deviceHandle is NULL then IoTHubTransportHttp_Subscribe shall fail and return a non-zero value. ]*/
+        LogError("invalid arg passed to IoTHubTransportHttp_Subscribe\r\n");
+        result = __LINE__;
+    }
+    else
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_104: [ IoTHubTransportHttp_Subscribe shall locate deviceHandle in the transport device list by calling list_find_if. ]*/
+		IOTHUB_DEVICE_HANDLE* listItem = get_perDeviceDataItem(handle);
+
+		if (listItem == NULL)
+		{
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_105: [ If the device structure is not found, then this function shall fail and return a non-zero value. ]*/
+			LogError("did not find device in transport handle");
+			result = __LINE__;
+		}
+		else
+		{
+			HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem;
+
+			perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA *)(*listItem);
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_106: [ Otherwise, IoTHubTransportHttp_Subscribe shall set the device so that subsequent calls to DoWork should execute HTTP requests. ]*/
+			perDeviceItem->DoWork_PullMessage = true;
+			perDeviceItem->transportHandle->isPollHeapDirty = true;
+		}
+        result = 0;
+    }
+    return result;
+}
+
+void IoTHubTransportHttp_Unsubscribe(IOTHUB_DEVICE_HANDLE handle)
+{
+	/*Codes_SRS_TRANSPORTMULTITHTTP_17_107: [ If parameter deviceHandle is NULL then IoTHubTransportHttp_Unsubscribe shall fail do nothing. ]*/
+    if (handle != NULL)
+    {
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_108: [ IoTHubTransportHttp_Unsubscribe shall locate deviceHandle in the transport device list by calling list_find_if. ]*/
+		IOTHUB_DEVICE_HANDLE* listItem = get_perDeviceDataItem(handle);
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_109: [ If the device structure is not found, then this function shall fail and do nothing. ]*/
+		if (listItem != NULL)
+		{
+			HTTPTRANSPORT_PERDEVICE_DATA * perDeviceItem = (HTTPTRANSPORT_PERDEVICE_DATA *)(*listItem);
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_110: [ Otherwise, IoTHubTransportHttp_Subscribe shall set the device so that subsequent calls to DoWork shall not execute HTTP requests. ]*/
+			perDeviceItem->DoWork_PullMessage = false;
+			perDeviceItem->transportHandle->isPollHeapDirty = true;
+    }
+		else
+		{
+			LogError("Device not found to unsuscribe.\r\n");
+}
+    }
+	else
+	{
+		LogError("Null handle passed to Unsuscribe.\r\n");
+	}
+}
+
+/*produces a representation of the properties, if they exist*/
+/*if they do not exist, produces ""*/
+static int concat_Properties(STRING_HANDLE existing, MAP_HANDLE map, size_t* propertiesMessageSizeContribution)
+{
+    int result;
+    const char*const* keys;
+    const char*const* values;
+    size_t count;
+    if (Map_GetInternals(map, &keys, &values, &count) != MAP_OK)
+    {
+        result = __LINE__;
+        LogError("error while Map_GetInternals\r\n");
+    }
+    else
+    {
+
+        if (count == 0)
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_064: [If IoTHubMessage does not have properties, then "properties":{...} shall be missing from the payload*/
+            /*no properties - do nothing with existing*/
+            result = 0;
+            *propertiesMessageSizeContribution = 0;
+        }
+        else
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_058: [If IoTHubMessage has properties, then they shall be serialized at the same level as "body" using the following pattern: "properties":{"iothub-app-name1":"value1","iothub-app-name2":"value2*/
+            if (STRING_concat(existing, ",\"properties\":") != 0)
+            {
+                /*go ahead and return it*/
+                result = __LINE__;
+                LogError("failed STRING_concat\r\n");
+            }
+            else if (appendMapToJSON(existing, keys, values, count) != 0)
+            {
+                result = __LINE__;
+                LogError("unable to append the properties\r\n");
+            }
+            else
+            {
+                /*all is fine*/
+                size_t i;
+                *propertiesMessageSizeContribution = 0;
+                for (i = 0;i < count;i++)
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_063: [Every property name shall add to the message size the length of the property name + the length of the property value + 16 bytes.] */
+                    *propertiesMessageSizeContribution += (strlen(keys[i]) + strlen(values[i]) + MAXIMUM_PROPERTY_OVERHEAD);
+                }
+                result = 0;
+            }
+        }
+    }
+    return result;
+}
+
+/*produces a JSON representation of the map : {"a": "value_of_a","b":"value_of_b"}*/
+static int appendMapToJSON(STRING_HANDLE existing, const char* const* keys, const char* const* values, size_t count) /*under consideration: move to MAP module when it has more than 1 user*/
+{
+    int result;
+    if (STRING_concat(existing, "{") != 0)
+    {
+        /*go on and return it*/
+        result = __LINE__;
+        LogError("STRING_construct failed\r\n");
+    }
+    else
+    {
+        size_t i;
+        for (i = 0; i < count; i++)
+        {
+            if (!(
+                (STRING_concat(existing, (i == 0) ? "\"" IOTHUB_APP_PREFIX : ",\"" IOTHUB_APP_PREFIX) == 0) &&
+                (STRING_concat(existing, keys[i]) == 0) &&
+                (STRING_concat(existing, "\":\"") == 0) &&
+                (STRING_concat(existing, values[i]) == 0) &&
+                (STRING_concat(existing, "\"") == 0)
+                ))
+            {
+                LogError("unable to STRING_concat\r\n");
+                break;
+            }
+        }
+
+        if (i < count)
+        {
+            result = __LINE__;
+            /*error, let it go through*/
+        }
+        else if (STRING_concat(existing, "}") != 0)
+        {
+            result = __LINE__;
+            LogError("unable to STRING_concat\r\n");
+        }
+        else
+        {
+            /*all is fine*/
+            result = 0;
+        }
+    }
+    return result;
+}
+
+/*makes the following string:{"body":"base64 encoding of the message content"[,"properties":{"a":"valueOfA"}]}*/
+/*return NULL if there was a failure, or a non-NULL STRING_HANDLE that contains the intended data*/
+static STRING_HANDLE make1EventJSONitem(PDLIST_ENTRY item, size_t *messageSizeContribution)
+{
+    STRING_HANDLE result; /*temp wants to contain :{"body":"base64 encoding of the message content"[,"properties":{"a":"valueOfA"}]}*/
+    IOTHUB_MESSAGE_LIST* message = containingRecord(item, IOTHUB_MESSAGE_LIST, entry);
+    IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
+    
+    switch (contentType)
+    {
+    case IOTHUBMESSAGE_BYTEARRAY:
+    {
+        result = STRING_construct("{\"body\":\"");
+        if (result == NULL)
+        {
+            LogError("unable to STRING_construct\r\n");
+        }
+        else
+        {
+            const unsigned char* source;
+            size_t size;
+
+            if (IoTHubMessage_GetByteArray(message->messageHandle, &source, &size) != IOTHUB_MESSAGE_OK)
+            {
+                LogError("unable to get the data for the message.\r\n");
+                STRING_delete(result);
+                result = NULL;
+            }
+            else
+            {
+                STRING_HANDLE encoded = Base64_Encode_Bytes(source, size);
+                if (encoded == NULL)
+                {
+                    LogError("unable to Base64_Encode_Bytes.\r\n");
+                    STRING_delete(result);
+                    result = NULL;
+                }
+                else
+                {
+                    size_t propertiesSize;
+                    if (!(
+                        (STRING_concat_with_STRING(result, encoded) == 0) &&
+                        (STRING_concat(result, "\"") == 0) && /*\" because closing value*/
+                        (concat_Properties(result, IoTHubMessage_Properties(message->messageHandle), &propertiesSize) == 0) &&
+                        (STRING_concat(result, "},") == 0) /*the last comma shall be replaced by a ']' by DaCr's suggestion (which is awesome enough to receive credits in the source code)*/
+                        ))
+                    {
+                        STRING_delete(result);
+                        result = NULL;
+                        LogError("unable to STRING_concat_with_STRING.\r\n");
+                    }
+                    else
+                    {
+                        /*all is fine... */
+                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_062: [The message size is computed from the length of the payload + 384.] */
+                        *messageSizeContribution = size + MAXIMUM_PAYLOAD_OVERHEAD + propertiesSize;
+                    }
+                    STRING_delete(encoded);
+                }
+            }
+        }
+        break;
+    }
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_057: [If a messages to be send has type IOTHUBMESSAGE_STRING, then its serialization shall be {"body":"JSON encoding of the string", "base64Encoded":false}] */
+    case IOTHUBMESSAGE_STRING:
+    {
+        result = STRING_construct("{\"body\":");
+        if (result == NULL)
+        {
+            LogError("unable to STRING_construct\r\n");
+        }
+        else
+        {
+            const char* source = IoTHubMessage_GetString(message->messageHandle);
+            if (source == NULL)
+            {
+                LogError("unable to IoTHubMessage_GetString\r\n");
+                STRING_delete(result);
+                result = NULL;
+            }
+            else
+            {
+                STRING_HANDLE asJson = STRING_new_JSON(source);
+                if (asJson == NULL)
+                {
+                    LogError("unable to STRING_new_JSON\r\n");
+                    STRING_delete(result);
+                    result = NULL;
+                }
+                else
+                {
+                    size_t propertiesSize;
+                    if (!(
+                        (STRING_concat_with_STRING(result, asJson) == 0) &&
+                        (STRING_concat(result, ",\"base64Encoded\":false") == 0) &&
+                        (concat_Properties(result, IoTHubMessage_Properties(message->messageHandle), &propertiesSize) == 0) &&
+                        (STRING_concat(result, "},") == 0) /*the last comma shall be replaced by a ']' by DaCr's suggestion (which is awesome enough to receive credits in the source code)*/
+                        ))
+                    {
+                        LogError("unable to STRING_concat_with_STRING");
+                        STRING_delete(result);
+                        result = NULL;
+                    }
+                    else
+                    {
+                        /*result has the intended content*/
+                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_062: [The message size is computed from the length of the payload + 384.] */
+                        *messageSizeContribution = strlen(source) + MAXIMUM_PAYLOAD_OVERHEAD + propertiesSize;
+                    }
+                    STRING_delete(asJson);
+                }
+            }
+        }
+        break;
+    }
+    default:
+    {
+        LogError("an unknown message type was encountered (%d)\r\n", contentType);
+        result = NULL; /*unknown message type*/
+        break;
+    }
+    }
+    return result;
+}
+
+#define MAKE_PAYLOAD_RESULT_VALUES \
+    MAKE_PAYLOAD_OK, /*returned when there is a payload to be later send by HTTP*/ \
+    MAKE_PAYLOAD_NO_ITEMS, /*returned when there are no items to be send*/ \
+    MAKE_PAYLOAD_ERROR, /*returned when there were errors*/ \
+    MAKE_PAYLOAD_FIRST_ITEM_DOES_NOT_FIT, /*returned when the first item doesn't fit*/ \
+    MAKE_PAYLOAD_COMPRESSION_ERROR /*returned when the compressed payload could not be finished, the items are in eventConfirmations*/
+
+DEFINE_ENUM(MAKE_PAYLOAD_RESULT, MAKE_PAYLOAD_RESULT_VALUES);
+
+/*this function assembles several {"body":"base64 encoding of the message content"," base64Encoded": true} into 1 payload*/
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_056: [IoTHubTransportHttp_DoWork shall build the following string:[{"body":"base64 encoding of the message1 content"},{"body":"base64 encoding of the message2 content"}...]]*/
+static MAKE_PAYLOAD_RESULT makePayload(HTTPTRANSPORT_PERDEVICE_DATA* deviceData, STRING_HANDLE* payload)
+{
+    MAKE_PAYLOAD_RESULT result;
+    size_t allMessagesSize = 0;
+    *payload = STRING_construct("[");
+    if (*payload == NULL)
+    {
+        LogError("unable to STRING_construct\r\n");
+        result = MAKE_PAYLOAD_ERROR;
+    }
+    else
+    {
+        bool isFirst = true;
+        PDLIST_ENTRY actual;
+        bool keepGoing = true; /*keepGoing gets sometimes to false from within the loop*/
+#ifdef USE_HTTP_COMPRESSION
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_167: [ When "BatchCompression" is true, every item added to the JSON payload shall also be given to the gzip stream of the transport, so that a compressed copy of the payload is built at the same time. ]*/
+        bool isCompressing = startCompressedPayload(deviceData);
+        HTTPTRANSPORT_COMPRESSOR* compressor = deviceData->transportHandle->compressor;
+#endif
+        /*either all the items enter the list or only some*/
+        result = MAKE_PAYLOAD_OK; /*optimistically initializing it*/
+        while (keepGoing && ((actual = deviceData->waitingToSend->Flink) != deviceData->waitingToSend))
+        {
+            size_t messageSize;
+            STRING_HANDLE temp = make1EventJSONitem(actual, &messageSize);
+            if (isFirst)
+            {
+                isFirst = false;
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
+                if (temp == NULL) /*first item failed to create, nothing to send*/
+                {
+                    result = MAKE_PAYLOAD_ERROR;
+                    STRING_delete(*payload);
+                    *payload = NULL;
+                    keepGoing = false;
+                }
+                else
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_065: [If the oldest message in waitingToSend causes the message size to exceed the message size limit then it shall be removed from waitingToSend, and IoTHubClient_LL_SendComplete shall be called. Parameter PDLIST_ENTRY completed shall point to a list containing only the oldest item, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_FAILED.]*/
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_061: [The message size shall be limited to 255KB - 1 byte.]*/
+                    if (messageSize > MAXIMUM_MESSAGE_SIZE)
+                    {
+                        PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
+                        DList_InsertTailList(&(deviceData->eventConfirmations), head);
+                        result = MAKE_PAYLOAD_FIRST_ITEM_DOES_NOT_FIT;
+                        STRING_delete(*payload);
+                        *payload = NULL;
+                        keepGoing = false;
+                    }
+                    else
+                    {
+#ifdef USE_HTTP_COMPRESSION
+                        if (isCompressing && !(isFittingCompressedPayload(compressor, STRING_length(temp)) && (compressPayloadItem(compressor, temp, true) == 0)))
+                        {
+                            /*the JSON payload is still good, it is only not compressed*/
+                            isCompressing = false;
+                        }
+#endif
+                        if (STRING_concat_with_STRING(*payload, temp) != 0)
+                        {
+                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
+                            result = MAKE_PAYLOAD_ERROR;
+                            STRING_delete(*payload);
+                            *payload = NULL;
+                            keepGoing = false;
+                        }
+                        else
+                        {
+                            /*first item was put nicely in the payload*/
+                            PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
+                            DList_InsertTailList(&(deviceData->eventConfirmations), head);
+                            allMessagesSize += messageSize;
+                        }
+                    }
+                    STRING_delete(temp);
+                }
+            }
+            else
+            {
+                /*there is at least 1 item already in the payload*/
+                if (temp == NULL)
+                {
+                    /*there are multiple payloads encoded, the last one had an internal error, just go with those - closing the payload happens "after the loop"*/
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_066: [If at any point during construction of the string there are errors, IoTHubTransportHttp_DoWork shall use the so far constructed string as payload.]*/
+                    result = MAKE_PAYLOAD_OK;
+                    keepGoing = false;
+                }
+                else
+                {
+#ifdef USE_HTTP_COMPRESSION
+                    if (isCompressing)
+                    {
+                        if (!isFittingCompressedPayload(compressor, STRING_length(temp)))
+                        {
+                            /*this item doesn't make it to the compressed payload*/
+                            result = MAKE_PAYLOAD_OK;
+                            keepGoing = false;
+                        }
+                        else if (compressPayloadItem(compressor, temp, false) != 0)
+                        {
+                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_170: [ If the compressed payload cannot be completed and the JSON payload does not fit the message size limit, the batched items shall be put back in waitingToSend and the next 16 batches of the device shall not be compressed. ]*/
+                            result = MAKE_PAYLOAD_COMPRESSION_ERROR;
+                            keepGoing = false;
+                        }
+                        else if (STRING_concat_with_STRING(*payload, temp) != 0)
+                        {
+                            /*the compressed payload now has an item that is not in the JSON payload*/
+                            result = MAKE_PAYLOAD_COMPRESSION_ERROR;
+                            keepGoing = false;
+                        }
+                        else
+                        {
+                            PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
+                            DList_InsertTailList(&(deviceData->eventConfirmations), head);
+                            allMessagesSize += messageSize;
+                        }
+                    }
+                    else
+#endif
+                    if (allMessagesSize + messageSize > MAXIMUM_MESSAGE_SIZE)
+                    {
+                        /*this item doesn't make it to the payload, but the payload is valid so far*/
+                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_066: [If at any point during construction of the string there are errors, IoTHubTransportHttp_DoWork shall use the so far constructed string as payload.]*/
+                        result = MAKE_PAYLOAD_OK;
+                        keepGoing = false;
+                    }
+                    else if (STRING_concat_with_STRING(*payload, temp) != 0)
+                    {
+                        /*should still send what there is so far...*/
+                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_066: [If at any point during construction of the string there are errors, IoTHubTransportHttp_DoWork shall use the so far constructed string as payload.]*/
+                        result = MAKE_PAYLOAD_OK;
+                        keepGoing = false;
+                    }
+                    else
+                    {
+                        /*cool, the payload made it there, let's continue... */
+                        PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
+                        DList_InsertTailList(&(deviceData->eventConfirmations), head);
+                        allMessagesSize += messageSize;
+                    }
+                    STRING_delete(temp);
+                }
+            }
+        }
+
+#ifdef USE_HTTP_COMPRESSION
+        if (isCompressing && (result == MAKE_PAYLOAD_OK))
+        {
+            if (compressPayloadBytes(compressor, "]", 1, Z_FINISH) == 0)
+            {
+                deviceData->compression.isPayloadCompressed = true;
+                deviceData->compression.payloadMessagesSize = allMessagesSize;
+            }
+            else if (allMessagesSize > MAXIMUM_MESSAGE_SIZE)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_170: [ If the compressed payload cannot be completed and the JSON payload does not fit the message size limit, the batched items shall be put back in waitingToSend and the next 16 batches of the device shall not be compressed. ]*/
+                result = MAKE_PAYLOAD_COMPRESSION_ERROR;
+            }
+            else
+            {
+                /*the JSON payload is sent*/
+            }
+        }
+
+        if (result == MAKE_PAYLOAD_COMPRESSION_ERROR)
+        {
+            deviceData->compression.batchesToSkip = COMPRESSION_PROBE_INTERVAL;
+            STRING_delete(*payload);
+            *payload = NULL;
+        }
+        else
+#endif
+        /*closing the payload*/
+        if (result == MAKE_PAYLOAD_OK)
+        {
+            ((char*)STRING_c_str(*payload))[STRING_length(*payload) - 1] = ']'; /*TODO - do this in STRING_HANDLE*/
+        }
+        else
+        {
+            /*no need to close anything*/
+        }
+    }
+    return result;
+}
+
+static void reversePutListBackIn(PDLIST_ENTRY source, PDLIST_ENTRY destination)
+{
+    /*this function takes a list, and inserts it in another list. When done in the context of this file, it reverses the effects of a not-able-to-send situation*/
+    DList_AppendTailList(destination->Flink, source);
+    DList_RemoveEntryList(source);
+    DList_InitializeListHead(source);
+}
+
+static void DoEvent(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+{
+
+    if (DList_IsListEmpty(deviceData->waitingToSend))
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_060: [If the list is empty then IoTHubTransportHttp_DoWork shall proceed to the following action.] */
+    }
+    else
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_053: [If option SetBatching is true then _Dowork shall send batched event message as specced below.] */
+        if (handleData->doBatchedTransfers)
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_054: [Request HTTP headers shall have the value of "Content-Type" created or updated to "application/vnd.microsoft.iothub.json" by a call to HTTPHeaders_ReplaceHeaderNameValuePair.] */
+            if (HTTPHeaders_ReplaceHeaderNameValuePair(deviceData->eventHTTPrequestHeaders, CONTENT_TYPE, APPLICATION_VND_MICROSOFT_IOTHUB_JSON) != HTTP_HEADERS_OK)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_055: [If updating Content-Type fails for any reason, then _DoWork shall advance to the next action.] */
+                LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
+            }
+            else
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_059: [It shall inspect the "waitingToSend" DLIST passed in config structure.] */
+                STRING_HANDLE payload;
+                switch (makePayload(deviceData, &payload))
+                {
+                case MAKE_PAYLOAD_OK:
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_068: [Once a final payload has been obtained, IoTHubTransportHttp_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest passing the following parameters:] */
+                    BUFFER_HANDLE temp = acquireBuffer(handleData, &(deviceData->requestContent));
+                    if (temp == NULL)
+                    {
+                        LogError("unable to BUFFER_new\r\n");
+                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
+                        reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
+                    }
+                    else
+                    {
+                        const unsigned char* content = (const unsigned char*)STRING_c_str(payload);
+                        size_t contentSize = STRING_length(payload);
+                        HTTP_HEADERS_HANDLE requestHeaders = deviceData->eventHTTPrequestHeaders;
+#ifdef USE_HTTP_COMPRESSION
+                        if (deviceData->compression.isPayloadCompressed)
+                        {
+                            size_t compressedSize = deviceData->transportHandle->compressor->stream.total_out;
+                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_169: [ If the compressed payload is not smaller than 90% of the JSON payload, the JSON payload shall be sent instead when it fits the message size limit, and the next 16 batches of the device shall not be compressed. ]*/
+                            if (compressedSize * 10 >= contentSize * 9)
+                            {
+                                deviceData->compression.batchesToSkip = COMPRESSION_PROBE_INTERVAL;
+                            }
+
+                            if ((compressedSize * 10 < contentSize * 9) || (deviceData->compression.payloadMessagesSize > MAXIMUM_MESSAGE_SIZE))
+                            {
+                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_171: [ A compressed payload shall be sent with the headers of the device's event HTTP request headers plus "Content-Encoding: gzip". ]*/
+                                content = (const unsigned char*)deviceData->transportHandle->compressor->output.buffer;
+                                contentSize = compressedSize;
+                                requestHeaders = deviceData->compression.requestHeaders;
+                            }
+                        }
+#endif
+                        if (BUFFER_build(temp, content, contentSize) != 0)
+                        {
+                            LogError("unable to BUFFER_build\r\n");
+                            //items go back to waitingToSend
+                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_067: [If there is no valid payload, IoTHubTransportHttp_DoWork shall advance to the next activity.]*/
+                            reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
+                        }
+                        else
+                        {
+                            unsigned int statusCode;
+                            HTTPAPIEX_RESULT r;
+                            if ((r = executeDeviceRequest(
+								handleData,
+                                deviceData,
+                                HTTPAPI_REQUEST_POST,
+                                STRING_c_str(deviceData->eventHTTPrelativePath),
+								requestHeaders,
+                                temp,
+                                &statusCode,
+                                NULL,
+                                NULL
+                                )) != HTTPAPIEX_OK)
+                            {
+                                LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
+                                //items go back to waitingToSend
+                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_069: [if HTTPAPIEX_SAS_ExecuteRequest fails or the http status code >=300 then IoTHubTransportHttp_DoWork shall not do any other action (it is assumed at the next _DoWork it shall be retried).] */
+                                reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
+                            }
+                            else
+                            {
+                                if (statusCode < 300)
+                                {
+                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_070: [If HTTPAPIEX_SAS_ExecuteRequest does not fail and http status code <300 then IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_SendComplete. Parameter PDLIST_ENTRY completed shall point to a list containing all the items batched, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_SUCESS. The batched items shall be removed from waitingToSend.] */
+                                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_SUCCESS);
+                                }
+                                else
+                                {
+                                    //items go back to waitingToSend
+                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_069: [if HTTPAPIEX_SAS_ExecuteRequest fails or the http status code >=300 then IoTHubTransportHttp_DoWork shall not do any other action (it is assumed at the next _DoWork it shall be retried).] */
+                                    LogError("unexpected HTTP status code (%u)\r\n", statusCode);
+                                    reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
+                                }
+                            }
+                        }
+                        releaseBuffer(&(deviceData->requestContent), temp);
+                    }
+                    STRING_delete(payload);
+                    break;
+                }
+                case MAKE_PAYLOAD_FIRST_ITEM_DOES_NOT_FIT:
+                {
+                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
+                    break;
+                }
+                case MAKE_PAYLOAD_ERROR:
+                {
+                    LogError("unrecoverable errors while building a batch message\r\n");
+                    break;
+                }
+                case MAKE_PAYLOAD_COMPRESSION_ERROR:
+                {
+                    LogError("unable to compress the batch message, it shall be retried uncompressed\r\n");
+                    reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
+                    break;
+                }
+                case MAKE_PAYLOAD_NO_ITEMS:
+                {
+                    /*do nothing*/
+                    break;
+                }
+                default:
+                {
+                    LogError("internal error: switch's default branch reached when never intended\r\n");
+                    break;
+                }
+                }
+            }
+        }
+        else
+        {
+            const unsigned char* messageContent=NULL;
+            size_t messageSize=0;
+            size_t originalMessageSize=0;
+            IOTHUB_MESSAGE_LIST* message = containingRecord(deviceData->waitingToSend->Flink, IOTHUB_MESSAGE_LIST, entry);
+            IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
+
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_073: [The message size is computed from the length of the payload + 384.]*/
+            if (!(
+                (((contentType == IOTHUBMESSAGE_BYTEARRAY) && 
+                    (IoTHubMessage_GetByteArray(message->messageHandle, &messageContent, &originalMessageSize)==IOTHUB_MESSAGE_OK)) ? (messageSize= originalMessageSize + MAXIMUM_PAYLOAD_OVERHEAD, 1): 0)
+                
+                ||
+
+                ((contentType == IOTHUBMESSAGE_STRING) && (
+                    messageContent = (const unsigned char*)IoTHubMessage_GetString(message->messageHandle), 
+                    (messageSize = MAXIMUM_PAYLOAD_OVERHEAD + (originalMessageSize = ((messageContent == NULL)?0:strlen((const char*)messageContent)))), 
+                    messageContent!=NULL)
+                    )
+                ))
+            {
+                LogError("unable to get the message content\r\n");
+                /*go on...*/
+            }
+            else
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_075: [If the oldest message in waitingToSend causes the message to exceed the message size limit then it shall be removed from waitingToSend, and IoTHubClient_LL_SendComplete shall be called. Parameter PDLIST_ENTRY completed shall point to a list containing only the oldest item, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_FAILED.]*/
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_072: [The message size shall be limited to 255KB -1 bytes.] */
+                if (messageSize > MAXIMUM_MESSAGE_SIZE)
+                {
+                    PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
+                    DList_InsertTailList(&(deviceData->eventConfirmations), head);
+                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
+                }
+                else
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_071: [If option SetBatching is false then _Dowork shall send individual event message as specced below.] */
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_076: [A clone of the event HTTP request headers shall be created.]*/
+                    HTTP_HEADERS_HANDLE clonedEventHTTPrequestHeaders = acquireSingleEventHeaders(handleData, deviceData, message->messageHandle);
+                    if (clonedEventHTTPrequestHeaders == NULL)
+                    {
+                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                        LogError("HTTPHeaders_Clone failed\r\n");
+                    }
+                    else
+                    {
+                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_077: [The cloned HTTP headers shall have the HTTP header "Content-Type" set to "application/octet-stream".] */
+                        if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, CONTENT_TYPE, APPLICATION_OCTET_STREAM) != HTTP_HEADERS_OK)
+                        {
+                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                            LogError("HTTPHeaders_ReplaceHeaderNameValuePair failed\r\n");
+                        }
+                        else
+                        {
+                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_078: [Every message property "property":"value" shall be added to the HTTP headers as an individual header "iothub-app-property":"value".] */
+                            MAP_HANDLE map = IoTHubMessage_Properties(message->messageHandle);
+                            const char*const* keys;
+                            const char*const* values;
+                            size_t count;
+                            if (Map_GetInternals(map, &keys, &values, &count) != MAP_OK)
+                            {
+                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_078: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                                LogError("unable to Map_GetInternals\r\n");
+                            }
+                            else
+                            {
+                                size_t i;
+                                bool goOn = true;
+                                const char* msgId;
+                                const char* corrId;
+                                
                                 for (i = 0; (i < count) && goOn; i++)
                                 {
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_074: [Every property name shall add  to the message size the length of the property name + the length of the property value + 16 bytes.] */
-                                    messageSize += (strlen(values[i]) + strlen(keys[i]) + MAXIMUM_PROPERTY_OVERHEAD);
-                                    if (messageSize > MAXIMUM_MESSAGE_SIZE)
+                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_074: [Every property name shall add  to the message size the length of the property name + the length of the property value + 16 bytes.] */
+                                    messageSize += (strlen(values[i]) + strlen(keys[i]) + MAXIMUM_PROPERTY_OVERHEAD);
+                                    if (messageSize > MAXIMUM_MESSAGE_SIZE)
+                                    {
+                                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_072: [The message size shall be limited to 255KB -1 bytes.] */
+                                        PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
+                                        DList_InsertTailList(&(deviceData->eventConfirmations), head);
+                                        IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
+                                        goOn = false;
+                                    }
+                                    else if (handleData->reuseRequestResources)
+                                    {
+                                        const char* propertyHeaderName = makePropertyHeaderName(deviceData, keys[i]);
+                                        if (propertyHeaderName == NULL)
+                                        {
+                                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                                            goOn = false;
+                                        }
+                                        else if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, propertyHeaderName, values[i]) != HTTP_HEADERS_OK)
+                                        {
+                                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                                            LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
+                                            goOn = false;
+                                        }
+                                    }
+                                    else
+                                    {
+                                        STRING_HANDLE temp = STRING_construct(IOTHUB_APP_PREFIX);
+                                        if (temp == NULL)
+                                        {
+                                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                                            LogError("unable to STRING_construct\r\n");
+                                            goOn = false;
+                                        }
+                                        else
+                                        {
+                                            if (STRING_concat(temp, keys[i]) != 0)
+                                            {
+                                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                                                LogError("unable to STRING_concat\r\n");
+                                                goOn = false;
+                                            }
+                                            else
+                                            {
+                                                if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, STRING_c_str(temp), values[i]) != HTTP_HEADERS_OK)
+                                                {
+                                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                                                    LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
+                                                    goOn = false;
+                                                }
+                                            }
+                                            STRING_delete(temp);
+                                        }
+                                    }
+                                }
+
+                                // Add the Message Id and the Correlation Id
+                                msgId = IoTHubMessage_GetMessageId(message->messageHandle);
+                                if (goOn && msgId != NULL)
+                                {
+                                    if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, IOTHUB_MESSAGE_ID, msgId) != HTTP_HEADERS_OK)
+                                    {
+                                        LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
+                                        goOn = false;
+                                    }
+                                }
+
+                                corrId = IoTHubMessage_GetCorrelationId(message->messageHandle);
+                                if (goOn && corrId != NULL)
+                                {
+                                    if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, IOTHUB_CORRELATION_ID, corrId) != HTTP_HEADERS_OK)
+                                    {
+                                        LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
+                                        goOn = false;
+                                    }
+                                }
+
+                                if (!goOn)
+                                {
+                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
+                                }
+                                else
+                                {
+                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_080: [IoTHubTransportHttp_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest passing the following parameters] */
+                                    BUFFER_HANDLE toBeSend = acquireBuffer(handleData, &(deviceData->requestContent));
+                                    if (toBeSend == NULL)
+                                    {
+                                        LogError("unable to BUFFER_new\r\n");
+                                    }
+                                    else
+                                    {
+                                        if (BUFFER_build(toBeSend, messageContent, originalMessageSize) != 0)
+                                        {
+                                            LogError("unable to BUFFER_build\r\n");
+                                        }
+                                        else
+                                        {
+                                            unsigned int statusCode;
+                                            HTTPAPIEX_RESULT r;
+                                            if ((r = executeDeviceRequest(
+												handleData,
+                                                deviceData,
+                                                HTTPAPI_REQUEST_POST,
+                                                STRING_c_str(deviceData->eventHTTPrelativePath),
+                                                clonedEventHTTPrequestHeaders,
+                                                toBeSend,
+                                                &statusCode,
+                                                NULL,
+                                                NULL
+                                                )) != HTTPAPIEX_OK)
+                                            {
+                                                LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
+                                            }
+                                            else
+                                            {
+                                                if (statusCode < 300)
+                                                {
+                                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_082: [If HTTPAPIEX_SAS_ExecuteRequest does not fail and http status code <300 then IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_SendComplete. Parameter PDLIST_ENTRY completed shall point to a list the item send, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_SUCCESS. The item shall be removed from waitingToSend.] */
+                                                    PDLIST_ENTRY justSent = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
+                                                    DList_InsertTailList(&(deviceData->eventConfirmations), justSent);
+                                                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_SUCCESS); /*takes care of emptying the list too*/
+                                                }
+                                                else
+                                                {
+                                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_081: [If HTTPAPIEX_SAS_ExecuteRequest fails or the http status code >=300 then IoTHubTransportHttp_DoWork shall not do any other action (it is assumed at the next _DoWork it shall be retried).] */
+                                                    LogError("unexpected HTTP status code (%u)\r\n", statusCode);
+                                                }
+                                            }
+                                        }
+                                        releaseBuffer(&(deviceData->requestContent), toBeSend);
+                                    }
+                                }
+                            }
+                        }
+                        releaseSingleEventHeaders(deviceData, clonedEventHTTPrequestHeaders);
+                    }
+                }
+            }
+        }
+    }
+}
+
+#define ACTION_VALUES \
+    ABANDON, \
+    REJECT, \
+    ACCEPT
+DEFINE_ENUM(ACTION, ACTION_VALUES);
+
+static void abandonOrAcceptMessageWithNewResources(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, const char* ETag, ACTION action)
+{
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_097: [_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest with the following parameters:
+-requestType: POST
+-relativePath: abandon relative path begin (as created by _Create) + value of ETag + "/abandon?api-version=2016-02-03" 
+- requestHttpHeadersHandle: an HTTP headers instance containing the following
+    Authorization: " "
+    If-Match: value of ETag
+- requestContent: NULL
+- statusCode: a pointer to unsigned int which might be examined for logging
+- responseHeadearsHandle: NULL
+- responseContent: NULL]*/
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_099: [_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest with the following parameters:
+-requestType: DELETE
+-relativePath: abandon relative path begin + value of ETag + "?api-version=2016-02-03" 
+- requestHttpHeadersHandle: an HTTP headers instance containing the following
+    Authorization: " "
+    If-Match: value of ETag
+- requestContent: NULL
+- statusCode: a pointer to unsigned int which might be used by logging
+- responseHeadearsHandle: NULL
+- responseContent: NULL]*/
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_101: [_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest with the following parameters:
+-requestType: DELETE
+-relativePath: abandon relative path begin + value of ETag +"?api-version=2016-02-03" + "&reject"
+- requestHttpHeadersHandle: an HTTP headers instance containing the following
+    Authorization: " "
+    If-Match: value of ETag
+- requestContent: NULL
+- statusCode: a pointer to unsigned int which might be used by logging
+- responseHeadearsHandle: NULL
+- responseContent: NULL]*/
+    
+    STRING_HANDLE fullAbandonRelativePath = STRING_clone(deviceData->abandonHTTPrelativePathBegin);
+    if (fullAbandonRelativePath == NULL)
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+        LogError("unable to STRING_clone\r\n");
+    }
+    else
+    {
+        STRING_HANDLE ETagUnquoted = STRING_construct_n(ETag + 1, strlen(ETag) - 2); /*skip first character which is '"' and the last one (which is also '"')*/
+        if (ETagUnquoted == NULL)
+        {
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+            LogError("unable to STRING_construct_n\r\n");
+        }
+        else
+        {
+            if (!(
+                (STRING_concat_with_STRING(fullAbandonRelativePath, ETagUnquoted) == 0) &&
+                (STRING_concat(fullAbandonRelativePath, (action == ABANDON) ? "/abandon" API_VERSION : ((action == REJECT) ? API_VERSION "&reject" : API_VERSION)) == 0)
+                ))
+            {
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+				/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                LogError("unable to STRING_concat\r\n");
+            }
+            else
+            {
+                HTTP_HEADERS_HANDLE abandonRequestHttpHeaders = HTTPHeaders_Alloc();
+                if (abandonRequestHttpHeaders == NULL)
+                {
+					/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+					/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+					/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                    LogError("unable to HTTPHeaders_Alloc\r\n");
+                }
+                else
+                {
+                    if (!(
+                        (HTTPHeaders_AddHeaderNameValuePair(abandonRequestHttpHeaders, "User-Agent", CLIENT_DEVICE_TYPE_PREFIX CLIENT_DEVICE_BACKSLASH IOTHUB_SDK_VERSION) == HTTP_HEADERS_OK) &&
+                        (HTTPHeaders_AddHeaderNameValuePair(abandonRequestHttpHeaders, "Authorization", " ") == HTTP_HEADERS_OK) &&
+                        (HTTPHeaders_AddHeaderNameValuePair(abandonRequestHttpHeaders, "If-Match", ETag) == HTTP_HEADERS_OK)
+                        ))
+                    {
+						/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+						/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+						/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                        LogError("unable to HTTPHeaders_AddHeaderNameValuePair\r\n");
+                    }
+                    else
+                    {
+                        unsigned int statusCode;
+                        if (executeDeviceRequest(
+							handleData,
+                            deviceData,
+                            (action == ABANDON) ? HTTPAPI_REQUEST_POST : HTTPAPI_REQUEST_DELETE,                               /*-requestType: POST                                                                                                       */
+                            STRING_c_str(fullAbandonRelativePath),              /*-relativePath: abandon relative path begin (as created by _Create) + value of ETag + "/abandon?api-version=2016-02-03"   */
+                            abandonRequestHttpHeaders,                          /*- requestHttpHeadersHandle: an HTTP headers instance containing the following                                            */
+                            NULL,                                               /*- requestContent: NULL                                                                                                   */
+                            &statusCode,                                         /*- statusCode: a pointer to unsigned int which might be examined for logging                                              */
+                            NULL,                                               /*- responseHeadearsHandle: NULL                                                                                           */
+                            NULL                                                /*- responseContent: NULL]                                                                                                 */
+                            ) != HTTPAPIEX_OK)
+                        {
+							/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+							/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+							/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                            LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
+                        }
+                        else
+                        {
+                            if (statusCode != 204)
+                            {
+								/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+								/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+								/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                                LogError("unexpected status code returned %u (was expecting 204)\r\n", statusCode);
+                            }
+                            else
+                            {
+								/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+								/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+								/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                                /*all is fine*/
+                            }
+                        }
+                    }
+                    HTTPHeaders_Free(abandonRequestHttpHeaders);
+                }
+            }
+            STRING_delete(ETagUnquoted);
+        }
+        STRING_delete(fullAbandonRelativePath);
+    }
+}
+
+/*same as abandonOrAcceptMessageWithNewResources, but the relative path is built in the device's scratch and the request headers are kept between calls*/
+static void abandonOrAcceptMessageWithReusedResources(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, const char* ETag, ACTION action)
+{
+    const char* suffix = (action == ABANDON) ? "/abandon" API_VERSION : ((action == REJECT) ? API_VERSION "&reject" : API_VERSION);
+    size_t beginLength = STRING_length(deviceData->abandonHTTPrelativePathBegin);
+    size_t ETagUnquotedLength = strlen(ETag) - 2; /*skip first character which is '"' and the last one (which is also '"')*/
+    size_t suffixLength = strlen(suffix);
+
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_161: [ When "ReuseRequestResources" is set, the relative path of abandon, accept and reject requests shall be built in a buffer of the device that only grows, and the request headers shall be created once per device and only have the "If-Match" header replaced with the value of ETag by each request. ]*/
+    if (reserveScratch(&(deviceData->abandonHTTPrelativePath), beginLength + ETagUnquotedLength + suffixLength + 1) != 0)
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+        LogError("unable to build the relative path\r\n");
+    }
+    else
+    {
+        char* relativePath = deviceData->abandonHTTPrelativePath.buffer;
+        (void)memcpy(relativePath, STRING_c_str(deviceData->abandonHTTPrelativePathBegin), beginLength);
+        (void)memcpy(relativePath + beginLength, ETag + 1, ETagUnquotedLength);
+        (void)memcpy(relativePath + beginLength + ETagUnquotedLength, suffix, suffixLength + 1);
+
+        if ((deviceData->abandonHTTPrequestHeaders == NULL) &&
+            ((deviceData->abandonHTTPrequestHeaders = HTTPHeaders_Alloc()) != NULL) &&
+            !(
+                (HTTPHeaders_AddHeaderNameValuePair(deviceData->abandonHTTPrequestHeaders, "User-Agent", CLIENT_DEVICE_TYPE_PREFIX CLIENT_DEVICE_BACKSLASH IOTHUB_SDK_VERSION) == HTTP_HEADERS_OK) &&
+                (HTTPHeaders_AddHeaderNameValuePair(deviceData->abandonHTTPrequestHeaders, "Authorization", " ") == HTTP_HEADERS_OK)
+            ))
+        {
+            HTTPHeaders_Free(deviceData->abandonHTTPrequestHeaders);
+            deviceData->abandonHTTPrequestHeaders = NULL;
+        }
+
+        if (deviceData->abandonHTTPrequestHeaders == NULL)
+        {
+            LogError("unable to create the request headers\r\n");
+        }
+        else if (HTTPHeaders_ReplaceHeaderNameValuePair(deviceData->abandonHTTPrequestHeaders, "If-Match", ETag) != HTTP_HEADERS_OK)
+        {
+            LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
+        }
+        else
+        {
+            unsigned int statusCode;
+            if (executeDeviceRequest(
+                handleData,
+                deviceData,
+                (action == ABANDON) ? HTTPAPI_REQUEST_POST : HTTPAPI_REQUEST_DELETE,
+                relativePath,
+                deviceData->abandonHTTPrequestHeaders,
+                NULL,
+                &statusCode,
+                NULL,
+                NULL
+                ) != HTTPAPIEX_OK)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
+                LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
+            }
+            else if (statusCode != 204)
+            {
+                LogError("unexpected status code returned %u (was expecting 204)\r\n", statusCode);
+            }
+            else
+            {
+                /*all is fine*/
+            }
+        }
+    }
+}
+
+static void abandonOrAcceptMessage(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, const char* ETag, ACTION action)
+{
+    if ((handleData->pipeline != NULL) && handleData->pipeline->isProcessingResponses)
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_178: [ Responses shall be processed as by the non pipelined _DoWork, except that abandon, accept and reject requests shall be sent on the pipelined connection without waiting for their response. ]*/
+        (void)enqueuePipelinedDisposition(handleData, deviceData, ETag,
+            (action == ABANDON) ? "/abandon" API_VERSION : ((action == REJECT) ? API_VERSION "&reject" : API_VERSION),
+            (action == ABANDON) ? HTTPAPI_REQUEST_POST : HTTPAPI_REQUEST_DELETE);
+    }
+    else if (handleData->reuseRequestResources)
+    {
+        abandonOrAcceptMessageWithReusedResources(handleData, deviceData, ETag, action);
+    }
+    else
+    {
+        abandonOrAcceptMessageWithNewResources(handleData, deviceData, ETag, action);
+    }
+}
+
+/*examines the response to a message GET. Shared by _DoWork and by the pipelined connection*/
+static void processMessageResponse(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, unsigned int statusCode, HTTP_HEADERS_HANDLE responseHTTPHeaders, BUFFER_HANDLE responseContent)
+{
+    if (statusCode == 204)
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_086: [If the HTTPAPIEX_SAS_ExecuteRequest executed successfully then status code shall be examined. Any status code different than 200 causes _DoWork to advance to the next action.] */
+        /*this is an expected status code, means "no commands", but logging that creates panic*/
+
+        /*do nothing, advance to next action*/
+    }
+    else if (statusCode != 200)
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_086: [If the HTTPAPIEX_SAS_ExecuteRequest executed successfully then status code shall be examined. Any status code different than 200 causes _DoWork to advance to the next action.] */
+        LogError("expected status code was 200, but actually was received %u... moving on\r\n", statusCode);
+    }
+    else
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_087: [If status code is 200, then _DoWork shall make a copy of the value of the "ETag" http header.]*/
+        const char* etagValue = HTTPHeaders_FindHeaderValue(responseHTTPHeaders, "ETag");
+        if (etagValue == NULL)
+        {
+            LogError("unable to find a received header called \"E-Tag\"\r\n");
+        }
+        else
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_088: [If no such header is found or is invalid, then _DoWork shall advance to the next action.]*/
+            size_t etagsize = strlen(etagValue);
+            if (
+                (etagsize < 2) ||
+                (etagValue[0] != '"') ||
+                (etagValue[etagsize - 1] != '"')
+                )
+            {
+                LogError("ETag is not a valid quoted string\r\n");
+            }
+            else
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_089: [_DoWork shall assemble an IOTHUBMESSAGE_HANDLE from the received HTTP content (using the responseContent buffer).] */
+                IOTHUB_MESSAGE_HANDLE receivedMessage = IoTHubMessage_CreateFromByteArray(BUFFER_u_char(responseContent), BUFFER_length(responseContent));
+                if (receivedMessage == NULL)
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_092: [If assembling the message fails in any way, then _DoWork shall "abandon" the message.]*/
+                    LogError("unable to IoTHubMessage_CreateFromByteArray, trying to abandon the message... \r\n");
+                    abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
+                }
+                else
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_090: [All the HTTP headers of the form iothub-app-name:somecontent shall be transformed in message properties {name, somecontent}.]*/
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_091: [The HTTP header of iothub-messageid shall be set in the MessageId.]*/
+                    size_t nHeaders;
+                    if (HTTPHeaders_GetHeaderCount(responseHTTPHeaders, &nHeaders) != HTTP_HEADERS_OK)
+                    {
+                        LogError("unable to get the count of HTTP headers\r\n");
+                        abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
+                    }
+                    else
+                    {
+                        size_t i;
+                        MAP_HANDLE properties = (nHeaders > 0) ? IoTHubMessage_Properties(receivedMessage) : NULL;
+                        for (i = 0; i < nHeaders; i++)
+                        {
+                            char* completeHeader;
+                            if (HTTPHeaders_GetHeader(responseHTTPHeaders, i, &completeHeader) != HTTP_HEADERS_OK)
+                            {
+                                break;
+                            }
+                            else
+                            {
+                                if (strncmp(IOTHUB_APP_PREFIX, completeHeader, strlen(IOTHUB_APP_PREFIX)) == 0)
+                                {
+                                    /*looks like a property headers*/
+                                    /*there's a guaranteed ':' in the completeHeader, by HTTP_HEADERS module*/
+                                    char* whereIsColon = strchr(completeHeader, ':');
+                                    if (whereIsColon != NULL)
                                     {
-                                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_072: [The message size shall be limited to 255KB -1 bytes.] */
-                                        PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
-                                        DList_InsertTailList(&(deviceData->eventConfirmations), head);
-                                        IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
-                                        goOn = false;
+                                        *whereIsColon = '\0'; /*cut it down*/
+                                        if (Map_AddOrUpdate(properties, completeHeader + strlen(IOTHUB_APP_PREFIX), whereIsColon + 2) != MAP_OK) /*whereIsColon+1 is a space because HTTPEHADERS outputs a ": " between name and value*/
+                                        {
+                                            free(completeHeader);
+                                            break;
+                                        }
                                     }
-                                    else
+                                }
+                                else if (strncmp(IOTHUB_MESSAGE_ID, completeHeader, strlen(IOTHUB_MESSAGE_ID)) == 0)
+                                {
+                                    char* whereIsColon = strchr(completeHeader, ':');
+                                    if (whereIsColon != NULL)
                                     {
-                                        STRING_HANDLE temp = STRING_construct(IOTHUB_APP_PREFIX);
-                                        if (temp == NULL)
+                                        *whereIsColon = '\0'; /*cut it down*/
+                                        if (IoTHubMessage_SetMessageId(receivedMessage, whereIsColon + 2) != IOTHUB_MESSAGE_OK)
                                         {
-                                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
-                                            LogError("unable to STRING_construct\r\n");
-                                            goOn = false;
+                                            free(completeHeader);
+                                            break;
                                         }
-                                        else
+                                    }
+                                }
+                                else if (strncmp(IOTHUB_CORRELATION_ID, completeHeader, strlen(IOTHUB_CORRELATION_ID)) == 0)
+                                {
+                                    char* whereIsColon = strchr(completeHeader, ':');
+                                    if (whereIsColon != NULL)
+                                    {
+                                        *whereIsColon = '\0'; /*cut it down*/
+                                        if (IoTHubMessage_SetCorrelationId(receivedMessage, whereIsColon + 2) != IOTHUB_MESSAGE_OK)
                                         {
-                                            if (STRING_concat(temp, keys[i]) != 0)
-                                            {
-                                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
-                                                LogError("unable to STRING_concat\r\n");
-                                                goOn = false;
-                                            }
-                                            else
-                                            {
-                                                if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, STRING_c_str(temp), values[i]) != HTTP_HEADERS_OK)
-                                                {
-                                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
-                                                    LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
-                                                    goOn = false;
-                                                }
-                                            }
-                                            STRING_delete(temp);
+                                            free(completeHeader);
+                                            break;
                                         }
                                     }
                                 }
+                                free(completeHeader);
+                            }
+                        }
+
+                        if (i < nHeaders)
+                        {
+                            abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
+                        }
+                        else
+                        {
+                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_093: [Otherwise, _DoWork shall call IoTHubClient_LL_MessageCallback with parameters handle = iotHubClientHandle and message = newly created message.]*/
+                            IOTHUBMESSAGE_DISPOSITION_RESULT messageResult = IoTHubClient_LL_MessageCallback(iotHubClientHandle, receivedMessage);
+                            if (messageResult == IOTHUBMESSAGE_ACCEPTED)
+                            {
+                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_094: [If IoTHubClient_LL_MessageCallback returns IOTHUBMESSAGE_ACCEPTED then _DoWork shall "accept" the message.]*/
+                                abandonOrAcceptMessage(handleData, deviceData, etagValue, ACCEPT);
+                            }
+                            else if (messageResult == IOTHUBMESSAGE_REJECTED)
+                            {
+                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_095: [If IoTHubClient_LL_MessageCallback returns IOTHUBMESSAGE_REJECTED then _DoWork shall "reject" the message.]*/
+                                abandonOrAcceptMessage(handleData, deviceData, etagValue, REJECT);
+                            }
+                            else
+                            {
+                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_096: [If IoTHubClient_LL_MessageCallback returns IOTHUBMESSAGE_ABANDONED then _DoWork shall "abandon" the message.] */
+                                abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
+                            }
+                        }
+                    }
+                    IoTHubMessage_Destroy(receivedMessage);
+                }
+            }
+            
+        }
+    }
+}
+
+static void DoMessages(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+{
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_083: [ If device is not subscribed then _DoWork shall advance to the next action. ] */
+    if (deviceData->DoWork_PullMessage)
+    {
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_123: [After client creation, the first GET shall be allowed no matter what the value of GetMinimumPollingTime.] */
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_124: [If time is not available then all calls shall be treated as if they are the first one.] */
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_122: [A GET request that happens earlier than GetMinimumPollingTime shall be ignored.] */
+        time_t timeNow = get_time(NULL);
+        bool isPollingAllowed = deviceData->isFirstPoll || (timeNow == (time_t)(-1)) || (get_difftime(timeNow, deviceData->lastPollTime) > handleData->getMinimumPollingTime);
+        if (isPollingAllowed)
+        {
+        HTTP_HEADERS_HANDLE responseHTTPHeaders = HTTPHeaders_Alloc();
+        if (responseHTTPHeaders == NULL)
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_085: [If the call to HTTPAPIEX_SAS_ExecuteRequest did not executed successfully or building any part of the prerequisites of the call fails, then _DoWork shall advance to the next action in this description.] */
+            LogError("unable to HTTPHeaders_Alloc\r\n");
+        }
+        else
+        {
+            BUFFER_HANDLE responseContent = acquireBuffer(handleData, &(deviceData->responseContent));
+            if (responseContent == NULL)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_085: [If the call to HTTPAPIEX_SAS_ExecuteRequest did not executed successfully or building any part of the prerequisites of the call fails, then _DoWork shall advance to the next action in this description.] */
+                LogError("unable to BUFFER_new\r\n");
+            }
+            else
+            {
+                unsigned int statusCode;
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_084: [Otherwise, IoTHubTransportHttp_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest passing the following parameters
+requestType: GET
+relativePath: the message HTTP relative path
+requestHttpHeadersHandle: message HTTP request headers created by _Create
+requestContent: NULL
+statusCode: a pointer to unsigned int which shall be later examined
+responseHeadearsHandle: a new instance of HTTP headers
+responseContent: a new instance of buffer] 
+*/
+                if (executeDeviceRequest(
+					handleData,
+                    deviceData,
+                    HTTPAPI_REQUEST_GET,                                            /*requestType: GET*/
+                    STRING_c_str(deviceData->messageHTTPrelativePath),         /*relativePath: the message HTTP relative path*/
+					deviceData->messageHTTPrequestHeaders,                     /*requestHttpHeadersHandle: message HTTP request headers created by _Create*/
+                    NULL,                                                           /*requestContent: NULL*/
+                    &statusCode,                                                    /*statusCode: a pointer to unsigned int which shall be later examined*/
+                    responseHTTPHeaders,                                            /*responseHeadearsHandle: a new instance of HTTP headers*/
+                    responseContent                                                 /*responseContent: a new instance of buffer*/
+                    ) 
+                    != HTTPAPIEX_OK)
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_085: [If the call to HTTPAPIEX_SAS_ExecuteRequest did not executed successfully or building any part of the prerequisites of the call fails, then _DoWork shall advance to the next action in this description.] */
+                    LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
+                }
+                else
+                { 
+                        /*HTTP dialogue was succesfull*/
+                        if (timeNow == (time_t)(-1))
+                        {
+							deviceData->isFirstPoll = true;
+                        }
+                        else
+                        {
+							deviceData->isFirstPoll = false;
+							deviceData->lastPollTime = timeNow;
+                        }
+                    processMessageResponse(handleData, deviceData, iotHubClientHandle, statusCode, responseHTTPHeaders, responseContent);
+                }
+                releaseBuffer(&(deviceData->responseContent), responseContent);
+            }
+            HTTPHeaders_Free(responseHTTPHeaders);
+        }
+    }
+        else
+        {
+            /*isPollingAllowed is false... */
+            /*do nothing "shall be ignored*/
+}
+    }
+}
+
+static void DoWorkAllDevices(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+	IOTHUB_DEVICE_HANDLE* listItem;
+	size_t deviceListSize = VECTOR_size(handleData->perDeviceList);
+	/*Codes_SRS_TRANSPORTMULTITHTTP_17_052: [ IoTHubTransportHttp_DoWork shall perform a round-robin loop through every deviceHandle in the transport device list, using the iotHubClientHandle field saved in the IOTHUB_DEVICE_HANDLE. ]*/
+	/*Codes_SRS_TRANSPORTMULTITHTTP_17_050: [ IoTHubTransportHttp_DoWork shall call loop through the device list. ] */
+	/*Codes_SRS_TRANSPORTMULTITHTTP_17_051: [ IF the list is empty, then IoTHubTransportHttp_DoWork shall do nothing. ]*/
+	for (size_t i = 0; i < deviceListSize; i++)
+	{
+		listItem = VECTOR_element(handleData->perDeviceList, i);
+		HTTPTRANSPORT_PERDEVICE_DATA* perDeviceItem = *(HTTPTRANSPORT_PERDEVICE_DATA**)(listItem);
+		DoEvent(handleData, perDeviceItem, perDeviceItem->iotHubClientHandle);
+		DoMessages(handleData, perDeviceItem, perDeviceItem->iotHubClientHandle);
+
+	}
+}
+
+/*moves all the items of source at the end of destination*/
+static void moveListToTail(PDLIST_ENTRY source, PDLIST_ENTRY destination)
+{
+    if (!DList_IsListEmpty(source))
+    {
+        DList_AppendTailList(destination, source);
+        DList_RemoveEntryList(source);
+        DList_InitializeListHead(source);
+    }
+}
+
+/*
+* Ready set scheduling: events are served by deficit round robin, GETs are served from a heap ordered by poll deadline
+*/
+
+static double getPollDeadline(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData)
+{
+    /*mirrors the isPollingAllowed computation of DoMessages*/
+    return (deviceData->isFirstPoll) ? 0 : (get_difftime(deviceData->lastPollTime, (time_t)0) + handleData->getMinimumPollingTime);
+}
+
+static void pollHeap_siftDown(HTTPTRANSPORT_HANDLE_DATA* handleData, size_t index)
+{
+    HTTPTRANSPORT_PERDEVICE_DATA** heap = handleData->pollHeap;
+    size_t size = handleData->pollHeapSize;
+    while (true)
+    {
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if ((left < size) && (heap[left]->pollDeadline < heap[smallest]->pollDeadline))
+        {
+            smallest = left;
+        }
+        if ((right < size) && (heap[right]->pollDeadline < heap[smallest]->pollDeadline))
+        {
+            smallest = right;
+        }
+        if (smallest == index)
+        {
+            break;
+        }
+        else
+        {
+            HTTPTRANSPORT_PERDEVICE_DATA* temp = heap[index];
+            heap[index] = heap[smallest];
+            heap[smallest] = temp;
+            index = smallest;
+        }
+    }
+}
+
+static int rebuildPollHeap(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    int result;
+    size_t deviceListSize = VECTOR_size(handleData->perDeviceList);
+    if (deviceListSize > handleData->pollHeapCapacity)
+    {
+        HTTPTRANSPORT_PERDEVICE_DATA** newHeap = (HTTPTRANSPORT_PERDEVICE_DATA**)realloc(handleData->pollHeap, deviceListSize * sizeof(HTTPTRANSPORT_PERDEVICE_DATA*));
+        if (newHeap == NULL)
+        {
+            LogError("unable to realloc the poll heap\r\n");
+            result = __LINE__;
+        }
+        else
+        {
+            handleData->pollHeap = newHeap;
+            handleData->pollHeapCapacity = deviceListSize;
+            result = 0;
+        }
+    }
+    else
+    {
+        result = 0;
+    }
+
+    if (result == 0)
+    {
+        size_t i;
+        handleData->pollHeapSize = 0;
+        for (i = 0; i < deviceListSize; i++)
+        {
+            HTTPTRANSPORT_PERDEVICE_DATA* deviceData = *(HTTPTRANSPORT_PERDEVICE_DATA**)VECTOR_element(handleData->perDeviceList, i);
+            if (deviceData->DoWork_PullMessage)
+            {
+                deviceData->pollDeadline = getPollDeadline(handleData, deviceData);
+                handleData->pollHeap[handleData->pollHeapSize++] = deviceData;
+            }
+        }
+        for (i = handleData->pollHeapSize / 2; i-- > 0;)
+        {
+            pollHeap_siftDown(handleData, i);
+        }
+        handleData->isPollHeapDirty = false;
+    }
+    return result;
+}
+
+/*the number of bytes DoEvent is about to put on the wire for the device, capped to the maximum message size*/
+static size_t getEventCost(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData)
+{
+    size_t result;
+    if (handleData->doBatchedTransfers)
+    {
+        /*a batch takes as many messages as fit in a request, so it uses a whole turn*/
+        result = MAXIMUM_MESSAGE_SIZE;
+    }
+    else
+    {
+        IOTHUB_MESSAGE_LIST* message = containingRecord(deviceData->waitingToSend->Flink, IOTHUB_MESSAGE_LIST, entry);
+        IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
+        const unsigned char* messageContent;
+        size_t messageSize;
+        const char* messageString;
+        if ((contentType == IOTHUBMESSAGE_BYTEARRAY) && (IoTHubMessage_GetByteArray(message->messageHandle, &messageContent, &messageSize) == IOTHUB_MESSAGE_OK))
+        {
+            result = messageSize + MAXIMUM_PAYLOAD_OVERHEAD;
+        }
+        else if ((contentType == IOTHUBMESSAGE_STRING) && ((messageString = IoTHubMessage_GetString(message->messageHandle)) != NULL))
+        {
+            result = strlen(messageString) + MAXIMUM_PAYLOAD_OVERHEAD;
+        }
+        else
+        {
+            /*DoEvent deals with messages that cannot be read*/
+            result = 0;
+        }
+
+        if (result > MAXIMUM_MESSAGE_SIZE)
+        {
+            /*DoEvent fails such a message without sending it*/
+            result = MAXIMUM_MESSAGE_SIZE;
+        }
+    }
+    return result;
+}
+
+/*serves the devices with pending events by deficit round robin. Only the devices of the activeDevices list are visited*/
+static void DoEventsReadySet(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_156: [ Devices with pending events shall be served by deficit round robin: every round a device earns "SchedulingQuantum" bytes and sends its next event only when its earnings cover the size of that event. Devices with no pending events shall not keep their earnings. ]*/
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_186: [ Only the devices for which IoTHubTransportHttp_EventQueued has been called since they were last found without events shall be visited. Rounds in which no device would send shall be skipped by giving every visited device the earnings of these rounds at once. ]*/
+    size_t quantum = handleData->schedulingQuantum;
+    size_t fewestQuanta = 0; /*quanta the device closest to its next event still has to earn, 0 when no device has events*/
+    PDLIST_ENTRY entry = handleData->activeDevices.Flink;
+
+    /*first pass: forget the devices that have no events anymore and find out how many quanta each of the others needs*/
+    while (entry != &(handleData->activeDevices))
+    {
+        HTTPTRANSPORT_PERDEVICE_DATA* deviceData = containingRecord(entry, HTTPTRANSPORT_PERDEVICE_DATA, activeEntry);
+        entry = entry->Flink;
+        if (DList_IsListEmpty(deviceData->waitingToSend))
+        {
+            (void)DList_RemoveEntryList(&(deviceData->activeEntry));
+            deviceData->isActive = false;
+            deviceData->eventDeficit = 0;
+        }
+        else
+        {
+            size_t quanta;
+            deviceData->eventCost = getEventCost(handleData, deviceData);
+            quanta = (deviceData->eventCost > deviceData->eventDeficit) ? ((deviceData->eventCost - deviceData->eventDeficit + quantum - 1) / quantum) : 1;
+            if ((fewestQuanta == 0) || (quanta < fewestQuanta))
+            {
+                fewestQuanta = quanta;
+            }
+        }
+    }
+
+    if (fewestQuanta > 0)
+    {
+        /*rounds in which no device could send are not played one DoWork at a time, every device earns them at once*/
+        size_t earnings = fewestQuanta * quantum;
+        DLIST_ENTRY round;
+        DList_InitializeListHead(&round);
+        moveListToTail(&(handleData->activeDevices), &round);
+        /*second pass: the devices are served in the order their events were first queued. A device goes back in the active list before it is served,
+        so a device unregistered by a callback leaves whichever list it is in and a device queued by a callback waits for the next round*/
+        while (!DList_IsListEmpty(&round))
+        {
+            HTTPTRANSPORT_PERDEVICE_DATA* deviceData = containingRecord(DList_RemoveHeadList(&round), HTTPTRANSPORT_PERDEVICE_DATA, activeEntry);
+            DList_InsertTailList(&(handleData->activeDevices), &(deviceData->activeEntry));
+            deviceData->eventDeficit += earnings;
+            if (deviceData->eventDeficit >= deviceData->eventCost)
+            {
+                deviceData->eventDeficit -= deviceData->eventCost;
+                DoEvent(handleData, deviceData, deviceData->iotHubClientHandle);
+            }
+        }
+    }
+}
+
+static void DoWorkReadySet(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_155: [ When "ReadySetScheduling" is true, IoTHubTransportHttp_DoWork shall read the time once. If time is not available, or the poll heap cannot be built, then IoTHubTransportHttp_DoWork shall visit every device as if the option was false. ]*/
+    time_t timeNow = get_time(NULL);
+    if ((timeNow == (time_t)(-1)) ||
+        (handleData->isPollHeapDirty && (rebuildPollHeap(handleData) != 0)))
+    {
+        DoWorkAllDevices(handleData);
+    }
+    else
+    {
+        double now = get_difftime(timeNow, (time_t)0);
+        DoEventsReadySet(handleData);
+
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_191: [ If the event callbacks changed the devices or the subscriptions, then IoTHubTransportHttp_DoWork shall rebuild the poll heap before polling. If the poll heap cannot be rebuilt, then no device shall poll during that IoTHubTransportHttp_DoWork. ]*/
+        if (handleData->isPollHeapDirty && (rebuildPollHeap(handleData) != 0))
+        {
+            /*the heap still points at the devices the callbacks unregistered, nothing polls until the next DoWork rebuilds it*/
+            handleData->pollHeapSize = 0;
+        }
+
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_157: [ Only subscribed devices whose poll deadline (last GET time + "MinimumPollingTime", or now for the first GET) has passed shall execute the "ExecuteMessage" action, at most once per IoTHubTransportHttp_DoWork. ]*/
+        while ((handleData->pollHeapSize > 0) && (handleData->pollHeap[0]->pollDeadline < now))
+        {
+            HTTPTRANSPORT_PERDEVICE_DATA* deviceData = handleData->pollHeap[0];
+            DoMessages(handleData, deviceData, deviceData->iotHubClientHandle);
+            if (handleData->isPollHeapDirty)
+            {
+                /*the message callback changed the devices or the subscriptions, the heap is rebuilt by the next DoWork*/
+                break;
+            }
+            else
+            {
+                deviceData->pollDeadline = getPollDeadline(handleData, deviceData);
+                if (deviceData->pollDeadline < now)
+                {
+                    /*the GET did not happen, try again on the next DoWork*/
+                    deviceData->pollDeadline = now;
+                }
+                pollHeap_siftDown(handleData, 0);
+            }
+        }
+    }
+}
+
+/*
+* Pipelined connection (option "Pipelining")
+*/
+
+static PDLIST_ENTRY removeTailEntry(PDLIST_ENTRY listHead)
+{
+    PDLIST_ENTRY result = listHead->Blink;
+    (void)DList_RemoveEntryList(result);
+    return result;
+}
+
+static void destroyPipelinedRequest(HTTPTRANSPORT_PIPELINED_REQUEST* request)
+{
+    if (request->responseHeaders != NULL)
+    {
+        HTTPHeaders_Free(request->responseHeaders);
+    }
+    if (request->responseContent != NULL)
+    {
+        BUFFER_delete(request->responseContent);
+    }
+    free(request);
+}
+
+/*gives back to the device what a request that will never have a response was holding*/
+static void abandonPipelinedRequest(HTTPTRANSPORT_PIPELINED_REQUEST* request)
+{
+    if (request->deviceData != NULL)
+    {
+        if (request->kind == PIPELINED_EVENT)
+        {
+            reversePutListBackIn(&(request->events), request->deviceData->waitingToSend);
+            request->deviceData->pipelinedEvents--;
+        }
+        else if (request->kind == PIPELINED_POLL)
+        {
+            request->deviceData->isPollPipelined = false;
+        }
+        else
+        {
+            LogError("an abandon/accept/reject request has been lost, the message shall be delivered again by the service\r\n");
+        }
+    }
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_179: [ On a connection error, a response timeout or a "Connection: close" response, the requests waiting for their response shall be abandoned: their events shall be put back at the beginning of waitingToSend in their original order. The connection shall be opened again after 5 seconds. ]*/
+static void resetPipeline(HTTPTRANSPORT_PIPELINE* pipeline)
+{
+    /*from the newest to the oldest, so that putting the events back at the beginning of waitingToSend keeps their order*/
+    while (!DList_IsListEmpty(&(pipeline->inFlight)))
+    {
+        HTTPTRANSPORT_PIPELINED_REQUEST* request = containingRecord(removeTailEntry(&(pipeline->inFlight)), HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+        abandonPipelinedRequest(request);
+        destroyPipelinedRequest(request);
+    }
+    pipeline->inFlightCount = 0;
+
+    if (pipeline->xio != NULL)
+    {
+        (void)xio_close(pipeline->xio, NULL, NULL);
+        xio_destroy(pipeline->xio);
+        pipeline->xio = NULL;
+    }
+
+    pipeline->parserState = RESPONSE_STATUS_LINE;
+    pipeline->lineSize = 0;
+    pipeline->bodySize = 0;
+    pipeline->isConnectionClose = false;
+    pipeline->state = PIPELINE_CLOSED;
+}
+
+static void destroyPipeline(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline = handleData->pipeline;
+    resetPipeline(pipeline);
+    /*the completed requests are normally processed by the DoWork that received them*/
+    while (!DList_IsListEmpty(&(pipeline->completed)))
+    {
+        HTTPTRANSPORT_PIPELINED_REQUEST* request = containingRecord(removeTailEntry(&(pipeline->completed)), HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+        abandonPipelinedRequest(request);
+        destroyPipelinedRequest(request);
+    }
+    destroy_scratch(&(pipeline->request));
+    destroy_scratch(&(pipeline->line));
+    destroy_scratch(&(pipeline->body));
+    free(pipeline);
+    handleData->pipeline = NULL;
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_180: [ When a device is unregistered, the events of its requests waiting for their response shall be put back in waitingToSend and the responses to its requests shall be ignored. ]*/
+static void forgetPipelinedDevice(HTTPTRANSPORT_PIPELINE* pipeline, HTTPTRANSPORT_PERDEVICE_DATA* deviceData)
+{
+    PDLIST_ENTRY lists[2];
+    size_t i;
+    lists[0] = &(pipeline->inFlight);
+    lists[1] = &(pipeline->completed);
+    for (i = 0; i < 2; i++)
+    {
+        PDLIST_ENTRY current;
+        for (current = lists[i]->Blink; current != lists[i]; current = current->Blink)
+        {
+            HTTPTRANSPORT_PIPELINED_REQUEST* request = containingRecord(current, HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+            if (request->deviceData == deviceData)
+            {
+                abandonPipelinedRequest(request);
+                request->deviceData = NULL;
+            }
+        }
+    }
+}
+
+/*the response to the oldest request is complete*/
+static void completePipelinedResponse(HTTPTRANSPORT_PIPELINE* pipeline)
+{
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_177: [ Responses shall be matched to requests in the order the requests have been sent. ]*/
+    HTTPTRANSPORT_PIPELINED_REQUEST* request = containingRecord(DList_RemoveHeadList(&(pipeline->inFlight)), HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+    pipeline->inFlightCount--;
+    request->statusCode = pipeline->statusCode;
+    if ((request->responseContent != NULL) && (pipeline->bodySize > 0) &&
+        (BUFFER_build(request->responseContent, (const unsigned char*)pipeline->body.buffer, pipeline->bodySize) != 0))
+    {
+        LogError("unable to BUFFER_build\r\n");
+        request->statusCode = 0; /*not a status code, the response is not used*/
+    }
+    DList_InsertTailList(&(pipeline->completed), &(request->entry));
+
+    pipeline->parserState = RESPONSE_STATUS_LINE;
+    pipeline->bodySize = 0;
+    if (pipeline->isConnectionClose)
+    {
+        /*the requests sent after this one will not get a response*/
+        pipeline->state = PIPELINE_ERROR;
+    }
+}
+
+static void onPipelineOpenComplete(void* context, IO_OPEN_RESULT open_result)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline = (HTTPTRANSPORT_PIPELINE*)context;
+    if (open_result == IO_OPEN_OK)
+    {
+        pipeline->state = PIPELINE_OPEN;
+    }
+    else
+    {
+        LogError("unable to open the pipelined connection\r\n");
+        pipeline->state = PIPELINE_ERROR;
+    }
+}
 
-                                // Add the Message Id and the Correlation Id
-                                msgId = IoTHubMessage_GetMessageId(message->messageHandle);
-                                if (goOn && msgId != NULL)
-                                {
-                                    if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, IOTHUB_MESSAGE_ID, msgId) != HTTP_HEADERS_OK)
-                                    {
-                                        LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
-                                        goOn = false;
-                                    }
-                                }
+static void onPipelineError(void* context)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline = (HTTPTRANSPORT_PIPELINE*)context;
+    if (pipeline->parserState == RESPONSE_BODY_UNTIL_CLOSE)
+    {
+        /*the server closing the connection is the end of the body*/
+        completePipelinedResponse(pipeline);
+    }
+    else
+    {
+        LogError("error on the pipelined connection\r\n");
+    }
+    pipeline->state = PIPELINE_ERROR;
+}
 
-                                corrId = IoTHubMessage_GetCorrelationId(message->messageHandle);
-                                if (goOn && corrId != NULL)
-                                {
-                                    if (HTTPHeaders_ReplaceHeaderNameValuePair(clonedEventHTTPrequestHeaders, IOTHUB_CORRELATION_ID, corrId) != HTTP_HEADERS_OK)
-                                    {
-                                        LogError("unable to HTTPHeaders_ReplaceHeaderNameValuePair\r\n");
-                                        goOn = false;
-                                    }
-                                }
+static void onPipelineSendComplete(void* context, IO_SEND_RESULT send_result)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline = (HTTPTRANSPORT_PIPELINE*)context;
+    if (send_result != IO_SEND_OK)
+    {
+        LogError("unable to send a pipelined request\r\n");
+        pipeline->state = PIPELINE_ERROR;
+    }
+}
 
-                                if (!goOn)
-                                {
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_079: [If any HTTP header operation fails, _DoWork shall advance to the next action.] */
-                                }
-                                else
-                                {
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_080: [IoTHubTransportHttp_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest passing the following parameters] */
-                                    BUFFER_HANDLE toBeSend = BUFFER_new();
-                                    if (toBeSend == NULL)
-                                    {
-                                        LogError("unable to BUFFER_new\r\n");
-                                    }
-                                    else
-                                    {
-                                        if (BUFFER_build(toBeSend, messageContent, originalMessageSize) != 0)
-                                        {
-                                            LogError("unable to BUFFER_build\r\n");
-                                        }
-                                        else
-                                        {
-                                            unsigned int statusCode;
-                                            HTTPAPIEX_RESULT r;
-                                            if ((r = HTTPAPIEX_SAS_ExecuteRequest(
-												deviceData->sasObject,
-                                                handleData->httpApiExHandle,
-                                                HTTPAPI_REQUEST_POST,
-                                                STRING_c_str(deviceData->eventHTTPrelativePath),
-                                                clonedEventHTTPrequestHeaders,
-                                                toBeSend,
-                                                &statusCode,
-                                                NULL,
-                                                NULL
-                                                )) != HTTPAPIEX_OK)
-                                            {
-                                                LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
-                                            }
-                                            else
-                                            {
-                                                if (statusCode < 300)
-                                                {
-                                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_082: [If HTTPAPIEX_SAS_ExecuteRequest does not fail and http status code <300 then IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_SendComplete. Parameter PDLIST_ENTRY completed shall point to a list the item send, and parameter IOTHUB_BATCHSTATE result shall be set to IOTHUB_BATCHSTATE_SUCCESS. The item shall be removed from waitingToSend.] */
-                                                    PDLIST_ENTRY justSent = DList_RemoveHeadList(deviceData->waitingToSend); /*actually this is the same as "actual", but now it is removed*/
-                                                    DList_InsertTailList(&(deviceData->eventConfirmations), justSent);
-                                                    IoTHubClient_LL_SendComplete(iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_SUCCESS); /*takes care of emptying the list too*/
-                                                }
-                                                else
-                                                {
-                                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_081: [If HTTPAPIEX_SAS_ExecuteRequest fails or the http status code >=300 then IoTHubTransportHttp_DoWork shall not do any other action (it is assumed at the next _DoWork it shall be retried).] */
-                                                    LogError("unexpected HTTP status code (%u)\r\n", statusCode);
-                                                }
-                                            }
-                                        }
-                                        BUFFER_delete(toBeSend);
-                                    }
-                                }
-                            }
-                        }
-                        HTTPHeaders_Free(clonedEventHTTPrequestHeaders);
-                    }
+/*compares ASCII names without regard to case, as HTTP header names are*/
+static int compareHeaderName(const char* name, const char* expected)
+{
+    while ((*name != '\0') && (tolower((unsigned char)*name) == tolower((unsigned char)*expected)))
+    {
+        name++;
+        expected++;
+    }
+    return tolower((unsigned char)*name) - tolower((unsigned char)*expected);
+}
+
+static int parseStatusLine(HTTPTRANSPORT_PIPELINE* pipeline, const char* line)
+{
+    int result;
+    const char* space = strchr(line, ' ');
+    if ((strncmp(line, "HTTP/1.", 7) != 0) || (space == NULL) || (sscanf(space + 1, "%u", &(pipeline->statusCode)) != 1))
+    {
+        LogError("invalid status line\r\n");
+        result = __LINE__;
+    }
+    else if (DList_IsListEmpty(&(pipeline->inFlight)))
+    {
+        LogError("unexpected response, there is no request waiting for it\r\n");
+        result = __LINE__;
+    }
+    else
+    {
+        pipeline->hasContentLength = false;
+        pipeline->isChunked = false;
+        pipeline->isConnectionClose = false;
+        pipeline->remaining = 0;
+        pipeline->bodySize = 0;
+        pipeline->parserState = RESPONSE_HEADERS;
+        result = 0;
+    }
+    return result;
+}
+
+static int parseHeaderLine(HTTPTRANSPORT_PIPELINE* pipeline, char* line)
+{
+    int result;
+    HTTPTRANSPORT_PIPELINED_REQUEST* request = containingRecord(pipeline->inFlight.Flink, HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+    if (line[0] == '\0')
+    {
+        /*end of headers*/
+        result = 0;
+        if (pipeline->statusCode < 200)
+        {
+            /*informational response, the real one follows*/
+            pipeline->parserState = RESPONSE_STATUS_LINE;
+        }
+        else if ((pipeline->statusCode == 204) || (pipeline->statusCode == 304))
+        {
+            completePipelinedResponse(pipeline);
+        }
+        else if (pipeline->isChunked)
+        {
+            pipeline->parserState = RESPONSE_CHUNK_SIZE;
+        }
+        else if (pipeline->hasContentLength)
+        {
+            if (pipeline->remaining > 0)
+            {
+                pipeline->parserState = RESPONSE_BODY;
+            }
+            else
+            {
+                completePipelinedResponse(pipeline);
+            }
+        }
+        else
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_189: [ The body of a response that has neither a "Content-Length" header nor a chunked "Transfer-Encoding" shall end when the connection is closed; no other request shall be sent on the connection meanwhile and the connection shall then be opened again. ]*/
+            pipeline->isConnectionClose = true;
+            pipeline->parserState = RESPONSE_BODY_UNTIL_CLOSE;
+        }
+    }
+    else
+    {
+        char* colon = strchr(line, ':');
+        if (colon == NULL)
+        {
+            LogError("invalid header line\r\n");
+            result = __LINE__;
+        }
+        else
+        {
+            char* value = colon + 1;
+            *colon = '\0';
+            while ((*value == ' ') || (*value == '\t'))
+            {
+                value++;
+            }
+
+            result = 0;
+            if (compareHeaderName(line, "Content-Length") == 0)
+            {
+                pipeline->hasContentLength = true;
+                pipeline->remaining = (size_t)strtoul(value, NULL, 10);
+            }
+            else if (compareHeaderName(line, "Transfer-Encoding") == 0)
+            {
+                pipeline->isChunked = (strstr(value, "chunked") != NULL);
+            }
+            else if (compareHeaderName(line, "Connection") == 0)
+            {
+                pipeline->isConnectionClose = (compareHeaderName(value, "close") == 0);
+            }
+
+            if ((request->responseHeaders != NULL) && (pipeline->statusCode >= 200) &&
+                (HTTPHeaders_AddHeaderNameValuePair(request->responseHeaders, line, value) != HTTP_HEADERS_OK))
+            {
+                LogError("unable to HTTPHeaders_AddHeaderNameValuePair\r\n");
+                result = __LINE__;
+            }
+        }
+    }
+    return result;
+}
+
+static int parseResponseLine(HTTPTRANSPORT_PIPELINE* pipeline)
+{
+    int result;
+    char* line = pipeline->line.buffer;
+    line[pipeline->lineSize] = '\0';
+    if ((pipeline->lineSize > 0) && (line[pipeline->lineSize - 1] == '\r'))
+    {
+        line[pipeline->lineSize - 1] = '\0';
+    }
+    pipeline->lineSize = 0;
+
+    switch (pipeline->parserState)
+    {
+    case RESPONSE_STATUS_LINE:
+    {
+        /*empty lines before a status line are tolerated*/
+        result = (line[0] == '\0') ? 0 : parseStatusLine(pipeline, line);
+        break;
+    }
+    case RESPONSE_HEADERS:
+    {
+        result = parseHeaderLine(pipeline, line);
+        break;
+    }
+    case RESPONSE_CHUNK_SIZE:
+    {
+        char* end;
+        pipeline->remaining = (size_t)strtoul(line, &end, 16);
+        if (end == line)
+        {
+            LogError("invalid chunk size\r\n");
+            result = __LINE__;
+        }
+        else
+        {
+            pipeline->parserState = (pipeline->remaining == 0) ? RESPONSE_TRAILERS : RESPONSE_CHUNK_DATA;
+            result = 0;
+        }
+        break;
+    }
+    case RESPONSE_CHUNK_DATA_END:
+    {
+        pipeline->parserState = RESPONSE_CHUNK_SIZE;
+        result = 0;
+        break;
+    }
+    case RESPONSE_TRAILERS:
+    {
+        if (line[0] == '\0')
+        {
+            completePipelinedResponse(pipeline);
+        }
+        result = 0;
+        break;
+    }
+    default:
+    {
+        LogError("internal error: switch's default branch reached when never intended\r\n");
+        result = __LINE__;
+        break;
+    }
+    }
+    return result;
+}
+
+static void onPipelineBytesReceived(void* context, const unsigned char* buffer, size_t size)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline = (HTTPTRANSPORT_PIPELINE*)context;
+    size_t i = 0;
+    while ((i < size) && (pipeline->state != PIPELINE_ERROR))
+    {
+        if ((pipeline->parserState == RESPONSE_BODY) || (pipeline->parserState == RESPONSE_BODY_UNTIL_CLOSE) || (pipeline->parserState == RESPONSE_CHUNK_DATA))
+        {
+            size_t available = size - i;
+            size_t toCopy = ((pipeline->parserState == RESPONSE_BODY_UNTIL_CLOSE) || (available < pipeline->remaining)) ? available : pipeline->remaining;
+            HTTPTRANSPORT_PIPELINED_REQUEST* request = containingRecord(pipeline->inFlight.Flink, HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+            if (request->responseContent != NULL)
+            {
+                /*only the content of GET responses is kept*/
+                if (reserveScratch(&(pipeline->body), pipeline->bodySize + toCopy) != 0)
+                {
+                    pipeline->state = PIPELINE_ERROR;
+                    break;
+                }
+                (void)memcpy(pipeline->body.buffer + pipeline->bodySize, buffer + i, toCopy);
+                pipeline->bodySize += toCopy;
+            }
+            i += toCopy;
+            if (pipeline->parserState == RESPONSE_BODY_UNTIL_CLOSE)
+            {
+                /*completed by onPipelineError*/
+            }
+            else if ((pipeline->remaining -= toCopy) == 0)
+            {
+                if (pipeline->parserState == RESPONSE_BODY)
+                {
+                    completePipelinedResponse(pipeline);
+                }
+                else
+                {
+                    pipeline->parserState = RESPONSE_CHUNK_DATA_END;
+                }
+            }
+        }
+        else if (buffer[i] == '\n')
+        {
+            i++;
+            if ((reserveScratch(&(pipeline->line), pipeline->lineSize + 1) != 0) ||
+                (parseResponseLine(pipeline) != 0))
+            {
+                pipeline->state = PIPELINE_ERROR;
+            }
+        }
+        else if (pipeline->lineSize + 1 >= PIPELINE_MAXIMUM_LINE_SIZE)
+        {
+            LogError("response line too long\r\n");
+            pipeline->state = PIPELINE_ERROR;
+        }
+        else if (reserveScratch(&(pipeline->line), pipeline->lineSize + 2) != 0)
+        {
+            pipeline->state = PIPELINE_ERROR;
+        }
+        else
+        {
+            pipeline->line.buffer[pipeline->lineSize++] = (char)buffer[i++];
+        }
+    }
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_175: [ The pipelined connection shall be a TLS connection to the host name on port 443 created with the platform's default TLS IO, opened by _DoWork. The last "TrustedCerts" given to IoTHubTransportHttp_SetOption, before or after "Pipelining", shall be passed to it every time it is created. ]*/
+static void openPipeline(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline = handleData->pipeline;
+    TLSIO_CONFIG tlsio_config;
+    tlsio_config.hostname = STRING_c_str(handleData->hostName);
+    tlsio_config.port = PIPELINE_PORT;
+    if ((pipeline->xio = xio_create(platform_get_default_tlsio(), &tlsio_config, NULL)) == NULL)
+    {
+        LogError("unable to xio_create\r\n");
+        pipeline->state = PIPELINE_ERROR;
+    }
+    else if ((handleData->pipelineTrustedCerts != NULL) && (xio_setoption(pipeline->xio, "TrustedCerts", handleData->pipelineTrustedCerts) != 0))
+    {
+        LogError("unable to set TrustedCerts on the pipelined connection\r\n");
+        pipeline->state = PIPELINE_ERROR;
+    }
+    else
+    {
+        pipeline->state = PIPELINE_OPENING;
+        if (xio_open(pipeline->xio, onPipelineOpenComplete, onPipelineBytesReceived, onPipelineError, pipeline) != 0)
+        {
+            LogError("unable to xio_open\r\n");
+            pipeline->state = PIPELINE_ERROR;
+        }
+    }
+}
+
+static HTTPTRANSPORT_PIPELINE* createPipeline(void)
+{
+    HTTPTRANSPORT_PIPELINE* result = (HTTPTRANSPORT_PIPELINE*)malloc(sizeof(HTTPTRANSPORT_PIPELINE));
+    if (result == NULL)
+    {
+        LogError("unable to malloc\r\n");
+    }
+    else
+    {
+        result->state = PIPELINE_CLOSED;
+        result->xio = NULL;
+        result->nextOpenTime = 0;
+        DList_InitializeListHead(&(result->inFlight));
+        result->inFlightCount = 0;
+        DList_InitializeListHead(&(result->completed));
+        result->isProcessingResponses = false;
+        result->request.buffer = NULL;
+        result->request.capacity = 0;
+        result->requestSize = 0;
+        result->parserState = RESPONSE_STATUS_LINE;
+        result->line.buffer = NULL;
+        result->line.capacity = 0;
+        result->lineSize = 0;
+        result->body.buffer = NULL;
+        result->body.capacity = 0;
+        result->bodySize = 0;
+        result->remaining = 0;
+        result->statusCode = 0;
+        result->hasContentLength = false;
+        result->isChunked = false;
+        result->isConnectionClose = false;
+    }
+    return result;
+}
+
+static int appendToPipelinedRequest(HTTPTRANSPORT_PIPELINE* pipeline, const char* data, size_t size)
+{
+    int result;
+    if (reserveScratch(&(pipeline->request), pipeline->requestSize + size) != 0)
+    {
+        result = __LINE__;
+    }
+    else
+    {
+        (void)memcpy(pipeline->request.buffer + pipeline->requestSize, data, size);
+        pipeline->requestSize += size;
+        result = 0;
+    }
+    return result;
+}
+
+static int appendPipelinedRequestHeader(HTTPTRANSPORT_PIPELINE* pipeline, const char* namePrefix, const char* name, const char* value)
+{
+    return (
+        (appendToPipelinedRequest(pipeline, namePrefix, strlen(namePrefix)) == 0) &&
+        (appendToPipelinedRequest(pipeline, name, strlen(name)) == 0) &&
+        (appendToPipelinedRequest(pipeline, ": ", 2) == 0) &&
+        (appendToPipelinedRequest(pipeline, value, strlen(value)) == 0) &&
+        (appendToPipelinedRequest(pipeline, "\r\n", 2) == 0)
+        ) ? 0 : __LINE__;
+}
+
+/*Codes_SRS_TRANSPORTMULTITHTTP_17_176: [ Requests shall be written as HTTP/1.1 requests with the "Host" header, an "Authorization" header with the device's token from the SAS token cache, the headers the non pipelined request would have and a "Content-Length" header. ]*/
+static int beginPipelinedRequest(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, HTTPAPI_REQUEST_TYPE requestType, const char* relativePath, HTTP_HEADERS_HANDLE headers)
+{
+    int result;
+    HTTPTRANSPORT_PIPELINE* pipeline = handleData->pipeline;
+    const char* method = (requestType == HTTPAPI_REQUEST_GET) ? "GET " : ((requestType == HTTPAPI_REQUEST_DELETE) ? "DELETE " : "POST ");
+    const char* sasToken = getCachedSasToken(handleData, deviceData);
+    size_t headersCount = 0;
+    pipeline->requestSize = 0;
+    if (sasToken == NULL)
+    {
+        result = __LINE__;
+    }
+    else if ((headers != NULL) && (HTTPHeaders_GetHeaderCount(headers, &headersCount) != HTTP_HEADERS_OK))
+    {
+        LogError("unable to HTTPHeaders_GetHeaderCount\r\n");
+        result = __LINE__;
+    }
+    else if (!(
+        (appendToPipelinedRequest(pipeline, method, strlen(method)) == 0) &&
+        (appendToPipelinedRequest(pipeline, relativePath, strlen(relativePath)) == 0) &&
+        (appendToPipelinedRequest(pipeline, " HTTP/1.1\r\n", 11) == 0) &&
+        (appendPipelinedRequestHeader(pipeline, "", "Host", STRING_c_str(handleData->hostName)) == 0) &&
+        (appendPipelinedRequestHeader(pipeline, "", "Authorization", sasToken) == 0)
+        ))
+    {
+        result = __LINE__;
+    }
+    else
+    {
+        size_t i;
+        result = 0;
+        for (i = 0; (i < headersCount) && (result == 0); i++)
+        {
+            char* header;
+            if (HTTPHeaders_GetHeader(headers, i, &header) != HTTP_HEADERS_OK)
+            {
+                LogError("unable to HTTPHeaders_GetHeader\r\n");
+                result = __LINE__;
+            }
+            else
+            {
+                /*the token and the content type are written by the caller*/
+                if ((strncmp(header, "Authorization:", 14) != 0) &&
+                    (strncmp(header, CONTENT_TYPE ":", sizeof(CONTENT_TYPE)) != 0) &&
+                    ((appendToPipelinedRequest(pipeline, header, strlen(header)) != 0) ||
+                    (appendToPipelinedRequest(pipeline, "\r\n", 2) != 0)))
+                {
+                    result = __LINE__;
                 }
+                free(header);
             }
         }
     }
+    return result;
 }
 
-#define ACTION_VALUES \
-    ABANDON, \
-    REJECT, \
-    ACCEPT
-DEFINE_ENUM(ACTION, ACTION_VALUES);
+/*finishes the request being built and sends it. The request is then waiting for its response*/
+static int sendPipelinedRequest(HTTPTRANSPORT_PIPELINE* pipeline, HTTPTRANSPORT_PIPELINED_REQUEST* request, const unsigned char* content, size_t contentSize)
+{
+    int result;
+    char contentLength[32];
+    (void)sprintf(contentLength, "%lu", (unsigned long)contentSize);
+    if (!(
+        (appendPipelinedRequestHeader(pipeline, "", "Content-Length", contentLength) == 0) &&
+        (appendToPipelinedRequest(pipeline, "\r\n", 2) == 0) &&
+        ((contentSize == 0) || (appendToPipelinedRequest(pipeline, (const char*)content, contentSize) == 0))
+        ))
+    {
+        result = __LINE__;
+    }
+    else if (xio_send(pipeline->xio, pipeline->request.buffer, pipeline->requestSize, onPipelineSendComplete, pipeline) != 0)
+    {
+        LogError("unable to xio_send\r\n");
+        pipeline->state = PIPELINE_ERROR;
+        result = __LINE__;
+    }
+    else
+    {
+        request->sendTime = get_time(NULL);
+        DList_InsertTailList(&(pipeline->inFlight), &(request->entry));
+        pipeline->inFlightCount++;
+        result = 0;
+    }
+    return result;
+}
 
-static void abandonOrAcceptMessage(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, const char* ETag, ACTION action)
+static HTTPTRANSPORT_PIPELINED_REQUEST* createPipelinedRequest(HTTPTRANSPORT_PERDEVICE_DATA* deviceData, PIPELINED_REQUEST_KIND kind)
 {
-    /*Codes_SRS_TRANSPORTMULTITHTTP_17_097: [_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest with the following parameters:
--requestType: POST
--relativePath: abandon relative path begin (as created by _Create) + value of ETag + "/abandon?api-version=2016-02-03" 
-- requestHttpHeadersHandle: an HTTP headers instance containing the following
-    Authorization: " "
-    If-Match: value of ETag
-- requestContent: NULL
-- statusCode: a pointer to unsigned int which might be examined for logging
-- responseHeadearsHandle: NULL
-- responseContent: NULL]*/
-    /*Codes_SRS_TRANSPORTMULTITHTTP_17_099: [_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest with the following parameters:
--requestType: DELETE
--relativePath: abandon relative path begin + value of ETag + "?api-version=2016-02-03" 
-- requestHttpHeadersHandle: an HTTP headers instance containing the following
-    Authorization: " "
-    If-Match: value of ETag
-- requestContent: NULL
-- statusCode: a pointer to unsigned int which might be used by logging
-- responseHeadearsHandle: NULL
-- responseContent: NULL]*/
-    /*Codes_SRS_TRANSPORTMULTITHTTP_17_101: [_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest with the following parameters:
--requestType: DELETE
--relativePath: abandon relative path begin + value of ETag +"?api-version=2016-02-03" + "&reject"
-- requestHttpHeadersHandle: an HTTP headers instance containing the following
-    Authorization: " "
-    If-Match: value of ETag
-- requestContent: NULL
-- statusCode: a pointer to unsigned int which might be used by logging
-- responseHeadearsHandle: NULL
-- responseContent: NULL]*/
-    
-    STRING_HANDLE fullAbandonRelativePath = STRING_clone(deviceData->abandonHTTPrelativePathBegin);
-    if (fullAbandonRelativePath == NULL)
+    HTTPTRANSPORT_PIPELINED_REQUEST* result = (HTTPTRANSPORT_PIPELINED_REQUEST*)malloc(sizeof(HTTPTRANSPORT_PIPELINED_REQUEST));
+    if (result == NULL)
     {
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-        LogError("unable to STRING_clone\r\n");
+        LogError("unable to malloc\r\n");
     }
     else
     {
-        STRING_HANDLE ETagUnquoted = STRING_construct_n(ETag + 1, strlen(ETag) - 2); /*skip first character which is '"' and the last one (which is also '"')*/
-        if (ETagUnquoted == NULL)
+        result->kind = kind;
+        result->deviceData = deviceData;
+        DList_InitializeListHead(&(result->events));
+        result->sendTime = (time_t)(-1);
+        result->statusCode = 0;
+        result->responseHeaders = NULL;
+        result->responseContent = NULL;
+        if ((kind == PIPELINED_POLL) &&
+            (((result->responseHeaders = HTTPHeaders_Alloc()) == NULL) || ((result->responseContent = BUFFER_new()) == NULL)))
         {
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-			/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-            LogError("unable to STRING_construct_n\r\n");
+            LogError("unable to allocate the response of a GET\r\n");
+            destroyPipelinedRequest(result);
+            result = NULL;
+        }
+    }
+    return result;
+}
+
+static int enqueuePipelinedDisposition(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, const char* ETag, const char* relativePathSuffix, HTTPAPI_REQUEST_TYPE requestType)
+{
+    int result;
+    HTTPTRANSPORT_PIPELINE* pipeline = handleData->pipeline;
+    HTTPTRANSPORT_PIPELINED_REQUEST* request;
+    size_t beginLength = STRING_length(deviceData->abandonHTTPrelativePathBegin);
+    size_t ETagUnquotedLength = strlen(ETag) - 2; /*skip first character which is '"' and the last one (which is also '"')*/
+    size_t suffixLength = strlen(relativePathSuffix);
+
+    if (pipeline->state != PIPELINE_OPEN)
+    {
+        LogError("the pipelined connection is not open, the message shall be delivered again by the service\r\n");
+        result = __LINE__;
+    }
+    else if (reserveScratch(&(deviceData->abandonHTTPrelativePath), beginLength + ETagUnquotedLength + suffixLength + 1) != 0)
+    {
+        result = __LINE__;
+    }
+    else if ((request = createPipelinedRequest(deviceData, PIPELINED_DISPOSITION)) == NULL)
+    {
+        result = __LINE__;
+    }
+    else
+    {
+        char* relativePath = deviceData->abandonHTTPrelativePath.buffer;
+        (void)memcpy(relativePath, STRING_c_str(deviceData->abandonHTTPrelativePathBegin), beginLength);
+        (void)memcpy(relativePath + beginLength, ETag + 1, ETagUnquotedLength);
+        (void)memcpy(relativePath + beginLength + ETagUnquotedLength, relativePathSuffix, suffixLength + 1);
+
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_188: [ Abandon, accept and reject requests shall only have the "Host", "Authorization", "User-Agent", "If-Match" and "Content-Length" headers. ]*/
+        if ((beginPipelinedRequest(handleData, deviceData, requestType, relativePath, NULL) != 0) ||
+            (appendPipelinedRequestHeader(pipeline, "", "User-Agent", CLIENT_DEVICE_TYPE_PREFIX CLIENT_DEVICE_BACKSLASH IOTHUB_SDK_VERSION) != 0) ||
+            (appendPipelinedRequestHeader(pipeline, "", "If-Match", ETag) != 0) ||
+            (sendPipelinedRequest(pipeline, request, NULL, 0) != 0))
+        {
+            LogError("unable to send the abandon/accept/reject request\r\n");
+            destroyPipelinedRequest(request);
+            result = __LINE__;
         }
         else
         {
-            if (!(
-                (STRING_concat_with_STRING(fullAbandonRelativePath, ETagUnquoted) == 0) &&
-                (STRING_concat(fullAbandonRelativePath, (action == ABANDON) ? "/abandon" API_VERSION : ((action == REJECT) ? API_VERSION "&reject" : API_VERSION)) == 0)
-                ))
-            {
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-				/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-                LogError("unable to STRING_concat\r\n");
-            }
-            else
+            result = 0;
+        }
+    }
+    return result;
+}
+
+static void enqueuePipelinedPoll(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, time_t timeNow)
+{
+    HTTPTRANSPORT_PIPELINED_REQUEST* request = createPipelinedRequest(deviceData, PIPELINED_POLL);
+    if (request == NULL)
+    {
+        /*it shall be retried by the next DoWork*/
+    }
+    else if ((beginPipelinedRequest(handleData, deviceData, HTTPAPI_REQUEST_GET, STRING_c_str(deviceData->messageHTTPrelativePath), deviceData->messageHTTPrequestHeaders) != 0) ||
+        (sendPipelinedRequest(handleData->pipeline, request, NULL, 0) != 0))
+    {
+        LogError("unable to send a GET on the pipelined connection\r\n");
+        destroyPipelinedRequest(request);
+    }
+    else
+    {
+        request->sendTime = timeNow;
+        deviceData->isPollPipelined = true;
+    }
+}
+
+/*writes the headers of a non batched event (as done by DoEvent) into the request being built. Returns non-zero if the message cannot be sent*/
+static int appendSingleEventHeaders(HTTPTRANSPORT_PIPELINE* pipeline, IOTHUB_MESSAGE_HANDLE messageHandle, size_t* messageSize)
+{
+    int result;
+    const char*const* keys;
+    const char*const* values;
+    size_t count;
+    if (Map_GetInternals(IoTHubMessage_Properties(messageHandle), &keys, &values, &count) != MAP_OK)
+    {
+        LogError("unable to Map_GetInternals\r\n");
+        result = __LINE__;
+    }
+    else
+    {
+        const char* msgId = IoTHubMessage_GetMessageId(messageHandle);
+        const char* corrId = IoTHubMessage_GetCorrelationId(messageHandle);
+        size_t i;
+        result = appendPipelinedRequestHeader(pipeline, "", CONTENT_TYPE, APPLICATION_OCTET_STREAM);
+        for (i = 0; (i < count) && (result == 0); i++)
+        {
+            *messageSize += (strlen(values[i]) + strlen(keys[i]) + MAXIMUM_PROPERTY_OVERHEAD);
+            result = appendPipelinedRequestHeader(pipeline, IOTHUB_APP_PREFIX, keys[i], values[i]);
+        }
+        if ((result == 0) && (msgId != NULL))
+        {
+            result = appendPipelinedRequestHeader(pipeline, "", IOTHUB_MESSAGE_ID, msgId);
+        }
+        if ((result == 0) && (corrId != NULL))
+        {
+            result = appendPipelinedRequestHeader(pipeline, "", IOTHUB_CORRELATION_ID, corrId);
+        }
+    }
+    return result;
+}
+
+static void enqueuePipelinedEvent(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline = handleData->pipeline;
+    HTTPTRANSPORT_PIPELINED_REQUEST* request = createPipelinedRequest(deviceData, PIPELINED_EVENT);
+    if (request == NULL)
+    {
+        /*it shall be retried by the next DoWork*/
+    }
+    else if (handleData->doBatchedTransfers)
+    {
+        STRING_HANDLE payload;
+        switch (makePayload(deviceData, &payload))
+        {
+        case MAKE_PAYLOAD_OK:
+        {
+            const unsigned char* content = (const unsigned char*)STRING_c_str(payload);
+            size_t contentSize = STRING_length(payload);
+            const char* contentEncoding = NULL;
+#ifdef USE_HTTP_COMPRESSION
+            if (deviceData->compression.isPayloadCompressed)
             {
-                HTTP_HEADERS_HANDLE abandonRequestHttpHeaders = HTTPHeaders_Alloc();
-                if (abandonRequestHttpHeaders == NULL)
+                size_t compressedSize = deviceData->transportHandle->compressor->stream.total_out;
+                if (compressedSize * 10 >= contentSize * 9)
                 {
-					/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-					/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-					/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-                    LogError("unable to HTTPHeaders_Alloc\r\n");
+                    deviceData->compression.batchesToSkip = COMPRESSION_PROBE_INTERVAL;
                 }
-                else
+
+                if ((compressedSize * 10 < contentSize * 9) || (deviceData->compression.payloadMessagesSize > MAXIMUM_MESSAGE_SIZE))
                 {
-                    if (!(
-                        (HTTPHeaders_AddHeaderNameValuePair(abandonRequestHttpHeaders, "User-Agent", CLIENT_DEVICE_TYPE_PREFIX CLIENT_DEVICE_BACKSLASH IOTHUB_SDK_VERSION) == HTTP_HEADERS_OK) &&
-                        (HTTPHeaders_AddHeaderNameValuePair(abandonRequestHttpHeaders, "Authorization", " ") == HTTP_HEADERS_OK) &&
-                        (HTTPHeaders_AddHeaderNameValuePair(abandonRequestHttpHeaders, "If-Match", ETag) == HTTP_HEADERS_OK)
-                        ))
-                    {
-						/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-						/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-						/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-                        LogError("unable to HTTPHeaders_AddHeaderNameValuePair\r\n");
-                    }
-                    else
-                    {
-                        unsigned int statusCode;
-                        if (HTTPAPIEX_SAS_ExecuteRequest(
-							deviceData->sasObject,
-                            handleData->httpApiExHandle,
-                            (action == ABANDON) ? HTTPAPI_REQUEST_POST : HTTPAPI_REQUEST_DELETE,                               /*-requestType: POST                                                                                                       */
-                            STRING_c_str(fullAbandonRelativePath),              /*-relativePath: abandon relative path begin (as created by _Create) + value of ETag + "/abandon?api-version=2016-02-03"   */
-                            abandonRequestHttpHeaders,                          /*- requestHttpHeadersHandle: an HTTP headers instance containing the following                                            */
-                            NULL,                                               /*- requestContent: NULL                                                                                                   */
-                            &statusCode,                                         /*- statusCode: a pointer to unsigned int which might be examined for logging                                              */
-                            NULL,                                               /*- responseHeadearsHandle: NULL                                                                                           */
-                            NULL                                                /*- responseContent: NULL]                                                                                                 */
-                            ) != HTTPAPIEX_OK)
-                        {
-							/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-							/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-							/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-                            LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
-                        }
-                        else
-                        {
-                            if (statusCode != 204)
-                            {
-								/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-								/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-								/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-                                LogError("unexpected status code returned %u (was expecting 204)\r\n", statusCode);
-                            }
-                            else
-                            {
-								/*Codes_SRS_TRANSPORTMULTITHTTP_17_098: [Abandoning the message is considered successful if the HTTPAPIEX_SAS_ExecuteRequest doesn't fail and the statusCode is 204.]*/
-								/*Codes_SRS_TRANSPORTMULTITHTTP_17_100: [Accepting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-								/*Codes_SRS_TRANSPORTMULTITHTTP_17_102: [Rejecting a message is successful when HTTPAPIEX_SAS_ExecuteRequest completes successfully and the status code is 204.] */
-                                /*all is fine*/
-                            }
-                        }
-                    }
-                    HTTPHeaders_Free(abandonRequestHttpHeaders);
+                    content = (const unsigned char*)deviceData->transportHandle->compressor->output.buffer;
+                    contentSize = compressedSize;
+                    contentEncoding = "gzip";
                 }
             }
-            STRING_delete(ETagUnquoted);
+#endif
+            if ((beginPipelinedRequest(handleData, deviceData, HTTPAPI_REQUEST_POST, STRING_c_str(deviceData->eventHTTPrelativePath), deviceData->eventHTTPrequestHeaders) != 0) ||
+                (appendPipelinedRequestHeader(pipeline, "", CONTENT_TYPE, APPLICATION_VND_MICROSOFT_IOTHUB_JSON) != 0) ||
+                ((contentEncoding != NULL) && (appendPipelinedRequestHeader(pipeline, "", "Content-Encoding", contentEncoding) != 0)) ||
+                (sendPipelinedRequest(pipeline, request, content, contentSize) != 0))
+            {
+                LogError("unable to send batched events on the pipelined connection\r\n");
+                reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
+                destroyPipelinedRequest(request);
+            }
+            else
+            {
+                moveListToTail(&(deviceData->eventConfirmations), &(request->events));
+                deviceData->pipelinedEvents++;
+            }
+            STRING_delete(payload);
+            break;
+        }
+        case MAKE_PAYLOAD_FIRST_ITEM_DOES_NOT_FIT:
+        {
+            IoTHubClient_LL_SendComplete(deviceData->iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
+            destroyPipelinedRequest(request);
+            break;
+        }
+        case MAKE_PAYLOAD_COMPRESSION_ERROR:
+        {
+            reversePutListBackIn(&(deviceData->eventConfirmations), deviceData->waitingToSend);
+            destroyPipelinedRequest(request);
+            break;
+        }
+        default:
+        {
+            /*MAKE_PAYLOAD_ERROR and MAKE_PAYLOAD_NO_ITEMS*/
+            destroyPipelinedRequest(request);
+            break;
+        }
+        }
+    }
+    else
+    {
+        IOTHUB_MESSAGE_LIST* message = containingRecord(deviceData->waitingToSend->Flink, IOTHUB_MESSAGE_LIST, entry);
+        const unsigned char* messageContent = NULL;
+        size_t messageContentSize = 0;
+        size_t messageSize;
+        IOTHUBMESSAGE_CONTENT_TYPE contentType = IoTHubMessage_GetContentType(message->messageHandle);
+        bool isContentAvailable;
+        if (contentType == IOTHUBMESSAGE_BYTEARRAY)
+        {
+            isContentAvailable = (IoTHubMessage_GetByteArray(message->messageHandle, &messageContent, &messageContentSize) == IOTHUB_MESSAGE_OK);
+        }
+        else if (contentType == IOTHUBMESSAGE_STRING)
+        {
+            messageContent = (const unsigned char*)IoTHubMessage_GetString(message->messageHandle);
+            messageContentSize = (messageContent == NULL) ? 0 : strlen((const char*)messageContent);
+            isContentAvailable = (messageContent != NULL);
+        }
+        else
+        {
+            isContentAvailable = false;
+        }
+
+        messageSize = messageContentSize + MAXIMUM_PAYLOAD_OVERHEAD;
+        if (!isContentAvailable)
+        {
+            LogError("unable to get the message content\r\n");
+            destroyPipelinedRequest(request);
+        }
+        else if ((beginPipelinedRequest(handleData, deviceData, HTTPAPI_REQUEST_POST, STRING_c_str(deviceData->eventHTTPrelativePath), deviceData->eventHTTPrequestHeaders) != 0) ||
+            (appendSingleEventHeaders(pipeline, message->messageHandle, &messageSize) != 0))
+        {
+            LogError("unable to build the event request\r\n");
+            destroyPipelinedRequest(request);
+        }
+        else if (messageSize > MAXIMUM_MESSAGE_SIZE)
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_072: [The message size shall be limited to 255KB -1 bytes.] */
+            PDLIST_ENTRY head = DList_RemoveHeadList(deviceData->waitingToSend);
+            DList_InsertTailList(&(deviceData->eventConfirmations), head);
+            IoTHubClient_LL_SendComplete(deviceData->iotHubClientHandle, &(deviceData->eventConfirmations), IOTHUB_BATCHSTATE_FAILED); /*takes care of emptying the list too*/
+            destroyPipelinedRequest(request);
+        }
+        else if (sendPipelinedRequest(pipeline, request, messageContent, messageContentSize) != 0)
+        {
+            LogError("unable to send an event on the pipelined connection\r\n");
+            destroyPipelinedRequest(request);
+        }
+        else
+        {
+            DList_InsertTailList(&(request->events), DList_RemoveHeadList(deviceData->waitingToSend));
+            deviceData->pipelinedEvents++;
         }
-        STRING_delete(fullAbandonRelativePath);
     }
 }
 
-static void DoMessages(HTTPTRANSPORT_HANDLE_DATA* handleData, HTTPTRANSPORT_PERDEVICE_DATA* deviceData, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+static void processPipelinedResponses(HTTPTRANSPORT_HANDLE_DATA* handleData)
 {
-    /*Codes_SRS_TRANSPORTMULTITHTTP_17_083: [ If device is not subscribed then _DoWork shall advance to the next action. ] */
-    if (deviceData->DoWork_PullMessage)
+    HTTPTRANSPORT_PIPELINE* pipeline = handleData->pipeline;
+    pipeline->isProcessingResponses = true;
+    while (!DList_IsListEmpty(&(pipeline->completed)))
     {
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_123: [After client creation, the first GET shall be allowed no matter what the value of GetMinimumPollingTime.] */
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_124: [If time is not available then all calls shall be treated as if they are the first one.] */
-        /*Codes_SRS_TRANSPORTMULTITHTTP_17_122: [A GET request that happens earlier than GetMinimumPollingTime shall be ignored.] */
-        time_t timeNow = get_time(NULL);
-        bool isPollingAllowed = deviceData->isFirstPoll || (timeNow == (time_t)(-1)) || (get_difftime(timeNow, deviceData->lastPollTime) > handleData->getMinimumPollingTime);
-        if (isPollingAllowed)
+        HTTPTRANSPORT_PIPELINED_REQUEST* request = containingRecord(DList_RemoveHeadList(&(pipeline->completed)), HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+        HTTPTRANSPORT_PERDEVICE_DATA* deviceData = request->deviceData;
+        if (deviceData == NULL)
         {
-        HTTP_HEADERS_HANDLE responseHTTPHeaders = HTTPHeaders_Alloc();
-        if (responseHTTPHeaders == NULL)
+            /*the device has been unregistered, nothing to do*/
+        }
+        else if (request->kind == PIPELINED_EVENT)
         {
-            /*Codes_SRS_TRANSPORTMULTITHTTP_17_085: [If the call to HTTPAPIEX_SAS_ExecuteRequest did not executed successfully or building any part of the prerequisites of the call fails, then _DoWork shall advance to the next action in this description.] */
-            LogError("unable to HTTPHeaders_Alloc\r\n");
+            deviceData->pipelinedEvents--;
+            if ((request->statusCode >= 200) && (request->statusCode < 300))
+            {
+                IoTHubClient_LL_SendComplete(deviceData->iotHubClientHandle, &(request->events), IOTHUB_BATCHSTATE_SUCCESS);
+            }
+            else
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_069: [if HTTPAPIEX_SAS_ExecuteRequest fails or the http status code >=300 then IoTHubTransportHttp_DoWork shall not do any other action (it is assumed at the next _DoWork it shall be retried).] */
+                LogError("unexpected HTTP status code (%u)\r\n", request->statusCode);
+                reversePutListBackIn(&(request->events), deviceData->waitingToSend);
+            }
         }
-        else
+        else if (request->kind == PIPELINED_POLL)
         {
-            BUFFER_HANDLE responseContent = BUFFER_new();
-            if (responseContent == NULL)
+            deviceData->isPollPipelined = false;
+            if (request->statusCode == 0)
             {
-                /*Codes_SRS_TRANSPORTMULTITHTTP_17_085: [If the call to HTTPAPIEX_SAS_ExecuteRequest did not executed successfully or building any part of the prerequisites of the call fails, then _DoWork shall advance to the next action in this description.] */
-                LogError("unable to BUFFER_new\r\n");
+                LogError("unable to receive the response of a GET\r\n");
             }
             else
             {
-                unsigned int statusCode;
-                /*Codes_SRS_TRANSPORTMULTITHTTP_17_084: [Otherwise, IoTHubTransportHttp_DoWork shall call HTTPAPIEX_SAS_ExecuteRequest passing the following parameters
-requestType: GET
-relativePath: the message HTTP relative path
-requestHttpHeadersHandle: message HTTP request headers created by _Create
-requestContent: NULL
-statusCode: a pointer to unsigned int which shall be later examined
-responseHeadearsHandle: a new instance of HTTP headers
-responseContent: a new instance of buffer] 
-*/
-                if (HTTPAPIEX_SAS_ExecuteRequest(
-					deviceData->sasObject,
-                    handleData->httpApiExHandle,     
-                    HTTPAPI_REQUEST_GET,                                            /*requestType: GET*/
-                    STRING_c_str(deviceData->messageHTTPrelativePath),         /*relativePath: the message HTTP relative path*/
-					deviceData->messageHTTPrequestHeaders,                     /*requestHttpHeadersHandle: message HTTP request headers created by _Create*/
-                    NULL,                                                           /*requestContent: NULL*/
-                    &statusCode,                                                    /*statusCode: a pointer to unsigned int which shall be later examined*/
-                    responseHTTPHeaders,                                            /*responseHeadearsHandle: a new instance of HTTP headers*/
-                    responseContent                                                 /*responseContent: a new instance of buffer*/
-                    ) 
-                    != HTTPAPIEX_OK)
+                if (request->sendTime == (time_t)(-1))
                 {
-                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_085: [If the call to HTTPAPIEX_SAS_ExecuteRequest did not executed successfully or building any part of the prerequisites of the call fails, then _DoWork shall advance to the next action in this description.] */
-                    LogError("unable to HTTPAPIEX_ExecuteRequest\r\n");
+                    deviceData->isFirstPoll = true;
                 }
                 else
-                { 
-                        /*HTTP dialogue was succesfull*/
-                        if (timeNow == (time_t)(-1))
-                        {
-							deviceData->isFirstPoll = true;
-                        }
-                        else
-                        {
-							deviceData->isFirstPoll = false;
-							deviceData->lastPollTime = timeNow;
-                        }
-                    if (statusCode == 204)
-                    {
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_086: [If the HTTPAPIEX_SAS_ExecuteRequest executed successfully then status code shall be examined. Any status code different than 200 causes _DoWork to advance to the next action.] */
-                        /*this is an expected status code, means "no commands", but logging that creates panic*/
+                {
+                    deviceData->isFirstPoll = false;
+                    deviceData->lastPollTime = request->sendTime;
+                }
+                processMessageResponse(handleData, deviceData, deviceData->iotHubClientHandle, request->statusCode, request->responseHeaders, request->responseContent);
+            }
+        }
+        else
+        {
+            if (request->statusCode != 204)
+            {
+                LogError("unexpected status code returned %u (was expecting 204)\r\n", request->statusCode);
+            }
+        }
+        destroyPipelinedRequest(request);
+    }
+    pipeline->isProcessingResponses = false;
+}
 
-                        /*do nothing, advance to next action*/
-                    }
-                    else if (statusCode != 200)
-                    {
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_086: [If the HTTPAPIEX_SAS_ExecuteRequest executed successfully then status code shall be examined. Any status code different than 200 causes _DoWork to advance to the next action.] */
-                        LogError("expected status code was 200, but actually was received %u... moving on\r\n", statusCode);
-                    }
-                    else
-                    {
-                        /*Codes_SRS_TRANSPORTMULTITHTTP_17_087: [If status code is 200, then _DoWork shall make a copy of the value of the "ETag" http header.]*/
-                        const char* etagValue = HTTPHeaders_FindHeaderValue(responseHTTPHeaders, "ETag");
-                        if (etagValue == NULL)
-                        {
-                            LogError("unable to find a received header called \"E-Tag\"\r\n");
-                        }
-                        else
-                        {
-                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_088: [If no such header is found or is invalid, then _DoWork shall advance to the next action.]*/
-                            size_t etagsize = strlen(etagValue);
-                            if (
-                                (etagsize < 2) ||
-                                (etagValue[0] != '"') ||
-                                (etagValue[etagsize - 1] != '"')
-                                )
-                            {
-                                LogError("ETag is not a valid quoted string\r\n");
-                            }
-                            else
-                            {
-                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_089: [_DoWork shall assemble an IOTHUBMESSAGE_HANDLE from the received HTTP content (using the responseContent buffer).] */
-                                IOTHUB_MESSAGE_HANDLE receivedMessage = IoTHubMessage_CreateFromByteArray(BUFFER_u_char(responseContent), BUFFER_length(responseContent));
-                                if (receivedMessage == NULL)
-                                {
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_092: [If assembling the message fails in any way, then _DoWork shall "abandon" the message.]*/
-                                    LogError("unable to IoTHubMessage_CreateFromByteArray, trying to abandon the message... \r\n");
-                                    abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
-                                }
-                                else
-                                {
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_090: [All the HTTP headers of the form iothub-app-name:somecontent shall be transformed in message properties {name, somecontent}.]*/
-                                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_091: [The HTTP header of iothub-messageid shall be set in the MessageId.]*/
-                                    size_t nHeaders;
-                                    if (HTTPHeaders_GetHeaderCount(responseHTTPHeaders, &nHeaders) != HTTP_HEADERS_OK)
-                                    {
-                                        LogError("unable to get the count of HTTP headers\r\n");
-                                        abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
-                                    }
-                                    else
-                                    {
-                                        size_t i;
-                                        MAP_HANDLE properties = (nHeaders > 0) ? IoTHubMessage_Properties(receivedMessage) : NULL;
-                                        for (i = 0; i < nHeaders; i++)
-                                        {
-                                            char* completeHeader;
-                                            if (HTTPHeaders_GetHeader(responseHTTPHeaders, i, &completeHeader) != HTTP_HEADERS_OK)
-                                            {
-                                                break;
-                                            }
-                                            else
-                                            {
-                                                if (strncmp(IOTHUB_APP_PREFIX, completeHeader, strlen(IOTHUB_APP_PREFIX)) == 0)
-                                                {
-                                                    /*looks like a property headers*/
-                                                    /*there's a guaranteed ':' in the completeHeader, by HTTP_HEADERS module*/
-                                                    char* whereIsColon = strchr(completeHeader, ':');
-                                                    if (whereIsColon != NULL)
-                                                    {
-                                                        *whereIsColon = '\0'; /*cut it down*/
-                                                        if (Map_AddOrUpdate(properties, completeHeader + strlen(IOTHUB_APP_PREFIX), whereIsColon + 2) != MAP_OK) /*whereIsColon+1 is a space because HTTPEHADERS outputs a ": " between name and value*/
-                                                        {
-                                                            free(completeHeader);
-                                                            break;
-                                                        }
-                                                    }
-                                                }
-                                                else if (strncmp(IOTHUB_MESSAGE_ID, completeHeader, strlen(IOTHUB_MESSAGE_ID)) == 0)
-                                                {
-                                                    char* whereIsColon = strchr(completeHeader, ':');
-                                                    if (whereIsColon != NULL)
-                                                    {
-                                                        *whereIsColon = '\0'; /*cut it down*/
-                                                        if (IoTHubMessage_SetMessageId(receivedMessage, whereIsColon + 2) != IOTHUB_MESSAGE_OK)
-                                                        {
-                                                            free(completeHeader);
-                                                            break;
-                                                        }
-                                                    }
-                                                }
-                                                else if (strncmp(IOTHUB_CORRELATION_ID, completeHeader, strlen(IOTHUB_CORRELATION_ID)) == 0)
-                                                {
-                                                    char* whereIsColon = strchr(completeHeader, ':');
-                                                    if (whereIsColon != NULL)
-                                                    {
-                                                        *whereIsColon = '\0'; /*cut it down*/
-                                                        if (IoTHubMessage_SetCorrelationId(receivedMessage, whereIsColon + 2) != IOTHUB_MESSAGE_OK)
-                                                        {
-                                                            free(completeHeader);
-                                                            break;
-                                                        }
-                                                    }
-                                                }
-                                                free(completeHeader);
-                                            }
-                                        }
+static void DoWorkPipelined(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    HTTPTRANSPORT_PIPELINE* pipeline;
+    time_t timeNow = get_time(NULL);
 
-                                        if (i < nHeaders)
-                                        {
-                                            abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
-                                        }
-                                        else
-                                        {
-                                            /*Codes_SRS_TRANSPORTMULTITHTTP_17_093: [Otherwise, _DoWork shall call IoTHubClient_LL_MessageCallback with parameters handle = iotHubClientHandle and message = newly created message.]*/
-                                            IOTHUBMESSAGE_DISPOSITION_RESULT messageResult = IoTHubClient_LL_MessageCallback(iotHubClientHandle, receivedMessage);
-                                            if (messageResult == IOTHUBMESSAGE_ACCEPTED)
-                                            {
-                                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_094: [If IoTHubClient_LL_MessageCallback returns IOTHUBMESSAGE_ACCEPTED then _DoWork shall "accept" the message.]*/
-                                                abandonOrAcceptMessage(handleData, deviceData, etagValue, ACCEPT);
-                                            }
-                                            else if (messageResult == IOTHUBMESSAGE_REJECTED)
-                                            {
-                                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_095: [If IoTHubClient_LL_MessageCallback returns IOTHUBMESSAGE_REJECTED then _DoWork shall "reject" the message.]*/
-                                                abandonOrAcceptMessage(handleData, deviceData, etagValue, REJECT);
-                                            }
-                                            else
-                                            {
-                                                /*Codes_SRS_TRANSPORTMULTITHTTP_17_096: [If IoTHubClient_LL_MessageCallback returns IOTHUBMESSAGE_ABANDONED then _DoWork shall "abandon" the message.] */
-                                                abandonOrAcceptMessage(handleData, deviceData, etagValue, ABANDON);
-                                            }
-                                        }
-                                    }
-                                    IoTHubMessage_Destroy(receivedMessage);
-                                }
-                            }
-                            
-                        }
-                    }
+    if ((handleData->pipeline == NULL) && ((handleData->pipeline = createPipeline()) == NULL))
+    {
+        /*not much to do but to use the connection of HTTPAPIEX*/
+        DoWorkAllDevices(handleData);
+    }
+    else
+    {
+        pipeline = handleData->pipeline;
+        if ((pipeline->state == PIPELINE_CLOSED) &&
+            ((timeNow == (time_t)(-1)) || (get_difftime(timeNow, pipeline->nextOpenTime) >= 0)))
+        {
+            openPipeline(handleData);
+        }
+
+        if (pipeline->xio != NULL)
+        {
+            xio_dowork(pipeline->xio);
+        }
+
+        if ((pipeline->state == PIPELINE_OPEN) && !DList_IsListEmpty(&(pipeline->inFlight)) && (timeNow != (time_t)(-1)))
+        {
+            HTTPTRANSPORT_PIPELINED_REQUEST* oldest = containingRecord(pipeline->inFlight.Flink, HTTPTRANSPORT_PIPELINED_REQUEST, entry);
+            if ((oldest->sendTime != (time_t)(-1)) && (get_difftime(timeNow, oldest->sendTime) > PIPELINE_RESPONSE_TIMEOUT))
+            {
+                LogError("no response on the pipelined connection for %d seconds\r\n", PIPELINE_RESPONSE_TIMEOUT);
+                pipeline->state = PIPELINE_ERROR;
+            }
+        }
+
+        processPipelinedResponses(handleData);
+
+        if (pipeline->state == PIPELINE_ERROR)
+        {
+            resetPipeline(pipeline);
+            pipeline->nextOpenTime = (timeNow == (time_t)(-1)) ? 0 : timeNow + PIPELINE_RECONNECT_DELAY;
+        }
+        else if ((pipeline->state == PIPELINE_OPEN) && pipeline->isConnectionClose)
+        {
+            /*the response being received ends the connection, the requests sent now would be lost*/
+        }
+        else if (pipeline->state == PIPELINE_OPEN)
+        {
+            /*Codes_SRS_TRANSPORTMULTITHTTP_17_181: [ At most "PipelineDepth" requests shall wait for their response. A device shall have at most one event request and one GET waiting for their response, and devices shall be visited starting with a different device at every _DoWork. ]*/
+            size_t deviceCount = VECTOR_size(handleData->perDeviceList);
+            size_t i;
+            for (i = 0; (i < deviceCount) && (pipeline->inFlightCount < handleData->pipelineDepth) && (pipeline->state == PIPELINE_OPEN); i++)
+            {
+                size_t index = (handleData->nextEventDevice + i) % deviceCount;
+                HTTPTRANSPORT_PERDEVICE_DATA* deviceData = *(HTTPTRANSPORT_PERDEVICE_DATA**)VECTOR_element(handleData->perDeviceList, index);
+
+                if ((deviceData->pipelinedEvents == 0) && !DList_IsListEmpty(deviceData->waitingToSend))
+                {
+                    enqueuePipelinedEvent(handleData, deviceData);
+                }
+
+                if (deviceData->DoWork_PullMessage && !deviceData->isPollPipelined &&
+                    (pipeline->inFlightCount < handleData->pipelineDepth) && (pipeline->state == PIPELINE_OPEN) &&
+                    (deviceData->isFirstPoll || (timeNow == (time_t)(-1)) || (get_difftime(timeNow, deviceData->lastPollTime) > handleData->getMinimumPollingTime)))
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_122: [A GET request that happens earlier than GetMinimumPollingTime shall be ignored.] */
+                    enqueuePipelinedPoll(handleData, deviceData, timeNow);
                 }
-                BUFFER_delete(responseContent);
             }
-            HTTPHeaders_Free(responseHTTPHeaders);
+            handleData->nextEventDevice = (deviceCount == 0) ? 0 : (handleData->nextEventDevice + 1) % deviceCount;
+
+            /*pushes the requests out*/
+            xio_dowork(pipeline->xio);
         }
-    }
         else
         {
-            /*isPollingAllowed is false... */
-            /*do nothing "shall be ignored*/
+            /*opening*/
+        }
+    }
 }
+
+static void reportConnectionReady(HTTPTRANSPORT_HANDLE_DATA* handleData)
+{
+    size_t deviceCount = VECTOR_size(handleData->perDeviceList);
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_190: [ Without "Pipelining", the connection shall be open once an HTTPAPIEX request of a device has been answered, that is HTTPAPIEX returned HTTPAPIEX_OK whatever the status code. No request shall be sent only to open the connection. ]*/
+    /*HTTPAPIEX opens its connection with the first request, a subscribed device makes that request with its first poll*/
+    bool isReady = handleData->usePipelining ?
+        ((handleData->pipeline != NULL) && (handleData->pipeline->state == PIPELINE_OPEN)) :
+        ((deviceCount > 0) && handleData->isConnectionOpen);
+    size_t i;
+    for (i = 0; i < deviceCount; i++)
+    {
+        HTTPTRANSPORT_PERDEVICE_DATA* deviceData = *(HTTPTRANSPORT_PERDEVICE_DATA**)VECTOR_element(handleData->perDeviceList, i);
+        if (!isReady)
+        {
+            deviceData->isConnectionReadyReported = false;
+        }
+        else if (!deviceData->isConnectionReadyReported)
+        {
+            deviceData->isConnectionReadyReported = true;
+            IoTHubClient_LL_ConnectionReady(deviceData->iotHubClientHandle);
+        }
     }
 }
 
@@ -1883,18 +4380,24 @@ void IoTHubTransportHttp_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT_LL_HAN
     if (handle != NULL)
     {
 		HTTPTRANSPORT_HANDLE_DATA* handleData = (HTTPTRANSPORT_HANDLE_DATA*)handle;
-		IOTHUB_DEVICE_HANDLE* listItem;
-		size_t deviceListSize = VECTOR_size(handleData->perDeviceList);
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_052: [ IoTHubTransportHttp_DoWork shall perform a round-robin loop through every deviceHandle in the transport device list, using the iotHubClientHandle field saved in the IOTHUB_DEVICE_HANDLE. ]*/
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_050: [ IoTHubTransportHttp_DoWork shall call loop through the device list. ] */
-		/*Codes_SRS_TRANSPORTMULTITHTTP_17_051: [ IF the list is empty, then IoTHubTransportHttp_DoWork shall do nothing. ]*/
-		for (size_t i = 0; i < deviceListSize; i++)
+		if (handleData->usePipelining)
 		{
-			listItem = VECTOR_element(handleData->perDeviceList, i);
-			HTTPTRANSPORT_PERDEVICE_DATA* perDeviceItem = *(HTTPTRANSPORT_PERDEVICE_DATA**)(listItem);
-			DoEvent(handleData, perDeviceItem, perDeviceItem->iotHubClientHandle);
-			DoMessages(handleData, perDeviceItem, perDeviceItem->iotHubClientHandle);
+			/*Codes_SRS_TRANSPORTMULTITHTTP_17_172: ["Pipelining"] */
+			DoWorkPipelined(handleData);
+		}
+		else if (handleData->useReadySetScheduling)
+		{
+			DoWorkReadySet(handleData);
+		}
+		else
+		{
+			DoWorkAllDevices(handleData);
+		}
 
+		/*Codes_SRS_TRANSPORTMULTITHTTP_17_183: [ If "eagerConnect" is true, IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_ConnectionReady once for every registered device when the transport can carry its requests: without "Pipelining" when an HTTPAPIEX request has been answered (and again after a request failed and another one was answered), with "Pipelining" when the pipelined connection is open (and again after it is reopened). ]*/
+		if (handleData->eagerConnect)
+		{
+			reportConnectionReady(handleData);
 		}
     }
 	else
@@ -1903,6 +4406,21 @@ void IoTHubTransportHttp_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT_LL_HAN
     }
 }
 
+void IoTHubTransportHttp_EventQueued(IOTHUB_DEVICE_HANDLE handle)
+{
+    /*Codes_SRS_TRANSPORTMULTITHTTP_17_184: [ If handle is NULL, then IoTHubTransportHttp_EventQueued shall do nothing. ]*/
+    if (handle != NULL)
+    {
+        HTTPTRANSPORT_PERDEVICE_DATA* deviceData = (HTTPTRANSPORT_PERDEVICE_DATA*)handle;
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_185: [ IoTHubTransportHttp_EventQueued shall add the device at the end of the list of devices with pending events if it is not already in it. ]*/
+        if (!deviceData->isActive)
+        {
+            DList_InsertTailList(&(deviceData->transportHandle->activeDevices), &(deviceData->activeEntry));
+            deviceData->isActive = true;
+        }
+    }
+}
+
 IOTHUB_CLIENT_RESULT IoTHubTransportHttp_GetSendStatus(IOTHUB_DEVICE_HANDLE handle, IOTHUB_CLIENT_STATUS *iotHubClientStatus)
 {
     IOTHUB_CLIENT_RESULT result;
@@ -1932,7 +4450,7 @@ IOTHUB_CLIENT_RESULT IoTHubTransportHttp_GetSendStatus(IOTHUB_DEVICE_HANDLE hand
 		{
 			HTTPTRANSPORT_PERDEVICE_DATA* deviceData = (HTTPTRANSPORT_PERDEVICE_DATA*)(*listItem);
 			/* Codes_SRS_TRANSPORTMULTITHTTP_17_113: [ IoTHubTransportHttp_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_BUSY if there are currently event items to be sent or being sent. ] */
-			if (!DList_IsListEmpty(deviceData->waitingToSend))
+			if (!DList_IsListEmpty(deviceData->waitingToSend) || (deviceData->pipelinedEvents > 0))
         {
             *iotHubClientStatus = IOTHUB_CLIENT_SEND_STATUS_BUSY;
         }
@@ -1977,6 +4495,126 @@ IOTHUB_CLIENT_RESULT IoTHubTransportHttp_SetOption(TRANSPORT_LL_HANDLE handle, c
         else if (strcmp("MinimumPollingTime", option) == 0)
         {
             handleData->getMinimumPollingTime = *(unsigned int*)value;
+            handleData->isPollHeapDirty = true;
+            result = IOTHUB_CLIENT_OK;
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_152: ["ReadySetScheduling"] */
+        else if (strcmp("ReadySetScheduling", option) == 0)
+        {
+            handleData->useReadySetScheduling = *(bool*)value;
+            handleData->isPollHeapDirty = true;
+            result = IOTHUB_CLIENT_OK;
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_153: ["SchedulingQuantum"] */
+        else if (strcmp("SchedulingQuantum", option) == 0)
+        {
+            unsigned int quantum = *(unsigned int*)value;
+            if (quantum == 0)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_154: [ If "SchedulingQuantum" is 0 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]*/
+                LogError("invalid SchedulingQuantum (0)\r\n");
+                result = IOTHUB_CLIENT_INVALID_ARG;
+            }
+            else
+            {
+                handleData->schedulingQuantum = quantum;
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_144: ["SasTokenCache"] */
+        else if (strcmp("SasTokenCache", option) == 0)
+        {
+            handleData->useSasTokenCache = *(bool*)value;
+            result = IOTHUB_CLIENT_OK;
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_145: ["SasTokenLifetime"] */
+        else if (strcmp("SasTokenLifetime", option) == 0)
+        {
+            unsigned int lifetime = *(unsigned int*)value;
+            if (lifetime == 0)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_146: [ If "SasTokenLifetime" is 0 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]*/
+                LogError("invalid SasTokenLifetime (0)\r\n");
+                result = IOTHUB_CLIENT_INVALID_ARG;
+            }
+            else
+            {
+                handleData->sasTokenLifetime = lifetime;
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_158: ["ReuseRequestResources"] */
+        else if (strcmp("ReuseRequestResources", option) == 0)
+        {
+            handleData->reuseRequestResources = *(bool*)value;
+            result = IOTHUB_CLIENT_OK;
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_163: ["BatchCompression"] */
+        else if (strcmp("BatchCompression", option) == 0)
+        {
+            bool useBatchCompression = *(bool*)value;
+#ifndef USE_HTTP_COMPRESSION
+            if (useBatchCompression)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_164: [ If the transport has not been built with USE_HTTP_COMPRESSION then setting "BatchCompression" to true shall fail and return IOTHUB_CLIENT_ERROR. ]*/
+                LogError("BatchCompression is not available in this build\r\n");
+                result = IOTHUB_CLIENT_ERROR;
+            }
+            else
+#endif
+            {
+                handleData->useBatchCompression = useBatchCompression;
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_165: ["CompressionLevel"] */
+        else if (strcmp("CompressionLevel", option) == 0)
+        {
+            int level = *(int*)value;
+            if ((level < 1) || (level > 9))
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_166: [ If "CompressionLevel" is not between 1 and 9 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]*/
+                LogError("invalid CompressionLevel (%d)\r\n", level);
+                result = IOTHUB_CLIENT_INVALID_ARG;
+            }
+            else
+            {
+                handleData->compressionLevel = level;
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_172: ["Pipelining"] */
+        else if (strcmp("Pipelining", option) == 0)
+        {
+            handleData->usePipelining = *(bool*)value;
+            result = IOTHUB_CLIENT_OK;
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_173: ["PipelineDepth"] */
+        else if (strcmp("PipelineDepth", option) == 0)
+        {
+            unsigned int depth = *(unsigned int*)value;
+            if (depth == 0)
+            {
+                /*Codes_SRS_TRANSPORTMULTITHTTP_17_174: [ If "PipelineDepth" is 0 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]*/
+                LogError("invalid PipelineDepth (0)\r\n");
+                result = IOTHUB_CLIENT_INVALID_ARG;
+            }
+            else
+            {
+                handleData->pipelineDepth = depth;
+                result = IOTHUB_CLIENT_OK;
+            }
+        }
+        /*Codes_SRS_TRANSPORTMULTITHTTP_17_182: ["eagerConnect"] */
+        else if (strcmp("eagerConnect", option) == 0)
+        {
+            size_t deviceCount = VECTOR_size(handleData->perDeviceList);
+            size_t i;
+            handleData->eagerConnect = *(bool*)value;
+            for (i = 0; i < deviceCount; i++)
+            {
+                (*(HTTPTRANSPORT_PERDEVICE_DATA**)VECTOR_element(handleData->perDeviceList, i))->isConnectionReadyReported = false;
+            }
             result = IOTHUB_CLIENT_OK;
         }
         else
@@ -1990,6 +4628,30 @@ IOTHUB_CLIENT_RESULT IoTHubTransportHttp_SetOption(TRANSPORT_LL_HANDLE handle, c
             if (HTTPAPIEX_result == HTTPAPIEX_OK)
             {
                 result = IOTHUB_CLIENT_OK;
+                if (strcmp("TrustedCerts", option) == 0)
+                {
+                    /*Codes_SRS_TRANSPORTMULTITHTTP_17_175: [ The pipelined connection shall be a TLS connection to the host name on port 443 created with the platform's default TLS IO, opened by _DoWork. The last "TrustedCerts" given to IoTHubTransportHttp_SetOption, before or after "Pipelining", shall be passed to it every time it is created. ]*/
+                    char* trustedCerts = NULL;
+                    if ((value != NULL) && (mallocAndStrcpy_s(&trustedCerts, (const char*)value) != 0))
+                    {
+                        LogError("unable to mallocAndStrcpy_s\r\n");
+                        result = IOTHUB_CLIENT_ERROR;
+                    }
+                    else
+                    {
+                        if (handleData->pipelineTrustedCerts != NULL)
+                        {
+                            free(handleData->pipelineTrustedCerts);
+                        }
+                        handleData->pipelineTrustedCerts = trustedCerts;
+                        if ((trustedCerts != NULL) && (handleData->pipeline != NULL) && (handleData->pipeline->xio != NULL) &&
+                            (xio_setoption(handleData->pipeline->xio, "TrustedCerts", trustedCerts) != 0))
+                        {
+                            LogError("unable to set TrustedCerts on the pipelined connection\r\n");
+                            result = IOTHUB_CLIENT_ERROR;
+                        }
+                    }
+                }
             }
             else if (HTTPAPIEX_result == HTTPAPIEX_INVALID_ARG)
             {
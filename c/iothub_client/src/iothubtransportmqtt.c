@@ -21,12 +21,13 @@
 
 #include "azure_c_shared_utility/tlsio.h"
 #include "azure_c_shared_utility/platform.h"
+#include "coalescingio.h"
 
-#include "azure_c_shared_utility/string_tokenizer.h"
 #include "iothub_client_version.h"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #define SAS_TOKEN_DEFAULT_LIFETIME  3600
 #define EPOCH_TIME_T_VALUE          0
@@ -36,31 +37,112 @@
 #define BUILD_CONFIG_USERNAME       24
 #define EVENT_TOPIC_DEFAULT_LEN     27
 #define SAS_TOKEN_DEFAULT_LEN       10
-#define RESEND_TIMEOUT_VALUE_MIN    1*60
+#define INITIAL_RETRANSMIT_TIMEOUT_MS   60*1000 // used until the first PUBACK round trip is measured
+#define MIN_RETRANSMIT_TIMEOUT_MS       1000
+#define MAX_RETRANSMIT_TIMEOUT_MS       2*60*1000
 #define MAX_SEND_RECOUNT_LIMIT      2
+#define MESSAGE_GIVE_UP_TIMEOUT_MS  2*60*1000 // a message is not failed sooner than this after its first publish, whatever the retransmit timeout
+#define TOKEN_BUCKET_MAX_REFILL_MS  1000 // the pacing buckets hold at most one second worth of credit
+#define TOPIC_BUFFER_INITIAL_SIZE   128
+#define INFLIGHT_BUCKET_COUNT       256 // power of 2, indexed by the low bits of the packet id
+#define CORK_SIZE_OPTION            "publish_cork_size"
+#define DEVICE_HOST_IDLE_POLL_OPTION    "device_host_idle_poll_ms"
+#define DEFAULT_DEVICE_HOST_IDLE_POLL_MS    100
+
+#ifdef USE_MQTT_STATIC_POOLS
+/* Build limits for the fixed pools (cmake options mqtt_max_inflight_messages and mqtt_max_topic_length). */
+#ifndef MQTT_MAX_INFLIGHT_MESSAGES
+#define MQTT_MAX_INFLIGHT_MESSAGES  16
+#endif
+#ifndef MQTT_MAX_TOPIC_LENGTH
+#define MQTT_MAX_TOPIC_LENGTH       512
+#endif
+// one waiting acknowledge entry followed by its encoded topic, rounded up so every slot stays aligned
+#define MESSAGE_DETAILS_SLOT_SIZE   ((sizeof(MQTT_MESSAGE_DETAILS_LIST) + MQTT_MAX_TOPIC_LENGTH + 1 + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t))
+#endif
 
 static const char* DEVICE_MSG_TOPIC = "devices/%s/messages/devicebound/#";
 static const char* DEVICE_DEVICE_TOPIC = "devices/%s/messages/events/";
 static const char* PROPERTY_SEPARATOR = "&";
 
+static const char* DEVICE_MSG_PROPERTY_MARKER = "/messages/devicebound/";
+
+typedef enum SYSTEM_PROPERTY_TYPE_TAG
+{
+    SYSTEM_PROPERTY_NONE,
+    SYSTEM_PROPERTY_MESSAGE_ID,
+    SYSTEM_PROPERTY_CORRELATION_ID,
+    SYSTEM_PROPERTY_IGNORED
+} SYSTEM_PROPERTY_TYPE;
+
 typedef struct SYSTEM_PROPERTY_INFO_TAG
 {
     const char* propName;
-    size_t propLength;
+    SYSTEM_PROPERTY_TYPE propType;
 } SYSTEM_PROPERTY_INFO;
 
-static SYSTEM_PROPERTY_INFO sysPropList[] = {
-    { "%24.exp", 7 },
-    { "%24.mid", 7 },
-    { "%24.uid", 7 },
-    { "%24.to", 6 },
-    { "%24.cid", 7 },
-    { "devices/", 8 },
-    { "iothub-operation", 16 },
-    { "iothub-ack", 10 }
+// Perfect hash over the decoded system property names, all of which are at least 4 characters long.
+// Every name lands in its own slot, so a lookup is one hash and one strcmp.
+#define SYSTEM_PROPERTY_HASH(name, length)  ((((unsigned char)(name)[2]) + (length)) & 31)
+
+static const SYSTEM_PROPERTY_INFO sysPropTable[32] = {
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { "iothub-operation", SYSTEM_PROPERTY_IGNORED },    // 4
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { "$.cid", SYSTEM_PROPERTY_CORRELATION_ID },        // 8
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { "$.exp", SYSTEM_PROPERTY_IGNORED },               // 10
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { "$.mid", SYSTEM_PROPERTY_MESSAGE_ID },            // 18
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { "$.to", SYSTEM_PROPERTY_IGNORED },                // 24
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { "$.uid", SYSTEM_PROPERTY_IGNORED },               // 26
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { NULL, SYSTEM_PROPERTY_NONE },
+    { "iothub-ack", SYSTEM_PROPERTY_IGNORED },          // 30
+    { NULL, SYSTEM_PROPERTY_NONE }
 };
 
-TICK_COUNTER_HANDLE g_msgTickCounter;
+// Options a device host keeps and sets on every device registered after them, with the size of their value (0 for a string).
+typedef struct HOST_OPTION_TAG
+{
+    const char* name;
+    size_t valueSize;
+} HOST_OPTION;
+
+static const HOST_OPTION hostOptions[] =
+{
+    { "logtrace", sizeof(bool) },
+    { "keepalive", sizeof(int) },
+    { "eagerConnect", sizeof(bool) },
+    { "telemetry_qos", sizeof(int) },
+    { "max_inflight_messages", sizeof(size_t) },
+    { "max_inflight_bytes", sizeof(size_t) },
+    { "messages_per_second", sizeof(size_t) },
+    { "bytes_per_second", sizeof(size_t) },
+    { CORK_SIZE_OPTION, sizeof(size_t) },
+    { "TrustedCerts", 0 },
+    { "x509certificate", 0 },
+    { "x509privatekey", 0 }
+};
+#define HOST_OPTION_COUNT   (sizeof(hostOptions) / sizeof(hostOptions[0]))
 
 typedef struct MQTTTRANSPORT_HANDLE_DATA_TAG
 {
@@ -83,23 +165,79 @@ typedef struct MQTTTRANSPORT_HANDLE_DATA_TAG
     bool isRegistered;
     bool connected;
     bool subscribed;
+    bool isSubscribeAcked; // the broker keeps an acknowledged subscription in the session
     bool receiveMessages;
     bool destroyCalled;
     DLIST_ENTRY waitingForAck;
+    // Messages in waitingForAck, hashed by packet id so PUBACKs don't scan the whole list.
+    struct MQTT_MESSAGE_DETAILS_LIST_TAG* inflightBuckets[INFLIGHT_BUCKET_COUNT];
     PDLIST_ENTRY waitingToSend;
     IOTHUB_CLIENT_LL_HANDLE llClientHandle;
     CONTROL_PACKET_TYPE currPacketState;
     XIO_HANDLE xioTransport;
     int keepAliveValue;
+    bool eagerConnect;
+    bool isConnectionReadyReported;
+    // Flow control on QoS 1 publishes; a value of 0 disables the corresponding limit.
+    size_t maxInflightMessages;
+    size_t maxInflightBytes;
+    size_t inflightMessageCount;
+    size_t inflightByteCount;
+    size_t messagesPerSecond;
+    size_t bytesPerSecond;
+    // Token buckets, in thousandths of a message/byte.
+    int64_t messageTokens;
+    int64_t byteTokens;
+    uint64_t lastTokenRefillTime;
+    // Scratch buffer the event topic and its properties are encoded into before each new publish.
+    char* topicBuffer;
+    size_t topicBufferSize;
+    QOS_VALUE telemetryQos;
+    TICK_COUNTER_HANDLE msgTickCounter;
+    uint64_t currentTime; // sampled once per DoWork
+    // Round trip estimate of publish -> PUBACK, used for the retransmit timeout (RFC 6298).
+    bool hasRttSample;
+    uint64_t smoothedRtt;
+    uint64_t rttVariance;
+    uint64_t retransmitTimeout;
+    // Bytes of MQTT packets collected into one TLS write while DoWork publishes; 0 sends each packet on its own.
+    size_t publishCorkSize;
+    bool isCorkLayerCreated;
+    // Device host mode: a transport created without a device runs one MQTT connection per registered device.
+    bool isDeviceHost;
+    STRING_HANDLE hostedIotHubName;
+    STRING_HANDLE hostedIotHubSuffix;
+    STRING_HANDLE hostedProtocolGatewayHostName;
+    IOTHUB_CLIENT_TRANSPORT_PROVIDER hostedProtocol;
+    void* hostOptionValues[HOST_OPTION_COUNT]; // copy of the last value set on the host for each of hostOptions, NULL if never set
+    size_t hostIdlePollInterval;
+    DLIST_ENTRY hostedDevices;
+    // Set on a hosted device: its host, its link in the host's list and when the host next has to service it.
+    struct MQTTTRANSPORT_HANDLE_DATA_TAG* deviceHost;
+    DLIST_ENTRY hostedDeviceEntry;
+    uint64_t nextServiceTime;
+    bool hasActivity;
+#ifdef USE_MQTT_STATIC_POOLS
+    // Waiting acknowledge entries come from a pool of MQTT_MAX_INFLIGHT_MESSAGES slots allocated on create.
+    unsigned char* messageDetailsPool;
+    struct MQTT_MESSAGE_DETAILS_LIST_TAG* freeMessageDetails;
+#endif
 } MQTTTRANSPORT_HANDLE_DATA, *PMQTTTRANSPORT_HANDLE_DATA;
 
 typedef struct MQTT_MESSAGE_DETAILS_LIST_TAG
 {
     uint64_t msgPublishTime;
+    uint64_t firstPublishTime;
+    uint64_t resendDeadline;
     size_t retryCount;
+    bool isReconnectResend;
+    bool wasResent;
     IOTHUB_MESSAGE_LIST* iotHubMessageEntry;
     void* context;
     uint16_t msgPacketId;
+    size_t msgLength;
+    const char* msgTopic; // encoded topic, stored right after the entry so resends reuse it
+    struct MQTT_MESSAGE_DETAILS_LIST_TAG* nextInBucket;
     DLIST_ENTRY entry;
 } MQTT_MESSAGE_DETAILS_LIST, *PMQTT_MESSAGE_DETAILS_LIST;
 
@@ -116,6 +254,61 @@ static void defaultPrintLogFunction(unsigned int options, char* format, ...)
     }
 }
 
+static MQTT_MESSAGE_DETAILS_LIST* allocateMessageDetails(PMQTTTRANSPORT_HANDLE_DATA transportState, size_t topicLength)
+{
+#ifdef USE_MQTT_STATIC_POOLS
+    MQTT_MESSAGE_DETAILS_LIST* result = transportState->freeMessageDetails;
+    (void)topicLength;
+    if (result != NULL)
+    {
+        transportState->freeMessageDetails = result->nextInBucket;
+    }
+    return result;
+#else
+    (void)transportState;
+    return (MQTT_MESSAGE_DETAILS_LIST*)malloc(sizeof(MQTT_MESSAGE_DETAILS_LIST) + topicLength + 1);
+#endif
+}
+
+static void releaseMessageDetails(PMQTTTRANSPORT_HANDLE_DATA transportState, MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry)
+{
+#ifdef USE_MQTT_STATIC_POOLS
+    mqttMsgEntry->nextInBucket = transportState->freeMessageDetails;
+    transportState->freeMessageDetails = mqttMsgEntry;
+#else
+    (void)transportState;
+    free(mqttMsgEntry);
+#endif
+}
+
+#ifdef USE_MQTT_STATIC_POOLS
+static int createStaticPools(PMQTTTRANSPORT_HANDLE_DATA transportState)
+{
+    int result;
+    if ((transportState->topicBuffer = (char*)malloc(MQTT_MAX_TOPIC_LENGTH + 1)) == NULL)
+    {
+        LogError("Failure allocating the MQTT topic buffer.\r\n");
+        result = __LINE__;
+    }
+    else if ((transportState->messageDetailsPool = (unsigned char*)malloc(MQTT_MAX_INFLIGHT_MESSAGES * MESSAGE_DETAILS_SLOT_SIZE)) == NULL)
+    {
+        LogError("Failure allocating the MQTT in-flight message pool.\r\n");
+        result = __LINE__;
+    }
+    else
+    {
+        size_t index;
+        transportState->topicBufferSize = MQTT_MAX_TOPIC_LENGTH + 1;
+        for (index = 0; index < MQTT_MAX_INFLIGHT_MESSAGES; index++)
+        {
+            releaseMessageDetails(transportState, (MQTT_MESSAGE_DETAILS_LIST*)(transportState->messageDetailsPool + index * MESSAGE_DETAILS_SLOT_SIZE));
+        }
+        result = 0;
+    }
+    return result;
+}
+#endif
+
 static void sendMsgComplete(IOTHUB_MESSAGE_LIST* iothubMsgList, PMQTTTRANSPORT_HANDLE_DATA transportState, IOTHUB_BATCHSTATE_RESULT batchResult)
 {
     DLIST_ENTRY messageCompleted;
@@ -124,50 +317,277 @@ static void sendMsgComplete(IOTHUB_MESSAGE_LIST* iothubMsgList, PMQTTTRANSPORT_H
     IoTHubClient_LL_SendComplete(transportState->llClientHandle, &messageCompleted, batchResult);
 }
 
-static STRING_HANDLE addPropertiesTouMqttMessage(IOTHUB_MESSAGE_HANDLE iothub_message_handle, const char* eventTopic)
+static void addInflightMessage(PMQTTTRANSPORT_HANDLE_DATA transportState, MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry)
+{
+    MQTT_MESSAGE_DETAILS_LIST** bucket = &transportState->inflightBuckets[mqttMsgEntry->msgPacketId & (INFLIGHT_BUCKET_COUNT - 1)];
+    mqttMsgEntry->nextInBucket = *bucket;
+    *bucket = mqttMsgEntry;
+    transportState->inflightMessageCount++;
+    transportState->inflightByteCount += mqttMsgEntry->msgLength;
+}
+
+static MQTT_MESSAGE_DETAILS_LIST* findInflightMessage(PMQTTTRANSPORT_HANDLE_DATA transportState, uint16_t packetId, bool removeEntry)
+{
+    MQTT_MESSAGE_DETAILS_LIST** current = &transportState->inflightBuckets[packetId & (INFLIGHT_BUCKET_COUNT - 1)];
+    while (*current != NULL && (*current)->msgPacketId != packetId)
+    {
+        current = &(*current)->nextInBucket;
+    }
+
+    MQTT_MESSAGE_DETAILS_LIST* result = *current;
+    if (result != NULL && removeEntry)
+    {
+        *current = result->nextInBucket;
+        result->nextInBucket = NULL;
+        transportState->inflightMessageCount--;
+        transportState->inflightByteCount -= result->msgLength;
+    }
+    return result;
+}
+
+static void refillPublishTokens(PMQTTTRANSPORT_HANDLE_DATA transportState)
+{
+    uint64_t elapsed = transportState->currentTime - transportState->lastTokenRefillTime;
+    if (elapsed > TOKEN_BUCKET_MAX_REFILL_MS)
+    {
+        elapsed = TOKEN_BUCKET_MAX_REFILL_MS;
+    }
+    transportState->lastTokenRefillTime = transportState->currentTime;
+
+    transportState->messageTokens += (int64_t)(transportState->messagesPerSecond * elapsed);
+    if (transportState->messageTokens > (int64_t)(transportState->messagesPerSecond * TOKEN_BUCKET_MAX_REFILL_MS))
+    {
+        transportState->messageTokens = (int64_t)(transportState->messagesPerSecond * TOKEN_BUCKET_MAX_REFILL_MS);
+    }
+    transportState->byteTokens += (int64_t)(transportState->bytesPerSecond * elapsed);
+    if (transportState->byteTokens > (int64_t)(transportState->bytesPerSecond * TOKEN_BUCKET_MAX_REFILL_MS))
+    {
+        transportState->byteTokens = (int64_t)(transportState->bytesPerSecond * TOKEN_BUCKET_MAX_REFILL_MS);
+    }
+}
+
+static void updateRetransmitTimeout(PMQTTTRANSPORT_HANDLE_DATA transportState, uint64_t roundTrip)
+{
+    if (!transportState->hasRttSample)
+    {
+        transportState->smoothedRtt = roundTrip;
+        transportState->rttVariance = roundTrip / 2;
+        transportState->hasRttSample = true;
+    }
+    else
+    {
+        uint64_t delta = (transportState->smoothedRtt > roundTrip) ? transportState->smoothedRtt - roundTrip : roundTrip - transportState->smoothedRtt;
+        transportState->rttVariance = (3 * transportState->rttVariance + delta) / 4;
+        transportState->smoothedRtt = (7 * transportState->smoothedRtt + roundTrip) / 8;
+    }
+
+    transportState->retransmitTimeout = transportState->smoothedRtt + 4 * transportState->rttVariance;
+    if (transportState->retransmitTimeout < MIN_RETRANSMIT_TIMEOUT_MS)
+    {
+        transportState->retransmitTimeout = MIN_RETRANSMIT_TIMEOUT_MS;
+    }
+    else if (transportState->retransmitTimeout > MAX_RETRANSMIT_TIMEOUT_MS)
+    {
+        transportState->retransmitTimeout = MAX_RETRANSMIT_TIMEOUT_MS;
+    }
+}
+
+/* Keeps waitingForAck ordered by resend deadline. Deadlines mostly grow with publish time,
+   so the walk back from the tail is usually a single step. */
+static void insertWaitingForAck(PMQTTTRANSPORT_HANDLE_DATA transportState, MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry)
+{
+    PDLIST_ENTRY position = &transportState->waitingForAck;
+    while (position->Blink != &transportState->waitingForAck &&
+        containingRecord(position->Blink, MQTT_MESSAGE_DETAILS_LIST, entry)->resendDeadline > mqttMsgEntry->resendDeadline)
+    {
+        position = position->Blink;
+    }
+    // Inserting at the tail of a list headed by position places the entry just before position.
+    DList_InsertTailList(position, &(mqttMsgEntry->entry));
+}
+
+static bool canPublishMessage(PMQTTTRANSPORT_HANDLE_DATA transportState, size_t messageLength)
+{
+    bool result;
+    if (transportState->maxInflightMessages > 0 && transportState->inflightMessageCount >= transportState->maxInflightMessages)
+    {
+        result = false;
+    }
+#ifdef USE_MQTT_STATIC_POOLS
+    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_166: [When built with USE_MQTT_STATIC_POOLS, IoTHubTransportMqtt_DoWork shall leave QoS 1 messages in waitingToSend while all MQTT_MAX_INFLIGHT_MESSAGES slots are waiting for acknowledgement.] */
+    else if (transportState->telemetryQos == DELIVER_AT_LEAST_ONCE && transportState->freeMessageDetails == NULL)
+    {
+        result = false;
+    }
+#endif
+    // A message larger than the whole byte window is still sent once nothing else is in flight.
+    else if (transportState->maxInflightBytes > 0 && transportState->inflightMessageCount > 0 &&
+        transportState->inflightByteCount + messageLength > transportState->maxInflightBytes)
+    {
+        result = false;
+    }
+    else if (transportState->messagesPerSecond > 0 || transportState->bytesPerSecond > 0)
+    {
+        refillPublishTokens(transportState);
+        // Buckets may go into debt by one message, so a message bigger than the burst is never starved.
+        result = (transportState->messagesPerSecond == 0 || transportState->messageTokens > 0) &&
+            (transportState->bytesPerSecond == 0 || transportState->byteTokens > 0);
+    }
+    else
+    {
+        result = true;
+    }
+    return result;
+}
+
+static void consumePublishTokens(PMQTTTRANSPORT_HANDLE_DATA transportState, size_t messageLength)
+{
+    if (transportState->messagesPerSecond > 0)
+    {
+        transportState->messageTokens -= TOKEN_BUCKET_MAX_REFILL_MS;
+    }
+    if (transportState->bytesPerSecond > 0)
+    {
+        transportState->byteTokens -= (int64_t)messageLength * TOKEN_BUCKET_MAX_REFILL_MS;
+    }
+}
+
+static uint16_t getNextPacketId(PMQTTTRANSPORT_HANDLE_DATA transportState)
+{
+    uint16_t result;
+    size_t attempts = 0;
+    do
+    {
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_135: [Packet identifiers shall never be 0 and shall skip any identifier still waiting for a PUBACK.] */
+        result = transportState->packetId++;
+        if (transportState->packetId == 0)
+        {
+            transportState->packetId = 1;
+        }
+        if (findInflightMessage(transportState, result, false) == NULL)
+        {
+            break;
+        }
+        LogInfo("Packet id %u is still waiting for acknowledgement, skipping it.\r\n", (unsigned int)result);
+    } while (++attempts < UINT16_MAX);
+
+    return result;
+}
+
+static bool isUrlUnreservedChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+static size_t getUrlEncodedLength(const char* text)
+{
+    size_t result = 0;
+    for (; *text != '\0'; text++)
+    {
+        result += isUrlUnreservedChar(*text) ? 1 : 3;
+    }
+    return result;
+}
+
+static char* writeUrlEncoded(char* destination, const char* text)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    for (; *text != '\0'; text++)
+    {
+        if (isUrlUnreservedChar(*text))
+        {
+            *destination++ = *text;
+        }
+        else
+        {
+            *destination++ = '%';
+            *destination++ = hexDigits[((unsigned char)*text) >> 4];
+            *destination++ = hexDigits[((unsigned char)*text) & 0x0F];
+        }
+    }
+    return destination;
+}
+
+static int growTopicBuffer(PMQTTTRANSPORT_HANDLE_DATA transportState, size_t requiredSize)
+{
+    int result;
+#ifdef USE_MQTT_STATIC_POOLS
+    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_167: [When built with USE_MQTT_STATIC_POOLS, a topic longer than MQTT_MAX_TOPIC_LENGTH shall fail the message instead of growing the topic buffer.] */
+    (void)requiredSize;
+    LogError("MQTT topic is longer than MQTT_MAX_TOPIC_LENGTH (%d).\r\n", (int)(transportState->topicBufferSize - 1));
+    result = __LINE__;
+#else
+    size_t newSize = (transportState->topicBufferSize * 2 > TOPIC_BUFFER_INITIAL_SIZE) ? transportState->topicBufferSize * 2 : TOPIC_BUFFER_INITIAL_SIZE;
+    if (newSize < requiredSize)
+    {
+        newSize = requiredSize;
+    }
+
+    char* newBuffer = (char*)realloc(transportState->topicBuffer, newSize);
+    if (newBuffer == NULL)
+    {
+        result = __LINE__;
+    }
+    else
+    {
+        transportState->topicBuffer = newBuffer;
+        transportState->topicBufferSize = newSize;
+        result = 0;
+    }
+#endif
+    return result;
+}
+
+/* Writes the event topic followed by the url encoded message properties into the transport topic buffer,
+   which is only reallocated when it is too small. Returns the topic length, or 0 on failure. */
+static size_t encodeEventTopic(PMQTTTRANSPORT_HANDLE_DATA transportState, IOTHUB_MESSAGE_HANDLE iothub_message_handle)
 {
-    STRING_HANDLE result = STRING_construct(eventTopic);
-    const char* const* propertyKeys;
-    const char* const* propertyValues;
-    size_t propertyCount;
+    size_t result;
+    const char* const* propertyKeys = NULL;
+    const char* const* propertyValues = NULL;
+    size_t propertyCount = 0;
+    const char* eventTopic = STRING_c_str(transportState->mqttEventTopic);
 
-    // Construct Properties
     MAP_HANDLE properties_map = IoTHubMessage_Properties(iothub_message_handle);
-    if (properties_map != NULL)
+    if (properties_map != NULL && Map_GetInternals(properties_map, &propertyKeys, &propertyValues, &propertyCount) != MAP_OK)
     {
-        if (Map_GetInternals(properties_map, &propertyKeys, &propertyValues, &propertyCount) != MAP_OK)
+        LogError("Failed to get the internals of the property map.\r\n");
+        result = 0;
+    }
+    else
+    {
+        size_t eventTopicLength = strlen(eventTopic);
+        size_t topicLength = eventTopicLength;
+        size_t index;
+        for (index = 0; index < propertyCount; index++)
         {
-            LogError("Failed to get the internals of the property map.\r\n");
-            STRING_delete(result);
-            result = NULL;
+            // key=value pairs separated by '&'
+            topicLength += getUrlEncodedLength(propertyKeys[index]) + 1 + getUrlEncodedLength(propertyValues[index]) + ((index > 0) ? 1 : 0);
+        }
+
+        if (topicLength + 1 > transportState->topicBufferSize && growTopicBuffer(transportState, topicLength + 1) != 0)
+        {
+            LogError("Failure allocating the MQTT topic buffer.\r\n");
+            result = 0;
         }
         else
         {
-            if (propertyCount != 0)
+            char* destination = transportState->topicBuffer;
+            (void)memcpy(destination, eventTopic, eventTopicLength);
+            destination += eventTopicLength;
+            for (index = 0; index < propertyCount; index++)
             {
-                for (size_t index = 0; index < propertyCount; index++)
+                if (index > 0)
                 {
-                    size_t len = strlen(propertyKeys[index]) + strlen(propertyValues[index]) + 2;
-                    char* propValues = malloc(len+1);
-                    if (propValues == NULL)
-                    {
-                        STRING_delete(result);
-                        result = NULL;
-                        break;
-                    }
-                    else
-                    {
-                        sprintf(propValues, "%s=%s%s", propertyKeys[index], propertyValues[index], propertyCount - 1 == index ? "" : "&");
-                        if (STRING_concat(result, propValues) != 0)
-                        {
-                            STRING_delete(result);
-                            result = NULL;
-                            break;
-                        }
-                        free(propValues);
-                    }
+                    *destination++ = PROPERTY_SEPARATOR[0];
                 }
+                destination = writeUrlEncoded(destination, propertyKeys[index]);
+                *destination++ = '=';
+                destination = writeUrlEncoded(destination, propertyValues[index]);
             }
+            *destination = '\0';
+            result = topicLength;
         }
     }
     return result;
@@ -176,140 +596,253 @@ static STRING_HANDLE addPropertiesTouMqttMessage(IOTHUB_MESSAGE_HANDLE iothub_me
 static int publishMqttMessage(PMQTTTRANSPORT_HANDLE_DATA transportState, MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry, const unsigned char* payload, size_t len)
 {
     int result;
-    STRING_HANDLE msgTopic = addPropertiesTouMqttMessage(mqttMsgEntry->iotHubMessageEntry->messageHandle, STRING_c_str(transportState->mqttEventTopic));
-    if (msgTopic == NULL)
+    MQTT_MESSAGE_HANDLE mqttMsg = mqttmessage_create(mqttMsgEntry->msgPacketId, mqttMsgEntry->msgTopic, DELIVER_AT_LEAST_ONCE, payload, len);
+    if (mqttMsg == NULL)
     {
         result = __LINE__;
     }
     else
     {
-        MQTT_MESSAGE_HANDLE mqttMsg = mqttmessage_create(transportState->packetId++, STRING_c_str(msgTopic), DELIVER_AT_LEAST_ONCE, payload, len);
-        if (mqttMsg == NULL)
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_172: [A resent message shall be published with the DUP flag set.] */
+        if (mqttMsgEntry->retryCount > 0 && mqttmessage_setIsDuplicateMsg(mqttMsg, true) != 0)
+        {
+            LogError("Failure setting the DUP flag of a resent message.\r\n");
+            result = __LINE__;
+        }
+        else if (mqtt_client_publish(transportState->mqttClient, mqttMsg) != 0)
         {
             result = __LINE__;
         }
         else
         {
-            if (mqtt_client_publish(transportState->mqttClient, mqttMsg) != 0)
+            uint64_t timeout = transportState->retransmitTimeout << mqttMsgEntry->retryCount;
+            if (mqttMsgEntry->retryCount == 0)
             {
-                result = __LINE__;
+                mqttMsgEntry->firstPublishTime = transportState->currentTime;
+            }
+            else
+            {
+                mqttMsgEntry->wasResent = true;
+            }
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_173: [The resend that follows a CONNACK shall not count as a resend of the message, and shall be done even for a message that has already been resent two times.] */
+            if (mqttMsgEntry->isReconnectResend)
+            {
+                mqttMsgEntry->isReconnectResend = false;
             }
             else
             {
                 mqttMsgEntry->retryCount++;
-                (void)tickcounter_get_current_ms(g_msgTickCounter, &mqttMsgEntry->msgPublishTime);
-                result = 0;
             }
-            mqttmessage_destroy(mqttMsg);
+            mqttMsgEntry->msgPublishTime = transportState->currentTime;
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_146: [Each send shall schedule the resend of the message at the retransmit timeout, doubled for every previous send of the same message and capped at 2 min.] */
+            mqttMsgEntry->resendDeadline = transportState->currentTime + ((timeout > MAX_RETRANSMIT_TIMEOUT_MS) ? MAX_RETRANSMIT_TIMEOUT_MS : timeout);
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_168: [A message shall not be failed for lack of acknowledgement sooner than 2 min after it was first published, whatever the retransmit timeout: the last allowed send shall schedule its deadline no earlier than that.] */
+            if (mqttMsgEntry->retryCount >= MAX_SEND_RECOUNT_LIMIT &&
+                mqttMsgEntry->resendDeadline < mqttMsgEntry->firstPublishTime + MESSAGE_GIVE_UP_TIMEOUT_MS)
+            {
+                mqttMsgEntry->resendDeadline = mqttMsgEntry->firstPublishTime + MESSAGE_GIVE_UP_TIMEOUT_MS;
+            }
+            result = 0;
         }
-        STRING_delete(msgTopic);
+        mqttmessage_destroy(mqttMsg);
     }
     return result;
 }
 
-static bool isSystemProperty(const char* tokenData)
+static int publishMqttMessageAtMostOnce(PMQTTTRANSPORT_HANDLE_DATA transportState, const char* topic, const unsigned char* payload, size_t len)
 {
-    bool result = false;
-    size_t propCount = sizeof(sysPropList)/sizeof(sysPropList[0]);
-    for (size_t index = 0; index < propCount; index++)
+    int result;
+    // QoS 0 publishes carry no packet id
+    MQTT_MESSAGE_HANDLE mqttMsg = mqttmessage_create(0, topic, DELIVER_AT_MOST_ONCE, payload, len);
+    if (mqttMsg == NULL)
+    {
+        result = __LINE__;
+    }
+    else
     {
-        if (memcmp(tokenData, sysPropList[index].propName, sysPropList[index].propLength) == 0)
+        if (mqtt_client_publish(transportState->mqttClient, mqttMsg) != 0)
         {
-            result = true;
-            break;
+            result = __LINE__;
         }
+        else
+        {
+            result = 0;
+        }
+        mqttmessage_destroy(mqttMsg);
     }
     return result;
 }
 
-static int extractMqttProperties(IOTHUB_MESSAGE_HANDLE IoTHubMessage, MQTT_MESSAGE_HANDLE msgHandle)
+static int getHexDigitValue(char c)
 {
     int result;
-    STRING_HANDLE mqttTopic = STRING_construct(mqttmessage_getTopicName(msgHandle));
+    if (c >= '0' && c <= '9')
+    {
+        result = c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+        result = c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+        result = c - 'A' + 10;
+    }
+    else
+    {
+        result = -1;
+    }
+    return result;
+}
 
-    STRING_TOKENIZER_HANDLE token = STRING_TOKENIZER_create(mqttTopic);
-    if (token != NULL)
+/* Percent decodes the text at *position in place up to the first delimiter or the end of the string and NUL terminates it.
+   Advances *position past the delimiter that was found and returns the decoded length. */
+static size_t urlDecodeInPlace(char** position, char delimiter1, char delimiter2, char* foundDelimiter)
+{
+    char* start = *position;
+    char* source = start;
+    char* destination = start;
+    int high;
+    int low;
+
+    while (*source != '\0' && *source != delimiter1 && *source != delimiter2)
     {
-        MAP_HANDLE propertyMap = IoTHubMessage_Properties(IoTHubMessage);
-        if (propertyMap == NULL)
+        if (*source == '%' && (high = getHexDigitValue(source[1])) >= 0 && (low = getHexDigitValue(source[2])) >= 0)
         {
-            LogError("Failure to retrieve IoTHubMessage_properties.\r\n");
-            result = __LINE__;
+            *destination++ = (char)((high << 4) | low);
+            source += 3;
+        }
+        else
+        {
+            *destination++ = *source++;
+        }
+    }
+
+    *foundDelimiter = *source;
+    *position = (*source == '\0') ? source : source + 1;
+    *destination = '\0';
+    return destination - start;
+}
+
+static SYSTEM_PROPERTY_TYPE getSystemPropertyType(const char* propName, size_t nameLength)
+{
+    SYSTEM_PROPERTY_TYPE result = SYSTEM_PROPERTY_NONE;
+    if (nameLength >= 3)
+    {
+        const SYSTEM_PROPERTY_INFO* propInfo = &sysPropTable[SYSTEM_PROPERTY_HASH(propName, nameLength)];
+        if (propInfo->propName != NULL && strcmp(propInfo->propName, propName) == 0)
+        {
+            result = propInfo->propType;
+        }
+    }
+    return result;
+}
+
+static int addMessageProperty(IOTHUB_MESSAGE_HANDLE IoTHubMessage, MAP_HANDLE propertyMap, const char* propName, size_t nameLength, const char* propValue)
+{
+    int result;
+    switch (getSystemPropertyType(propName, nameLength))
+    {
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_149: [A received "$.mid" property shall be set with IoTHubMessage_SetMessageId and a received "$.cid" property with IoTHubMessage_SetCorrelationId; the other system properties shall not be added to the message properties.] */
+        case SYSTEM_PROPERTY_MESSAGE_ID:
+            if (IoTHubMessage_SetMessageId(IoTHubMessage, propValue) != IOTHUB_MESSAGE_OK)
+            {
+                LogError("Failure setting the message id of the received message.\r\n");
+                result = __LINE__;
+            }
+            else
+            {
+                result = 0;
+            }
+            break;
+        case SYSTEM_PROPERTY_CORRELATION_ID:
+            if (IoTHubMessage_SetCorrelationId(IoTHubMessage, propValue) != IOTHUB_MESSAGE_OK)
+            {
+                LogError("Failure setting the correlation id of the received message.\r\n");
+                result = __LINE__;
+            }
+            else
+            {
+                result = 0;
+            }
+            break;
+        case SYSTEM_PROPERTY_IGNORED:
+            result = 0;
+            break;
+        case SYSTEM_PROPERTY_NONE:
+        default:
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_150: [Every other received property that has a value shall be added to the message properties with Map_AddOrUpdate.] */
+            if (Map_AddOrUpdate(propertyMap, propName, propValue) != MAP_OK)
+            {
+                LogError("Map_AddOrUpdate failed.\r\n");
+                result = __LINE__;
+            }
+            else
+            {
+                result = 0;
+            }
+            break;
+    }
+    return result;
+}
+
+/* Copies the property bag of the devicebound topic once into the transport topic buffer and decodes the
+   name=value pairs in place, handing out pointers into that buffer without further allocations. */
+static int extractMqttProperties(PMQTTTRANSPORT_HANDLE_DATA transportState, IOTHUB_MESSAGE_HANDLE IoTHubMessage, MQTT_MESSAGE_HANDLE msgHandle)
+{
+    int result;
+    const char* topicName = mqttmessage_getTopicName(msgHandle);
+    const char* propertyBag = (topicName == NULL) ? NULL : strstr(topicName, DEVICE_MSG_PROPERTY_MARKER);
+
+    if (propertyBag == NULL)
+    {
+        LogError("Received message topic is not a devicebound topic.\r\n");
+        result = __LINE__;
+    }
+    else
+    {
+        propertyBag += strlen(DEVICE_MSG_PROPERTY_MARKER);
+        size_t bagLength = strlen(propertyBag);
+        if (bagLength == 0)
+        {
+            result = 0;
         }
         else
         {
-            STRING_HANDLE output = STRING_new();
-            if (output == NULL)
+            MAP_HANDLE propertyMap = IoTHubMessage_Properties(IoTHubMessage);
+            if (propertyMap == NULL)
             {
-                LogError("Failure to allocate STRING_new.\r\n");
+                LogError("Failure to retrieve IoTHubMessage_properties.\r\n");
+                result = __LINE__;
+            }
+            else if (bagLength + 1 > transportState->topicBufferSize && growTopicBuffer(transportState, bagLength + 1) != 0)
+            {
+                LogError("Failure allocating the MQTT topic buffer.\r\n");
                 result = __LINE__;
             }
             else
             {
+                /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_148: [When a message is received the transport shall copy the topic properties once into its topic buffer and url decode each name and value in place.] */
+                char* position = transportState->topicBuffer;
+                (void)memcpy(position, propertyBag, bagLength + 1);
+
                 result = 0;
-                while (STRING_TOKENIZER_get_next_token(token, output, PROPERTY_SEPARATOR) == 0 && result == 0)
+                while (*position != '\0' && result == 0)
                 {
-                    const char* tokenData = STRING_c_str(output);
-                    size_t tokenLen = strlen(tokenData);
-                    if (tokenData == NULL || tokenLen == 0)
+                    char delimiter;
+                    char* propName = position;
+                    size_t nameLength = urlDecodeInPlace(&position, '=', PROPERTY_SEPARATOR[0], &delimiter);
+                    // properties without a value carry no information for the application
+                    if (delimiter == '=')
                     {
-                        break;
-                    }
-                    else
-                    {
-                        if (!isSystemProperty(tokenData) )
-                        {
-                            const char* iterator = tokenData;
-                            while (iterator != NULL && *iterator != '\0' && result == 0)
-                            {
-                                if (*iterator == '=')
-                                {
-                                    size_t nameLen = iterator - tokenData;
-                                    char* propName = malloc(nameLen + 1);
-
-                                    size_t valLen = tokenLen - (nameLen + 1) + 1;
-                                    char* propValue = malloc(valLen + 1);
-
-                                    if (propName == NULL || propValue == NULL)
-                                    {
-                                        result = __LINE__;
-                                    }
-                                    else
-                                    {
-                                        strncpy(propName, tokenData, nameLen);
-                                        propName[nameLen] = '\0';
-
-                                        strncpy(propValue, iterator + 1, valLen);
-                                        propValue[valLen] = '\0';
-
-                                        if (Map_AddOrUpdate(propertyMap, propName, propValue) != MAP_OK)
-                                        {
-                                            LogError("Map_AddOrUpdate failed.\r\n");
-                                            result = __LINE__;
-                                        }
-                                    }
-                                    free(propName);
-                                    free(propValue);
-
-                                    break;
-                                }
-                                iterator++;
-                            }
-                        }
+                        char* propValue = position;
+                        (void)urlDecodeInPlace(&position, PROPERTY_SEPARATOR[0], PROPERTY_SEPARATOR[0], &delimiter);
+                        result = addMessageProperty(IoTHubMessage, propertyMap, propName, nameLength, propValue);
                     }
                 }
-                STRING_delete(output);
             }
-        }
-        STRING_TOKENIZER_destroy(token);
-    }
-    else
-    {
-        LogError("Unable to create Tokenizer object .\r\n");
-        result = __LINE__;
+        }
     }
-    STRING_delete(mqttTopic);
-
     return result;
 }
 
@@ -326,8 +859,9 @@ static void MqttRecvCallback(MQTT_MESSAGE_HANDLE msgHandle, void* callbackCtx)
         else
         {
             // Will need to update this when the service has messages that can be rejected
-            (void)extractMqttProperties(IoTHubMessage, msgHandle);
             PMQTTTRANSPORT_HANDLE_DATA transportData = (PMQTTTRANSPORT_HANDLE_DATA)callbackCtx;
+            transportData->hasActivity = true;
+            (void)extractMqttProperties(transportData, IoTHubMessage, msgHandle);
             if (IoTHubClient_LL_MessageCallback(transportData->llClientHandle, IoTHubMessage) != IOTHUBMESSAGE_ACCEPTED)
             {
                 LogError("Event not accepted by our client.\r\n");
@@ -343,6 +877,7 @@ static void MqttOpCompleteCallback(MQTT_CLIENT_HANDLE handle, MQTT_CLIENT_EVENT_
     if (callbackCtx != NULL)
     {
         PMQTTTRANSPORT_HANDLE_DATA transportData = (PMQTTTRANSPORT_HANDLE_DATA)callbackCtx;
+        transportData->hasActivity = true;
 
         switch (actionResult)
         {
@@ -352,20 +887,25 @@ static void MqttOpCompleteCallback(MQTT_CLIENT_HANDLE handle, MQTT_CLIENT_EVENT_
                 const PUBLISH_ACK* puback = (const PUBLISH_ACK*)msgInfo;
                 if (puback != NULL)
                 {
-                    PDLIST_ENTRY currentListEntry = transportData->waitingForAck.Flink;
-                    while (currentListEntry != &transportData->waitingForAck)
+                    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_136: [On PUBACK the transport shall locate the acknowledged message by its packet id without scanning the Waiting Acknowledge list.] */
+                    MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry = findInflightMessage(transportData, puback->packetId, true);
+                    if (mqttMsgEntry == NULL)
                     {
-                        MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry = containingRecord(currentListEntry, MQTT_MESSAGE_DETAILS_LIST, entry);
-                        DLIST_ENTRY saveListEntry;
-                        saveListEntry.Flink = currentListEntry->Flink;
-
-                        if (puback->packetId == mqttMsgEntry->msgPacketId)
+                        LogInfo("Received PUBACK for unknown packet id %u.\r\n", (unsigned int)puback->packetId);
+                    }
+                    else
+                    {
+                        uint64_t current_ms;
+                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_145: [On PUBACK of a message that was sent only once, the transport shall update its smoothed round trip time and variance and derive the retransmit timeout from them, bounded between 1 s and 2 min.] */
+                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_175: [A message resent after a CONNACK shall not be taken as sent only once, even though that resend is not counted as a resend of the message.] */
+                        if (!mqttMsgEntry->wasResent &&
+                            tickcounter_get_current_ms(transportData->msgTickCounter, &current_ms) == 0)
                         {
-                            (void)DList_RemoveEntryList(currentListEntry); //First remove the item from Waiting for Ack List.
-                            sendMsgComplete(mqttMsgEntry->iotHubMessageEntry, transportData, IOTHUB_BATCHSTATE_SUCCESS);
-                            free(mqttMsgEntry);
+                            updateRetransmitTimeout(transportData, current_ms - mqttMsgEntry->msgPublishTime);
                         }
-                        currentListEntry = saveListEntry.Flink;
+                        (void)DList_RemoveEntryList(&mqttMsgEntry->entry); //First remove the item from Waiting for Ack List.
+                        sendMsgComplete(mqttMsgEntry->iotHubMessageEntry, transportData, IOTHUB_BATCHSTATE_SUCCESS);
+                        releaseMessageDetails(transportData, mqttMsgEntry);
                     }
                 }
                 break;
@@ -377,8 +917,30 @@ static void MqttOpCompleteCallback(MQTT_CLIENT_HANDLE handle, MQTT_CLIENT_EVENT_
                 {
                     if (connack->returnCode == CONNECTION_ACCEPTED)
                     {
+                        PDLIST_ENTRY currentListEntry;
+
                         // The connect packet has been acked
-                        transportData->currPacketState = CONNACK_TYPE;
+                        transportData->isConnectionReadyReported = false;
+                        if (connack->isSessionPresent && transportData->subscribed && transportData->isSubscribeAcked)
+                        {
+                            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_162: [If the CONNACK reports a session present and the message topic subscription was acknowledged before, the transport shall not subscribe again and shall be ready to publish.] */
+                            transportData->currPacketState = PUBLISH_TYPE;
+                        }
+                        else
+                        {
+                            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_163: [If the CONNACK reports no session present, the transport shall subscribe to the message topic again if it receives messages.] */
+                            transportData->subscribed = false;
+                            transportData->isSubscribeAcked = false;
+                            transportData->currPacketState = CONNACK_TYPE;
+                        }
+
+                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_164: [On CONNACK every message in the Waiting Acknowledge list shall be due for resend, with its original packet id and topic, the next time IoTHubTransportMqtt_DoWork publishes.] */
+                        for (currentListEntry = transportData->waitingForAck.Flink; currentListEntry != &transportData->waitingForAck; currentListEntry = currentListEntry->Flink)
+                        {
+                            MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry = containingRecord(currentListEntry, MQTT_MESSAGE_DETAILS_LIST, entry);
+                            mqttMsgEntry->resendDeadline = 0;
+                            mqttMsgEntry->isReconnectResend = true;
+                        }
                     }
                     else
                     {
@@ -403,6 +965,7 @@ static void MqttOpCompleteCallback(MQTT_CLIENT_HANDLE handle, MQTT_CLIENT_EVENT_
                     {
                         // The connect packet has been acked
                         transportData->currPacketState = SUBACK_TYPE;
+                        transportData->isSubscribeAcked = true;
                     }
                     else
                     {
@@ -426,15 +989,53 @@ static void MqttOpCompleteCallback(MQTT_CLIENT_HANDLE handle, MQTT_CLIENT_EVENT_
             }
             case MQTT_CLIENT_ON_ERROR:
             {
+                /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_174: [On a transport error the subscription state shall be kept, so that a CONNACK reporting a session present does not subscribe again; only a CONNACK reporting no session shall clear it.] */
                 xio_close(transportData->xioTransport, NULL, NULL);
                 transportData->connected = false;
-                transportData->subscribed = false;
                 transportData->currPacketState = PACKET_TYPE_ERROR;
             }
         }
     }
 }
 
+static int createCorkLayerIfNecessary(PMQTTTRANSPORT_HANDLE_DATA transportState)
+{
+    int result;
+    if (transportState->isCorkLayerCreated || transportState->publishCorkSize == 0 || transportState->xioTransport == NULL)
+    {
+        result = 0;
+    }
+    else
+    {
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_152: [While corked, the packets written by the MQTT client shall be copied into a buffer of "publish_cork_size" bytes, which is sent as one write when the next packet would not fit; packets larger than the buffer shall be sent directly, after the buffered bytes.] */
+        COALESCINGIO_CONFIG corkConfig = { transportState->xioTransport, transportState->publishCorkSize, false };
+        XIO_HANDLE corkIo = xio_create(coalescingio_get_interface_description(), &corkConfig, NULL);
+        if (corkIo == NULL)
+        {
+            LogError("Unable to create the MQTT cork layer; sending each packet on its own.\r\n");
+            result = __LINE__;
+        }
+        else
+        {
+            transportState->xioTransport = corkIo;
+            transportState->isCorkLayerCreated = true;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+static void setPublishCork(PMQTTTRANSPORT_HANDLE_DATA transportState, bool corked)
+{
+    if (transportState->isCorkLayerCreated && transportState->publishCorkSize > 0)
+    {
+        if (xio_setoption(transportState->xioTransport, COALESCINGIO_OPTION_HOLD_WRITES, &corked) != 0)
+        {
+            LogError("Failure %s the MQTT cork layer.\r\n", corked ? "corking" : "uncorking");
+        }
+    }
+}
+
 const XIO_HANDLE getIoTransportProvider(const char* fqdn, int port)
 {
     TLSIO_CONFIG tls_io_config = { fqdn, port };
@@ -452,7 +1053,7 @@ static int SubscribeToMqttProtocol(PMQTTTRANSPORT_HANDLE_DATA transportState)
             { STRING_c_str(transportState->mqttMessageTopic), DELIVER_AT_LEAST_ONCE }
         };
         /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_016: [IoTHubTransportMqtt_Subscribe shall call mqtt_client_subscribe to subscribe to the Message Topic.] */
-        if (mqtt_client_subscribe(transportState->mqttClient, transportState->packetId++, subscribe, 1) != 0)
+        if (mqtt_client_subscribe(transportState->mqttClient, getNextPacketId(transportState), subscribe, 1) != 0)
         {
             /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_017: [Upon failure IoTHubTransportMqtt_Subscribe shall return a non-zero value.] */
             result = __LINE__;
@@ -600,6 +1201,8 @@ static int GetTransportProviderIfNecessary(PMQTTTRANSPORT_HANDLE_DATA transportS
         }
         else
         {
+            // without the cork layer the packets are simply sent one by one
+            (void)createCorkLayerIfNecessary(transportState);
             result = 0;
         }
     }
@@ -782,9 +1385,11 @@ static PMQTTTRANSPORT_HANDLE_DATA InitializeTransportHandleData(const IOTHUB_CLI
             {
                 /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_010: [IoTHubTransportMqtt_Create shall allocate memory to save its internal state where all topics, hostname, device_id, device_key, sasTokenSr and client handle shall be saved.] */
                 DList_InitializeListHead(&(state->waitingForAck));
+                memset(state->inflightBuckets, 0, sizeof(state->inflightBuckets));
                 state->destroyCalled = false;
                 state->isRegistered = false;
                 state->subscribed = false;
+                state->isSubscribeAcked = false;
                 state->connected = false;
                 state->receiveMessages = false;
                 state->packetId = 1;
@@ -794,12 +1399,153 @@ static PMQTTTRANSPORT_HANDLE_DATA InitializeTransportHandleData(const IOTHUB_CLI
                 state->waitingToSend = waitingToSend;
                 state->currPacketState = CONNECT_TYPE;
                 state->keepAliveValue = DEFAULT_MQTT_KEEPALIVE;
+                state->eagerConnect = false;
+                state->maxInflightMessages = 0;
+                state->maxInflightBytes = 0;
+                state->inflightMessageCount = 0;
+                state->inflightByteCount = 0;
+                state->messagesPerSecond = 0;
+                state->bytesPerSecond = 0;
+                state->messageTokens = 0;
+                state->byteTokens = 0;
+                state->lastTokenRefillTime = 0;
+                state->topicBuffer = NULL;
+                state->topicBufferSize = 0;
+                state->telemetryQos = DELIVER_AT_LEAST_ONCE;
+                state->msgTickCounter = NULL;
+                state->currentTime = 0;
+                state->hasRttSample = false;
+                state->smoothedRtt = 0;
+                state->rttVariance = 0;
+                state->retransmitTimeout = INITIAL_RETRANSMIT_TIMEOUT_MS;
+                state->isConnectionReadyReported = false;
+                state->publishCorkSize = 0;
+                state->isCorkLayerCreated = false;
+                state->isDeviceHost = false;
+                state->hostedIotHubName = NULL;
+                state->hostedIotHubSuffix = NULL;
+                state->hostedProtocol = NULL;
+                state->hostIdlePollInterval = 0;
+                state->deviceHost = NULL;
+                state->nextServiceTime = 0;
+                state->hasActivity = false;
+#ifdef USE_MQTT_STATIC_POOLS
+                state->messageDetailsPool = NULL;
+                state->freeMessageDetails = NULL;
+#endif
             }
         }
     }
     return state;
 }
 
+static PMQTTTRANSPORT_HANDLE_DATA InitializeDeviceHostData(const IOTHUB_CLIENT_CONFIG* upperConfig)
+{
+    PMQTTTRANSPORT_HANDLE_DATA state = (PMQTTTRANSPORT_HANDLE_DATA)malloc(sizeof(MQTTTRANSPORT_HANDLE_DATA));
+    if (state == NULL)
+    {
+        LogError("Could not create MQTT device host. Memory allocation failed.\r\n");
+    }
+    else
+    {
+        (void)memset(state, 0, sizeof(MQTTTRANSPORT_HANDLE_DATA));
+        if ((state->hostedIotHubName = STRING_construct(upperConfig->iotHubName)) == NULL)
+        {
+            LogError("Could not create iotHubName for the MQTT device host\r\n");
+            free(state);
+            state = NULL;
+        }
+        else if ((state->hostedIotHubSuffix = STRING_construct(upperConfig->iotHubSuffix)) == NULL)
+        {
+            LogError("Could not create iotHubSuffix for the MQTT device host\r\n");
+            STRING_delete(state->hostedIotHubName);
+            free(state);
+            state = NULL;
+        }
+        else if (upperConfig->protocolGatewayHostName != NULL &&
+            (state->hostedProtocolGatewayHostName = STRING_construct(upperConfig->protocolGatewayHostName)) == NULL)
+        {
+            LogError("Could not create protocolGatewayHostName for the MQTT device host\r\n");
+            STRING_delete(state->hostedIotHubSuffix);
+            STRING_delete(state->hostedIotHubName);
+            free(state);
+            state = NULL;
+        }
+        else if ((state->msgTickCounter = tickcounter_create()) == NULL)
+        {
+            LogError("Could not create tick counter for the MQTT device host\r\n");
+            STRING_delete(state->hostedProtocolGatewayHostName);
+            STRING_delete(state->hostedIotHubSuffix);
+            STRING_delete(state->hostedIotHubName);
+            free(state);
+            state = NULL;
+        }
+        else
+        {
+            state->isDeviceHost = true;
+            state->hostedProtocol = upperConfig->protocol;
+            state->hostIdlePollInterval = DEFAULT_DEVICE_HOST_IDLE_POLL_MS;
+            DList_InitializeListHead(&state->hostedDevices);
+        }
+    }
+    return state;
+}
+
+// A hosted device is serviced on every pass while it has work in progress, otherwise once per idle poll interval.
+static bool isHostedDeviceBusy(PMQTTTRANSPORT_HANDLE_DATA transportState)
+{
+    return transportState->hasActivity ||
+        !transportState->connected ||
+        transportState->currPacketState != PUBLISH_TYPE ||
+        transportState->waitingToSend->Flink != transportState->waitingToSend ||
+        transportState->waitingForAck.Flink != &transportState->waitingForAck;
+}
+
+static void DoWorkDeviceHost(PMQTTTRANSPORT_HANDLE_DATA hostState, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle)
+{
+    uint64_t currentTime;
+    if (tickcounter_get_current_ms(hostState->msgTickCounter, &currentTime) != 0)
+    {
+        LogError("Failure getting the current time for the MQTT device host\r\n");
+    }
+    else
+    {
+        PDLIST_ENTRY currentListEntry = hostState->hostedDevices.Flink;
+        while (currentListEntry != &hostState->hostedDevices)
+        {
+            PMQTTTRANSPORT_HANDLE_DATA deviceState = containingRecord(currentListEntry, MQTTTRANSPORT_HANDLE_DATA, hostedDeviceEntry);
+            currentListEntry = currentListEntry->Flink;
+
+            if ((iotHubClientHandle == NULL || iotHubClientHandle == deviceState->llClientHandle) &&
+                (deviceState->nextServiceTime <= currentTime || deviceState->waitingToSend->Flink != deviceState->waitingToSend))
+            {
+                deviceState->hasActivity = false;
+                IoTHubTransportMqtt_DoWork(deviceState, deviceState->llClientHandle);
+                deviceState->nextServiceTime = isHostedDeviceBusy(deviceState) ? currentTime : currentTime + hostState->hostIdlePollInterval;
+            }
+        }
+    }
+}
+
+static void DestroyDeviceHost(PMQTTTRANSPORT_HANDLE_DATA hostState)
+{
+    size_t i;
+    while (!DList_IsListEmpty(&hostState->hostedDevices))
+    {
+        PDLIST_ENTRY currentListEntry = DList_RemoveHeadList(&hostState->hostedDevices);
+        IoTHubTransportMqtt_Destroy(containingRecord(currentListEntry, MQTTTRANSPORT_HANDLE_DATA, hostedDeviceEntry));
+    }
+    for (i = 0; i < HOST_OPTION_COUNT; i++)
+    {
+        free(hostState->hostOptionValues[i]);
+    }
+    STRING_delete(hostState->hostedIotHubName);
+    STRING_delete(hostState->hostedIotHubSuffix);
+    STRING_delete(hostState->hostedProtocolGatewayHostName);
+    tickcounter_destroy(hostState->msgTickCounter);
+    free(hostState);
+}
+
 extern TRANSPORT_LL_HANDLE IoTHubTransportMqtt_Create(const IOTHUBTRANSPORT_CONFIG* config)
 {
     PMQTTTRANSPORT_HANDLE_DATA result;
@@ -811,6 +1557,20 @@ extern TRANSPORT_LL_HANDLE IoTHubTransportMqtt_Create(const IOTHUBTRANSPORT_CONF
         LogError("Invalid Argument: Config Parameter is NULL.\r\n");
         result = NULL;
     }
+    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_154: [If the upperConfig's deviceId and deviceKey and the config's waitingToSend are all NULL then IoTHubTransportMqtt_Create shall create a device host for the iotHubName and iotHubSuffix, which runs one MQTT connection per device registered with IoTHubTransportMqtt_Register.] */
+    else if (config->upperConfig != NULL && config->upperConfig->deviceId == NULL && config->upperConfig->deviceKey == NULL && config->waitingToSend == NULL)
+    {
+        if (config->upperConfig->protocol == NULL || config->upperConfig->iotHubName == NULL || config->upperConfig->iotHubSuffix == NULL ||
+            strlen(config->upperConfig->iotHubName) == 0)
+        {
+            LogError("Invalid Argument: upperConfig structure contains an invalid parameter\r\n");
+            result = NULL;
+        }
+        else
+        {
+            result = InitializeDeviceHostData(config->upperConfig);
+        }
+    }
     /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_002: [If the parameter config's variables upperConfig or waitingToSend are NULL then IoTHubTransportMqtt_Create shall return NULL.] */
     /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_003: [If the upperConfig's variables deviceId, deviceKey, iotHubName, protocol, or iotHubSuffix are NULL then IoTHubTransportMqtt_Create shall return NULL.] */
     else if (config->upperConfig == NULL || config->upperConfig->protocol == NULL || config->upperConfig->deviceId == NULL || config->upperConfig->deviceKey == NULL ||
@@ -848,7 +1608,15 @@ extern TRANSPORT_LL_HANDLE IoTHubTransportMqtt_Create(const IOTHUBTRANSPORT_CONF
         result = InitializeTransportHandleData(config->upperConfig, config->waitingToSend);
         if (result != NULL)
         {
-            g_msgTickCounter = tickcounter_create();
+            result->msgTickCounter = tickcounter_create();
+#ifdef USE_MQTT_STATIC_POOLS
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_165: [When built with USE_MQTT_STATIC_POOLS, IoTHubTransportMqtt_Create shall allocate the topic buffer of MQTT_MAX_TOPIC_LENGTH bytes and MQTT_MAX_INFLIGHT_MESSAGES waiting acknowledge entries once, and IoTHubTransportMqtt_DoWork shall not allocate them per message.] */
+            if (createStaticPools(result) != 0)
+            {
+                IoTHubTransportMqtt_Destroy(result);
+                result = NULL;
+            }
+#endif
         }
     }
     /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_009: [If any error is encountered then IoTHubTransportMqtt_Create shall return NULL.] */
@@ -875,7 +1643,12 @@ void IoTHubTransportMqtt_Destroy(TRANSPORT_LL_HANDLE handle)
 {
     /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_012: [IoTHubTransportMqtt_Destroy shall do nothing if parameter handle is NULL.] */
     PMQTTTRANSPORT_HANDLE_DATA transportState = (PMQTTTRANSPORT_HANDLE_DATA)handle;
-    if (transportState != NULL)
+    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_159: [IoTHubTransportMqtt_Destroy on a device host shall destroy every device it still hosts.] */
+    if (transportState != NULL && transportState->isDeviceHost)
+    {
+        DestroyDeviceHost(transportState);
+    }
+    else if (transportState != NULL)
     {
         transportState->destroyCalled = true;
 
@@ -887,7 +1660,7 @@ void IoTHubTransportMqtt_Destroy(TRANSPORT_LL_HANDLE handle)
             PDLIST_ENTRY currentEntry = DList_RemoveHeadList(&transportState->waitingForAck);
             MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry = containingRecord(currentEntry, MQTT_MESSAGE_DETAILS_LIST, entry);
             sendMsgComplete(mqttMsgEntry->iotHubMessageEntry, transportState, IOTHUB_BATCHSTATE_FAILED);
-            free(mqttMsgEntry);
+            releaseMessageDetails(transportState, mqttMsgEntry);
         }
 
         /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_014: [IoTHubTransportMqtt_Destroy shall free all the resources currently in use.] */
@@ -899,7 +1672,11 @@ void IoTHubTransportMqtt_Destroy(TRANSPORT_LL_HANDLE handle)
         STRING_delete(transportState->sasTokenSr);
         STRING_delete(transportState->hostAddress);
         STRING_delete(transportState->configPassedThroughUsername);
-        tickcounter_destroy(g_msgTickCounter);
+        free(transportState->topicBuffer);
+#ifdef USE_MQTT_STATIC_POOLS
+        free(transportState->messageDetailsPool);
+#endif
+        tickcounter_destroy(transportState->msgTickCounter);
         free(transportState);
     }
 }
@@ -939,8 +1716,9 @@ void IoTHubTransportMqtt_Unsubscribe(IOTHUB_DEVICE_HANDLE handle)
     {
         /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_020: [IoTHubTransportMqtt_Unsubscribe shall call mqtt_client_unsubscribe to unsubscribe the mqtt message topic.] */
         const char* unsubscribe[] = { STRING_c_str(transportState->mqttMessageTopic) };
-        (void)mqtt_client_unsubscribe(transportState->mqttClient, transportState->packetId++, unsubscribe, 1);
+        (void)mqtt_client_unsubscribe(transportState->mqttClient, getNextPacketId(transportState), unsubscribe, 1);
         transportState->subscribed = false;
+        transportState->isSubscribeAcked = false;
         transportState->receiveMessages = false;
     }
     else
@@ -953,7 +1731,12 @@ extern void IoTHubTransportMqtt_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT
 {
     /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_026: [IoTHubTransportMqtt_DoWork shall do nothing if parameter handle and/or iotHubClientHandle is NULL.] */
     PMQTTTRANSPORT_HANDLE_DATA transportState = (PMQTTTRANSPORT_HANDLE_DATA)handle;
-    if (transportState != NULL && iotHubClientHandle != NULL)
+    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_157: [IoTHubTransportMqtt_DoWork on a device host shall service a hosted device, or only the device of iotHubClientHandle when it is not NULL, when the device has messages waiting to be sent, had MQTT activity or work in progress on its previous pass, or has been idle for the "device_host_idle_poll_ms" interval.] */
+    if (transportState != NULL && transportState->isDeviceHost)
+    {
+        DoWorkDeviceHost(transportState, iotHubClientHandle);
+    }
+    else if (transportState != NULL && iotHubClientHandle != NULL)
     {
         transportState->llClientHandle = iotHubClientHandle;
 
@@ -974,42 +1757,53 @@ extern void IoTHubTransportMqtt_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT
             }
             else if (transportState->currPacketState == PUBLISH_TYPE)
             {
+                /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_147: [IoTHubTransportMqtt_DoWork shall read the transport tick counter once per call.] */
+                (void)tickcounter_get_current_ms(transportState->msgTickCounter, &transportState->currentTime);
+                /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_151: [If "publish_cork_size" is not 0, IoTHubTransportMqtt_DoWork shall cork the MQTT cork layer before publishing and uncork it, sending the collected packets in one write, once the Waiting Acknowledge and waitingToSend lists have been processed.] */
+                setPublishCork(transportState, true);
+
                 PDLIST_ENTRY currentListEntry = transportState->waitingForAck.Flink;
                 while (currentListEntry != &transportState->waitingForAck)
                 {
                     MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry = containingRecord(currentListEntry, MQTT_MESSAGE_DETAILS_LIST, entry);
                     DLIST_ENTRY nextListEntry;
+
+                    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_033: [IoTHubTransportMqtt_DoWork shall iterate through the Waiting Acknowledge messages, in resend deadline order, stopping at the first message whose deadline has not passed.]*/
+                    if (mqttMsgEntry->resendDeadline > transportState->currentTime)
+                    {
+                        break;
+                    }
                     nextListEntry.Flink = currentListEntry->Flink;
 
-                    uint64_t current_ms;
-                    (void)tickcounter_get_current_ms(g_msgTickCounter, &current_ms);
-                    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_033: [IoTHubTransportMqtt_DoWork shall iterate through the Waiting Acknowledge messages looking for any message that has been waiting longer than 2 min.]*/
-                    if (((current_ms - mqttMsgEntry->msgPublishTime) / 1000) > RESEND_TIMEOUT_VALUE_MIN)
+                    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_034: [If IoTHubTransportMqtt_DoWork has resent the message two times then it shall fail the message] */
+                    if (mqttMsgEntry->retryCount >= MAX_SEND_RECOUNT_LIMIT && !mqttMsgEntry->isReconnectResend)
                     {
-                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_034: [If IoTHubTransportMqtt_DoWork has resent the message two times then it shall fail the message] */
-                        if (mqttMsgEntry->retryCount >= MAX_SEND_RECOUNT_LIMIT)
+                        (void)findInflightMessage(transportState, mqttMsgEntry->msgPacketId, true);
+                        (void)DList_RemoveEntryList(currentListEntry);
+                        sendMsgComplete(mqttMsgEntry->iotHubMessageEntry, transportState, IOTHUB_BATCHSTATE_FAILED);
+                        releaseMessageDetails(transportState, mqttMsgEntry);
+                    }
+                    else
+                    {
+                        size_t messageLength;
+                        const unsigned char* messagePayload = RetrieveMessagePayload(mqttMsgEntry->iotHubMessageEntry->messageHandle, &messageLength);
+                        if (messageLength == 0 || messagePayload == NULL)
+                        {
+                            LogError("Failure from creating Message IoTHubMessage_GetData\r\n");
+                        }
+                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_137: [A resent message shall keep the packet id it was first published with.] */
+                        else if (publishMqttMessage(transportState, mqttMsgEntry, messagePayload, messageLength) != 0)
                         {
+                            (void)findInflightMessage(transportState, mqttMsgEntry->msgPacketId, true);
                             (void)DList_RemoveEntryList(currentListEntry);
                             sendMsgComplete(mqttMsgEntry->iotHubMessageEntry, transportState, IOTHUB_BATCHSTATE_FAILED);
-                            free(mqttMsgEntry);
+                            releaseMessageDetails(transportState, mqttMsgEntry);
                         }
                         else
                         {
-                            size_t messageLength;
-                            const unsigned char* messagePayload = RetrieveMessagePayload(mqttMsgEntry->iotHubMessageEntry->messageHandle, &messageLength);
-                            if (messageLength == 0 || messagePayload == NULL)
-                            {
-                                LogError("Failure from creating Message IoTHubMessage_GetData\r\n");
-                            }
-                            else
-                            {
-                                if (publishMqttMessage(transportState, mqttMsgEntry, messagePayload, messageLength) != 0)
-                                {
-                                    (void)DList_RemoveEntryList(currentListEntry);
-                                    sendMsgComplete(mqttMsgEntry->iotHubMessageEntry, transportState, IOTHUB_BATCHSTATE_FAILED);
-                                    free(mqttMsgEntry);
-                                }
-                            }
+                            // the new deadline is in the future, so the walk stops before reaching it again
+                            (void)DList_RemoveEntryList(currentListEntry);
+                            insertWaitingForAck(transportState, mqttMsgEntry);
                         }
                     }
                     currentListEntry = nextListEntry.Flink;
@@ -1030,36 +1824,83 @@ extern void IoTHubTransportMqtt_DoWork(TRANSPORT_LL_HANDLE handle, IOTHUB_CLIENT
                     {
                         LogError("Failure result from IoTHubMessage_GetData\r\n");
                     }
+                    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_140: [IoTHubTransportMqtt_DoWork shall stop publishing new messages, leaving them in waitingToSend in order, while the in-flight window is full or the pacing token buckets are empty.] */
+                    else if (!canPublishMessage(transportState, messageLength))
+                    {
+                        break;
+                    }
                     else
                     {
+                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_141: [IoTHubTransportMqtt_DoWork shall encode the event topic and the url encoded message properties into a buffer kept by the transport and only grow it when it is too small.] */
+                        size_t topicLength = encodeEventTopic(transportState, iothubMsgList->messageHandle);
+                        MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry;
+                        if (topicLength == 0)
+                        {
+                            (void)(DList_RemoveEntryList(currentListEntry));
+                            sendMsgComplete(iothubMsgList, transportState, IOTHUB_BATCHSTATE_FAILED);
+                        }
+                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_144: [If "telemetry_qos" is 0, IoTHubTransportMqtt_DoWork shall publish the message with DELIVER_AT_MOST_ONCE and complete it as soon as mqtt_client_publish returns, without adding it to the Waiting Acknowledge list.] */
+                        else if (transportState->telemetryQos == DELIVER_AT_MOST_ONCE)
+                        {
+                            (void)(DList_RemoveEntryList(currentListEntry));
+                            if (publishMqttMessageAtMostOnce(transportState, transportState->topicBuffer, messagePayload, messageLength) != 0)
+                            {
+                                sendMsgComplete(iothubMsgList, transportState, IOTHUB_BATCHSTATE_FAILED);
+                            }
+                            else
+                            {
+                                consumePublishTokens(transportState, messageLength);
+                                sendMsgComplete(iothubMsgList, transportState, IOTHUB_BATCHSTATE_SUCCESS);
+                            }
+                        }
                         /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_029: [IoTHubTransportMqtt_DoWork shall create a MQTT_MESSAGE_HANDLE and pass this to a call to mqtt_client_publish.] */
-                        MQTT_MESSAGE_DETAILS_LIST* mqttMsgEntry = (MQTT_MESSAGE_DETAILS_LIST*)malloc(sizeof(MQTT_MESSAGE_DETAILS_LIST));
-                        if (mqttMsgEntry == NULL)
+                        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_142: [The encoded topic shall be stored in the same allocation as the waiting acknowledge entry and reused when the message is resent.] */
+                        else if ((mqttMsgEntry = allocateMessageDetails(transportState, topicLength)) == NULL)
                         {
                             LogError("Allocation Error: Failure allocating MQTT Message Detail List.\r\n");
                         }
                         else
                         {
+                            char* msgTopic = (char*)(mqttMsgEntry + 1);
+                            (void)memcpy(msgTopic, transportState->topicBuffer, topicLength + 1);
+                            mqttMsgEntry->msgTopic = msgTopic;
                             mqttMsgEntry->retryCount = 0;
-                            mqttMsgEntry->msgPacketId = transportState->packetId;
+                            mqttMsgEntry->isReconnectResend = false;
+                            mqttMsgEntry->wasResent = false;
+                            mqttMsgEntry->msgPacketId = getNextPacketId(transportState);
+                            mqttMsgEntry->msgLength = messageLength;
+                            mqttMsgEntry->nextInBucket = NULL;
                             mqttMsgEntry->iotHubMessageEntry = iothubMsgList;
 
                             if (publishMqttMessage(transportState, mqttMsgEntry, messagePayload, messageLength) != 0)
                             {
                                 (void)(DList_RemoveEntryList(currentListEntry));
                                 sendMsgComplete(iothubMsgList, transportState, IOTHUB_BATCHSTATE_FAILED);
-                                free(mqttMsgEntry);
+                                releaseMessageDetails(transportState, mqttMsgEntry);
                             }
                             else
                             {
                                 (void)(DList_RemoveEntryList(currentListEntry));
-                                DList_InsertTailList(&(transportState->waitingForAck), &(mqttMsgEntry->entry));
+                                insertWaitingForAck(transportState, mqttMsgEntry);
+                                addInflightMessage(transportState, mqttMsgEntry);
+                                consumePublishTokens(transportState, messageLength);
                             }
                         }
                     }
                     currentListEntry = savedFromCurrentListEntry.Flink;
                 }
+                setPublishCork(transportState, false);
             }
+
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_134: [If "eagerConnect" is set, IoTHubTransportMqtt_DoWork shall call IoTHubClient_LL_ConnectionReady once per connection, when the transport is able to publish (after the subscription is acknowledged, if subscribed).] */
+            if (transportState->eagerConnect &&
+                !transportState->isConnectionReadyReported &&
+                transportState->currPacketState == PUBLISH_TYPE)
+            {
+                transportState->isConnectionReadyReported = true;
+                IoTHubClient_LL_ConnectionReady(iotHubClientHandle);
+            }
+
             /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
             mqtt_client_dowork(transportState->mqttClient);
         }
@@ -1094,6 +1935,56 @@ IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_GetSendStatus(IOTHUB_DEVICE_HANDLE hand
     return result;
 }
 
+static IOTHUB_CLIENT_RESULT saveHostOption(PMQTTTRANSPORT_HANDLE_DATA hostState, const char* option, const void* value)
+{
+    IOTHUB_CLIENT_RESULT result;
+    size_t i;
+    for (i = 0; i < HOST_OPTION_COUNT; i++)
+    {
+        if (strcmp(hostOptions[i].name, option) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == HOST_OPTION_COUNT)
+    {
+        LogInfo("Option %s is only set on the devices currently hosted.\r\n", option);
+        result = IOTHUB_CLIENT_OK;
+    }
+    else if (strcmp("telemetry_qos", option) == 0 && *((int*)value) != 0 && *((int*)value) != 1)
+    {
+        LogError("Invalid telemetry_qos value %d, only 0 and 1 are supported.\r\n", *((int*)value));
+        result = IOTHUB_CLIENT_INVALID_ARG;
+    }
+    else
+    {
+        void* savedValue;
+        if (hostOptions[i].valueSize == 0)
+        {
+            char* savedString = NULL;
+            savedValue = (mallocAndStrcpy_s(&savedString, (const char*)value) == 0) ? savedString : NULL;
+        }
+        else if ((savedValue = malloc(hostOptions[i].valueSize)) != NULL)
+        {
+            (void)memcpy(savedValue, value, hostOptions[i].valueSize);
+        }
+
+        if (savedValue == NULL)
+        {
+            LogError("Failure saving option %s on the MQTT device host\r\n", option);
+            result = IOTHUB_CLIENT_ERROR;
+        }
+        else
+        {
+            free(hostState->hostOptionValues[i]);
+            hostState->hostOptionValues[i] = savedValue;
+            result = IOTHUB_CLIENT_OK;
+        }
+    }
+    return result;
+}
+
 IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_SetOption(TRANSPORT_LL_HANDLE handle, const char* option, const void* value)
 {
     /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_021: [If any parameter is NULL then IoTHubTransportMqtt_SetOption shall return IOTHUB_CLIENT_INVALID_ARG.] */
@@ -1110,8 +2001,32 @@ IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_SetOption(TRANSPORT_LL_HANDLE handle, c
     else
     {
         MQTTTRANSPORT_HANDLE_DATA* transportState = (MQTTTRANSPORT_HANDLE_DATA*)handle;
+        if (transportState->isDeviceHost)
+        {
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_160: [If the option parameter is set to "device_host_idle_poll_ms" on a device host then the value shall be a size_t_ptr setting how often, in milliseconds, a hosted device without work in progress is serviced.] */
+            if (strcmp(DEVICE_HOST_IDLE_POLL_OPTION, option) == 0)
+            {
+                transportState->hostIdlePollInterval = *((size_t*)value);
+                result = IOTHUB_CLIENT_OK;
+            }
+            /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_169: [IoTHubTransportMqtt_SetOption on a device host shall keep a copy of the value of the MQTT transport options and of the "TrustedCerts", "x509certificate" and "x509privatekey" options, and IoTHubTransportMqtt_Register shall set them on every device it registers afterwards.] */
+            else if ((result = saveHostOption(transportState, option, value)) == IOTHUB_CLIENT_OK)
+            {
+                /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_161: [IoTHubTransportMqtt_SetOption on a device host shall apply any other option to every device currently hosted and return the first failure, if any.] */
+                PDLIST_ENTRY currentListEntry = transportState->hostedDevices.Flink;
+                while (currentListEntry != &transportState->hostedDevices)
+                {
+                    IOTHUB_CLIENT_RESULT deviceResult = IoTHubTransportMqtt_SetOption(containingRecord(currentListEntry, MQTTTRANSPORT_HANDLE_DATA, hostedDeviceEntry), option, value);
+                    if (deviceResult != IOTHUB_CLIENT_OK && result == IOTHUB_CLIENT_OK)
+                    {
+                        result = deviceResult;
+                    }
+                    currentListEntry = currentListEntry->Flink;
+                }
+            }
+        }
         /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_031: [If the option parameter is set to "logtrace" then the value shall be a bool_ptr and the value will determine if the mqtt client log is on or off.] */
-        if (strcmp("logtrace", option) == 0)
+        else if (strcmp("logtrace", option) == 0)
         {
             bool* traceVal = (bool*)value;
             mqtt_client_set_trace(transportState->mqttClient, *traceVal, *traceVal);
@@ -1133,6 +2048,72 @@ IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_SetOption(TRANSPORT_LL_HANDLE handle, c
             }
             result = IOTHUB_CLIENT_OK;
         }
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_133: [If the option parameter is set to "eagerConnect" then the value shall be a bool_ptr and the value will determine if IoTHubClient_LL_ConnectionReady is called once the connection is ready.] */
+        else if (strcmp("eagerConnect", option) == 0)
+        {
+            transportState->eagerConnect = *((bool*)value);
+            transportState->isConnectionReadyReported = false;
+            result = IOTHUB_CLIENT_OK;
+        }
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_143: [If the option parameter is set to "telemetry_qos" then the value shall be an int_ptr of 0 or 1 selecting the QoS used to publish events; any other value shall return IOTHUB_CLIENT_INVALID_ARG.] */
+        else if (strcmp("telemetry_qos", option) == 0)
+        {
+            int qos = *((int*)value);
+            if (qos == 0)
+            {
+                transportState->telemetryQos = DELIVER_AT_MOST_ONCE;
+                result = IOTHUB_CLIENT_OK;
+            }
+            else if (qos == 1)
+            {
+                transportState->telemetryQos = DELIVER_AT_LEAST_ONCE;
+                result = IOTHUB_CLIENT_OK;
+            }
+            else
+            {
+                LogError("Invalid telemetry_qos value %d, only 0 and 1 are supported.\r\n", qos);
+                result = IOTHUB_CLIENT_INVALID_ARG;
+            }
+        }
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_138: [If the option parameter is set to "max_inflight_messages" or "max_inflight_bytes" then the value shall be a size_t_ptr limiting the unacknowledged publishes; 0 removes the limit.] */
+        else if (strcmp("max_inflight_messages", option) == 0)
+        {
+            transportState->maxInflightMessages = *((size_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        else if (strcmp("max_inflight_bytes", option) == 0)
+        {
+            transportState->maxInflightBytes = *((size_t*)value);
+            result = IOTHUB_CLIENT_OK;
+        }
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_139: [If the option parameter is set to "messages_per_second" or "bytes_per_second" then the value shall be a size_t_ptr setting the token bucket rate for new publishes, starting with a full bucket; 0 disables pacing.] */
+        else if (strcmp("messages_per_second", option) == 0)
+        {
+            transportState->messagesPerSecond = *((size_t*)value);
+            transportState->messageTokens = (int64_t)(transportState->messagesPerSecond * TOKEN_BUCKET_MAX_REFILL_MS);
+            (void)tickcounter_get_current_ms(transportState->msgTickCounter, &transportState->lastTokenRefillTime);
+            result = IOTHUB_CLIENT_OK;
+        }
+        else if (strcmp("bytes_per_second", option) == 0)
+        {
+            transportState->bytesPerSecond = *((size_t*)value);
+            transportState->byteTokens = (int64_t)(transportState->bytesPerSecond * TOKEN_BUCKET_MAX_REFILL_MS);
+            (void)tickcounter_get_current_ms(transportState->msgTickCounter, &transportState->lastTokenRefillTime);
+            result = IOTHUB_CLIENT_OK;
+        }
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_153: [If the option parameter is set to "publish_cork_size" then the value shall be a size_t_ptr setting the number of bytes of MQTT packets collected into one write while IoTHubTransportMqtt_DoWork publishes; 0 disables the corking.] */
+        else if (strcmp(CORK_SIZE_OPTION, option) == 0)
+        {
+            transportState->publishCorkSize = *((size_t*)value);
+            if (transportState->isCorkLayerCreated)
+            {
+                result = (xio_setoption(transportState->xioTransport, COALESCINGIO_OPTION_MAX_WRITE_SIZE, value) == 0) ? IOTHUB_CLIENT_OK : IOTHUB_CLIENT_ERROR;
+            }
+            else
+            {
+                result = (createCorkLayerIfNecessary(transportState) == 0) ? IOTHUB_CLIENT_OK : IOTHUB_CLIENT_ERROR;
+            }
+        }
         else
         {
             /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_032: [IoTHubTransportMqtt_SetOption shall pass down the option to xio_setoption if the option parameter is not a known option string for the MQTT transport.] */
@@ -1157,6 +2138,77 @@ IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_SetOption(TRANSPORT_LL_HANDLE handle, c
     return result;
 }
 
+static IOTHUB_DEVICE_HANDLE RegisterHostedDevice(PMQTTTRANSPORT_HANDLE_DATA hostState, const char* deviceId, const char* deviceKey, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, PDLIST_ENTRY waitingToSend)
+{
+    IOTHUB_DEVICE_HANDLE result = NULL;
+    PDLIST_ENTRY currentListEntry = hostState->hostedDevices.Flink;
+    while (currentListEntry != &hostState->hostedDevices)
+    {
+        PMQTTTRANSPORT_HANDLE_DATA deviceState = containingRecord(currentListEntry, MQTTTRANSPORT_HANDLE_DATA, hostedDeviceEntry);
+        if (strcmp(STRING_c_str(deviceState->device_id), deviceId) == 0)
+        {
+            break;
+        }
+        currentListEntry = currentListEntry->Flink;
+    }
+
+    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_156: [IoTHubTransportMqtt_Register on a device host shall return NULL if the deviceId is already hosted or the device transport cannot be created.] */
+    if (currentListEntry != &hostState->hostedDevices)
+    {
+        LogError("Transport already has device registered by id: [%s]", deviceId);
+    }
+    else
+    {
+        IOTHUB_CLIENT_CONFIG upperConfig;
+        IOTHUBTRANSPORT_CONFIG transportConfig;
+        PMQTTTRANSPORT_HANDLE_DATA deviceState;
+
+        upperConfig.protocol = hostState->hostedProtocol;
+        upperConfig.deviceId = deviceId;
+        upperConfig.deviceKey = deviceKey;
+        upperConfig.iotHubName = STRING_c_str(hostState->hostedIotHubName);
+        upperConfig.iotHubSuffix = STRING_c_str(hostState->hostedIotHubSuffix);
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_171: [The transport of a hosted device shall be created with the protocolGatewayHostName given to the device host.] */
+        upperConfig.protocolGatewayHostName = (hostState->hostedProtocolGatewayHostName == NULL) ? NULL : STRING_c_str(hostState->hostedProtocolGatewayHostName);
+        transportConfig.upperConfig = &upperConfig;
+        transportConfig.waitingToSend = waitingToSend;
+
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_155: [IoTHubTransportMqtt_Register on a device host shall create a transport for the device with its own MQTT connection, add it to the hosted devices and return it as the IOTHUB_DEVICE_HANDLE.] */
+        if ((deviceState = (PMQTTTRANSPORT_HANDLE_DATA)IoTHubTransportMqtt_Create(&transportConfig)) == NULL)
+        {
+            LogError("Failure creating the transport for hosted device [%s]", deviceId);
+        }
+        else
+        {
+            size_t i;
+            for (i = 0; i < HOST_OPTION_COUNT; i++)
+            {
+                /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_169: [IoTHubTransportMqtt_SetOption on a device host shall keep a copy of the value of the MQTT transport options and of the "TrustedCerts", "x509certificate" and "x509privatekey" options, and IoTHubTransportMqtt_Register shall set them on every device it registers afterwards.] */
+                if (hostState->hostOptionValues[i] != NULL &&
+                    IoTHubTransportMqtt_SetOption(deviceState, hostOptions[i].name, hostState->hostOptionValues[i]) != IOTHUB_CLIENT_OK)
+                {
+                    LogError("Failure setting option %s on hosted device [%s]", hostOptions[i].name, deviceId);
+                    break;
+                }
+            }
+
+            if (i < HOST_OPTION_COUNT)
+            {
+                IoTHubTransportMqtt_Destroy(deviceState);
+            }
+            else
+            {
+                deviceState->isRegistered = true;
+                deviceState->llClientHandle = iotHubClientHandle;
+                deviceState->deviceHost = hostState;
+                DList_InsertTailList(&hostState->hostedDevices, &deviceState->hostedDeviceEntry);
+                result = (IOTHUB_DEVICE_HANDLE)deviceState;
+            }
+        }
+    }
+    return result;
+}
+
 IOTHUB_DEVICE_HANDLE IoTHubTransportMqtt_Register(TRANSPORT_LL_HANDLE handle, const char* deviceId, const char* deviceKey, IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle, PDLIST_ENTRY waitingToSend)
 {
     IOTHUB_DEVICE_HANDLE result;
@@ -1170,8 +2222,12 @@ IOTHUB_DEVICE_HANDLE IoTHubTransportMqtt_Register(TRANSPORT_LL_HANDLE handle, co
     {
         MQTTTRANSPORT_HANDLE_DATA* transportState = (MQTTTRANSPORT_HANDLE_DATA*)handle;
 
+        if (transportState->isDeviceHost)
+        {
+            result = RegisterHostedDevice(transportState, deviceId, deviceKey, iotHubClientHandle, waitingToSend);
+        }
         // Codes_SRS_IOTHUB_MQTT_TRANSPORT_17_003: [ IoTHubTransportMqtt_Register shall return NULL if deviceId or deviceKey do not match the deviceId and deviceKey passed in during IoTHubTransportMqtt_Create.]
-        if (strcmp(STRING_c_str(transportState->device_id), deviceId) != 0)
+        else if (strcmp(STRING_c_str(transportState->device_id), deviceId) != 0)
         {
             result = NULL;
         }
@@ -1206,10 +2262,25 @@ void IoTHubTransportMqtt_Unregister(IOTHUB_DEVICE_HANDLE deviceHandle)
     {
         MQTTTRANSPORT_HANDLE_DATA* transportState = (MQTTTRANSPORT_HANDLE_DATA*)deviceHandle;
 
-        transportState->isRegistered = false;
+        /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_158: [IoTHubTransportMqtt_Unregister on a hosted device shall remove it from its device host and destroy it.] */
+        if (transportState->deviceHost != NULL)
+        {
+            (void)DList_RemoveEntryList(&transportState->hostedDeviceEntry);
+            IoTHubTransportMqtt_Destroy(transportState);
+        }
+        else
+        {
+            transportState->isRegistered = false;
+        }
     }
 }
 
+IOTHUB_CLIENT_RESULT IoTHubTransportMqtt_SetDeviceOption(IOTHUB_DEVICE_HANDLE handle, const char* option, const void* value)
+{
+    /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_170: [IoTHubTransportMqtt_SetDeviceOption shall set the option on the transport of the device, which is the hosted device's own transport on a device host, as IoTHubTransportMqtt_SetOption does.] */
+    return IoTHubTransportMqtt_SetOption((TRANSPORT_LL_HANDLE)handle, option, value);
+}
+
 TRANSPORT_PROVIDER myfunc = {
     IoTHubTransportMqtt_SetOption,
     IoTHubTransportMqtt_Create, 
@@ -1219,7 +2290,9 @@ TRANSPORT_PROVIDER myfunc = {
     IoTHubTransportMqtt_Subscribe, 
     IoTHubTransportMqtt_Unsubscribe, 
     IoTHubTransportMqtt_DoWork, 
-    IoTHubTransportMqtt_GetSendStatus
+    IoTHubTransportMqtt_GetSendStatus,
+    NULL,
+    IoTHubTransportMqtt_SetDeviceOption
 };
 
 /* Codes_SRS_IOTHUB_MQTT_TRANSPORT_07_022: [This function shall return a pointer to a structure of type TRANSPORT_PROVIDER having the following values for its fields: IoTHubTransport_Create = IoTHubTransportMqtt_Create
@@ -0,0 +1,644 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <cstdlib>
+#ifdef _CRTDBG_MAP_ALLOC
+#include <crtdbg.h>
+#endif
+
+#include <cstddef>
+#include <cstring>
+
+#include "testrunnerswitcher.h"
+#include "micromock.h"
+#include "micromockcharstararenullterminatedstrings.h"
+#include "azure_c_shared_utility/lock.h"
+#include "azure_c_shared_utility/xio.h"
+#include "coalescingio.h"
+
+#define GBALLOC_H
+extern "C" int gballoc_init(void);
+extern "C" void gballoc_deinit(void);
+extern "C" void* gballoc_malloc(size_t size);
+extern "C" void* gballoc_calloc(size_t nmemb, size_t size);
+extern "C" void* gballoc_realloc(void* ptr, size_t size);
+extern "C" void gballoc_free(void* ptr);
+
+namespace BASEIMPLEMENTATION
+{
+#define Lock(x) (LOCK_OK + gballocState - gballocState) /*compiler warning about constant in if condition*/
+#define Unlock(x) (LOCK_OK + gballocState - gballocState)
+#define Lock_Init() (LOCK_HANDLE)0x42
+#define Lock_Deinit(x) (LOCK_OK + gballocState - gballocState)
+#include "gballoc.c"
+#undef Lock
+#undef Unlock
+#undef Lock_Init
+#undef Lock_Deinit
+};
+
+static MICROMOCK_MUTEX_HANDLE g_testByTest;
+static MICROMOCK_GLOBAL_SEMAPHORE_HANDLE g_dllByDll;
+
+static const XIO_HANDLE TEST_UNDERLYING_IO = (XIO_HANDLE)0x4242;
+static void* TEST_CONTEXT_1 = (void*)0x4301;
+static void* TEST_CONTEXT_2 = (void*)0x4302;
+static void* TEST_CONTEXT_3 = (void*)0x4303;
+static const unsigned char TEST_BYTES[] = { 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x80, 0x90, 0xA0, 0xB0, 0xC0 };
+
+static size_t currentmalloc_call;
+static size_t whenShallmalloc_fail;
+
+// Writes reaching the underlying I/O
+#define TEST_MAX_UNDERLYING_SENDS 4
+static unsigned char g_underlying_send_bytes[TEST_MAX_UNDERLYING_SENDS][64];
+static size_t g_underlying_send_sizes[TEST_MAX_UNDERLYING_SENDS];
+static ON_SEND_COMPLETE g_underlying_send_callbacks[TEST_MAX_UNDERLYING_SENDS];
+static void* g_underlying_send_contexts[TEST_MAX_UNDERLYING_SENDS];
+static size_t g_number_of_underlying_sends;
+
+// Send completions reported to the writer
+#define TEST_MAX_COMPLETIONS 8
+static void* g_completed_contexts[TEST_MAX_COMPLETIONS];
+static IO_SEND_RESULT g_completed_results[TEST_MAX_COMPLETIONS];
+static size_t g_number_of_completions;
+
+static void test_on_send_complete(void* context, IO_SEND_RESULT send_result)
+{
+    if (g_number_of_completions < TEST_MAX_COMPLETIONS)
+    {
+        g_completed_contexts[g_number_of_completions] = context;
+        g_completed_results[g_number_of_completions] = send_result;
+    }
+    g_number_of_completions++;
+}
+
+static void test_on_io_open_complete(void* context, IO_OPEN_RESULT open_result)
+{
+    (void)context;
+    (void)open_result;
+}
+
+static void test_on_bytes_received(void* context, const unsigned char* buffer, size_t size)
+{
+    (void)context;
+    (void)buffer;
+    (void)size;
+}
+
+static void test_on_io_error(void* context)
+{
+    (void)context;
+}
+
+static void test_on_io_close_complete(void* context)
+{
+    (void)context;
+}
+
+TYPED_MOCK_CLASS(CCoalescingIoMocks, CGlobalMock)
+{
+public:
+    MOCK_STATIC_METHOD_1(, void*, gballoc_malloc, size_t, size)
+        void* result2;
+        currentmalloc_call++;
+        if (whenShallmalloc_fail > 0 && currentmalloc_call == whenShallmalloc_fail)
+        {
+            result2 = NULL;
+        }
+        else
+        {
+            result2 = BASEIMPLEMENTATION::gballoc_malloc(size);
+        }
+    MOCK_METHOD_END(void*, result2);
+
+    MOCK_STATIC_METHOD_2(, void*, gballoc_realloc, void*, ptr, size_t, size)
+    MOCK_METHOD_END(void*, BASEIMPLEMENTATION::gballoc_realloc(ptr, size));
+
+    MOCK_STATIC_METHOD_1(, void, gballoc_free, void*, ptr)
+        BASEIMPLEMENTATION::gballoc_free(ptr);
+    MOCK_VOID_METHOD_END()
+
+    MOCK_STATIC_METHOD_5(, int, xio_open, XIO_HANDLE, xio, ON_IO_OPEN_COMPLETE, on_io_open_complete, ON_BYTES_RECEIVED, on_bytes_received, ON_IO_ERROR, on_io_error, void*, callback_context)
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_3(, int, xio_close, XIO_HANDLE, xio, ON_IO_CLOSE_COMPLETE, on_io_close_complete, void*, callback_context)
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_5(, int, xio_send, XIO_HANDLE, xio, const void*, buffer, size_t, size, ON_SEND_COMPLETE, on_send_complete, void*, callback_context)
+        if (g_number_of_underlying_sends < TEST_MAX_UNDERLYING_SENDS)
+        {
+            (void)memcpy(g_underlying_send_bytes[g_number_of_underlying_sends], buffer, (size < sizeof(g_underlying_send_bytes[0])) ? size : sizeof(g_underlying_send_bytes[0]));
+            g_underlying_send_sizes[g_number_of_underlying_sends] = size;
+            g_underlying_send_callbacks[g_number_of_underlying_sends] = on_send_complete;
+            g_underlying_send_contexts[g_number_of_underlying_sends] = callback_context;
+        }
+        g_number_of_underlying_sends++;
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_1(, void, xio_dowork, XIO_HANDLE, xio)
+    MOCK_VOID_METHOD_END()
+
+    MOCK_STATIC_METHOD_3(, int, xio_setoption, XIO_HANDLE, xio, const char*, optionName, const void*, value)
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_1(, void, xio_destroy, XIO_HANDLE, xio)
+    MOCK_VOID_METHOD_END()
+};
+
+DECLARE_GLOBAL_MOCK_METHOD_1(CCoalescingIoMocks, , void*, gballoc_malloc, size_t, size);
+DECLARE_GLOBAL_MOCK_METHOD_2(CCoalescingIoMocks, , void*, gballoc_realloc, void*, ptr, size_t, size);
+DECLARE_GLOBAL_MOCK_METHOD_1(CCoalescingIoMocks, , void, gballoc_free, void*, ptr);
+
+DECLARE_GLOBAL_MOCK_METHOD_5(CCoalescingIoMocks, , int, xio_open, XIO_HANDLE, xio, ON_IO_OPEN_COMPLETE, on_io_open_complete, ON_BYTES_RECEIVED, on_bytes_received, ON_IO_ERROR, on_io_error, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_3(CCoalescingIoMocks, , int, xio_close, XIO_HANDLE, xio, ON_IO_CLOSE_COMPLETE, on_io_close_complete, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_5(CCoalescingIoMocks, , int, xio_send, XIO_HANDLE, xio, const void*, buffer, size_t, size, ON_SEND_COMPLETE, on_send_complete, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_1(CCoalescingIoMocks, , void, xio_dowork, XIO_HANDLE, xio);
+DECLARE_GLOBAL_MOCK_METHOD_3(CCoalescingIoMocks, , int, xio_setoption, XIO_HANDLE, xio, const char*, optionName, const void*, value);
+DECLARE_GLOBAL_MOCK_METHOD_1(CCoalescingIoMocks, , void, xio_destroy, XIO_HANDLE, xio);
+
+BEGIN_TEST_SUITE(coalescingio_unittests)
+
+    static CONCRETE_IO_HANDLE createCoalescingIo(size_t max_write_size, bool hold_writes)
+    {
+        COALESCINGIO_CONFIG config = { TEST_UNDERLYING_IO, max_write_size, hold_writes };
+        return coalescingio_get_interface_description()->concrete_io_create(&config, NULL);
+    }
+
+    TEST_SUITE_INITIALIZE(TestClassInitialize)
+    {
+        INITIALIZE_MEMORY_DEBUG(g_dllByDll);
+        g_testByTest = MicroMockCreateMutex();
+        ASSERT_IS_NOT_NULL(g_testByTest);
+    }
+
+    TEST_SUITE_CLEANUP(TestClassCleanup)
+    {
+        MicroMockDestroyMutex(g_testByTest);
+        DEINITIALIZE_MEMORY_DEBUG(g_dllByDll);
+    }
+
+    TEST_FUNCTION_INITIALIZE(TestMethodInitialize)
+    {
+        if (!MicroMockAcquireMutex(g_testByTest))
+        {
+            ASSERT_FAIL("our mutex is ABANDONED. Failure in test framework");
+        }
+
+        currentmalloc_call = 0;
+        whenShallmalloc_fail = 0;
+
+        g_number_of_underlying_sends = 0;
+        g_number_of_completions = 0;
+    }
+
+    TEST_FUNCTION_CLEANUP(TestMethodCleanup)
+    {
+        if (!MicroMockReleaseMutex(g_testByTest))
+        {
+            ASSERT_FAIL("failure in test framework at ReleaseMutex");
+        }
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_002: [If io_create_parameters is NULL or its underlying_io is NULL, coalescingio_create shall fail and return NULL.] */
+    TEST_FUNCTION(coalescingio_create_with_NULL_parameters_fails)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        COALESCINGIO_CONFIG config = { NULL, 16, true };
+
+        // act
+        CONCRETE_IO_HANDLE result1 = coalescingio_get_interface_description()->concrete_io_create(NULL, NULL);
+        CONCRETE_IO_HANDLE result2 = coalescingio_get_interface_description()->concrete_io_create(&config, NULL);
+
+        // assert
+        ASSERT_IS_NULL(result1);
+        ASSERT_IS_NULL(result2);
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_003: [If allocating the instance fails, coalescingio_create shall return NULL.] */
+    TEST_FUNCTION(coalescingio_create_malloc_fails)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        whenShallmalloc_fail = 1;
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+
+        // act
+        CONCRETE_IO_HANDLE result = createCoalescingIo(16, true);
+
+        // assert
+        ASSERT_IS_NULL(result);
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_001: [coalescingio_create shall return a handle wrapping the underlying_io of the COALESCINGIO_CONFIG passed in io_create_parameters, with its max_write_size and hold_writes settings; the buffer shall only be allocated by the first buffered write.] */
+    TEST_FUNCTION(coalescingio_create_succeeds)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+
+        // act
+        CONCRETE_IO_HANDLE result = createCoalescingIo(16, true);
+
+        // assert
+        ASSERT_IS_NOT_NULL(result);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(result);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_004: [coalescingio_open shall call xio_open on the underlying I/O with the same arguments and return its result.] */
+    TEST_FUNCTION(coalescingio_open_opens_the_underlying_io)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, xio_open(TEST_UNDERLYING_IO, test_on_io_open_complete, test_on_bytes_received, test_on_io_error, TEST_CONTEXT_1))
+            .SetReturn(42);
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_open(coalescing_io, test_on_io_open_complete, test_on_bytes_received, test_on_io_error, TEST_CONTEXT_1);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 42, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_008: [If the writes are not held, max_write_size is 0 or size is larger than max_write_size, coalescingio_send shall send the buffered bytes first and then pass the write to the underlying I/O with xio_send.] */
+    TEST_FUNCTION(coalescingio_send_passes_the_write_through_when_the_writes_are_not_held)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, false);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, xio_send(TEST_UNDERLYING_IO, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1));
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 0, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_006: [While the writes are held, coalescingio_send shall copy the bytes into a buffer of max_write_size bytes, keep on_send_complete for when they are sent and return 0.] */
+    /* Tests_SRS_COALESCINGIO_01_010: [coalescingio_dowork shall send the buffered bytes, call xio_dowork on the underlying I/O and then send the bytes buffered while it ran.] */
+    /* Tests_SRS_COALESCINGIO_01_011: [The buffered bytes shall be sent to the underlying I/O with one xio_send call.] */
+    TEST_FUNCTION(coalescingio_dowork_sends_the_held_writes_in_one_underlying_send)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        mocks.ResetAllCalls();
+
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
+            .ExpectedTimesExactly(2);
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, xio_send(TEST_UNDERLYING_IO, IGNORED_PTR_ARG, 7, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(4)
+            .IgnoreArgument(5);
+        STRICT_EXPECTED_CALL(mocks, xio_dowork(TEST_UNDERLYING_IO));
+
+        // act
+        int result1 = coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        int result2 = coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 3, 4, test_on_send_complete, TEST_CONTEXT_2);
+        size_t sends_before_dowork = g_number_of_underlying_sends;
+        coalescingio_get_interface_description()->concrete_io_dowork(coalescing_io);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 0, result1);
+        ASSERT_ARE_EQUAL(int, 0, result2);
+        ASSERT_ARE_EQUAL(size_t, 0, sends_before_dowork);
+        ASSERT_ARE_EQUAL(size_t, 1, g_number_of_underlying_sends);
+        ASSERT_ARE_EQUAL(int, 0, memcmp(g_underlying_send_bytes[0], TEST_BYTES, 7));
+        ASSERT_ARE_EQUAL(size_t, 0, g_number_of_completions);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_012: [When the underlying send of the merged bytes completes, each write merged into it shall be completed with the result of that send, in the order the writes were made.] */
+    TEST_FUNCTION(coalescingio_completes_the_merged_writes_with_the_result_of_the_underlying_send)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 3, 2, NULL, NULL);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 5, 2, test_on_send_complete, TEST_CONTEXT_2);
+        coalescingio_get_interface_description()->concrete_io_dowork(coalescing_io);
+        mocks.ResetAllCalls();
+
+        ASSERT_ARE_EQUAL(size_t, 1, g_number_of_underlying_sends);
+        ASSERT_IS_TRUE(g_underlying_send_callbacks[0] != NULL);
+
+        // act
+        g_underlying_send_callbacks[0](g_underlying_send_contexts[0], IO_SEND_OK);
+
+        // assert
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_completions);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_1, g_completed_contexts[0]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_OK, (int)g_completed_results[0]);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_2, g_completed_contexts[1]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_OK, (int)g_completed_results[1]);
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_012: [When the underlying send of the merged bytes completes, each write merged into it shall be completed with the result of that send, in the order the writes were made.] */
+    TEST_FUNCTION(coalescingio_completes_the_merged_writes_with_the_error_of_the_underlying_send)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 3, 2, test_on_send_complete, TEST_CONTEXT_2);
+        coalescingio_get_interface_description()->concrete_io_dowork(coalescing_io);
+        mocks.ResetAllCalls();
+
+        // act
+        g_underlying_send_callbacks[0](g_underlying_send_contexts[0], IO_SEND_ERROR);
+
+        // assert
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_completions);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_ERROR, (int)g_completed_results[0]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_ERROR, (int)g_completed_results[1]);
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_013: [If that xio_send fails, each write merged into it shall be completed with IO_SEND_ERROR.] */
+    TEST_FUNCTION(coalescingio_completes_the_merged_writes_with_IO_SEND_ERROR_when_the_underlying_send_fails)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 3, 2, test_on_send_complete, TEST_CONTEXT_2);
+        mocks.ResetAllCalls();
+
+        EXPECTED_CALL(mocks, xio_send(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_NUM_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .SetReturn(1);
+
+        // act
+        coalescingio_get_interface_description()->concrete_io_dowork(coalescing_io);
+
+        // assert
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_completions);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_1, g_completed_contexts[0]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_ERROR, (int)g_completed_results[0]);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_2, g_completed_contexts[1]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_ERROR, (int)g_completed_results[1]);
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_007: [If the write does not fit in the space left in the buffer, coalescingio_send shall send the buffered bytes before copying it.] */
+    TEST_FUNCTION(coalescingio_send_sends_the_buffered_bytes_when_the_write_does_not_fit)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(8, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 5, test_on_send_complete, TEST_CONTEXT_1);
+        mocks.ResetAllCalls();
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 5, 5, test_on_send_complete, TEST_CONTEXT_2);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 0, result);
+        ASSERT_ARE_EQUAL(size_t, 1, g_number_of_underlying_sends);
+        ASSERT_ARE_EQUAL(size_t, 5, g_underlying_send_sizes[0]);
+        ASSERT_ARE_EQUAL(int, 0, memcmp(g_underlying_send_bytes[0], TEST_BYTES, 5));
+
+        // the second write stays buffered until the next DoWork
+        coalescingio_get_interface_description()->concrete_io_dowork(coalescing_io);
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_underlying_sends);
+        ASSERT_ARE_EQUAL(size_t, 5, g_underlying_send_sizes[1]);
+        ASSERT_ARE_EQUAL(int, 0, memcmp(g_underlying_send_bytes[1], TEST_BYTES + 5, 5));
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_008: [If the writes are not held, max_write_size is 0 or size is larger than max_write_size, coalescingio_send shall send the buffered bytes first and then pass the write to the underlying I/O with xio_send.] */
+    TEST_FUNCTION(coalescingio_send_sends_an_oversized_write_directly_after_the_buffered_bytes)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(8, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, xio_send(TEST_UNDERLYING_IO, IGNORED_PTR_ARG, 3, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(4)
+            .IgnoreArgument(5);
+        STRICT_EXPECTED_CALL(mocks, xio_send(TEST_UNDERLYING_IO, TEST_BYTES, 10, test_on_send_complete, TEST_CONTEXT_2));
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 10, test_on_send_complete, TEST_CONTEXT_2);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 0, result);
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_underlying_sends);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_009: [If the buffer cannot be allocated or the send completion cannot be saved, coalescingio_send shall fail and return a non-zero value.] */
+    TEST_FUNCTION(coalescingio_send_fails_when_the_buffer_cannot_be_allocated)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        mocks.ResetAllCalls();
+        whenShallmalloc_fail = currentmalloc_call + 1;
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+
+        // assert
+        ASSERT_ARE_NOT_EQUAL(int, 0, result);
+        ASSERT_ARE_EQUAL(size_t, 0, g_number_of_underlying_sends);
+        ASSERT_ARE_EQUAL(size_t, 0, g_number_of_completions);
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_020: [coalescingio_destroy shall complete the writes still buffered with IO_SEND_CANCELLED, without sending them.] */
+    /* Tests_SRS_COALESCINGIO_01_021: [coalescingio_destroy shall destroy the underlying I/O and free all the resources of the instance.] */
+    TEST_FUNCTION(coalescingio_destroy_cancels_the_buffered_writes)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 3, 2, test_on_send_complete, TEST_CONTEXT_2);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, xio_destroy(TEST_UNDERLYING_IO));
+        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG))
+            .ExpectedTimesExactly(3);
+
+        // act
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+
+        // assert
+        ASSERT_ARE_EQUAL(size_t, 0, g_number_of_underlying_sends);
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_completions);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_1, g_completed_contexts[0]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_CANCELLED, (int)g_completed_results[0]);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_2, g_completed_contexts[1]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_CANCELLED, (int)g_completed_results[1]);
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_020: [coalescingio_destroy shall complete the writes still buffered with IO_SEND_CANCELLED, without sending them.] */
+    TEST_FUNCTION(coalescingio_destroy_leaves_the_sent_writes_to_the_underlying_io)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        coalescingio_get_interface_description()->concrete_io_dowork(coalescing_io);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 3, 2, test_on_send_complete, TEST_CONTEXT_2);
+        mocks.ResetAllCalls();
+
+        // act
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+
+        // assert
+        ASSERT_ARE_EQUAL(size_t, 1, g_number_of_completions);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_2, g_completed_contexts[0]);
+        ASSERT_ARE_EQUAL(int, (int)IO_SEND_CANCELLED, (int)g_completed_results[0]);
+
+        // cleanup: the underlying I/O reports the write it was given
+        g_underlying_send_callbacks[0](g_underlying_send_contexts[0], IO_SEND_CANCELLED);
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_completions);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_1, g_completed_contexts[1]);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_005: [coalescingio_close shall send the buffered bytes and then call xio_close on the underlying I/O, returning its result.] */
+    TEST_FUNCTION(coalescingio_close_sends_the_buffered_bytes_before_closing)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, xio_send(TEST_UNDERLYING_IO, IGNORED_PTR_ARG, 3, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(4)
+            .IgnoreArgument(5);
+        STRICT_EXPECTED_CALL(mocks, xio_close(TEST_UNDERLYING_IO, test_on_io_close_complete, TEST_CONTEXT_3));
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_close(coalescing_io, test_on_io_close_complete, TEST_CONTEXT_3);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 0, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_014: [If optionName is COALESCINGIO_OPTION_HOLD_WRITES, coalescingio_setoption shall save the bool value; setting it to false shall send the buffered bytes.] */
+    TEST_FUNCTION(coalescingio_setoption_hold_writes_false_sends_the_buffered_bytes)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, false);
+        bool hold_writes = true;
+        (void)coalescingio_get_interface_description()->concrete_io_setoption(coalescing_io, COALESCINGIO_OPTION_HOLD_WRITES, &hold_writes);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES + 3, 2, test_on_send_complete, TEST_CONTEXT_2);
+        size_t sends_while_held = g_number_of_underlying_sends;
+        hold_writes = false;
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_setoption(coalescing_io, COALESCINGIO_OPTION_HOLD_WRITES, &hold_writes);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 0, result);
+        ASSERT_ARE_EQUAL(size_t, 0, sends_while_held);
+        ASSERT_ARE_EQUAL(size_t, 1, g_number_of_underlying_sends);
+        ASSERT_ARE_EQUAL(size_t, 5, g_underlying_send_sizes[0]);
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_015: [If optionName is COALESCINGIO_OPTION_MAX_WRITE_SIZE, coalescingio_setoption shall send the buffered bytes, release the buffer and save the size_t value.] */
+    TEST_FUNCTION(coalescingio_setoption_max_write_size_sends_the_buffered_bytes_and_applies_the_size)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        size_t max_write_size = 4;
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 3, test_on_send_complete, TEST_CONTEXT_1);
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_setoption(coalescing_io, COALESCINGIO_OPTION_MAX_WRITE_SIZE, &max_write_size);
+        (void)coalescingio_get_interface_description()->concrete_io_send(coalescing_io, TEST_BYTES, 5, test_on_send_complete, TEST_CONTEXT_2);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 0, result);
+        ASSERT_ARE_EQUAL(size_t, 2, g_number_of_underlying_sends);
+        ASSERT_ARE_EQUAL(size_t, 3, g_underlying_send_sizes[0]);
+        // 5 bytes no longer fit in the new size and go out on their own
+        ASSERT_ARE_EQUAL(size_t, 5, g_underlying_send_sizes[1]);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_CONTEXT_2, g_underlying_send_contexts[1]);
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+    /* Tests_SRS_COALESCINGIO_01_016: [Any other option shall be passed to xio_setoption on the underlying I/O, returning its result.] */
+    TEST_FUNCTION(coalescingio_setoption_passes_other_options_to_the_underlying_io)
+    {
+        // arrange
+        CCoalescingIoMocks mocks;
+        CONCRETE_IO_HANDLE coalescing_io = createCoalescingIo(16, true);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, xio_setoption(TEST_UNDERLYING_IO, "TrustedCerts", TEST_CONTEXT_1))
+            .SetReturn(42);
+
+        // act
+        int result = coalescingio_get_interface_description()->concrete_io_setoption(coalescing_io, "TrustedCerts", TEST_CONTEXT_1);
+
+        // assert
+        ASSERT_ARE_EQUAL(int, 42, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        coalescingio_get_interface_description()->concrete_io_destroy(coalescing_io);
+    }
+
+END_TEST_SUITE(coalescingio_unittests)
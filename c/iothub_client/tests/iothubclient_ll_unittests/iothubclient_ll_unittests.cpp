@@ -243,12 +243,21 @@ public:
         *iotHubClientStatus = currentIotHubClientStatus;
     MOCK_METHOD_END(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK)
 
+    MOCK_STATIC_METHOD_1(, void, FAKE_IoTHubTransport_EventQueued, IOTHUB_DEVICE_HANDLE, handle)
+    MOCK_VOID_METHOD_END()
+
+    MOCK_STATIC_METHOD_3(, IOTHUB_CLIENT_RESULT, FAKE_IoTHubTransport_SetDeviceOption, IOTHUB_DEVICE_HANDLE, handle, const char*, optionName, const void*, value)
+    MOCK_METHOD_END(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK)
+
     MOCK_STATIC_METHOD_2(, void, eventConfirmationCallback, IOTHUB_CLIENT_CONFIRMATION_RESULT, result2, void*, userContextCallback)
     MOCK_VOID_METHOD_END()
 
     MOCK_STATIC_METHOD_2(, IOTHUBMESSAGE_DISPOSITION_RESULT, messageCallback, IOTHUB_MESSAGE_HANDLE, message, void*, userContextCallback)
     MOCK_METHOD_END(IOTHUBMESSAGE_DISPOSITION_RESULT, IOTHUBMESSAGE_ACCEPTED);
 
+    MOCK_STATIC_METHOD_1(, void, connectionReadyCallback, void*, userContextCallback)
+    MOCK_VOID_METHOD_END()
+
     MOCK_STATIC_METHOD_1(, IOTHUB_MESSAGE_HANDLE, IoTHubMessage_Clone, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle)
     MOCK_METHOD_END(IOTHUB_MESSAGE_HANDLE, (IOTHUB_MESSAGE_HANDLE)((uintptr_t)iotHubMessageHandle + 1000))
 
@@ -324,9 +333,12 @@ DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientLLMocks, , int, FAKE_IoTHubTransport_S
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientLLMocks, , void, FAKE_IoTHubTransport_Unsubscribe, TRANSPORT_LL_HANDLE, handle);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientLLMocks, , void, FAKE_IoTHubTransport_DoWork, TRANSPORT_LL_HANDLE, handle, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientLLMocks, , IOTHUB_CLIENT_RESULT, FAKE_IoTHubTransport_GetSendStatus, TRANSPORT_LL_HANDLE, handle, IOTHUB_CLIENT_STATUS*, iotHubClientStatus);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientLLMocks, , void, FAKE_IoTHubTransport_EventQueued, IOTHUB_DEVICE_HANDLE, handle);
+DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubClientLLMocks, , IOTHUB_CLIENT_RESULT, FAKE_IoTHubTransport_SetDeviceOption, IOTHUB_DEVICE_HANDLE, handle, const char*, optionName, const void*, value);
 
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientLLMocks, , void, eventConfirmationCallback, IOTHUB_CLIENT_CONFIRMATION_RESULT, result2, void*, userContextCallback);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientLLMocks, , IOTHUBMESSAGE_DISPOSITION_RESULT, messageCallback, IOTHUB_MESSAGE_HANDLE, message, void*, userContextCallback);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientLLMocks, , void, connectionReadyCallback, void*, userContextCallback);
 
 
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientLLMocks, , IOTHUB_MESSAGE_HANDLE, IoTHubMessage_Clone, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle);
@@ -369,6 +381,63 @@ static const void* provideFAKE(void)
     return &FAKE_transport_provider; /*by convention... */
 }
 
+/*same as FAKE_transport_provider, plus the optional _EventQueued*/
+static TRANSPORT_PROVIDER FAKE_transport_provider_with_EventQueued =
+{
+    FAKE_IoTHubTransport_SetOption,     /*pfIoTHubTransport_SetOption IoTHubTransport_SetOption;       */
+    FAKE_IoTHubTransport_Create,        /*pfIoTHubTransport_Create IoTHubTransport_Create;              */
+    FAKE_IoTHubTransport_Destroy,       /*pfIoTHubTransport_Destroy IoTHubTransport_Destroy;            */
+    FAKE_IoTHubTransport_Register,      /* pfIotHubTransport_Register IoTHubTransport_Register;         */
+    FAKE_IoTHubTransport_Unregister,    /* pfIotHubTransport_Unregister IoTHubTransport_Unegister;      */
+    FAKE_IoTHubTransport_Subscribe,     /*pfIoTHubTransport_Subscribe IoTHubTransport_Subscribe;        */
+    FAKE_IoTHubTransport_Unsubscribe,   /*pfIoTHubTransport_Unsubscribe IoTHubTransport_Unsubscribe;    */
+    FAKE_IoTHubTransport_DoWork,        /*pfIoTHubTransport_DoWork IoTHubTransport_DoWork;              */
+    FAKE_IoTHubTransport_GetSendStatus, /*pfIoTHubTransport_GetSendStatus IoTHubTransport_GetSendStatus; */
+    FAKE_IoTHubTransport_EventQueued    /*pfIoTHubTransport_EventQueued IoTHubTransport_EventQueued; */
+};
+
+static const void* provideFAKE_with_EventQueued(void)
+{
+    return &FAKE_transport_provider_with_EventQueued;
+}
+
+static const IOTHUB_CLIENT_DEVICE_CONFIG TEST_DEVICE_CONFIG_with_EventQueued =
+{
+    provideFAKE_with_EventQueued,
+    FAKE_TRANSPORT_HANDLE,
+    TEST_DEVICE_ID,
+    TEST_DEVICE_KEY
+};
+
+/*same as FAKE_transport_provider, plus the optional _SetDeviceOption*/
+static TRANSPORT_PROVIDER FAKE_transport_provider_with_SetDeviceOption =
+{
+    FAKE_IoTHubTransport_SetOption,     /*pfIoTHubTransport_SetOption IoTHubTransport_SetOption;       */
+    FAKE_IoTHubTransport_Create,        /*pfIoTHubTransport_Create IoTHubTransport_Create;              */
+    FAKE_IoTHubTransport_Destroy,       /*pfIoTHubTransport_Destroy IoTHubTransport_Destroy;            */
+    FAKE_IoTHubTransport_Register,      /* pfIotHubTransport_Register IoTHubTransport_Register;         */
+    FAKE_IoTHubTransport_Unregister,    /* pfIotHubTransport_Unregister IoTHubTransport_Unegister;      */
+    FAKE_IoTHubTransport_Subscribe,     /*pfIoTHubTransport_Subscribe IoTHubTransport_Subscribe;        */
+    FAKE_IoTHubTransport_Unsubscribe,   /*pfIoTHubTransport_Unsubscribe IoTHubTransport_Unsubscribe;    */
+    FAKE_IoTHubTransport_DoWork,        /*pfIoTHubTransport_DoWork IoTHubTransport_DoWork;              */
+    FAKE_IoTHubTransport_GetSendStatus, /*pfIoTHubTransport_GetSendStatus IoTHubTransport_GetSendStatus; */
+    NULL,                               /*pfIoTHubTransport_EventQueued IoTHubTransport_EventQueued; */
+    FAKE_IoTHubTransport_SetDeviceOption /*pfIoTHubTransport_SetDeviceOption IoTHubTransport_SetDeviceOption; */
+};
+
+static const void* provideFAKE_with_SetDeviceOption(void)
+{
+    return &FAKE_transport_provider_with_SetDeviceOption;
+}
+
+static const IOTHUB_CLIENT_DEVICE_CONFIG TEST_DEVICE_CONFIG_with_SetDeviceOption =
+{
+    provideFAKE_with_SetDeviceOption,
+    FAKE_TRANSPORT_HANDLE,
+    TEST_DEVICE_ID,
+    TEST_DEVICE_KEY
+};
+
 BEGIN_TEST_SUITE(iothubclient_ll_unittests)
 
     TEST_SUITE_INITIALIZE(TestClassInitialize)
@@ -2176,6 +2245,38 @@ BEGIN_TEST_SUITE(iothubclient_ll_unittests)
         IoTHubClient_LL_Destroy(handle);
     }
 
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_016: [If the transport provides _EventQueued, IoTHubClient_LL_SendEventAsync shall call it with the device handle after adding the record to waitingToSend.]*/
+    TEST_FUNCTION(IoTHubClient_LL_SendEventAsync_calls_EventQueued_of_the_transport)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+        auto handle = IoTHubClient_LL_CreateWithTransport(&TEST_DEVICE_CONFIG_with_EventQueued);
+        auto messageHandle = (IOTHUB_MESSAGE_HANDLE)1;
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
+            .IgnoreArgument(1);
+
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Clone(IGNORED_PTR_ARG))
+            .IgnoreArgument(1);
+
+        STRICT_EXPECTED_CALL(mocks, FAKE_IoTHubTransport_EventQueued((IOTHUB_DEVICE_HANDLE)FAKE_TRANSPORT_HANDLE)); /*the fake _Register returns the transport handle as device handle*/
+
+        ///act
+        auto result = IoTHubClient_LL_SendEventAsync(handle, messageHandle, eventConfirmationCallback, (void*)1);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubClient_LL_Destroy(handle);
+    }
+
     /*Tests_SRS_IOTHUBCLIENT_LL_02_010: [IoTHubClient_LL_Destroy shall call the underlaying layer's _Destroy function and shall free the resources allocated by IoTHubClient (if any).] */
     /*Tests_SRS_IOTHUBCLIENT_LL_02_033: [Otherwise, IoTHubClient_LL_Destroy shall complete all the event message callbacks that are in the waitingToSend list with the result IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY.] */
     TEST_FUNCTION(IoTHubClient_LL_Destroy_after_sendEvent_succeeds)
@@ -2803,6 +2904,123 @@ BEGIN_TEST_SUITE(iothubclient_ll_unittests)
         IoTHubClient_LL_Destroy(handle);
     }
 
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_010: [IoTHubClient_LL_SetConnectionReadyCallback shall fail and return IOTHUB_CLIENT_INVALID_ARG if parameter iotHubClientHandle is NULL.]*/
+    TEST_FUNCTION(IoTHubClient_LL_SetConnectionReadyCallback_with_NULL_handle_fails)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+
+        ///act
+        auto result = IoTHubClient_LL_SetConnectionReadyCallback(NULL, connectionReadyCallback, (void*)1);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_011: [IoTHubClient_LL_SetConnectionReadyCallback shall call the underlying layer's _SetOption function with option "eagerConnect" set to true if connectionReadyCallback is non-NULL and false otherwise.]*/
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_013: [Otherwise IoTHubClient_LL_SetConnectionReadyCallback shall save connectionReadyCallback and userContextCallback and return IOTHUB_CLIENT_OK.]*/
+    TEST_FUNCTION(IoTHubClient_LL_SetConnectionReadyCallback_sets_eagerConnect_on_the_transport_succeeds)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+        auto handle = IoTHubClient_LL_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, FAKE_IoTHubTransport_SetOption(IGNORED_PTR_ARG, "eagerConnect", IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(3);
+
+        ///act
+        auto result = IoTHubClient_LL_SetConnectionReadyCallback(handle, connectionReadyCallback, (void*)1);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubClient_LL_Destroy(handle);
+    }
+
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_017: [If the transport provides _SetDeviceOption, the options shall be set by calling it with the device handle instead of calling _SetOption with the transport handle.]*/
+    TEST_FUNCTION(IoTHubClient_LL_SetConnectionReadyCallback_sets_eagerConnect_on_the_device_when_the_transport_has_SetDeviceOption)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+        auto handle = IoTHubClient_LL_CreateWithTransport(&TEST_DEVICE_CONFIG_with_SetDeviceOption);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, FAKE_IoTHubTransport_SetDeviceOption((IOTHUB_DEVICE_HANDLE)FAKE_TRANSPORT_HANDLE, "eagerConnect", IGNORED_PTR_ARG)) /*the fake _Register returns the transport handle as device handle*/
+            .IgnoreArgument(3);
+
+        ///act
+        auto result = IoTHubClient_LL_SetConnectionReadyCallback(handle, connectionReadyCallback, (void*)1);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubClient_LL_Destroy(handle);
+    }
+
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_012: [If the underlying layer's _SetOption function fails, IoTHubClient_LL_SetConnectionReadyCallback shall return what _SetOption returned and shall keep the previous callback.]*/
+    TEST_FUNCTION(IoTHubClient_LL_SetConnectionReadyCallback_fails_when_underlying_transport_fails)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+        auto handle = IoTHubClient_LL_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        EXPECTED_CALL(mocks, FAKE_IoTHubTransport_SetOption(IGNORED_PTR_ARG, "eagerConnect", IGNORED_PTR_ARG))
+            .SetReturn(IOTHUB_CLIENT_INVALID_ARG);
+
+        ///act
+        auto result = IoTHubClient_LL_SetConnectionReadyCallback(handle, connectionReadyCallback, (void*)1);
+        IoTHubClient_LL_ConnectionReady(handle);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubClient_LL_Destroy(handle);
+    }
+
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_014: [If parameter handle is NULL then IoTHubClient_LL_ConnectionReady shall return.]*/
+    TEST_FUNCTION(IoTHubClient_LL_ConnectionReady_with_NULL_handle_does_nothing)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+
+        ///act
+        IoTHubClient_LL_ConnectionReady(NULL);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_015: [IoTHubClient_LL_ConnectionReady shall invoke the last non-NULL callback set by IoTHubClient_LL_SetConnectionReadyCallback passing the saved userContextCallback.]*/
+    TEST_FUNCTION(IoTHubClient_LL_ConnectionReady_calls_upper_layer_succeeds)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+        auto handle = IoTHubClient_LL_Create(&TEST_CONFIG);
+        (void)IoTHubClient_LL_SetConnectionReadyCallback(handle, connectionReadyCallback, (void*)11);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, connectionReadyCallback((void*)11));
+
+        ///act
+        IoTHubClient_LL_ConnectionReady(handle);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubClient_LL_Destroy(handle);
+    }
+
 
     /*** IoTHubClient_LL_GetLastMessageReceiveTime ***/
 
@@ -3079,6 +3297,28 @@ BEGIN_TEST_SUITE(iothubclient_ll_unittests)
 
     }
 
+    /*Tests_SRS_IOTHUBCLIENT_LL_09_017: [If the transport provides _SetDeviceOption, the options shall be set by calling it with the device handle instead of calling _SetOption with the transport handle.]*/
+    TEST_FUNCTION(IoTHubClient_LL_SetOption_calls_SetDeviceOption_with_the_device_handle_when_the_transport_has_it)
+    {
+        ///arrange
+        CIoTHubClientLLMocks mocks;
+        IOTHUB_CLIENT_LL_HANDLE handle = IoTHubClient_LL_CreateWithTransport(&TEST_DEVICE_CONFIG_with_SetDeviceOption);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, FAKE_IoTHubTransport_SetDeviceOption((IOTHUB_DEVICE_HANDLE)FAKE_TRANSPORT_HANDLE, "a", "b"))
+            .SetReturn(IOTHUB_CLIENT_INDEFINITE_TIME);
+
+        ///act
+        auto result = IoTHubClient_LL_SetOption(handle, "a", "b");
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INDEFINITE_TIME, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubClient_LL_Destroy(handle);
+    }
+
     /*Tests_SRS_IOTHUBCLIENT_LL_02_038: [Otherwise, IoTHubClient_LL shall call the function _SetOption of the underlying transport and return what that function is returning.] */
     TEST_FUNCTION(IoTHubClient_LL_SetOption_fails_when_underlying_transport_fails)
     {
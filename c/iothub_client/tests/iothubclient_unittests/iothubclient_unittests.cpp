@@ -97,6 +97,8 @@ public:
     MOCK_METHOD_END(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK);
     MOCK_STATIC_METHOD_3(, IOTHUB_CLIENT_RESULT, IoTHubClient_LL_SetMessageCallback, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle, IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC, messageCallback, void*, userContextCallback)
     MOCK_METHOD_END(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK);
+    MOCK_STATIC_METHOD_3(, IOTHUB_CLIENT_RESULT, IoTHubClient_LL_SetConnectionReadyCallback, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle, IOTHUB_CLIENT_CONNECTION_READY_CALLBACK, connectionReadyCallback, void*, userContextCallback)
+    MOCK_METHOD_END(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK);
     MOCK_STATIC_METHOD_1(, void, IoTHubClient_LL_DoWork, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle)
         doWorkCallCount++;
     MOCK_VOID_METHOD_END();
@@ -169,6 +171,9 @@ public:
     MOCK_STATIC_METHOD_2(, IOTHUBMESSAGE_DISPOSITION_RESULT, messageCallback, IOTHUB_MESSAGE_HANDLE, message, void*, userContextCallback)
     MOCK_METHOD_END(IOTHUBMESSAGE_DISPOSITION_RESULT, IOTHUBMESSAGE_ACCEPTED);
 
+    MOCK_STATIC_METHOD_1(, void, connectionReadyCallback, void*, userContextCallback)
+    MOCK_VOID_METHOD_END()
+
 	/* TRANSPORT mocks*/
 
 	MOCK_STATIC_METHOD_1(, LOCK_HANDLE, IoTHubTransport_GetLock, TRANSPORT_HANDLE, transportHlHandle)
@@ -195,6 +200,7 @@ DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientMocks, , IOTHUB_CLIENT_LL_HANDLE, IoTH
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientMocks, , void, IoTHubClient_LL_Destroy, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle);
 DECLARE_GLOBAL_MOCK_METHOD_4(CIoTHubClientMocks, , IOTHUB_CLIENT_RESULT, IoTHubClient_LL_SendEventAsync, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle, IOTHUB_MESSAGE_HANDLE, eventMessageHandle, IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK, eventConfirmationCallback, void*, userContextCallback)
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubClientMocks, , IOTHUB_CLIENT_RESULT, IoTHubClient_LL_SetMessageCallback, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle, IOTHUB_CLIENT_MESSAGE_CALLBACK_ASYNC, messageCallback, void*, userContextCallback)
+DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubClientMocks, , IOTHUB_CLIENT_RESULT, IoTHubClient_LL_SetConnectionReadyCallback, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle, IOTHUB_CLIENT_CONNECTION_READY_CALLBACK, connectionReadyCallback, void*, userContextCallback)
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientMocks, , void, IoTHubClient_LL_DoWork, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle)
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientMocks, , IOTHUB_CLIENT_RESULT, IoTHubClient_LL_GetSendStatus, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle, IOTHUB_CLIENT_STATUS*, iotHubClientStatus)
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientMocks, , IOTHUB_CLIENT_RESULT, IoTHubClient_LL_GetLastMessageReceiveTime, IOTHUB_CLIENT_LL_HANDLE, iotHubClientHandle, time_t*, lastMessageReceiveTime)
@@ -216,6 +222,7 @@ DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientMocks, , void, gballoc_free, void*, pt
 
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientMocks, , void, eventConfirmationCallback, IOTHUB_CLIENT_CONFIRMATION_RESULT, result2, void*, userContextCallback);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubClientMocks, , IOTHUBMESSAGE_DISPOSITION_RESULT, messageCallback, IOTHUB_MESSAGE_HANDLE, message, void*, userContextCallback);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientMocks, , void, connectionReadyCallback, void*, userContextCallback);
 
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientMocks, , LOCK_HANDLE, IoTHubTransport_GetLock, TRANSPORT_HANDLE, transportHlHandle);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubClientMocks, , TRANSPORT_LL_HANDLE, IoTHubTransport_GetLLTransport, TRANSPORT_HANDLE, transportHlHandle);
@@ -1255,6 +1262,71 @@ BEGIN_TEST_SUITE(iothubclient_unittests)
         IoTHubClient_Destroy(iotHubClient);
     }
 
+    /* IoTHubClient_SetConnectionReadyCallback */
+
+    /* Tests_SRS_IOTHUBCLIENT_09_011: [IoTHubClient_SetConnectionReadyCallback shall be made thread-safe by using the lock created in IoTHubClient_Create.] */
+    /* Tests_SRS_IOTHUBCLIENT_09_013: [IoTHubClient_SetConnectionReadyCallback shall start the worker thread if it was not previously started.] */
+    /* Tests_SRS_IOTHUBCLIENT_09_015: [IoTHubClient_SetConnectionReadyCallback shall call IoTHubClient_LL_SetConnectionReadyCallback, while passing the IoTHubClient_LL handle created by IoTHubClient_Create and the parameters connectionReadyCallback and userContextCallback, and shall return its result.] */
+    TEST_FUNCTION(IoTHubClient_SetConnectionReadyCallback_starts_the_worker_thread_and_calls_the_underlayer)
+    {
+        // arrange
+        CIoTHubClientMocks mocks;
+        IOTHUB_CLIENT_HANDLE iotHubClient = IoTHubClient_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, Lock(TEST_LOCK_HANDLE));
+        EXPECTED_CALL(mocks, ThreadAPI_Create(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SetConnectionReadyCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, connectionReadyCallback, (void*)0x42));
+        STRICT_EXPECTED_CALL(mocks, Unlock(TEST_LOCK_HANDLE));
+
+        // act
+        IOTHUB_CLIENT_RESULT result = IoTHubClient_SetConnectionReadyCallback(iotHubClient, connectionReadyCallback, (void*)0x42);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        IoTHubClient_Destroy(iotHubClient);
+    }
+
+    /* Tests_SRS_IOTHUBCLIENT_09_014: [If starting the thread fails, IoTHubClient_SetConnectionReadyCallback shall return IOTHUB_CLIENT_ERROR.] */
+    TEST_FUNCTION(When_Thread_API_Create_fails_then_IoTHubClient_SetConnectionReadyCallback_fails)
+    {
+        // arrange
+        CIoTHubClientMocks mocks;
+        IOTHUB_CLIENT_HANDLE iotHubClient = IoTHubClient_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, Lock(TEST_LOCK_HANDLE));
+        EXPECTED_CALL(mocks, ThreadAPI_Create(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .SetReturn(THREADAPI_ERROR);
+        STRICT_EXPECTED_CALL(mocks, Unlock(TEST_LOCK_HANDLE));
+
+        // act
+        IOTHUB_CLIENT_RESULT result = IoTHubClient_SetConnectionReadyCallback(iotHubClient, connectionReadyCallback, (void*)0x42);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_ERROR);
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        IoTHubClient_Destroy(iotHubClient);
+    }
+
+    /* Tests_SRS_IOTHUBCLIENT_09_010: [If iotHubClientHandle is NULL, IoTHubClient_SetConnectionReadyCallback shall return IOTHUB_CLIENT_INVALID_ARG.] */
+    TEST_FUNCTION(IoTHubClient_SetConnectionReadyCallback_with_NULL_handle_fails)
+    {
+        // arrange
+        CIoTHubClientMocks mocks;
+
+        // act
+        IOTHUB_CLIENT_RESULT result = IoTHubClient_SetConnectionReadyCallback(NULL, connectionReadyCallback, (void*)0x42);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG);
+    }
+
     /* IoTHubClient_GetLastMessageReceiveTime */
 
     /* Tests_SRS_IOTHUBCLIENT_01_019: [IoTHubClient_GetLastMessageReceiveTime shall call IoTHubClient_LL_GetLastMessageReceiveTime, while passing the IoTHubClient_LL handle created by IoTHubClient_Create and the parameter lastMessageReceiveTime.] */
@@ -10,6 +10,7 @@
 #include "micromock.h"
 #include "micromockcharstararenullterminatedstrings.h"
 #include "iothub_message.h"
+#include "iothub_client_private.h"
 #include "azure_c_shared_utility/buffer_.h"
 #include "azure_c_shared_utility/strings.h"
 #include "azure_c_shared_utility/lock.h"
@@ -778,6 +779,84 @@ BEGIN_TEST_SUITE(iothubmessage_unittests)
         ///cleanup
     }
 
+    /*Tests_SRS_IOTHUBMESSAGE_09_001: [IoTHubMessage_CreateFromBorrowedByteArray shall create a IOTHUBMESSAGE_BYTEARRAY message whose content points to byteArray without copying it; byteArray shall outlive the message.] */
+    /*Tests_SRS_IOTHUBMESSAGE_09_003: [IoTHubMessage_CreateFromBorrowedByteArray shall call Map_Create to create the message properties.] */
+    /*Tests_SRS_IOTHUBMESSAGE_09_006: [If the message content is borrowed, IoTHubMessage_GetByteArray shall return the borrowed pointer and size.] */
+    TEST_FUNCTION(IoTHubMessage_CreateFromBorrowedByteArray_does_not_copy_the_content)
+    {
+        ///arrange
+        CIoTHubMessageMocks mocks;
+        const unsigned char* byteArray;
+        size_t size;
+
+        STRICT_EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, Map_Create(IGNORED_PTR_ARG))
+            .IgnoreArgument(1);
+
+        ///act
+        auto h = IoTHubMessage_CreateFromBorrowedByteArray(c, 1);
+        auto r = IoTHubMessage_GetByteArray(h, &byteArray, &size);
+
+        ///assert
+        ASSERT_IS_NOT_NULL(h);
+        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(IOTHUBMESSAGE_CONTENT_TYPE, IOTHUBMESSAGE_BYTEARRAY, IoTHubMessage_GetContentType(h));
+        ASSERT_ARE_EQUAL(IOTHUB_MESSAGE_RESULT, IOTHUB_MESSAGE_OK, r);
+        ASSERT_IS_TRUE(byteArray == c);
+        ASSERT_ARE_EQUAL(size_t, 1, size);
+
+        ///cleanup
+        IoTHubMessage_Destroy(h);
+    }
+
+    /*Tests_SRS_IOTHUBMESSAGE_09_007: [IoTHubMessage_Destroy shall not free borrowed content.] */
+    TEST_FUNCTION(IoTHubMessage_Destroy_does_not_free_borrowed_content)
+    {
+        ///arrange
+        CIoTHubMessageMocks mocks;
+        auto h = IoTHubMessage_CreateFromBorrowedByteArray(c, 1);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, Map_Destroy(IGNORED_PTR_ARG))
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, gballoc_free(h));
+        STRICT_EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG)).IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG)).IgnoreArgument(1);
+
+        ///act
+        IoTHubMessage_Destroy(h);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+    /*Tests_SRS_IOTHUBMESSAGE_09_005: [IoTHubMessage_Clone of a message with borrowed content shall copy the content by a call to BUFFER_create, so the clone owns its content.] */
+    TEST_FUNCTION(IoTHubMessage_Clone_copies_borrowed_content)
+    {
+        ///arrange
+        CIoTHubMessageMocks mocks;
+        auto h = IoTHubMessage_CreateFromBorrowedByteArray(c, 1);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, BUFFER_create(c, 1));
+        STRICT_EXPECTED_CALL(mocks, Map_Clone(IGNORED_PTR_ARG))
+            .IgnoreArgument(1);
+
+        ///act
+        auto clone = IoTHubMessage_Clone(h);
+
+        ///assert
+        ASSERT_IS_NOT_NULL(clone);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubMessage_Destroy(h);
+        IoTHubMessage_Destroy(clone);
+    }
+
     /*Tests_SRS_IOTHUBMESSAGE_01_003: [IoTHubMessage_Destroy shall free all resources associated with iotHubMessageHandle.]  */
     TEST_FUNCTION(IoTHubMessage_Destroy_destroys_a_STRING_IoTHubMEssage)
     {
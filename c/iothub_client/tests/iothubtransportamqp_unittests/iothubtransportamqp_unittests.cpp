@@ -29,10 +29,12 @@ static MICROMOCK_GLOBAL_SEMAPHORE_HANDLE g_dllByDll;
 #include "azure_c_shared_utility/xio.h"
 #include "azure_c_shared_utility/macro_utils.h"
 #include "azure_c_shared_utility/map.h"
+#include "azure_c_shared_utility/tickcounter.h"
 
 #include "iothubtransportamqp.h"
 #include "iothub_client_private.h"
 #include "iothub_message.h"
+#include "coalescingio.h"
 
 #include "azure_uamqp_c/amqpvalue.h"
 #include "azure_uamqp_c/amqpvalue_to_string.h"
@@ -154,6 +156,7 @@ std::ostream& operator<<(std::ostream& left, const BINARY_DATA bindata)
 #define TEST_IOTHUB_CLIENT_LL_HANDLE (IOTHUB_CLIENT_LL_HANDLE)0x49
 #define TEST_TLS_IO_INTERFACE_DESC (IO_INTERFACE_DESCRIPTION*)0x77
 #define TEST_TLS_IO_INTERFACE (XIO_HANDLE)0x81
+#define TEST_TICK_COUNTER (TICK_COUNTER_HANDLE)0x85
 #define TEST_SASL_MECHANISM (SASL_MECHANISM_HANDLE)0x90
 #define TEST_SASL_IO (XIO_HANDLE)0x101
 #define TEST_CONNECTION (CONNECTION_HANDLE)0x110
@@ -167,6 +170,10 @@ std::ostream& operator<<(std::ostream& left, const BINARY_DATA bindata)
 #define TEST_MESSAGESENDER_LINK (LINK_HANDLE)0x160
 #define TEST_MESSAGERECEIVER_LINK (LINK_HANDLE)0x166
 #define TEST_MESSAGE_SENDER (MESSAGE_SENDER_HANDLE)0x180
+#define TEST_ADDITIONAL_SENDER_LINK_1 (LINK_HANDLE)0x181
+#define TEST_ADDITIONAL_SENDER_LINK_2 (LINK_HANDLE)0x182
+#define TEST_ADDITIONAL_MESSAGE_SENDER_1 (MESSAGE_SENDER_HANDLE)0x183
+#define TEST_ADDITIONAL_MESSAGE_SENDER_2 (MESSAGE_SENDER_HANDLE)0x184
 #define TEST_MESSAGE_RECEIVER (MESSAGE_RECEIVER_HANDLE)0x190
 #define TEST_IOTHUB_MESSAGE_HANDLE (IOTHUB_MESSAGE_HANDLE)0x200
 #define TEST_RANDOM_CHAR_SEQ "This is a random char sequence"
@@ -174,6 +181,8 @@ std::ostream& operator<<(std::ostream& left, const BINARY_DATA bindata)
 #define TEST_BINARY_BUFFER (const unsigned char*)0x210
 #define TEST_BINARY_BUFFER_SIZE 56
 #define TEST_EVENT_MESSAGE_HANDLE (MESSAGE_HANDLE)0x220
+#define TEST_BATCHED_EVENT_DATA_SECTION (AMQP_VALUE)0x230
+#define TEST_BATCHED_EVENT_ENCODED_SIZE 16
 #define TEST_OPTION_SASTOKEN_LIFETIME "sas_token_lifetime"
 #define TEST_OPTION_SASTOKEN_REFRESH_TIME "sas_token_refresh_time"
 #define TEST_OPTION_CBS_REQUEST_TIMEOUT "cbs_request_timeout"
@@ -203,9 +212,26 @@ static time_t test_current_time;
 static size_t test_latest_SASToken_expiry_time = 0;
 static ON_CBS_OPERATION_COMPLETE test_latest_cbs_put_token_callback;
 static void* test_latest_cbs_put_token_context;
+static ON_MESSAGE_SENDER_STATE_CHANGED test_latest_sender_state_changed_callback;
+static void* test_latest_sender_state_changed_context;
+static size_t test_number_of_connection_ready_calls;
 static int test_number_of_event_confirmation_callbacks_invoked;
 static int test_sum_of_event_confirmation_callback_contexts;
 static BINARY_DATA test_binary_data;
+static uint64_t test_current_ms;
+#define TEST_MAX_SENT_MESSAGES 16
+static ON_MESSAGE_SEND_COMPLETE test_sent_message_callbacks[TEST_MAX_SENT_MESSAGES];
+static void* test_sent_message_contexts[TEST_MAX_SENT_MESSAGES];
+static MESSAGE_SENDER_HANDLE test_sent_message_senders[TEST_MAX_SENT_MESSAGES];
+#define TEST_MAX_LINKS 8
+static char test_link_names[TEST_MAX_LINKS][32];
+static size_t test_number_of_links_created;
+static size_t test_number_of_sent_messages;
+static size_t test_batched_event_encoded_size;
+static size_t test_number_of_encoding_buffer_reallocs;
+static size_t test_number_of_connection_attempts;
+static size_t test_number_of_coalescing_size_options;
+static size_t test_last_coalescing_size;
 
 static bool fail_malloc = false;
 static bool fail_STRING_new = false;
@@ -246,10 +272,26 @@ public:
     MOCK_STATIC_METHOD_3(, int, amqpvalue_set_map_value, AMQP_VALUE, map, AMQP_VALUE, key, AMQP_VALUE, value)
     MOCK_METHOD_END(int, 0)
 
+    MOCK_STATIC_METHOD_1(, AMQP_VALUE, amqpvalue_create_application_properties, application_properties, value)
+    MOCK_METHOD_END(AMQP_VALUE, (AMQP_VALUE)0x1)
+
+    MOCK_STATIC_METHOD_1(, AMQP_VALUE, amqpvalue_create_data, data, value)
+    MOCK_METHOD_END(AMQP_VALUE, TEST_BATCHED_EVENT_DATA_SECTION)
+
+    MOCK_STATIC_METHOD_2(, int, amqpvalue_get_encoded_size, AMQP_VALUE, value, size_t*, encoded_size)
+        *encoded_size = test_batched_event_encoded_size;
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_3(, int, amqpvalue_encode, AMQP_VALUE, value, AMQPVALUE_ENCODER_OUTPUT, encoder_output, void*, context)
+    MOCK_METHOD_END(int, 0)
+
     /* Map mocks */
     MOCK_STATIC_METHOD_4(, MAP_RESULT, Map_GetInternals, MAP_HANDLE, handle, const char*const**, keys, const char*const**, values, size_t*, count);
     MOCK_METHOD_END(MAP_RESULT, MAP_OK)
 
+    MOCK_STATIC_METHOD_2(, const char*, Map_GetValueFromKey, MAP_HANDLE, handle, const char*, key);
+    MOCK_METHOD_END(const char*, NULL)
+
     /* crt_abstractions mocks */
     MOCK_STATIC_METHOD_2(, int, mallocAndStrcpy_s, char**, destination, const char*, source)
     MOCK_METHOD_END(int, (*destination = (char*)BASEIMPLEMENTATION::gballoc_malloc(strlen(source) + 1), strcpy(*destination, source), 0))
@@ -258,6 +300,9 @@ public:
     MOCK_STATIC_METHOD_2(, IOTHUB_MESSAGE_HANDLE, IoTHubMessage_CreateFromByteArray, const unsigned char*, buffer, size_t, size)
     MOCK_METHOD_END(IOTHUB_MESSAGE_HANDLE, NULL)
 
+    MOCK_STATIC_METHOD_2(, IOTHUB_MESSAGE_HANDLE, IoTHubMessage_CreateFromBorrowedByteArray, const unsigned char*, buffer, size_t, size)
+    MOCK_METHOD_END(IOTHUB_MESSAGE_HANDLE, NULL)
+
     MOCK_STATIC_METHOD_1(, void, IoTHubMessage_Destroy, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle)
     MOCK_VOID_METHOD_END()
 
@@ -408,6 +453,11 @@ public:
     MOCK_METHOD_END(void*, transport_state);
 
     MOCK_STATIC_METHOD_2(, void*, gballoc_realloc, void*, ptr, size_t, size)
+        // The encoded event sizes used by the tests are not a multiple of a pointer size, unlike the batch event arrays.
+        if (size == test_batched_event_encoded_size)
+        {
+            test_number_of_encoding_buffer_reallocs++;
+        }
     MOCK_METHOD_END(void*, BASEIMPLEMENTATION::gballoc_realloc(ptr, size));
 
     MOCK_STATIC_METHOD_1(, void, gballoc_free, void*, ptr)
@@ -417,6 +467,10 @@ public:
     MOCK_STATIC_METHOD_2(, IOTHUBMESSAGE_DISPOSITION_RESULT, IoTHubClient_LL_MessageCallback, IOTHUB_CLIENT_LL_HANDLE, handle, IOTHUB_MESSAGE_HANDLE, messageHandle)
     MOCK_METHOD_END(IOTHUBMESSAGE_DISPOSITION_RESULT, IOTHUBMESSAGE_ACCEPTED);
 
+    MOCK_STATIC_METHOD_1(, void, IoTHubClient_LL_ConnectionReady, IOTHUB_CLIENT_LL_HANDLE, handle)
+        test_number_of_connection_ready_calls++;
+    MOCK_VOID_METHOD_END();
+
     MOCK_STATIC_METHOD_3(, void, IoTHubClient_LL_SendComplete, IOTHUB_CLIENT_LL_HANDLE, handle, PDLIST_ENTRY, completedMessages, IOTHUB_BATCHSTATE_RESULT, batchResult)
         PDLIST_ENTRY oldest;
         while ((oldest = BASEIMPLEMENTATION::DList_RemoveHeadList(completedMessages)) != completedMessages)
@@ -428,6 +482,15 @@ public:
     MOCK_STATIC_METHOD_1(, time_t, get_time, time_t*, t)
     MOCK_METHOD_END(time_t, 0);
 
+    // tickcounter.h
+    MOCK_STATIC_METHOD_0(, TICK_COUNTER_HANDLE, tickcounter_create)
+    MOCK_METHOD_END(TICK_COUNTER_HANDLE, TEST_TICK_COUNTER);
+    MOCK_STATIC_METHOD_1(, void, tickcounter_destroy, TICK_COUNTER_HANDLE, tick_counter)
+    MOCK_VOID_METHOD_END();
+    MOCK_STATIC_METHOD_2(, int, tickcounter_get_current_ms, TICK_COUNTER_HANDLE, tick_counter, uint64_t*, current_ms)
+        *current_ms = test_current_ms;
+    MOCK_METHOD_END(int, 0);
+
     MOCK_STATIC_METHOD_4(, STRING_HANDLE, SASToken_Create, STRING_HANDLE, key, STRING_HANDLE, scope, STRING_HANDLE, keyName, size_t, expiry)
         test_latest_SASToken_expiry_time = expiry;
     MOCK_METHOD_END(STRING_HANDLE, BASEIMPLEMENTATION::STRING_construct(TEST_SAS_TOKEN));
@@ -452,6 +515,11 @@ public:
     MOCK_VOID_METHOD_END()
 
 	MOCK_STATIC_METHOD_3(, int, xio_setoption, XIO_HANDLE, xio, const char*, optionName, const void*, value)
+		if (optionName != NULL && strcmp(optionName, COALESCINGIO_OPTION_MAX_WRITE_SIZE) == 0)
+		{
+			test_number_of_coalescing_size_options++;
+			test_last_coalescing_size = *((const size_t*)value);
+		}
 	MOCK_METHOD_END(int, 0)
 		
 	// tlsio_openssl.h
@@ -533,11 +601,20 @@ public:
     MOCK_STATIC_METHOD_1(, void, connection_destroy, CONNECTION_HANDLE, connection)
     MOCK_VOID_METHOD_END()
 
+    MOCK_STATIC_METHOD_2(, int, connection_set_idle_timeout, CONNECTION_HANDLE, connection, milliseconds, idle_timeout)
+    MOCK_METHOD_END(int, 0)
+
     MOCK_STATIC_METHOD_1(, void, connection_dowork, CONNECTION_HANDLE, connection)
     MOCK_VOID_METHOD_END()
 
     // link.h
     MOCK_STATIC_METHOD_5(, LINK_HANDLE, link_create, SESSION_HANDLE, session, const char*, name, role, _role, AMQP_VALUE, source, AMQP_VALUE, target)
+        if (test_number_of_links_created < TEST_MAX_LINKS)
+        {
+            (void)strncpy(test_link_names[test_number_of_links_created], name, sizeof(test_link_names[0]) - 1);
+            test_link_names[test_number_of_links_created][sizeof(test_link_names[0]) - 1] = '\0';
+        }
+        test_number_of_links_created++;
     MOCK_METHOD_END(LINK_HANDLE, 0)
 
     MOCK_STATIC_METHOD_2(, int, link_set_max_message_size, LINK_HANDLE, link, uint64_t, max_message_size)
@@ -562,6 +639,9 @@ public:
     MOCK_STATIC_METHOD_2(, int, message_add_body_amqp_data, MESSAGE_HANDLE, message, BINARY_DATA, binary_data)
     MOCK_METHOD_END(int, 0)
 
+    MOCK_STATIC_METHOD_2(, int, message_set_message_format, MESSAGE_HANDLE, message, uint32_t, message_format)
+    MOCK_METHOD_END(int, 0)
+
     MOCK_STATIC_METHOD_1(, void, message_destroy, MESSAGE_HANDLE, message)
     MOCK_VOID_METHOD_END()
 
@@ -587,6 +667,11 @@ public:
 
     // message_sender.h
     MOCK_STATIC_METHOD_4(, MESSAGE_SENDER_HANDLE, messagesender_create, LINK_HANDLE, link, ON_MESSAGE_SENDER_STATE_CHANGED, on_message_sender_state_changed, void*, context, LOGGER_LOG, logger_log)
+        if (on_message_sender_state_changed != NULL)
+        {
+            test_latest_sender_state_changed_callback = on_message_sender_state_changed;
+            test_latest_sender_state_changed_context = context;
+        }
     MOCK_METHOD_END(MESSAGE_SENDER_HANDLE, 0)
 
     MOCK_STATIC_METHOD_1(, void, messagesender_destroy, MESSAGE_SENDER_HANDLE, message_sender)
@@ -599,6 +684,13 @@ public:
     MOCK_METHOD_END(int, 0)
 
     MOCK_STATIC_METHOD_4(, int, messagesender_send, MESSAGE_SENDER_HANDLE, message_sender, MESSAGE_HANDLE, message, ON_MESSAGE_SEND_COMPLETE, on_message_send_complete, void*, callback_context)
+        if (test_number_of_sent_messages < TEST_MAX_SENT_MESSAGES)
+        {
+            test_sent_message_callbacks[test_number_of_sent_messages] = on_message_send_complete;
+            test_sent_message_contexts[test_number_of_sent_messages] = callback_context;
+            test_sent_message_senders[test_number_of_sent_messages] = message_sender;
+        }
+        test_number_of_sent_messages++;
     MOCK_METHOD_END(int, 0)
 
     // messaging.h
@@ -678,6 +770,7 @@ public:
     MOCK_METHOD_END(int, 0)
 
     MOCK_STATIC_METHOD_0(, const SASL_MECHANISM_INTERFACE_DESCRIPTION*, saslmssbcbs_get_interface)
+        test_number_of_connection_attempts++;
     MOCK_METHOD_END(const SASL_MECHANISM_INTERFACE_DESCRIPTION*, 0)
 
     // session.h
@@ -714,10 +807,16 @@ DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportAMQPMocks, , AMQP_VALUE, amqpvalue_
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , AMQP_VALUE, amqpvalue_create_symbol, const char*, value);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , AMQP_VALUE, amqpvalue_create_string, const char*, value);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportAMQPMocks, , int, amqpvalue_set_map_value, AMQP_VALUE, map, AMQP_VALUE, key, AMQP_VALUE, value);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , AMQP_VALUE, amqpvalue_create_application_properties, application_properties, value);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , AMQP_VALUE, amqpvalue_create_data, data, value);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, amqpvalue_get_encoded_size, AMQP_VALUE, value, size_t*, encoded_size);
+DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportAMQPMocks, , int, amqpvalue_encode, AMQP_VALUE, value, AMQPVALUE_ENCODER_OUTPUT, encoder_output, void*, context);
 
 DECLARE_GLOBAL_MOCK_METHOD_4(CIoTHubTransportAMQPMocks, , MAP_RESULT, Map_GetInternals, MAP_HANDLE, handle, const char*const**, keys, const char*const**, values, size_t*, count);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , const char*, Map_GetValueFromKey, MAP_HANDLE, handle, const char*, key);
 
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , IOTHUB_MESSAGE_HANDLE, IoTHubMessage_CreateFromByteArray, const unsigned char*, buffre, size_t, size);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , IOTHUB_MESSAGE_HANDLE, IoTHubMessage_CreateFromBorrowedByteArray, const unsigned char*, buffer, size_t, size);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , const char*, IoTHubMessage_GetString, IOTHUB_MESSAGE_HANDLE, handle);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , void, IoTHubMessage_Destroy, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportAMQPMocks, , IOTHUB_MESSAGE_RESULT, IoTHubMessage_GetByteArray, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle, const unsigned char**, buffer, size_t*, size);
@@ -761,9 +860,14 @@ DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , void*, gballoc_realloc
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , void, gballoc_free, void*, ptr);
 
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , IOTHUBMESSAGE_DISPOSITION_RESULT, IoTHubClient_LL_MessageCallback, IOTHUB_CLIENT_LL_HANDLE, handle, IOTHUB_MESSAGE_HANDLE, messageHandle);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , void, IoTHubClient_LL_ConnectionReady, IOTHUB_CLIENT_LL_HANDLE, handle);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportAMQPMocks, , void, IoTHubClient_LL_SendComplete, IOTHUB_CLIENT_LL_HANDLE, handle, PDLIST_ENTRY, completedMessages, IOTHUB_BATCHSTATE_RESULT, batchResult);
 
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , time_t, get_time, time_t*, t)
+
+DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportAMQPMocks, , TICK_COUNTER_HANDLE, tickcounter_create);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , void, tickcounter_destroy, TICK_COUNTER_HANDLE, tick_counter);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, tickcounter_get_current_ms, TICK_COUNTER_HANDLE, tick_counter, uint64_t*, current_ms);
 DECLARE_GLOBAL_MOCK_METHOD_4(CIoTHubTransportAMQPMocks, , STRING_HANDLE, SASToken_Create, STRING_HANDLE, key, STRING_HANDLE, scope, STRING_HANDLE, keyName, size_t, expiry)
 
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, mallocAndStrcpy_s, char**, destination, const char*, source);
@@ -816,6 +920,7 @@ DECLARE_GLOBAL_MOCK_METHOD_5(CIoTHubTransportAMQPMocks, , int, cbs_delete_token,
 
 // connection.h
 DECLARE_GLOBAL_MOCK_METHOD_5(CIoTHubTransportAMQPMocks, , CONNECTION_HANDLE, connection_create, XIO_HANDLE, io, const char*, hostname, const char*, container_id, ON_NEW_ENDPOINT, on_new_endpoint, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, connection_set_idle_timeout, CONNECTION_HANDLE, connection, milliseconds, idle_timeout);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , void, connection_dowork, CONNECTION_HANDLE, connection);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , void, connection_destroy, CONNECTION_HANDLE, connection);
 
@@ -831,6 +936,7 @@ DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, link_set_attach_p
 DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportAMQPMocks, , MESSAGE_HANDLE, message_create);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, message_set_application_properties, MESSAGE_HANDLE, message, AMQP_VALUE, application_properties);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, message_add_body_amqp_data, MESSAGE_HANDLE, message, BINARY_DATA, binary_data);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, message_set_message_format, MESSAGE_HANDLE, message, uint32_t, message_format);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportAMQPMocks, , int, message_get_body_amqp_data, MESSAGE_HANDLE, message, size_t, index, BINARY_DATA*, binary_data);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportAMQPMocks, , int, message_get_body_type, MESSAGE_HANDLE, message, MESSAGE_BODY_TYPE*, body_type);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportAMQPMocks, , void, message_destroy, MESSAGE_HANDLE, message);
@@ -1309,6 +1415,94 @@ static void setExpectedCallsForConnectionDestroyUpTo(CIoTHubTransportAMQPMocks&
 	}
 }
 
+static void setExpectedCallsForEventContents(CIoTHubTransportAMQPMocks& mocks, size_t numberOfEvents)
+{
+    while (numberOfEvents-- > 0)
+    {
+        const unsigned char* binarydata_ptr = test_binary_data.bytes;
+        EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MESSAGE_HANDLE, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &binarydata_ptr, sizeof(binarydata_ptr))
+            .CopyOutArgumentBuffer(3, &test_binary_data.length, sizeof(test_binary_data.length));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MESSAGE_HANDLE))
+            .SetReturn(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP);
+        STRICT_EXPECTED_CALL(mocks, Map_GetInternals(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &no_property_keys_ptr, sizeof(no_property_keys_ptr))
+            .CopyOutArgumentBuffer(3, &no_property_values_ptr, sizeof(no_property_values_ptr))
+            .CopyOutArgumentBuffer(4, &no_property_size, sizeof(no_property_size));
+    }
+}
+
+static void setExpectedCallsForEventsToSend(CIoTHubTransportAMQPMocks& mocks, size_t numberOfEvents)
+{
+    size_t i;
+    for (i = 0; i < numberOfEvents; i++)
+    {
+        EXPECTED_CALL(mocks, message_create()).SetReturn(TEST_EVENT_MESSAGE_HANDLE);
+    }
+
+    setExpectedCallsForEventContents(mocks, numberOfEvents);
+}
+
+static void settleSentMessages(size_t first, size_t last, MESSAGE_SEND_RESULT send_result)
+{
+    size_t i;
+    for (i = first; i < last; i++)
+    {
+        test_sent_message_callbacks[i](test_sent_message_contexts[i], send_result);
+    }
+}
+
+// Fails a connection attempt at failure_time and returns the number of seconds DoWork waits before the next attempt.
+static size_t measureReconnectDelay(TRANSPORT_LL_HANDLE transport, CIoTHubTransportAMQPMocks& mocks, IOTHUBTRANSPORT_CONFIG* config, time_t failure_time)
+{
+    size_t seconds;
+    size_t attempts;
+
+    setExpectedCallsForTransportDoWorkUpTo(mocks, config, STEP_DOWORK_GET_TLS_IO, DOWORK_MESSAGERECEIVER_NONE);
+    EXPECTED_CALL(mocks, saslmechanism_create(NULL, NULL)).SetReturn((SASL_MECHANISM_HANDLE)NULL);
+    ((TRANSPORT_PROVIDER*)AMQP_Protocol())->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    setExpectedCallsForTransportDoWorkUpTo(mocks, config, STEP_DOWORK_GET_TLS_IO, DOWORK_MESSAGERECEIVER_NONE);
+    EXPECTED_CALL(mocks, saslmechanism_create(NULL, NULL)).SetReturn((SASL_MECHANISM_HANDLE)NULL);
+    attempts = test_number_of_connection_attempts;
+
+    for (seconds = 0; seconds <= 60 && test_number_of_connection_attempts == attempts; seconds++)
+    {
+        STRICT_EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(failure_time + seconds);
+        ((TRANSPORT_PROVIDER*)AMQP_Protocol())->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    }
+
+    return seconds - 1;
+}
+
+static void setExpectedCallsForCreateAdditionalEventSender(CIoTHubTransportAMQPMocks& mocks, LINK_HANDLE link, MESSAGE_SENDER_HANDLE message_sender, int open_result)
+{
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(link);
+    EXPECTED_CALL(mocks, messagesender_create(NULL, NULL, NULL, NULL)).SetReturn(message_sender);
+    EXPECTED_CALL(mocks, messagesender_open(NULL)).SetReturn(open_result);
+}
+
+// Connects the transport with sender_link_count 3; the second additional sender link opens with second_link_open_result.
+static void setupSuccessfulDoWorkWithAdditionalSenders(TRANSPORT_LL_HANDLE transport, CIoTHubTransportAMQPMocks& mocks, IOTHUBTRANSPORT_CONFIG& config, time_t current_time, int second_link_open_result)
+{
+    size_t sender_link_count = 3;
+    (void)((TRANSPORT_PROVIDER*)AMQP_Protocol())->IoTHubTransport_SetOption(transport, "sender_link_count", &sender_link_count);
+
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForCreateEventSender(mocks, &config);
+    setExpectedCallsForCreateAdditionalEventSender(mocks, TEST_ADDITIONAL_SENDER_LINK_1, TEST_ADDITIONAL_MESSAGE_SENDER_1, 0);
+    setExpectedCallsForCreateAdditionalEventSender(mocks, TEST_ADDITIONAL_SENDER_LINK_2, TEST_ADDITIONAL_MESSAGE_SENDER_2, second_link_open_result);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    ((TRANSPORT_PROVIDER*)AMQP_Protocol())->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    ((TRANSPORT_PROVIDER*)AMQP_Protocol())->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    mocks.ResetAllCalls();
+}
+
 static void setupSuccessfulDoWork(TRANSPORT_LL_HANDLE transport, CIoTHubTransportAMQPMocks& mocks, IOTHUBTRANSPORT_CONFIG& config, time_t current_time)
 {
     setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
@@ -1384,6 +1578,18 @@ TEST_FUNCTION_INITIALIZE(TestMethodInitialize)
     }
     int result = BASEIMPLEMENTATION::gballoc_init();
     ASSERT_ARE_EQUAL(int, 0, result);
+
+    test_current_ms = 0;
+    test_number_of_sent_messages = 0;
+    test_batched_event_encoded_size = TEST_BATCHED_EVENT_ENCODED_SIZE;
+    test_number_of_encoding_buffer_reallocs = 0;
+    test_number_of_connection_attempts = 0;
+    test_number_of_links_created = 0;
+    test_number_of_coalescing_size_options = 0;
+    test_last_coalescing_size = 0;
+    test_latest_sender_state_changed_callback = NULL;
+    test_latest_sender_state_changed_context = NULL;
+    test_number_of_connection_ready_calls = 0;
 }
 
 TEST_FUNCTION_CLEANUP(TestMethodCleanup)
@@ -2014,10 +2220,8 @@ TEST_FUNCTION(AMQP_DoWork_saslmechanism_create_fails)
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
-
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_060: [IoTHubTransportAMQP_DoWork shall create the SASL I/O layer using the xio_create() C Shared Utility API] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_061: [If xio_create() fails creating the SASL I/O layer, IoTHubTransportAMQP_DoWork shall fail and return immediately]
-TEST_FUNCTION(AMQP_DoWork_saslio_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_173: [After a failed connection, IoTHubTransportAMQP_DoWork shall wait before reconnecting for a random delay between half and all of 'reconnect_min_delay' doubled for each further consecutive failure, up to 'reconnect_max_delay'. The random part shall be drawn from a generator seeded per transport from its device id and the time of the first failure.]
+TEST_FUNCTION(AMQP_DoWork_waits_before_reconnecting_after_a_failure)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2025,21 +2229,25 @@ TEST_FUNCTION(AMQP_DoWork_saslio_create_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
-
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
 
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
 
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_GET_TLS_IO, DOWORK_MESSAGERECEIVER_NONE);
+    STRICT_EXPECTED_CALL(mocks, saslmssbcbs_get_interface());
+    EXPECTED_CALL(mocks, saslmechanism_create(NULL, NULL)).SetReturn((SASL_MECHANISM_HANDLE)NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_SASLIO_GET_INTERFACE, DOWORK_MESSAGERECEIVER_NONE);
-    EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn((XIO_HANDLE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_SASLMECHANISM);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+    STRICT_EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(current_time);
+    STRICT_EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(current_time);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
@@ -2048,9 +2256,48 @@ TEST_FUNCTION(AMQP_DoWork_saslio_create_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_062: [IoTHubTransportAMQP_DoWork shall create the connection with the IoT service using connection_create() AMQP API, passing the SASL I/O layer, IoT Hub FQDN and container ID as parameters (pass NULL for callbacks)]
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_063: [If connection_create() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
-TEST_FUNCTION(AMQP_DoWork_connection_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_173: [After a failed connection, IoTHubTransportAMQP_DoWork shall wait before reconnecting for a random delay between half and all of 'reconnect_min_delay' doubled for each further consecutive failure, up to 'reconnect_max_delay'. The random part shall be drawn from a generator seeded per transport from its device id and the time of the first failure.]
+TEST_FUNCTION(AMQP_DoWork_devices_failing_together_reconnect_after_different_delays)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts1;
+    DLIST_ENTRY wts2;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts1);
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts2);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config1 = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUB_CLIENT_CONFIG client_config2 = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        "otherdevice", TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config1 = { &client_config1, &wts1 };
+    IOTHUBTRANSPORT_CONFIG config2 = { &client_config2, &wts2 };
+    time_t failure_time = (time_t)1500000000;
+    size_t reconnect_min_delay = 20000;
+
+    TRANSPORT_LL_HANDLE transport1 = transport_interface->IoTHubTransport_Create(&config1);
+    TRANSPORT_LL_HANDLE transport2 = transport_interface->IoTHubTransport_Create(&config2);
+    (void)transport_interface->IoTHubTransport_SetOption(transport1, "reconnect_min_delay", &reconnect_min_delay);
+    (void)transport_interface->IoTHubTransport_SetOption(transport2, "reconnect_min_delay", &reconnect_min_delay);
+    mocks.ResetAllCalls();
+
+    // act
+    size_t delay1 = measureReconnectDelay(transport1, mocks, &config1, failure_time);
+    size_t delay2 = measureReconnectDelay(transport2, mocks, &config2, failure_time);
+
+    // assert
+    ASSERT_IS_TRUE(delay1 >= 10 && delay1 <= 20);
+    ASSERT_IS_TRUE(delay2 >= 10 && delay2 <= 20);
+    ASSERT_ARE_NOT_EQUAL(size_t, delay1, delay2);
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport1);
+    transport_interface->IoTHubTransport_Destroy(transport2);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_176: [Events rolled back to the waitingToSend list shall be placed ahead of the events still waiting, in the order they were originally sent.]
+TEST_FUNCTION(AMQP_DoWork_connection_retry_puts_the_events_in_progress_back_in_order)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2058,33 +2305,56 @@ TEST_FUNCTION(AMQP_DoWork_connection_create_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
-
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_SAS_TOKEN_LIFETIME_MS/1000 + 1);
+    PDLIST_ENTRY expected_order[6];
+    PDLIST_ENTRY entry;
+    int i;
 
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
 
-    mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_CREATE_SASLIO, DOWORK_MESSAGERECEIVER_NONE);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, connection_create(NULL, NULL, NULL, NULL, NULL)).SetReturn((CONNECTION_HANDLE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_SASLIO);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+    setupSuccessfulDoWork(transport, mocks, config, current_time);
+
+    addTestEvents(config.waitingToSend, 4, true);
+    for (i = 0, entry = wts.Flink; i < 4; i++, entry = entry->Flink)
+    {
+        expected_order[i] = entry;
+    }
+
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForEventsToSend(mocks, 4);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    addTestEvents(config.waitingToSend, 2, true);
+    for (i = 4, entry = wts.Flink; i < 6; i++, entry = entry->Flink)
+    {
+        expected_order[i] = entry;
+    }
+
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, expiration_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0)).SetReturn((STRING_HANDLE)NULL);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(size_t, 4, test_number_of_sent_messages);
+    for (i = 0, entry = wts.Flink; i < 6; i++, entry = entry->Flink)
+    {
+        ASSERT_IS_TRUE(entry == expected_order[i]);
+    }
+    ASSERT_IS_TRUE(entry == &wts);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_137: [IoTHubTransportAMQP_DoWork shall create the AMQP session session_create() AMQP API, passing the connection instance as parameter]
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_138: [If session_create() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
-TEST_FUNCTION(AMQP_DoWork_session_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_177: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "reconnect_min_delay", "reconnect_max_delay" or "connection_idle_timeout" (size_t, in milliseconds), returning IOTHUB_CLIENT_OK.]
+TEST_FUNCTION(AMQP_SetOption_reconnect_options_succeed)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2092,35 +2362,33 @@ TEST_FUNCTION(AMQP_DoWork_session_create_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
-
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t reconnect_min_delay = 2000;
+    size_t reconnect_max_delay = 120000;
+    size_t connection_idle_timeout = 240000;
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_CREATE_CONNECTION, DOWORK_MESSAGERECEIVER_NONE);
-    EXPECTED_CALL(mocks, session_create(NULL, NULL, NULL)).SetReturn((SESSION_HANDLE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CONNECTION);
-
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    IOTHUB_CLIENT_RESULT result1 = transport_interface->IoTHubTransport_SetOption(transport, "reconnect_min_delay", &reconnect_min_delay);
+    IOTHUB_CLIENT_RESULT result2 = transport_interface->IoTHubTransport_SetOption(transport, "reconnect_max_delay", &reconnect_max_delay);
+    IOTHUB_CLIENT_RESULT result3 = transport_interface->IoTHubTransport_SetOption(transport, "connection_idle_timeout", &connection_idle_timeout);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result1, IOTHUB_CLIENT_OK);
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result2, IOTHUB_CLIENT_OK);
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result3, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_065: [IoTHubTransportAMQP_DoWork shall apply a default value of UINT_MAX for the parameter 'AMQP incoming window'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_115: [IoTHubTransportAMQP_DoWork shall apply a default value of 100 for the parameter 'AMQP outgoing window'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_066: [IoTHubTransportAMQP_DoWork shall establish the CBS connection using the cbs_create() AMQP API] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_067: [If cbs_create() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
-TEST_FUNCTION(AMQP_DoWork_cbs_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_180: [IoTHubTransportAMQP_SetOption shall save the value if the option name is "sender_link_count" (size_t, at least 1), returning IOTHUB_CLIENT_OK; it applies to the next event sender created. A value of 0 shall be rejected with IOTHUB_CLIENT_INVALID_ARG.]
+TEST_FUNCTION(AMQP_SetOption_sender_link_count_succeeds)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2128,33 +2396,27 @@ TEST_FUNCTION(AMQP_DoWork_cbs_create_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
-
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t sender_link_count = 4;
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OUTGOING_WINDOW, DOWORK_MESSAGERECEIVER_NONE);
-    EXPECTED_CALL(mocks, cbs_create(NULL, NULL, NULL)).SetReturn((CBS_HANDLE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_SESSION);
-
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "sender_link_count", &sender_link_count);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_139: [IoTHubTransportAMQP_DoWork shall open the CBS connection using the cbs_open() AMQP API]
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_140: [If cbs_open() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
-TEST_FUNCTION(AMQP_DoWork_cbs_open_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_180: [IoTHubTransportAMQP_SetOption shall save the value if the option name is "sender_link_count" (size_t, at least 1), returning IOTHUB_CLIENT_OK; it applies to the next event sender created. A value of 0 shall be rejected with IOTHUB_CLIENT_INVALID_ARG.]
+TEST_FUNCTION(AMQP_SetOption_sender_link_count_zero_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2162,33 +2424,27 @@ TEST_FUNCTION(AMQP_DoWork_cbs_open_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
-
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t sender_link_count = 0;
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    EXPECTED_CALL(mocks, cbs_open(NULL)).SetReturn(1);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "sender_link_count", &sender_link_count);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_020: [IoTHubTransportAMQP_Create shall set parameter transport_state->sas_token_lifetime with the default value of 3600000 (milliseconds).] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_081: [IoTHubTransportAMQP_DoWork shall put a new SAS token if the one has not been out already, or if the previous one failed to be put due to timeout of cbs_put_token().] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_083: [Each new SAS token created by the transport shall be valid for up to 'sas_token_lifetime' milliseconds from the time of creation] 
-TEST_FUNCTION(AMQP_DoWork_SASToken_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_181: [IoTHubTransportAMQP_SetOption shall save a copy of the value if the option name is "sender_partition_property" (const char*), returning IOTHUB_CLIENT_OK; an empty string restores the round-robin distribution. If the copy fails IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.]
+TEST_FUNCTION(AMQP_SetOption_sender_partition_property_succeeds)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2200,30 +2456,27 @@ TEST_FUNCTION(AMQP_DoWork_SASToken_create_fails)
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    time_t current_time = time(NULL);
-    size_t expected_expiry_time = (size_t)(difftime(current_time, 0) + TEST_SAS_TOKEN_LIFETIME_MS / 1000);
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    STRICT_EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(current_time);
-    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0)).SetReturn((STRING_HANDLE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    STRICT_EXPECTED_CALL(mocks, mallocAndStrcpy_s(IGNORED_PTR_ARG, "deviceZone"))
+        .IgnoreArgument(1);
+    EXPECTED_CALL(mocks, gballoc_free(NULL));
 
     // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "sender_partition_property", "deviceZone");
 
     // assert
     mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL(int, expected_expiry_time, test_latest_SASToken_expiry_time);
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_146: [If the SAS token fails to be sent to CBS (cbs_put_token), IoTHubTransportAMQP_DoWork shall fail and exit immediately]
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_145: [Each new SAS token created shall be deleted from memory immediately after sending it to CBS]
-TEST_FUNCTION(AMQP_DoWork_cbs_put_token_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_178: [If 'sender_link_count' is greater than 1, IoTHubTransportAMQP_DoWork shall open that many sender links minus one in addition to the primary sender link, named "sender-link-<n>", with the same source, target and settings; a link that fails to open shall be logged and the events spread across the links that opened.]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_179: [With more than one sender link open, IoTHubTransportAMQP_DoWork shall send each event on the link selected by the hash of its 'sender_partition_property' value if that option is set (events without the property on the primary link), or round-robin otherwise.]
+TEST_FUNCTION(AMQP_DoWork_sends_the_events_round_robin_on_the_additional_sender_links)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2234,33 +2487,40 @@ TEST_FUNCTION(AMQP_DoWork_cbs_put_token_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
     time_t current_time = time(NULL);
 
-    mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    STRICT_EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(current_time);
-    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0));
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, cbs_put_token(NULL, NULL, NULL, NULL, NULL, NULL)).SetReturn(1);
-    EXPECTED_CALL(mocks, STRING_delete(NULL));
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
 
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+    setupSuccessfulDoWorkWithAdditionalSenders(transport, mocks, config, current_time, 0);
+
+    addTestEvents(config.waitingToSend, 6, true);
+
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForEventsToSend(mocks, 6);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(size_t, 3, test_number_of_links_created);
+    ASSERT_ARE_EQUAL(char_ptr, TEST_MESSAGE_SENDER_LINK_NAME, test_link_names[0]);
+    ASSERT_ARE_EQUAL(char_ptr, TEST_MESSAGE_SENDER_LINK_NAME "-1", test_link_names[1]);
+    ASSERT_ARE_EQUAL(char_ptr, TEST_MESSAGE_SENDER_LINK_NAME "-2", test_link_names[2]);
+    ASSERT_ARE_EQUAL(size_t, 6, test_number_of_sent_messages);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_MESSAGE_SENDER, test_sent_message_senders[0]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_1, test_sent_message_senders[1]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_2, test_sent_message_senders[2]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_MESSAGE_SENDER, test_sent_message_senders[3]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_1, test_sent_message_senders[4]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_2, test_sent_message_senders[5]);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_084: [IoTHubTransportAMQP_DoWork shall wait for 'cbs_request_timeout' milliseconds for the cbs_put_token() to complete before failing due to timeout] 
-TEST_FUNCTION(AMQP_DoWork_CBS_auth_timeout_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_178: [If 'sender_link_count' is greater than 1, IoTHubTransportAMQP_DoWork shall open that many sender links minus one in addition to the primary sender link, named "sender-link-<n>", with the same source, target and settings; a link that fails to open shall be logged and the events spread across the links that opened.]
+TEST_FUNCTION(AMQP_DoWork_spreads_the_events_across_the_sender_links_that_opened)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2271,30 +2531,34 @@ TEST_FUNCTION(AMQP_DoWork_CBS_auth_timeout_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
     time_t current_time = time(NULL);
-    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
 
-    mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(expiration_time);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    setupSuccessfulDoWorkWithAdditionalSenders(transport, mocks, config, current_time, 1);
+
+    addTestEvents(config.waitingToSend, 4, true);
+
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForEventsToSend(mocks, 4);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(size_t, 4, test_number_of_sent_messages);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_MESSAGE_SENDER, test_sent_message_senders[0]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_1, test_sent_message_senders[1]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_MESSAGE_SENDER, test_sent_message_senders[2]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_1, test_sent_message_senders[3]);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_068: [IoTHubTransportAMQP_DoWork shall create the AMQP link for sending messages using 'source' as "ingress", target as the IoT hub FQDN, link name as "sender-link" and role as 'role_sender'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_069: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for sending messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
-TEST_FUNCTION(AMQP_DoWork_messagesender_create_source_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_179: [With more than one sender link open, IoTHubTransportAMQP_DoWork shall send each event on the link selected by the hash of its 'sender_partition_property' value if that option is set (events without the property on the primary link), or round-robin otherwise.]
+TEST_FUNCTION(AMQP_DoWork_sends_the_events_on_the_sender_link_selected_by_their_partition_property)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2305,35 +2569,46 @@ TEST_FUNCTION(AMQP_DoWork_messagesender_create_source_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
     time_t current_time = time(NULL);
-    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
+    // The FNV-1a hashes of "a" and "d" select the additional links 1 and 2 out of 3.
+    const char* partition_keys[] = { "a", "d", "a", NULL };
+    int i;
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    (void)transport_interface->IoTHubTransport_SetOption(transport, "sender_partition_property", "sensor");
+
+    setupSuccessfulDoWorkWithAdditionalSenders(transport, mocks, config, current_time, 0);
+
+    addTestEvents(config.waitingToSend, 4, true);
 
-    mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
     setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+    for (i = 0; i < 4; i++)
+    {
+        EXPECTED_CALL(mocks, message_create()).SetReturn(TEST_EVENT_MESSAGE_HANDLE);
+        setExpectedCallsForEventContents(mocks, 1);
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MESSAGE_HANDLE))
+            .SetReturn(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP);
+        STRICT_EXPECTED_CALL(mocks, Map_GetValueFromKey(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP, "sensor"))
+            .SetReturn(partition_keys[i]);
+    }
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(size_t, 4, test_number_of_sent_messages);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_1, test_sent_message_senders[0]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_2, test_sent_message_senders[1]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_ADDITIONAL_MESSAGE_SENDER_1, test_sent_message_senders[2]);
+    ASSERT_ARE_EQUAL(void_ptr, TEST_MESSAGE_SENDER, test_sent_message_senders[3]);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_068: [IoTHubTransportAMQP_DoWork shall create the AMQP link for sending messages using 'source' as "ingress", target as the IoT hub FQDN, link name as "sender-link" and role as 'role_sender'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_069: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for sending messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
-TEST_FUNCTION(AMQP_DoWork_messagesender_create_target_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_186: [IoTHubTransportAMQP_SetOption shall save the value if the option name is "eagerConnect" (bool), returning IOTHUB_CLIENT_OK.]
+TEST_FUNCTION(AMQP_SetOption_eagerConnect_succeeds)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2345,37 +2620,23 @@ TEST_FUNCTION(AMQP_DoWork_messagesender_create_target_fails)
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    time_t current_time = time(NULL);
-    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
+    bool eagerConnect = true;
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn((AMQP_VALUE)NULL);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "eagerConnect", &eagerConnect);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_068: [IoTHubTransportAMQP_DoWork shall create the AMQP link for sending messages using 'source' as "ingress", target as the IoT hub FQDN, link name as "sender-link" and role as 'role_sender'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_069: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for sending messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
-TEST_FUNCTION(AMQP_DoWork_messagesender_create_link_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_187: [If 'eagerConnect' is set, IoTHubTransportAMQP_DoWork shall call IoTHubClient_LL_ConnectionReady() once per connection, as soon as the event sender (and the message receiver, if subscribed) report they are open.]
+TEST_FUNCTION(AMQP_DoWork_with_eagerConnect_reports_the_connection_ready_once_the_event_sender_is_open)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2386,41 +2647,33 @@ TEST_FUNCTION(AMQP_DoWork_messagesender_create_link_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
     time_t current_time = time(NULL);
-    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
+    bool eagerConnect = true;
+    size_t connection_ready_calls_while_opening;
 
-    mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGESENDER_TARGET);
-    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn((LINK_HANDLE)NULL);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_TARGET));
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    (void)transport_interface->IoTHubTransport_SetOption(transport, "eagerConnect", &eagerConnect);
+    setupSuccessfulDoWork(transport, mocks, config, current_time);
+    connection_ready_calls_while_opening = test_number_of_connection_ready_calls;
 
     // act
+    test_latest_sender_state_changed_callback(test_latest_sender_state_changed_context, MESSAGE_SENDER_STATE_OPEN, MESSAGE_SENDER_STATE_OPENING);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
+    ASSERT_IS_TRUE(test_latest_sender_state_changed_callback != NULL);
+    ASSERT_ARE_EQUAL(size_t, 0, connection_ready_calls_while_opening);
+    ASSERT_ARE_EQUAL(size_t, 1, test_number_of_connection_ready_calls);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_070: [IoTHubTransportAMQP_DoWork shall create the AMQP message sender using messagesender_create() AMQP API] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_071: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message sender instance fails to be created, flagging the connection to be re-established] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_119: [IoTHubTransportAMQP_DoWork shall apply a default value of 65536 for the parameter 'Link MAX message size'] 
-TEST_FUNCTION(AMQP_DoWork_messagesender_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_187: [If 'eagerConnect' is set, IoTHubTransportAMQP_DoWork shall call IoTHubClient_LL_ConnectionReady() once per connection, as soon as the event sender (and the message receiver, if subscribed) report they are open.]
+TEST_FUNCTION(AMQP_DoWork_without_eagerConnect_does_not_report_the_connection_ready)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2431,50 +2684,27 @@ TEST_FUNCTION(AMQP_DoWork_messagesender_create_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
     time_t current_time = time(NULL);
-    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
 
-    mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGESENDER_TARGET);
-    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGESENDER_LINK);
-    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
-    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
-    EXPECTED_CALL(mocks, messagesender_create(NULL, NULL, NULL, NULL)).SetReturn((MESSAGE_SENDER_HANDLE)NULL);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_TARGET));
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
-    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    setupSuccessfulDoWork(transport, mocks, config, current_time);
 
     // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    test_latest_sender_state_changed_callback(test_latest_sender_state_changed_context, MESSAGE_SENDER_STATE_OPEN, MESSAGE_SENDER_STATE_OPENING);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(size_t, 0, test_number_of_connection_ready_calls);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_072: [IoTHubTransportAMQP_DoWork shall open the AMQP message sender using messagesender_open() AMQP API] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_073: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message sender instance fails to be opened, flagging the connection to be re-established] 
-TEST_FUNCTION(AMQP_DoWork_messagesender_open_fails)
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_060: [IoTHubTransportAMQP_DoWork shall create the SASL I/O layer using the xio_create() C Shared Utility API] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_061: [If xio_create() fails creating the SASL I/O layer, IoTHubTransportAMQP_DoWork shall fail and return immediately]
+TEST_FUNCTION(AMQP_DoWork_saslio_create_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2482,43 +2712,21 @@ TEST_FUNCTION(AMQP_DoWork_messagesender_open_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    time_t current_time = time(NULL);
-    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGESENDER_TARGET);
-    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGESENDER_LINK);
-    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
-    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
-    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, messagesender_create(NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGE_SENDER);
-    EXPECTED_CALL(mocks, messagesender_open(TEST_MESSAGE_SENDER)).SetReturn(1);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_TARGET));
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_SASLIO_GET_INTERFACE, DOWORK_MESSAGERECEIVER_NONE);
+    EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn((XIO_HANDLE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_SASLMECHANISM);
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
@@ -2527,10 +2735,9 @@ TEST_FUNCTION(AMQP_DoWork_messagesender_open_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_074: [IoTHubTransportAMQP_DoWork shall create the AMQP link for receiving messages using 'source' as messageReceiveAddress, target as the "ingress-rx", link name as "receiver-link" and role as 'role_receiver'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_075: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_038: [IoTHubTransportAMQP_Subscribe shall set transport_handle->receive_messages to true and return success code.]
-TEST_FUNCTION(AMQP_DoWork_messagereceiver_source_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_062: [IoTHubTransportAMQP_DoWork shall create the connection with the IoT service using connection_create() AMQP API, passing the SASL I/O layer, IoT Hub FQDN and container ID as parameters (pass NULL for callbacks)]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_063: [If connection_create() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
+TEST_FUNCTION(AMQP_DoWork_connection_create_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2538,31 +2745,22 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_source_create_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
 
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
-    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_CREATE_SASLIO, DOWORK_MESSAGERECEIVER_NONE);
     EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    EXPECTED_CALL(mocks, connection_create(NULL, NULL, NULL, NULL, NULL)).SetReturn((CONNECTION_HANDLE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_SASLIO);
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
@@ -2571,9 +2769,9 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_source_create_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_074: [IoTHubTransportAMQP_DoWork shall create the AMQP link for receiving messages using 'source' as messageReceiveAddress, target as the "ingress-rx", link name as "receiver-link" and role as 'role_receiver'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_075: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
-TEST_FUNCTION(AMQP_DoWork_messagereceiver_target_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_137: [IoTHubTransportAMQP_DoWork shall create the AMQP session session_create() AMQP API, passing the connection instance as parameter]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_138: [If session_create() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
+TEST_FUNCTION(AMQP_DoWork_session_create_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2581,33 +2779,22 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_target_create_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
 
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
-    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn((AMQP_VALUE)NULL);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_CREATE_CONNECTION, DOWORK_MESSAGERECEIVER_NONE);
+    EXPECTED_CALL(mocks, session_create(NULL, NULL, NULL)).SetReturn((SESSION_HANDLE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CONNECTION);
+
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
@@ -2616,9 +2803,11 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_target_create_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_074: [IoTHubTransportAMQP_DoWork shall create the AMQP link for receiving messages using 'source' as messageReceiveAddress, target as the "ingress-rx", link name as "receiver-link" and role as 'role_receiver'] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_075: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
-TEST_FUNCTION(AMQP_DoWork_messagereceiver_link_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_065: [IoTHubTransportAMQP_DoWork shall apply a default value of UINT_MAX for the parameter 'AMQP incoming window'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_115: [IoTHubTransportAMQP_DoWork shall apply a default value of 100 for the parameter 'AMQP outgoing window'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_066: [IoTHubTransportAMQP_DoWork shall establish the CBS connection using the cbs_create() AMQP API] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_067: [If cbs_create() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
+TEST_FUNCTION(AMQP_DoWork_cbs_create_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2626,35 +2815,22 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_link_create_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
 
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
-    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
-    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn((LINK_HANDLE)NULL);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
-    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OUTGOING_WINDOW, DOWORK_MESSAGERECEIVER_NONE);
+    EXPECTED_CALL(mocks, cbs_create(NULL, NULL, NULL)).SetReturn((CBS_HANDLE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_SESSION);
+
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
@@ -2663,9 +2839,9 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_link_create_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_076: [IoTHubTransportAMQP_DoWork shall set the receiver link settle mode as receiver_settle_mode_first] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_141: [If IoTHubTransportAMQP_DoWork fails to set the settle mode on the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
-TEST_FUNCTION(AMQP_DoWork_messagereceiver_settle_mode_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_139: [IoTHubTransportAMQP_DoWork shall open the CBS connection using the cbs_open() AMQP API]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_140: [If cbs_open() fails, IoTHubTransportAMQP_DoWork shall fail and return immediately]
+TEST_FUNCTION(AMQP_DoWork_cbs_open_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2673,35 +2849,20 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_settle_mode_fails)
     DLIST_ENTRY wts;
     BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
     TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
 
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
-    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
-    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGERECEIVER_LINK);
-    STRICT_EXPECTED_CALL(mocks, link_set_rcv_settle_mode(TEST_MESSAGERECEIVER_LINK, receiver_settle_mode_first)).SetReturn(1);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    EXPECTED_CALL(mocks, cbs_open(NULL)).SetReturn(1);
     setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
-                                                 // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
@@ -2711,10 +2872,10 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_settle_mode_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_077: [IoTHubTransportAMQP_DoWork shall create the AMQP message receiver using messagereceiver_create() AMQP API] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_078: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message receiver instance fails to be created, flagging the connection to be re-established] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_119: [IoTHubTransportAMQP_DoWork shall apply a default value of 65536 for the parameter 'Link MAX message size'] 
-TEST_FUNCTION(AMQP_DoWork_messagereceiver_create_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_020: [IoTHubTransportAMQP_Create shall set parameter transport_state->sas_token_lifetime with the default value of 3600000 (milliseconds).] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_081: [IoTHubTransportAMQP_DoWork shall put a new SAS token if the one has not been out already, or if the previous one failed to be put due to timeout of cbs_put_token().] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_083: [Each new SAS token created by the transport shall be valid for up to 'sas_token_lifetime' milliseconds from the time of creation] 
+TEST_FUNCTION(AMQP_DoWork_SASToken_create_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2725,42 +2886,57 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_create_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
-
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
-    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+    time_t current_time = time(NULL);
+    size_t expected_expiry_time = (size_t)(difftime(current_time, 0) + TEST_SAS_TOKEN_LIFETIME_MS / 1000);
 
     mocks.ResetAllCalls();
     setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
-    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGERECEIVER_LINK);
-    STRICT_EXPECTED_CALL(mocks, link_set_rcv_settle_mode(TEST_MESSAGERECEIVER_LINK, receiver_settle_mode_first));
-    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
-    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
-    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, messagereceiver_create(NULL, NULL, NULL)).SetReturn(TEST_MESSAGE_RECEIVER).SetReturn((MESSAGE_RECEIVER_HANDLE)NULL);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    STRICT_EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(current_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0)).SetReturn((STRING_HANDLE)NULL);
     setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
     // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(int, expected_expiry_time, test_latest_SASToken_expiry_time);
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_146: [If the SAS token fails to be sent to CBS (cbs_put_token), IoTHubTransportAMQP_DoWork shall fail and exit immediately]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_145: [Each new SAS token created shall be deleted from memory immediately after sending it to CBS]
+TEST_FUNCTION(AMQP_DoWork_cbs_put_token_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    time_t current_time = time(NULL);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    STRICT_EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(current_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, cbs_put_token(NULL, NULL, NULL, NULL, NULL, NULL)).SetReturn(1);
+    EXPECTED_CALL(mocks, STRING_delete(NULL));
+
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
     transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
@@ -2770,9 +2946,8 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_create_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_079: [IoTHubTransportAMQP_DoWork shall open the AMQP message receiver using messagereceiver_open() AMQP API, passing a callback function for handling C2D incoming messages] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_080: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message receiver instance fails to be opened, flagging the connection to be re-established] 
-TEST_FUNCTION(AMQP_DoWork_messagereceiver_open_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_084: [IoTHubTransportAMQP_DoWork shall wait for 'cbs_request_timeout' milliseconds for the cbs_put_token() to complete before failing due to timeout] 
+TEST_FUNCTION(AMQP_DoWork_CBS_auth_timeout_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2783,11 +2958,43 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_open_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
     time_t current_time = time(NULL);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(expiration_time);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_068: [IoTHubTransportAMQP_DoWork shall create the AMQP link for sending messages using 'source' as "ingress", target as the IoT hub FQDN, link name as "sender-link" and role as 'role_sender'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_069: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for sending messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
+TEST_FUNCTION(AMQP_DoWork_messagesender_create_source_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
-    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+    time_t current_time = time(NULL);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
 
     mocks.ResetAllCalls();
     setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
@@ -2795,24 +3002,6 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_open_fails)
     setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
     setExpectedCallsForConnectionDoWork(mocks, &config);
     setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    EXPECTED_CALL(mocks, STRING_c_str(NULL));
-    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
-    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
-    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGERECEIVER_LINK);
-    STRICT_EXPECTED_CALL(mocks, link_set_rcv_settle_mode(TEST_MESSAGERECEIVER_LINK, receiver_settle_mode_first));
-    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
-    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
-    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
-    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
-    EXPECTED_CALL(mocks, messagereceiver_create(NULL, NULL, NULL)).SetReturn(TEST_MESSAGE_RECEIVER);
-    EXPECTED_CALL(mocks, messagereceiver_open(TEST_MESSAGE_RECEIVER, NULL, NULL)).SetReturn(1);
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
-    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
     EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
     setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
@@ -2829,10 +3018,51 @@ TEST_FUNCTION(AMQP_DoWork_messagereceiver_open_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_055: [If the transport handle has a NULL connection, IoTHubTransportAMQP_DoWork shall instantiate and initialize the AMQP components and establish the connection] 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_082: [IoTHubTransportAMQP_DoWork shall refresh the SAS token if the current token has been used for more than 'sas_token_refresh_time' milliseconds]
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_128: [IoTHubTransportAMQP_Create shall set parameter transport_state->sas_token_refresh_time with the default value of sas_token_lifetime/2 (milliseconds).] 
-TEST_FUNCTION(AMQP_DoWork_expired_SASToken_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_068: [IoTHubTransportAMQP_DoWork shall create the AMQP link for sending messages using 'source' as "ingress", target as the IoT hub FQDN, link name as "sender-link" and role as 'role_sender'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_069: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for sending messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
+TEST_FUNCTION(AMQP_DoWork_messagesender_create_target_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    time_t current_time = time(NULL);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn((AMQP_VALUE)NULL);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_068: [IoTHubTransportAMQP_DoWork shall create the AMQP link for sending messages using 'source' as "ingress", target as the IoT hub FQDN, link name as "sender-link" and role as 'role_sender'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_069: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for sending messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
+TEST_FUNCTION(AMQP_DoWork_messagesender_create_link_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2843,21 +3073,77 @@ TEST_FUNCTION(AMQP_DoWork_expired_SASToken_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
     time_t current_time = time(NULL);
-    time_t expiration_time = addSecondsToTime(current_time, (TEST_SAS_TOKEN_LIFETIME_MS/2)/1000 + 1);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGESENDER_TARGET);
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn((LINK_HANDLE)NULL);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_TARGET));
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_070: [IoTHubTransportAMQP_DoWork shall create the AMQP message sender using messagesender_create() AMQP API] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_071: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message sender instance fails to be created, flagging the connection to be re-established] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_119: [IoTHubTransportAMQP_DoWork shall apply a default value of 65536 for the parameter 'Link MAX message size'] 
+TEST_FUNCTION(AMQP_DoWork_messagesender_create_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
-    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+    time_t current_time = time(NULL);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
 
     mocks.ResetAllCalls();
     setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
     setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
     setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
     setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, expiration_time);
-    EXPECTED_CALL(mocks, get_time(NULL)).SetReturn(current_time);
-    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0)).SetReturn((STRING_HANDLE)NULL);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGESENDER_TARGET);
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGESENDER_LINK);
+    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
+    EXPECTED_CALL(mocks, messagesender_create(NULL, NULL, NULL, NULL)).SetReturn((MESSAGE_SENDER_HANDLE)NULL);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_TARGET));
     setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
     setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
 
@@ -2873,10 +3159,879 @@ TEST_FUNCTION(AMQP_DoWork_expired_SASToken_fails)
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_086: [IoTHubTransportAMQP_DoWork shall move queued events to an "in-progress" list right before processing them for sending]
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_089: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain its char* representation using IoTHubMessage_GetString()]
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_090: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain the size of its char* representation using strlen()] 
-TEST_FUNCTION(AMQP_DoWork_succeeds_when_2_waiting_to_send_messages_are_in_the_list)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_072: [IoTHubTransportAMQP_DoWork shall open the AMQP message sender using messagesender_open() AMQP API] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_073: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message sender instance fails to be opened, flagging the connection to be re-established] 
+TEST_FUNCTION(AMQP_DoWork_messagesender_open_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    time_t current_time = time(NULL);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_CBS_REQUEST_TIMEOUT_MS + 1);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGESENDER_SOURCE);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGESENDER_TARGET);
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGESENDER_LINK);
+    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
+    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, messagesender_create(NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGE_SENDER);
+    EXPECTED_CALL(mocks, messagesender_open(TEST_MESSAGE_SENDER)).SetReturn(1);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_SOURCE));
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGESENDER_TARGET));
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_074: [IoTHubTransportAMQP_DoWork shall create the AMQP link for receiving messages using 'source' as messageReceiveAddress, target as the "ingress-rx", link name as "receiver-link" and role as 'role_receiver'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_075: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_038: [IoTHubTransportAMQP_Subscribe shall set transport_handle->receive_messages to true and return success code.]
+TEST_FUNCTION(AMQP_DoWork_messagereceiver_source_create_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
+    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_074: [IoTHubTransportAMQP_DoWork shall create the AMQP link for receiving messages using 'source' as messageReceiveAddress, target as the "ingress-rx", link name as "receiver-link" and role as 'role_receiver'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_075: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
+TEST_FUNCTION(AMQP_DoWork_messagereceiver_target_create_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
+    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn((AMQP_VALUE)NULL);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_074: [IoTHubTransportAMQP_DoWork shall create the AMQP link for receiving messages using 'source' as messageReceiveAddress, target as the "ingress-rx", link name as "receiver-link" and role as 'role_receiver'] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_075: [If IoTHubTransportAMQP_DoWork fails to create the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
+TEST_FUNCTION(AMQP_DoWork_messagereceiver_link_create_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
+    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn((LINK_HANDLE)NULL);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_076: [IoTHubTransportAMQP_DoWork shall set the receiver link settle mode as receiver_settle_mode_first] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_141: [If IoTHubTransportAMQP_DoWork fails to set the settle mode on the AMQP link for receiving messages, the function shall fail and return immediately, flagging the connection to be re-stablished] 
+TEST_FUNCTION(AMQP_DoWork_messagereceiver_settle_mode_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
+    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGERECEIVER_LINK);
+    STRICT_EXPECTED_CALL(mocks, link_set_rcv_settle_mode(TEST_MESSAGERECEIVER_LINK, receiver_settle_mode_first)).SetReturn(1);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+                                                 // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_077: [IoTHubTransportAMQP_DoWork shall create the AMQP message receiver using messagereceiver_create() AMQP API] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_078: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message receiver instance fails to be created, flagging the connection to be re-established] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_119: [IoTHubTransportAMQP_DoWork shall apply a default value of 65536 for the parameter 'Link MAX message size'] 
+TEST_FUNCTION(AMQP_DoWork_messagereceiver_create_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
+    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGERECEIVER_LINK);
+    STRICT_EXPECTED_CALL(mocks, link_set_rcv_settle_mode(TEST_MESSAGERECEIVER_LINK, receiver_settle_mode_first));
+    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
+    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, messagereceiver_create(NULL, NULL, NULL)).SetReturn(TEST_MESSAGE_RECEIVER).SetReturn((MESSAGE_RECEIVER_HANDLE)NULL);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_079: [IoTHubTransportAMQP_DoWork shall open the AMQP message receiver using messagereceiver_open() AMQP API, passing a callback function for handling C2D incoming messages] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_080: [IoTHubTransportAMQP_DoWork shall fail and return immediately if the AMQP message receiver instance fails to be opened, flagging the connection to be re-established] 
+TEST_FUNCTION(AMQP_DoWork_messagereceiver_open_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
+    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn(TEST_MESSAGERECEIVER_SOURCE);
+    EXPECTED_CALL(mocks, messaging_create_target(NULL)).SetReturn(TEST_MESSAGERECEIVER_TARGET);
+    EXPECTED_CALL(mocks, link_create(NULL, NULL, NULL, NULL, NULL)).SetReturn(TEST_MESSAGERECEIVER_LINK);
+    STRICT_EXPECTED_CALL(mocks, link_set_rcv_settle_mode(TEST_MESSAGERECEIVER_LINK, receiver_settle_mode_first));
+    EXPECTED_CALL(mocks, link_set_max_message_size(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+    EXPECTED_CALL(mocks, amqpvalue_create_map()).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_symbol(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_create_string(NULL)).IgnoreArgument(1).SetReturn(TEST_AMQP_VALUE_TEST_HANDLE);
+    EXPECTED_CALL(mocks, amqpvalue_set_map_value(NULL, NULL, NULL)).IgnoreAllArguments();
+    EXPECTED_CALL(mocks, link_set_attach_properties(NULL, NULL)).IgnoreAllArguments().SetReturn(0);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, amqpvalue_destroy(NULL)).IgnoreArgument(1);
+    EXPECTED_CALL(mocks, messagereceiver_create(NULL, NULL, NULL)).SetReturn(TEST_MESSAGE_RECEIVER);
+    EXPECTED_CALL(mocks, messagereceiver_open(TEST_MESSAGE_RECEIVER, NULL, NULL)).SetReturn(1);
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_SOURCE));
+    STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_MESSAGERECEIVER_TARGET));
+    EXPECTED_CALL(mocks, messaging_create_source(NULL)).SetReturn((AMQP_VALUE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_055: [If the transport handle has a NULL connection, IoTHubTransportAMQP_DoWork shall instantiate and initialize the AMQP components and establish the connection] 
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_082: [IoTHubTransportAMQP_DoWork shall refresh the SAS token if the current token has been used for more than 'sas_token_refresh_time' milliseconds]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_156: [If the current SAS token has expired and no refresh has succeeded, IoTHubTransportAMQP_DoWork shall fail and trigger a connection retry.]
+TEST_FUNCTION(AMQP_DoWork_expired_SASToken_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    time_t expiration_time = addSecondsToTime(current_time, TEST_SAS_TOKEN_LIFETIME_MS/1000 + 1);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    int subscribe_result = transport_interface->IoTHubTransport_Subscribe(transport);
+    ASSERT_ARE_EQUAL(int, subscribe_result, 0);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, expiration_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0)).SetReturn((STRING_HANDLE)NULL);
+    setExpectedCallsForConnectionDestroyUpTo(mocks, &config, STEP_DOWORK_CREATE_CBS);
+    setExpectedCallsForRollEventsBackToWaitList(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_082: [IoTHubTransportAMQP_DoWork shall refresh the SAS token if the current token has been used for more than 'sas_token_refresh_time' milliseconds]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_153: [While a refreshed SAS token is put to CBS the transport shall remain authenticated and keep sending events; a failed refresh shall be retried no sooner than 'cbs_request_timeout' milliseconds after the previous attempt.]
+TEST_FUNCTION(AMQP_DoWork_SASToken_refresh_keeps_sending_events)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    time_t refresh_time = addSecondsToTime(current_time, (TEST_SAS_TOKEN_LIFETIME_MS/2)/1000 + 1);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    addTestEvents(config.waitingToSend, 1, true);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, refresh_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, cbs_put_token(NULL, NULL, NULL, NULL, NULL, NULL));
+    EXPECTED_CALL(mocks, STRING_delete(NULL));
+    setExpectedCallsForCreateEventSender(mocks, &config);
+    setExpectedCallsForSendPendingEvents(mocks, IOTHUBMESSAGE_STRING, refresh_time, 1);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_155: [If CBS does not answer the refresh within 'cbs_request_timeout' milliseconds, the refresh shall be considered failed.]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_189: [A put-token completion that does not belong to the last put-token operation sent, or that arrives after that operation timed out, shall be ignored.]
+TEST_FUNCTION(AMQP_DoWork_SASToken_refresh_ignores_late_result_of_timed_out_refresh)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    time_t refresh_time = addSecondsToTime(current_time, (TEST_SAS_TOKEN_LIFETIME_MS/2)/1000 + 1);
+    time_t first_refresh_timeout_time = addSecondsToTime(refresh_time, TEST_CBS_REQUEST_TIMEOUT_MS/1000);
+    time_t second_refresh_timeout_time = addSecondsToTime(first_refresh_timeout_time, TEST_CBS_REQUEST_TIMEOUT_MS/1000);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    // First refresh, never answered in time.
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, refresh_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, cbs_put_token(NULL, NULL, NULL, NULL, NULL, NULL));
+    EXPECTED_CALL(mocks, STRING_delete(NULL));
+    setExpectedCallsForCreateEventSender(mocks, &config);
+    setExpectedCallsForSendPendingEvents(mocks, IOTHUBMESSAGE_STRING, refresh_time, 0);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    // The first refresh times out and is retried.
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, first_refresh_timeout_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, cbs_put_token(NULL, NULL, NULL, NULL, NULL, NULL));
+    EXPECTED_CALL(mocks, STRING_delete(NULL));
+    setExpectedCallsForSendPendingEvents(mocks, IOTHUBMESSAGE_STRING, first_refresh_timeout_time, 0);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    // The late result of the first refresh must not be taken as the result of the second one,
+    // so the second refresh times out as well and is retried.
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, second_refresh_timeout_time);
+    EXPECTED_CALL(mocks, SASToken_Create(NULL, NULL, NULL, 0));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, cbs_put_token(NULL, NULL, NULL, NULL, NULL, NULL));
+    EXPECTED_CALL(mocks, STRING_delete(NULL));
+    setExpectedCallsForSendPendingEvents(mocks, IOTHUBMESSAGE_STRING, second_refresh_timeout_time, 0);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_086: [IoTHubTransportAMQP_DoWork shall move queued events to an "in-progress" list right before processing them for sending]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_089: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain its char* representation using IoTHubMessage_GetString()]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_090: [If the event contains a message of type IOTHUBMESSAGE_STRING, IoTHubTransportAMQP_DoWork shall obtain the size of its char* representation using strlen()] 
+TEST_FUNCTION(AMQP_DoWork_succeeds_when_2_waiting_to_send_messages_are_in_the_list)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    addTestEvents(config.waitingToSend, 2, true);
+
+    mocks.ResetAllCalls();
+    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
+    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
+    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForCreateEventSender(mocks, &config);
+    setExpectedCallsForSendPendingEvents(mocks, IOTHUBMESSAGE_STRING, current_time, 2);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
+}
+
+
+// Codes_SRS_IOTHUBTRANSPORTAMQP_09_041: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.] 
+// Codes_SRS_IOTHUBTRANSPORTAMQP_09_042: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_IDLE if there are currently no event items to be sent or being sent.]
+TEST_FUNCTION(AMQP_GetSendStatus_idle_succeeds)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    IOTHUB_CLIENT_STATUS iotHubClientStatus;
+
+    mocks.ResetAllCalls();
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
+
+    // act
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_GetSendStatus(transport, &iotHubClientStatus);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK, "IoTHubTransport_GetSendStatus returned unexpected result.");
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_STATUS, iotHubClientStatus, IOTHUB_CLIENT_SEND_STATUS_IDLE, "IoTHubTransport_GetSendStatus returned unexpected status.");
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_041: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.]  
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_043: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_BUSY if there are currently event items to be sent or being sent.] 
+TEST_FUNCTION(AMQP_GetSendStatus_inProgress_not_empty_succeeds)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    IOTHUB_CLIENT_STATUS iotHubClientStatus;
+
+    mocks.ResetAllCalls();
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(0);
+
+    // act
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_GetSendStatus(transport, &iotHubClientStatus);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK, "IoTHubTransport_GetSendStatus returned unexpected result.");
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_STATUS, iotHubClientStatus, IOTHUB_CLIENT_SEND_STATUS_BUSY, "IoTHubTransport_GetSendStatus returned unexpected status.");
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_041: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.]  
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_043: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_BUSY if there are currently event items to be sent or being sent.] 
+TEST_FUNCTION(AMQP_GetSendStatus_waitingToSend_not_empty_succeeds)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    IOTHUB_CLIENT_STATUS iotHubClientStatus;
+
+    mocks.ResetAllCalls();
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(0);
+
+    // act
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_GetSendStatus(transport, &iotHubClientStatus);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK, "IoTHubTransport_GetSendStatus returned unexpected result.");
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_STATUS, iotHubClientStatus, IOTHUB_CLIENT_SEND_STATUS_BUSY, "IoTHubTransport_GetSendStatus returned unexpected status.");
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_037: [IoTHubTransportAMQP_Subscribe shall fail if the transport handle parameter received is NULL.]
+TEST_FUNCTION(AMQP_Subscribe_NULL_transport_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    mocks.ResetAllCalls();
+
+    // act
+    transport_interface->IoTHubTransport_Subscribe(NULL);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_039: [IoTHubTransportAMQP_Unsubscribe shall fail if the transport handle parameter received is NULL.]
+TEST_FUNCTION(AMQP_Unsubscribe_NULL_transport_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    mocks.ResetAllCalls();
+
+    // act
+    transport_interface->IoTHubTransport_Unsubscribe(NULL);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_044: [If handle parameter is NULL then IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_INVALID_ARG.]
+TEST_FUNCTION(AMQP_SetOption_NULL_transport_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    mocks.ResetAllCalls();
+
+    // act
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(NULL, TEST_OPTION_SASTOKEN_LIFETIME, TEST_RANDOM_CHAR_SEQ);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG, "IoTHubTransport_SetOption returned unexpected result.");
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_045: [If parameter optionName is NULL then IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_INVALID_ARG.] 
+TEST_FUNCTION(AMQP_SetOption_NULL_option_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    mocks.ResetAllCalls();
+
+
+    // act
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, NULL, TEST_RANDOM_CHAR_SEQ);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG, "IoTHubTransport_SetOption returned unexpected result.");
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_046: [If parameter value is NULL then IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_INVALID_ARG.]
+TEST_FUNCTION(AMQP_SetOption_NULL_value_fails)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+
+    mocks.ResetAllCalls();
+
+    // act
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, TEST_OPTION_SASTOKEN_LIFETIME, NULL);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG, "IoTHubTransport_SetOption returned unexpected result.");
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_047: [If the option name does not match one of the options handled by this module, then IoTHubTransportAMQP_SetOption shall get  the handle to the XIO and invoke the xio_setoption passing down the option name and value parameters.] 
+TEST_FUNCTION(AMQP_SetOption_invokes_xio_setoption_succeeds)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+	const char* SOME_OPTION = "AnOption";
+	const void* SOME_VALUE = (void*)42;
+
+    mocks.ResetAllCalls();
+
+	EXPECTED_CALL(mocks, STRING_c_str(NULL));
+	EXPECTED_CALL(mocks, platform_get_default_tlsio()).SetReturn(TEST_TLS_IO_INTERFACE_DESC);
+	EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn(TEST_TLS_IO_INTERFACE);
+	STRICT_EXPECTED_CALL(mocks, xio_setoption(NULL, SOME_OPTION, SOME_VALUE))
+		.IgnoreArgument(1);
+
+	// act
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, SOME_OPTION, SOME_VALUE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+/* Tests_SRS_IOTHUBTRANSPORTUAMQP_03_001: [If xio_setoption fails, IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.] */
+TEST_FUNCTION(AMQP_SetOption_fails_when_xio_setoption_fails)
+{
+	// arrange
+	CIoTHubTransportAMQPMocks mocks;
+
+	DLIST_ENTRY wts;
+	BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+	TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+	IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+		TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+	IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+	TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+	const char* SOME_OPTION = "AnOption";
+	const void* SOME_VALUE = (void*)42;
+
+	mocks.ResetAllCalls();
+
+	EXPECTED_CALL(mocks, STRING_c_str(NULL));
+	EXPECTED_CALL(mocks, platform_get_default_tlsio()).SetReturn(TEST_TLS_IO_INTERFACE_DESC);
+	EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn(TEST_TLS_IO_INTERFACE);
+	STRICT_EXPECTED_CALL(mocks, xio_setoption(NULL, SOME_OPTION, SOME_VALUE))
+		.IgnoreArgument(1)
+		.SetReturn(42);
+
+	// act
+	IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, SOME_OPTION, SOME_VALUE);
+
+	// assert
+	mocks.AssertActualAndExpectedCalls();
+	ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_ERROR);
+
+	// cleanup
+	transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_185: [IoTHubTransportAMQP_SetOption shall apply the value if the option name is "websocket_write_coalescing_size" (size_t, in bytes) on AMQP over WebSockets, sending the bytes already buffered first; zero disables the coalescing. The value shall be saved once applied, to be applied again to the TLS I/O created on each reconnection.]
+TEST_FUNCTION(AMQP_SetOption_websocket_write_coalescing_size_applies_the_size_to_the_tls_io)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2887,39 +4042,30 @@ TEST_FUNCTION(AMQP_DoWork_succeeds_when_2_waiting_to_send_messages_are_in_the_li
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
-    
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-
-    addTestEvents(config.waitingToSend, 2, true);
+    size_t coalescing_size = 4096;
 
     mocks.ResetAllCalls();
-    setExpectedCallsForTransportDoWorkUpTo(mocks, &config, STEP_DOWORK_OPEN_CBS, DOWORK_MESSAGERECEIVER_NONE);
-    setExpectedCallsForCbsAuthentication(mocks, &config, current_time);
-    setExpectedCallsForCbsAuthTimeoutCheck(mocks, &config, current_time);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
-    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
-    setExpectedCallsForCreateEventSender(mocks, &config);
-    setExpectedCallsForSendPendingEvents(mocks, IOTHUBMESSAGE_STRING, current_time, 2);
-    setExpectedCallsForConnectionDoWork(mocks, &config);
+
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, platform_get_default_tlsio()).SetReturn(TEST_TLS_IO_INTERFACE_DESC);
+    EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn(TEST_TLS_IO_INTERFACE);
+    STRICT_EXPECTED_CALL(mocks, xio_setoption(NULL, COALESCINGIO_OPTION_MAX_WRITE_SIZE, &coalescing_size))
+        .IgnoreArgument(1);
 
     // act
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
-    test_latest_cbs_put_token_callback(test_latest_cbs_put_token_context, CBS_OPERATION_RESULT_OK, 0, NULL);
-    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "websocket_write_coalescing_size", &coalescing_size);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
-    cleanupList(config.waitingToSend);
 }
 
-
-// Codes_SRS_IOTHUBTRANSPORTAMQP_09_041: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.] 
-// Codes_SRS_IOTHUBTRANSPORTAMQP_09_042: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_IDLE if there are currently no event items to be sent or being sent.]
-TEST_FUNCTION(AMQP_GetSendStatus_idle_succeeds)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_185: [IoTHubTransportAMQP_SetOption shall apply the value if the option name is "websocket_write_coalescing_size" (size_t, in bytes) on AMQP over WebSockets, sending the bytes already buffered first; zero disables the coalescing. The value shall be saved once applied, to be applied again to the TLS I/O created on each reconnection.]
+TEST_FUNCTION(AMQP_SetOption_websocket_write_coalescing_size_fails_when_xio_setoption_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2930,31 +4076,31 @@ TEST_FUNCTION(AMQP_GetSendStatus_idle_succeeds)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
-
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-
-    IOTHUB_CLIENT_STATUS iotHubClientStatus;
+    size_t coalescing_size = 4096;
 
     mocks.ResetAllCalls();
-    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
-    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
+
+    EXPECTED_CALL(mocks, STRING_c_str(NULL));
+    EXPECTED_CALL(mocks, platform_get_default_tlsio()).SetReturn(TEST_TLS_IO_INTERFACE_DESC);
+    EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn(TEST_TLS_IO_INTERFACE);
+    STRICT_EXPECTED_CALL(mocks, xio_setoption(NULL, COALESCINGIO_OPTION_MAX_WRITE_SIZE, &coalescing_size))
+        .IgnoreArgument(1)
+        .SetReturn(42);
 
     // act
-    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_GetSendStatus(transport, &iotHubClientStatus);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "websocket_write_coalescing_size", &coalescing_size);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK, "IoTHubTransport_GetSendStatus returned unexpected result.");
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_STATUS, iotHubClientStatus, IOTHUB_CLIENT_SEND_STATUS_IDLE, "IoTHubTransport_GetSendStatus returned unexpected status.");
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_ERROR, result);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_041: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.]  
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_043: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_BUSY if there are currently event items to be sent or being sent.] 
-TEST_FUNCTION(AMQP_GetSendStatus_inProgress_not_empty_succeeds)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_188: [Each time the TLS I/O is created, the 'websocket_write_coalescing_size' saved by IoTHubTransportAMQP_SetOption shall be applied to it with xio_setoption; if that fails the error shall be logged and the default size kept.]
+TEST_FUNCTION(AMQP_DoWork_applies_the_websocket_write_coalescing_size_to_the_tls_io_created_on_reconnection)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -2965,31 +4111,28 @@ TEST_FUNCTION(AMQP_GetSendStatus_inProgress_not_empty_succeeds)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
-
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t coalescing_size = 4096;
 
-    IOTHUB_CLIENT_STATUS iotHubClientStatus;
-
+    (void)transport_interface->IoTHubTransport_SetOption(transport, "websocket_write_coalescing_size", &coalescing_size);
+    coalescing_size = 0;
     mocks.ResetAllCalls();
-    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
-    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(0);
 
     // act
-    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_GetSendStatus(transport, &iotHubClientStatus);
+    // the failed connection destroys the TLS I/O the option was applied to; the retry creates a new one
+    (void)measureReconnectDelay(transport, mocks, &config, (time_t)1500000000);
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK, "IoTHubTransport_GetSendStatus returned unexpected result.");
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_STATUS, iotHubClientStatus, IOTHUB_CLIENT_SEND_STATUS_BUSY, "IoTHubTransport_GetSendStatus returned unexpected status.");
+    ASSERT_ARE_EQUAL(size_t, 2, test_number_of_connection_attempts);
+    ASSERT_ARE_EQUAL(size_t, 2, test_number_of_coalescing_size_options);
+    ASSERT_ARE_EQUAL(size_t, 4096, test_last_coalescing_size);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_041: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.]  
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_043: [IoTHubTransportAMQP_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_BUSY if there are currently event items to be sent or being sent.] 
-TEST_FUNCTION(AMQP_GetSendStatus_waitingToSend_not_empty_succeeds)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_160: [IoTHubTransportAMQP_SetOption shall save the value if the option name is "session_incoming_window" or "session_outgoing_window", returning IOTHUB_CLIENT_OK. The values apply to the next AMQP session created.]
+TEST_FUNCTION(AMQP_SetOption_session_windows_succeeds)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -3000,29 +4143,27 @@ TEST_FUNCTION(AMQP_GetSendStatus_waitingToSend_not_empty_succeeds)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-    time_t current_time = time(NULL);
-
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-
-    IOTHUB_CLIENT_STATUS iotHubClientStatus;
+    uint32_t incoming_window = 1000;
+    uint32_t outgoing_window = 10;
 
     mocks.ResetAllCalls();
-    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(0);
 
     // act
-    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_GetSendStatus(transport, &iotHubClientStatus);
+    IOTHUB_CLIENT_RESULT result1 = transport_interface->IoTHubTransport_SetOption(transport, "session_incoming_window", &incoming_window);
+    IOTHUB_CLIENT_RESULT result2 = transport_interface->IoTHubTransport_SetOption(transport, "session_outgoing_window", &outgoing_window);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK, "IoTHubTransport_GetSendStatus returned unexpected result.");
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_STATUS, iotHubClientStatus, IOTHUB_CLIENT_SEND_STATUS_BUSY, "IoTHubTransport_GetSendStatus returned unexpected status.");
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result1, IOTHUB_CLIENT_OK);
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result2, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_037: [IoTHubTransportAMQP_Subscribe shall fail if the transport handle parameter received is NULL.]
-TEST_FUNCTION(AMQP_Subscribe_NULL_transport_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_161: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "max_unsettled_events", returning IOTHUB_CLIENT_OK. A non-zero value enables the event flow control and shall create the tick counter if it does not exist yet; if tickcounter_create fails IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.]
+TEST_FUNCTION(AMQP_SetOption_max_unsettled_events_succeeds)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -3034,21 +4175,27 @@ TEST_FUNCTION(AMQP_Subscribe_NULL_transport_fails)
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t max_unsettled_events = 16;
 
     mocks.ResetAllCalls();
 
+    STRICT_EXPECTED_CALL(mocks, tickcounter_create());
+
     // act
-    transport_interface->IoTHubTransport_Subscribe(NULL);
+    IOTHUB_CLIENT_RESULT result1 = transport_interface->IoTHubTransport_SetOption(transport, "max_unsettled_events", &max_unsettled_events);
+    IOTHUB_CLIENT_RESULT result2 = transport_interface->IoTHubTransport_SetOption(transport, "max_unsettled_events", &max_unsettled_events);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result1, IOTHUB_CLIENT_OK);
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result2, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_039: [IoTHubTransportAMQP_Unsubscribe shall fail if the transport handle parameter received is NULL.]
-TEST_FUNCTION(AMQP_Unsubscribe_NULL_transport_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_161: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "max_unsettled_events", returning IOTHUB_CLIENT_OK. A non-zero value enables the event flow control and shall create the tick counter if it does not exist yet; if tickcounter_create fails IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.]
+TEST_FUNCTION(AMQP_SetOption_max_unsettled_events_tickcounter_create_fails)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -3060,21 +4207,25 @@ TEST_FUNCTION(AMQP_Unsubscribe_NULL_transport_fails)
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t max_unsettled_events = 16;
 
     mocks.ResetAllCalls();
 
+    STRICT_EXPECTED_CALL(mocks, tickcounter_create()).SetReturn((TICK_COUNTER_HANDLE)NULL);
+
     // act
-    transport_interface->IoTHubTransport_Unsubscribe(NULL);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "max_unsettled_events", &max_unsettled_events);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_ERROR);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_044: [If handle parameter is NULL then IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_INVALID_ARG.]
-TEST_FUNCTION(AMQP_SetOption_NULL_transport_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_162: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "event_ack_latency_threshold", returning IOTHUB_CLIENT_OK.]
+TEST_FUNCTION(AMQP_SetOption_event_ack_latency_threshold_succeeds)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -3086,22 +4237,25 @@ TEST_FUNCTION(AMQP_SetOption_NULL_transport_fails)
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t event_ack_latency_threshold = 500;
 
     mocks.ResetAllCalls();
 
     // act
-    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(NULL, TEST_OPTION_SASTOKEN_LIFETIME, TEST_RANDOM_CHAR_SEQ);
+    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, "event_ack_latency_threshold", &event_ack_latency_threshold);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG, "IoTHubTransport_SetOption returned unexpected result.");
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_045: [If parameter optionName is NULL then IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_INVALID_ARG.] 
-TEST_FUNCTION(AMQP_SetOption_NULL_option_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_157: [If 'max_unsettled_events' is not zero, IoTHubTransportAMQP_DoWork shall not send an event while the number of events sent and not yet settled has reached the event send window.]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_158: [The event send window shall start at 4 and grow by one every time a full window of events has been settled within 'event_ack_latency_threshold' milliseconds, up to 'max_unsettled_events'.]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_159: [The event send window shall be halved when an event fails or is settled later than 'event_ack_latency_threshold' milliseconds after being sent, at most once per 'event_ack_latency_threshold' milliseconds.]
+TEST_FUNCTION(AMQP_DoWork_flow_control_grows_and_shrinks_the_event_send_window)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -3112,24 +4266,53 @@ TEST_FUNCTION(AMQP_SetOption_NULL_option_fails)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    size_t max_unsettled_events = 8;
+    size_t sent_with_initial_window;
+    size_t sent_with_grown_window;
+    size_t sent_with_halved_window;
+
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    (void)transport_interface->IoTHubTransport_SetOption(transport, "max_unsettled_events", &max_unsettled_events);
 
-    mocks.ResetAllCalls();
+    setupSuccessfulDoWork(transport, mocks, config, current_time);
 
+    addTestEvents(config.waitingToSend, 12, true);
 
     // act
-    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, NULL, TEST_RANDOM_CHAR_SEQ);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForEventsToSend(mocks, 4);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    sent_with_initial_window = test_number_of_sent_messages;
+
+    // A full window settled within the latency threshold grows it by one.
+    test_current_ms = 100;
+    settleSentMessages(0, 4, MESSAGE_SEND_OK);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForEventsToSend(mocks, 5);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    sent_with_grown_window = test_number_of_sent_messages - sent_with_initial_window;
+
+    // A burst of late settlements halves it only once.
+    test_current_ms = 5000;
+    settleSentMessages(4, 9, MESSAGE_SEND_OK);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForEventsToSend(mocks, 2);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    sent_with_halved_window = test_number_of_sent_messages - sent_with_initial_window - sent_with_grown_window;
 
     // assert
-    mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG, "IoTHubTransport_SetOption returned unexpected result.");
+    ASSERT_ARE_EQUAL(size_t, 4, sent_with_initial_window);
+    ASSERT_ARE_EQUAL(size_t, 5, sent_with_grown_window);
+    ASSERT_ARE_EQUAL(size_t, 2, sent_with_halved_window);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_046: [If parameter value is NULL then IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_INVALID_ARG.]
-TEST_FUNCTION(AMQP_SetOption_NULL_value_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_167: [IoTHubTransportAMQP_SetOption shall save and apply the value if the option name is "event_batching" (bool) or "max_event_batch_size" (size_t, in bytes), returning IOTHUB_CLIENT_OK.]
+TEST_FUNCTION(AMQP_SetOption_event_batching_succeeds)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -3141,22 +4324,26 @@ TEST_FUNCTION(AMQP_SetOption_NULL_value_fails)
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    bool event_batching = true;
+    size_t max_event_batch_size = 64 * 1024;
 
     mocks.ResetAllCalls();
 
     // act
-    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, TEST_OPTION_SASTOKEN_LIFETIME, NULL);
+    IOTHUB_CLIENT_RESULT result1 = transport_interface->IoTHubTransport_SetOption(transport, "event_batching", &event_batching);
+    IOTHUB_CLIENT_RESULT result2 = transport_interface->IoTHubTransport_SetOption(transport, "max_event_batch_size", &max_event_batch_size);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL_WITH_MSG(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG, "IoTHubTransport_SetOption returned unexpected result.");
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result1, IOTHUB_CLIENT_OK);
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result2, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
 }
 
-// Tests_SRS_IOTHUBTRANSPORTAMQP_09_047: [If the option name does not match one of the options handled by this module, then IoTHubTransportAMQP_SetOption shall get  the handle to the XIO and invoke the xio_setoption passing down the option name and value parameters.] 
-TEST_FUNCTION(AMQP_SetOption_invokes_xio_setoption_succeeds)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_163: [If 'event_batching' is enabled, IoTHubTransportAMQP_DoWork shall send the pending events packed as data sections of AMQP batch messages (message format 0x80013700), each data section holding the event encoded as an AMQP message with its application-properties.]
+TEST_FUNCTION(AMQP_DoWork_event_batching_sends_two_events_in_one_message)
 {
     // arrange
     CIoTHubTransportAMQPMocks mocks;
@@ -3167,65 +4354,126 @@ TEST_FUNCTION(AMQP_SetOption_invokes_xio_setoption_succeeds)
     IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
         TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
     IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    bool event_batching = true;
+    int i;
+
     TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-	const char* SOME_OPTION = "AnOption";
-	const void* SOME_VALUE = (void*)42;
+    (void)transport_interface->IoTHubTransport_SetOption(transport, "event_batching", &event_batching);
 
+    setupSuccessfulDoWork(transport, mocks, config, current_time);
+
+    addTestEvents(config.waitingToSend, 2, true);
     mocks.ResetAllCalls();
 
-	EXPECTED_CALL(mocks, STRING_c_str(NULL));
-	EXPECTED_CALL(mocks, platform_get_default_tlsio()).SetReturn(TEST_TLS_IO_INTERFACE_DESC);
-	EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn(TEST_TLS_IO_INTERFACE);
-	STRICT_EXPECTED_CALL(mocks, xio_setoption(NULL, SOME_OPTION, SOME_VALUE))
-		.IgnoreArgument(1);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
 
-	// act
-    IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, SOME_OPTION, SOME_VALUE);
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(0);
+    EXPECTED_CALL(mocks, message_create()).SetReturn(TEST_EVENT_MESSAGE_HANDLE);
+    STRICT_EXPECTED_CALL(mocks, message_set_message_format(TEST_EVENT_MESSAGE_HANDLE, 0x80013700));
+
+    for (i = 0; i < 2; i++)
+    {
+        EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(0);
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MESSAGE_HANDLE)).SetReturn(IOTHUBMESSAGE_BYTEARRAY);
+        EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MESSAGE_HANDLE, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &test_binary_data.bytes, sizeof(test_binary_data.bytes))
+            .CopyOutArgumentBuffer(3, &test_binary_data.length, sizeof(test_binary_data.length));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MESSAGE_HANDLE))
+            .SetReturn(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP);
+        STRICT_EXPECTED_CALL(mocks, Map_GetInternals(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &no_property_keys_ptr, sizeof(no_property_keys_ptr))
+            .CopyOutArgumentBuffer(3, &no_property_values_ptr, sizeof(no_property_values_ptr))
+            .CopyOutArgumentBuffer(4, &no_property_size, sizeof(no_property_size));
+        EXPECTED_CALL(mocks, amqpvalue_create_data(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, amqpvalue_get_encoded_size(TEST_BATCHED_EVENT_DATA_SECTION, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, amqpvalue_encode(TEST_BATCHED_EVENT_DATA_SECTION, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(3);
+        STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_BATCHED_EVENT_DATA_SECTION));
+        EXPECTED_CALL(mocks, message_add_body_amqp_data(TEST_EVENT_MESSAGE_HANDLE, IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+    }
+
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
+    EXPECTED_CALL(mocks, messagesender_send(IGNORED_PTR_ARG, TEST_EVENT_MESSAGE_HANDLE, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+    STRICT_EXPECTED_CALL(mocks, message_destroy(TEST_EVENT_MESSAGE_HANDLE));
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
     // assert
     mocks.AssertActualAndExpectedCalls();
-    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
 
     // cleanup
     transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
 }
 
-/* Tests_SRS_IOTHUBTRANSPORTUAMQP_03_001: [If xio_setoption fails, IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.] */
-TEST_FUNCTION(AMQP_SetOption_fails_when_xio_setoption_fails)
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_168: [The batched events shall be encoded into a buffer owned by the transport instance that is reused across events and only grows; it shall be released by IoTHubTransportAMQP_Destroy.]
+TEST_FUNCTION(AMQP_DoWork_event_batching_reuses_the_encoding_buffer_and_grows_it_when_needed)
 {
-	// arrange
-	CIoTHubTransportAMQPMocks mocks;
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
 
-	DLIST_ENTRY wts;
-	BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
-	TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
-	IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
-		TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
-	IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
-	TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
-	const char* SOME_OPTION = "AnOption";
-	const void* SOME_VALUE = (void*)42;
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    bool event_batching = true;
+    size_t reallocs_for_first_batch;
+    size_t reallocs_for_second_batch;
+    size_t reallocs_for_larger_event;
 
-	mocks.ResetAllCalls();
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    (void)transport_interface->IoTHubTransport_SetOption(transport, "event_batching", &event_batching);
 
-	EXPECTED_CALL(mocks, STRING_c_str(NULL));
-	EXPECTED_CALL(mocks, platform_get_default_tlsio()).SetReturn(TEST_TLS_IO_INTERFACE_DESC);
-	EXPECTED_CALL(mocks, xio_create(NULL, NULL, NULL)).SetReturn(TEST_TLS_IO_INTERFACE);
-	STRICT_EXPECTED_CALL(mocks, xio_setoption(NULL, SOME_OPTION, SOME_VALUE))
-		.IgnoreArgument(1)
-		.SetReturn(42);
+    setupSuccessfulDoWork(transport, mocks, config, current_time);
 
-	// act
-	IOTHUB_CLIENT_RESULT result = transport_interface->IoTHubTransport_SetOption(transport, SOME_OPTION, SOME_VALUE);
+    test_batched_event_encoded_size = 1001;
+    addTestEvents(config.waitingToSend, 2, true);
 
-	// assert
-	mocks.AssertActualAndExpectedCalls();
-	ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_ERROR);
+    // act
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, message_create()).SetReturn(TEST_EVENT_MESSAGE_HANDLE);
+    setExpectedCallsForEventContents(mocks, 2);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    reallocs_for_first_batch = test_number_of_encoding_buffer_reallocs;
 
-	// cleanup
-	transport_interface->IoTHubTransport_Destroy(transport);
-}
+    settleSentMessages(0, 1, MESSAGE_SEND_OK);
+    addTestEvents(config.waitingToSend, 2, true);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, message_create()).SetReturn(TEST_EVENT_MESSAGE_HANDLE);
+    setExpectedCallsForEventContents(mocks, 2);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    reallocs_for_second_batch = test_number_of_encoding_buffer_reallocs - reallocs_for_first_batch;
 
+    settleSentMessages(1, 2, MESSAGE_SEND_OK);
+    test_batched_event_encoded_size = 4001;
+    addTestEvents(config.waitingToSend, 1, true);
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    EXPECTED_CALL(mocks, message_create()).SetReturn(TEST_EVENT_MESSAGE_HANDLE);
+    setExpectedCallsForEventContents(mocks, 1);
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    reallocs_for_larger_event = test_number_of_encoding_buffer_reallocs - reallocs_for_first_batch - reallocs_for_second_batch;
+
+    // assert
+    ASSERT_ARE_EQUAL(size_t, 3, test_number_of_sent_messages);
+    ASSERT_ARE_EQUAL(size_t, 1, reallocs_for_first_batch);
+    ASSERT_ARE_EQUAL(size_t, 0, reallocs_for_second_batch);
+    ASSERT_ARE_EQUAL(size_t, 1, reallocs_for_larger_event);
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
+}
 
 /* Tests_SRS_IOTHUBTRANSPORTUAMQP_01_007: [The IoTHub message properties shall be obtained by calling IoTHubMessage_Properties.] */
 /* Tests_SRS_IOTHUBTRANSPORTUAMQP_01_016: [If the number of properties is 0, no uAMQP map shall be created and no application properties shall be set on the uAMQP message.] */
@@ -3486,6 +4734,124 @@ TEST_FUNCTION(AMQP_DoWork_encodes_two_properties_on_an_IoTHub_Message_before_giv
     transport_interface->IoTHubTransport_Destroy(transport);
     cleanupList(config.waitingToSend);
 }
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_172: [IoTHubTransportAMQP_SetOption shall replace the application properties cache with an empty one holding up to the given number of property sets if the option name is "application_properties_cache_size", returning IOTHUB_CLIENT_OK; zero disables the cache. If the cache cannot be allocated IoTHubTransportAMQP_SetOption shall return IOTHUB_CLIENT_ERROR.]
+TEST_FUNCTION(AMQP_SetOption_application_properties_cache_size_succeeds)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    size_t cache_size = 4;
+    size_t no_cache = 0;
+
+    mocks.ResetAllCalls();
+
+    // act
+    IOTHUB_CLIENT_RESULT result1 = transport_interface->IoTHubTransport_SetOption(transport, "application_properties_cache_size", &cache_size);
+    IOTHUB_CLIENT_RESULT result2 = transport_interface->IoTHubTransport_SetOption(transport, "application_properties_cache_size", &no_cache);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result1, IOTHUB_CLIENT_OK);
+    ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result2, IOTHUB_CLIENT_OK);
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+}
+
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_169: [If the application properties cache is enabled and an event carries the same properties (same keys and values, in the same order) as a cached property set, the cached uAMQP map shall be used instead of building a new one.]
+// Tests_SRS_IOTHUBTRANSPORTAMQP_09_170: [A property set that is not cached yet shall be cached after its uAMQP map is built, replacing the oldest cached property set when the cache is full; failing to cache it shall not fail the event.]
+TEST_FUNCTION(AMQP_DoWork_application_properties_cache_builds_the_map_once_for_two_events)
+{
+    // arrange
+    CIoTHubTransportAMQPMocks mocks;
+
+    DLIST_ENTRY wts;
+    BASEIMPLEMENTATION::DList_InitializeListHead(&wts);
+    TRANSPORT_PROVIDER* transport_interface = (TRANSPORT_PROVIDER*)AMQP_Protocol();
+    IOTHUB_CLIENT_CONFIG client_config = { (IOTHUB_CLIENT_TRANSPORT_PROVIDER)transport_interface,
+        TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOT_HUB_NAME, TEST_IOT_HUB_SUFFIX, TEST_PROT_GW_HOSTNAME };
+    IOTHUBTRANSPORT_CONFIG config = { &client_config, &wts };
+    time_t current_time = time(NULL);
+    size_t cache_size = 4;
+    int i;
+
+    TRANSPORT_LL_HANDLE transport = transport_interface->IoTHubTransport_Create(&config);
+    (void)transport_interface->IoTHubTransport_SetOption(transport, "application_properties_cache_size", &cache_size);
+
+    setupSuccessfulDoWork(transport, mocks, config, current_time);
+
+    addTestEvents(config.waitingToSend, 2, true);
+    mocks.ResetAllCalls();
+
+    setExpectedCallsForSASTokenExpiryCheck(mocks, &config, current_time);
+    setExpectedCallsForConnectionDoWork(mocks, &config);
+
+    for (i = 0; i < 2; i++)
+    {
+        EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(0);
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MESSAGE_HANDLE)).SetReturn(IOTHUBMESSAGE_BYTEARRAY);
+
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MESSAGE_HANDLE, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &test_binary_data.bytes, sizeof(test_binary_data.bytes))
+            .CopyOutArgumentBuffer(3, &test_binary_data.length, sizeof(test_binary_data.length));
+        EXPECTED_CALL(mocks, message_create()).SetReturn(TEST_EVENT_MESSAGE_HANDLE);
+        STRICT_EXPECTED_CALL(mocks, message_add_body_amqp_data(TEST_EVENT_MESSAGE_HANDLE, test_binary_data));
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MESSAGE_HANDLE))
+            .SetReturn(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP);
+        STRICT_EXPECTED_CALL(mocks, Map_GetInternals(TEST_IOTHUB_MESSAGE_PROPERTIES_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &two_property_keys_ptr, sizeof(two_property_keys_ptr))
+            .CopyOutArgumentBuffer(3, &two_property_values_ptr, sizeof(two_property_values_ptr))
+            .CopyOutArgumentBuffer(4, &two_properties_size, sizeof(two_properties_size));
+
+        if (i == 0)
+        {
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_create_map())
+                .SetReturn(TEST_UAMQP_MAP);
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_create_string(two_property_keys[0]))
+                .SetReturn(TEST_PROPERTY_1_KEY_UAMQP_VALUE);
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_create_string(two_property_values[0]))
+                .SetReturn(TEST_PROPERTY_1_VALUE_UAMQP_VALUE);
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_set_map_value(TEST_UAMQP_MAP, TEST_PROPERTY_1_KEY_UAMQP_VALUE, TEST_PROPERTY_1_VALUE_UAMQP_VALUE));
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_create_string(two_property_keys[1]))
+                .SetReturn(TEST_PROPERTY_2_KEY_UAMQP_VALUE);
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_create_string(two_property_values[1]))
+                .SetReturn(TEST_PROPERTY_2_VALUE_UAMQP_VALUE);
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_set_map_value(TEST_UAMQP_MAP, TEST_PROPERTY_2_KEY_UAMQP_VALUE, TEST_PROPERTY_2_VALUE_UAMQP_VALUE));
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_PROPERTY_1_KEY_UAMQP_VALUE));
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_PROPERTY_1_VALUE_UAMQP_VALUE));
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_PROPERTY_2_KEY_UAMQP_VALUE));
+            STRICT_EXPECTED_CALL(mocks, amqpvalue_destroy(TEST_PROPERTY_2_VALUE_UAMQP_VALUE));
+            EXPECTED_CALL(mocks, mallocAndStrcpy_s(IGNORED_PTR_ARG, IGNORED_PTR_ARG)).ExpectedTimesExactly(4);
+        }
+
+        STRICT_EXPECTED_CALL(mocks, message_set_application_properties(TEST_EVENT_MESSAGE_HANDLE, TEST_UAMQP_MAP));
+        EXPECTED_CALL(mocks, messagesender_send(NULL, TEST_EVENT_MESSAGE_HANDLE, NULL, NULL));
+        STRICT_EXPECTED_CALL(mocks, message_destroy(TEST_EVENT_MESSAGE_HANDLE));
+    }
+
+    EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG)).SetReturn(1);
+
+    // act
+    transport_interface->IoTHubTransport_DoWork(transport, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+    // assert
+    mocks.AssertActualAndExpectedCalls();
+
+    // cleanup
+    transport_interface->IoTHubTransport_Destroy(transport);
+    cleanupList(config.waitingToSend);
+}
+
 
 /* Tests_SRS_IOTHUBTRANSPORTUAMQP_01_014: [If any of the APIs fails while building the property map and setting it on the uAMQP message, IoTHubTransportAMQP_DoWork shall notify the failure by invoking the upper layer message send callback with IOTHUB_CLIENT_CONFIRMATION_ERROR.] */
 TEST_FUNCTION(when_creating_the_property_map_fails_AMQP_DoWork_completes_the_message_send_with_an_error)
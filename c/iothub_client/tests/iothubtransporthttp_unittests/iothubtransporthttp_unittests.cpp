@@ -31,6 +31,13 @@
 #include "azure_c_shared_utility/base64.h"
 #include "azure_c_shared_utility/vector.h"
 #include "azure_c_shared_utility/lock.h"
+#include "azure_c_shared_utility/xio.h"
+#include "azure_c_shared_utility/tlsio.h"
+#include "azure_c_shared_utility/platform.h"
+#include "azure_c_shared_utility/sha.h"
+#ifdef USE_HTTP_COMPRESSION
+#include "zlib.h"
+#endif
 
 #define IOTHUB_ACK "iothub-ack"
 #define IOTHUB_ACK_NONE "none"
@@ -100,6 +107,7 @@ static MICROMOCK_GLOBAL_SEMAPHORE_HANDLE g_dllByDll;
 #define TEST_DEVICE_ID2 "aSecondDeviceID"
 #define TEST_DEVICE_KEY "thisIsDeviceKey"
 #define TEST_DEVICE_KEY2 "aSecondDeviceKey"
+#define TEST_SAS_TOKEN_CACHE_DEVICE_KEY "MDEyMzQ1Njc4OWFiY2RlZg==" /*the SAS token cache needs a key that is valid base64*/
 #define TEST_IOTHUB_NAME "thisIsIotBuhName"
 #define TEST_IOTHUB_SUFFIX "thisIsIotHubSuffix"
 #define TEST_BLANK_SAS_TOKEN " "
@@ -216,6 +224,7 @@ static IOTHUBTRANSPORT_CONFIG TEST_CONFIG_NULL_IOTHUB_SUFFIX =
 #define TEST_IOTHUB_MESSAGE_HANDLE_10 ((IOTHUB_MESSAGE_HANDLE)0x01da)
 #define TEST_IOTHUB_MESSAGE_HANDLE_11 ((IOTHUB_MESSAGE_HANDLE)0x01db)
 #define TEST_IOTHUB_MESSAGE_HANDLE_12 ((IOTHUB_MESSAGE_HANDLE)0x01dc)
+#define TEST_IOTHUB_MESSAGE_HANDLE_13 ((IOTHUB_MESSAGE_HANDLE)0x01dd)
 
 static IOTHUB_MESSAGE_LIST message1 =  /*this is the oldest message, always the first to be processed, send etc*/
 {
@@ -444,6 +453,13 @@ static const size_t buffer11_size = MAXIMUM_MESSAGE_SIZE - PAYLOAD_OVERHEAD - 2
 static unsigned char* bigBufferOverflow; /*this is a buffer that contains just enough characters to go over the limit of 256K as a single message*/
 static unsigned char* bigBufferFit; /*this is a buffer that contains just enough characters to NOT go over the limit of 256K as a single message*/
 
+/*random bytes, so the items of the messages with TEST_IOTHUB_MESSAGE_HANDLE_13 compress about as badly as base64 can.*/
+/*Their base64 is longer than the deflate window, so an item cannot be compressed as a copy of the previous one*/
+static unsigned char buffer13[44 * 1024];
+static const size_t buffer13_size = sizeof(buffer13);
+#define TEST_INCOMPRESSIBLE_MESSAGES_COUNT 8
+static IOTHUB_MESSAGE_LIST incompressibleMessages[TEST_INCOMPRESSIBLE_MESSAGES_COUNT];
+
 static const char* string10 = "thisgoestoJ\\s//on\"ToBeEn\r\n\bcoded";
 
 const unsigned int httpStatus200 = 200;
@@ -455,6 +471,42 @@ static BUFFER_HANDLE last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest = NULL;
 
 static bool HTTPHeaders_GetHeaderCount_writes_to_its_outputs = true;
 
+/*the SAS token cache tests follow the "Authorization" header and move the clock*/
+static char lastAuthorizationHeaderValue[1024];
+static size_t countAuthorizationHeaderReplaced;
+static time_t currentGetTimeValue;
+
+/*the event scheduling tests follow the order in which the devices POST their events*/
+#define SENT_RELATIVE_PATHS_CAPACITY 8
+static char sentRelativePaths[SENT_RELATIVE_PATHS_CAPACITY][128];
+static size_t countSentRelativePaths;
+
+/*the pipelined connection tests play the server: they keep what the transport writes and call its xio callbacks*/
+#define TEST_PIPELINE_XIO_HANDLE (XIO_HANDLE)0x4F4F
+static ON_IO_OPEN_COMPLETE pipelineOnOpenComplete;
+static ON_BYTES_RECEIVED pipelineOnBytesReceived;
+static ON_IO_ERROR pipelineOnError;
+static void* pipelineCallbackContext;
+static char pipelineSentBytes[8192];
+static size_t pipelineSentSize;
+static size_t countPipelineSends;
+static size_t countPipelineXioCreate;
+static size_t countPipelineXioDestroy;
+static size_t countPipelineTrustedCerts;
+static char lastPipelineTrustedCerts[64];
+
+/*the pipelined connection tests follow the completion of the events*/
+static size_t countSendComplete;
+static IOTHUB_CLIENT_LL_HANDLE lastSendCompleteHandle;
+static IOTHUB_BATCHSTATE_RESULT lastSendCompleteResult;
+static size_t countConnectionReady;
+static HTTPAPIEX_RESULT deviceRequestResult;
+
+/*the poll heap tests unregister a device from the event callback and follow the devices that poll*/
+static IOTHUB_DEVICE_HANDLE deviceToUnregisterOnSendComplete;
+static size_t countPolls;
+static char lastPolledRelativePath[128];
+
 #define TEST_HEADER_1 "iothub-app-NAME1: VALUE1"
 #define TEST_HEADER_1_5 "not-iothub-app-NAME1: VALUE1"
 #define TEST_HEADER_2 "iothub-app-NAME2: VALUE2"
@@ -695,6 +747,11 @@ public:
     MOCK_METHOD_END(HTTP_HEADERS_RESULT, HTTP_HEADERS_OK)
 
     MOCK_STATIC_METHOD_3(, HTTP_HEADERS_RESULT, HTTPHeaders_ReplaceHeaderNameValuePair, HTTP_HEADERS_HANDLE, httpHeadersHandle, const char*, name, const char*, value)
+        if ((name != NULL) && (value != NULL) && (strcmp(name, "Authorization") == 0) && (strlen(value) < sizeof(lastAuthorizationHeaderValue)))
+        {
+            (void)strcpy(lastAuthorizationHeaderValue, value);
+            countAuthorizationHeaderReplaced++;
+        }
     MOCK_METHOD_END(HTTP_HEADERS_RESULT, HTTP_HEADERS_OK)
 
     MOCK_STATIC_METHOD_2(, const char*, HTTPHeaders_FindHeaderValue, HTTP_HEADERS_HANDLE, httpHeadersHandle, const char*, name)
@@ -777,6 +834,12 @@ public:
             *size = buffer11_size;
             break;
         }
+        case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_13) : /*this is a message that does not compress*/
+        {
+            *buffer = buffer13;
+            *size = buffer13_size;
+            break;
+        }
         default:
         {
             /*not expected really*/
@@ -803,6 +866,7 @@ public:
         case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_9) :
         case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_11) :
         case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_12) :
+        case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_13) :
         {
             result2 = NULL;
             break;
@@ -884,6 +948,11 @@ public:
             result2 = TEST_MAP_1_PROPERTY_AA_B;
             break;
         }
+        case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_13) :
+        {
+            result2 = TEST_MAP_EMPTY;
+            break;
+        }
         default:
         {
             /*not expected really*/
@@ -919,6 +988,7 @@ public:
         case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_9) :
         case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_11) :
         case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_12) :
+        case ((uintptr_t)TEST_IOTHUB_MESSAGE_HANDLE_13) :
         {
             result2 = IOTHUBMESSAGE_BYTEARRAY;
             break;
@@ -937,7 +1007,20 @@ public:
     MOCK_STATIC_METHOD_2(, IOTHUBMESSAGE_DISPOSITION_RESULT, IoTHubClient_LL_MessageCallback, IOTHUB_CLIENT_LL_HANDLE, handle, IOTHUB_MESSAGE_HANDLE, message)
     MOCK_METHOD_END(IOTHUBMESSAGE_DISPOSITION_RESULT, IOTHUBMESSAGE_ACCEPTED)
 
+    MOCK_STATIC_METHOD_1(, void, IoTHubClient_LL_ConnectionReady, IOTHUB_CLIENT_LL_HANDLE, handle)
+        countConnectionReady++;
+    MOCK_VOID_METHOD_END()
+
     MOCK_STATIC_METHOD_3(, void, IoTHubClient_LL_SendComplete, IOTHUB_CLIENT_LL_HANDLE, handle, PDLIST_ENTRY, completed, IOTHUB_BATCHSTATE_RESULT, result2)
+        countSendComplete++;
+        lastSendCompleteHandle = handle;
+        lastSendCompleteResult = result2;
+        if (deviceToUnregisterOnSendComplete != NULL)
+        {
+            IOTHUB_DEVICE_HANDLE deviceHandle = deviceToUnregisterOnSendComplete;
+            deviceToUnregisterOnSendComplete = NULL;
+            IoTHubTransportHttp_Unregister(deviceHandle);
+        }
     MOCK_VOID_METHOD_END()
 
     /*buffer*/
@@ -1107,14 +1190,79 @@ public:
             BASEIMPLEMENTATION::BUFFER_delete(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest);
         }
         last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest = BASEIMPLEMENTATION::BUFFER_clone(requestContent);
+        if (statusCode != NULL)
+        {
+            /*the tests that care about the status code copy their own*/
+            *statusCode = 204;
+        }
+        if ((requestType == HTTPAPI_REQUEST_POST) && (relativePath != NULL) && (countSentRelativePaths < SENT_RELATIVE_PATHS_CAPACITY) && (strlen(relativePath) < sizeof(sentRelativePaths[0])))
+        {
+            (void)strcpy(sentRelativePaths[countSentRelativePaths], relativePath);
+            countSentRelativePaths++;
+        }
+        if ((requestType == HTTPAPI_REQUEST_GET) && (relativePath != NULL) && (strlen(relativePath) < sizeof(lastPolledRelativePath)))
+        {
+            (void)strcpy(lastPolledRelativePath, relativePath);
+            countPolls++;
+        }
+    MOCK_METHOD_END(HTTPAPIEX_RESULT, deviceRequestResult)
+
+    MOCK_STATIC_METHOD_8(, HTTPAPIEX_RESULT, HTTPAPIEX_ExecuteRequest, HTTPAPIEX_HANDLE, handle, HTTPAPI_REQUEST_TYPE, requestType, const char*, relativePath, HTTP_HEADERS_HANDLE, requestHttpHeadersHandle, BUFFER_HANDLE, requestContent, unsigned int*, statusCode, HTTP_HEADERS_HANDLE, responseHttpHeadersHandle, BUFFER_HANDLE, responseContent)
+        *statusCode = 204;
     MOCK_METHOD_END(HTTPAPIEX_RESULT, HTTPAPIEX_OK)
 
+    MOCK_STATIC_METHOD_1(, BUFFER_HANDLE, Base64_Decoder, const char*, source)
+    MOCK_METHOD_END(BUFFER_HANDLE, BASEIMPLEMENTATION::Base64_Decoder(source))
+
     MOCK_STATIC_METHOD_1(, time_t, get_time, time_t*, currentTime)
-    MOCK_METHOD_END(time_t, TEST_GET_TIME_VALUE)
+    MOCK_METHOD_END(time_t, currentGetTimeValue)
 
     MOCK_STATIC_METHOD_2(, double, get_difftime, time_t, stopTime, time_t, startTime)
     MOCK_METHOD_END(double, stopTime-startTime)
 
+    // xio.h
+    MOCK_STATIC_METHOD_0(, const IO_INTERFACE_DESCRIPTION*, platform_get_default_tlsio)
+    MOCK_METHOD_END(const IO_INTERFACE_DESCRIPTION*, 0)
+
+    MOCK_STATIC_METHOD_3(, XIO_HANDLE, xio_create, const IO_INTERFACE_DESCRIPTION*, io_interface_description, const void*, io_create_parameters, LOGGER_LOG, logger_log)
+        countPipelineXioCreate++;
+    MOCK_METHOD_END(XIO_HANDLE, TEST_PIPELINE_XIO_HANDLE)
+
+    MOCK_STATIC_METHOD_1(, void, xio_destroy, XIO_HANDLE, xio)
+        countPipelineXioDestroy++;
+    MOCK_VOID_METHOD_END()
+
+    MOCK_STATIC_METHOD_5(, int, xio_open, XIO_HANDLE, xio, ON_IO_OPEN_COMPLETE, on_io_open_complete, ON_BYTES_RECEIVED, on_bytes_received, ON_IO_ERROR, on_io_error, void*, callback_context)
+        pipelineOnOpenComplete = on_io_open_complete;
+        pipelineOnBytesReceived = on_bytes_received;
+        pipelineOnError = on_io_error;
+        pipelineCallbackContext = callback_context;
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_3(, int, xio_close, XIO_HANDLE, xio, ON_IO_CLOSE_COMPLETE, on_io_close_complete, void*, callback_context)
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_5(, int, xio_send, XIO_HANDLE, xio, const void*, buffer, size_t, size, ON_SEND_COMPLETE, on_send_complete, void*, callback_context)
+        countPipelineSends++;
+        if (pipelineSentSize + size < sizeof(pipelineSentBytes))
+        {
+            (void)memcpy(pipelineSentBytes + pipelineSentSize, buffer, size);
+            pipelineSentSize += size;
+            pipelineSentBytes[pipelineSentSize] = '\0';
+        }
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_1(, void, xio_dowork, XIO_HANDLE, xio)
+    MOCK_VOID_METHOD_END()
+
+    MOCK_STATIC_METHOD_3(, int, xio_setoption, XIO_HANDLE, xio, const char*, optionName, const void*, value)
+        if ((strcmp(optionName, "TrustedCerts") == 0) && (strlen((const char*)value) < sizeof(lastPipelineTrustedCerts)))
+        {
+            (void)strcpy(lastPipelineTrustedCerts, (const char*)value);
+            countPipelineTrustedCerts++;
+        }
+    MOCK_METHOD_END(int, 0)
+
 	// vector.h
 		MOCK_STATIC_METHOD_1(, VECTOR_HANDLE, VECTOR_create, size_t, elementSize)
 		VECTOR_HANDLE result2;
@@ -1242,6 +1390,7 @@ DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportHttpMocks, , MAP_RESULT, Map_AddOrU
 DECLARE_GLOBAL_MOCK_METHOD_4(CIoTHubTransportHttpMocks, , MAP_RESULT, Map_GetInternals, MAP_HANDLE, handle, const char*const**, keys, const char*const**, values, size_t*, count);
 
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportHttpMocks, , IOTHUBMESSAGE_DISPOSITION_RESULT, IoTHubClient_LL_MessageCallback, IOTHUB_CLIENT_LL_HANDLE, handle, IOTHUB_MESSAGE_HANDLE, message)
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , void, IoTHubClient_LL_ConnectionReady, IOTHUB_CLIENT_LL_HANDLE, handle)
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportHttpMocks, , void, IoTHubClient_LL_SendComplete, IOTHUB_CLIENT_LL_HANDLE, handle, PDLIST_ENTRY, completed, IOTHUB_BATCHSTATE_RESULT, result2)
 
 
@@ -1264,9 +1413,21 @@ DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportHttpMocks, , HTTPAPIEX_SAS_HANDLE,
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , void, HTTPAPIEX_SAS_Destroy, HTTPAPIEX_SAS_HANDLE, handle);
 DECLARE_GLOBAL_MOCK_METHOD_9(CIoTHubTransportHttpMocks, , HTTPAPIEX_RESULT, HTTPAPIEX_SAS_ExecuteRequest2, HTTPAPIEX_SAS_HANDLE, sasHandle, HTTPAPIEX_HANDLE, handle, HTTPAPI_REQUEST_TYPE, requestType, const char*, relativePath, HTTP_HEADERS_HANDLE, requestHttpHeadersHandle, BUFFER_HANDLE, requestContent, unsigned int*, statusCode, HTTP_HEADERS_HANDLE, responseHttpHeadersHandle, BUFFER_HANDLE, responseContent);
 
+DECLARE_GLOBAL_MOCK_METHOD_8(CIoTHubTransportHttpMocks, , HTTPAPIEX_RESULT, HTTPAPIEX_ExecuteRequest, HTTPAPIEX_HANDLE, handle, HTTPAPI_REQUEST_TYPE, requestType, const char*, relativePath, HTTP_HEADERS_HANDLE, requestHttpHeadersHandle, BUFFER_HANDLE, requestContent, unsigned int*, statusCode, HTTP_HEADERS_HANDLE, responseHttpHeadersHandle, BUFFER_HANDLE, responseContent);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , BUFFER_HANDLE, Base64_Decoder, const char*, source);
+
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , time_t, get_time, time_t*, currentTime);
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportHttpMocks, , double, get_difftime, time_t, stopTime, time_t, startTime);
 
+DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportHttpMocks, , const IO_INTERFACE_DESCRIPTION*, platform_get_default_tlsio);
+DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportHttpMocks, , XIO_HANDLE, xio_create, const IO_INTERFACE_DESCRIPTION*, io_interface_description, const void*, io_create_parameters, LOGGER_LOG, logger_log);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , void, xio_destroy, XIO_HANDLE, xio);
+DECLARE_GLOBAL_MOCK_METHOD_5(CIoTHubTransportHttpMocks, , int, xio_open, XIO_HANDLE, xio, ON_IO_OPEN_COMPLETE, on_io_open_complete, ON_BYTES_RECEIVED, on_bytes_received, ON_IO_ERROR, on_io_error, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportHttpMocks, , int, xio_close, XIO_HANDLE, xio, ON_IO_CLOSE_COMPLETE, on_io_close_complete, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_5(CIoTHubTransportHttpMocks, , int, xio_send, XIO_HANDLE, xio, const void*, buffer, size_t, size, ON_SEND_COMPLETE, on_send_complete, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , void, xio_dowork, XIO_HANDLE, xio);
+DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportHttpMocks, , int, xio_setoption, XIO_HANDLE, xio, const char*, optionName, const void*, value);
+
 //vector
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , VECTOR_HANDLE, VECTOR_create, size_t, elementSize);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportHttpMocks, , void, VECTOR_destroy, VECTOR_HANDLE, vector);
@@ -1338,12 +1499,20 @@ static void setupCreateHappyPathPerDeviceList(CIoTHubTransportHttpMocks &mocks,
 	}
 }
 
+static void setupCreateHappyPathActiveDevices(CIoTHubTransportHttpMocks &mocks)
+{
+	(void)mocks;
+	STRICT_EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG))
+		.IgnoreArgument(1);
+}
+
 static void setupCreateHappyPath(CIoTHubTransportHttpMocks &mocks, bool deallocateCreated)
 {
 	setupCreateHappyPathAlloc(mocks, deallocateCreated);
 	setupCreateHappyPathHostname(mocks, deallocateCreated);
 	setupCreateHappyPathApiExHandle(mocks, deallocateCreated);
 	setupCreateHappyPathPerDeviceList(mocks, deallocateCreated);
+	setupCreateHappyPathActiveDevices(mocks);
 }
 
 static void setupRegisterHappyPathNotFoundInList(CIoTHubTransportHttpMocks &mocks, bool deallocateCreated)
@@ -1668,6 +1837,51 @@ static void setupDoWorkLoopForNextDevice(CIoTHubTransportHttpMocks &mocks, size_
 //}
 //
 
+#ifdef USE_HTTP_COMPRESSION
+/*inflates a gzip request content into output (as a string), returns the number of inflated bytes or 0 when the content is not a complete gzip stream*/
+static size_t gunzip(const unsigned char* source, size_t sourceSize, char* output, size_t outputSize)
+{
+    size_t result;
+    z_stream stream;
+    (void)memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 16) != Z_OK)
+    {
+        result = 0;
+    }
+    else
+    {
+        stream.next_in = (Bytef*)source;
+        stream.avail_in = (uInt)sourceSize;
+        stream.next_out = (Bytef*)output;
+        stream.avail_out = (uInt)(outputSize - 1);
+        if (inflate(&stream, Z_FINISH) != Z_STREAM_END)
+        {
+            result = 0;
+        }
+        else
+        {
+            result = stream.total_out;
+            output[result] = '\0';
+        }
+        (void)inflateEnd(&stream);
+    }
+    return result;
+}
+#endif
+
+/*plays the server of the pipelined connection*/
+static void receiveOnPipeline(const char* bytes)
+{
+    pipelineOnBytesReceived(pipelineCallbackContext, (const unsigned char*)bytes, strlen(bytes));
+}
+
+/*opens the pipelined connection of a transport that has "Pipelining" set*/
+static void openPipelinedConnection(TRANSPORT_LL_HANDLE handle)
+{
+    IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+    pipelineOnOpenComplete(pipelineCallbackContext, IO_OPEN_OK);
+}
+
 BEGIN_TEST_SUITE(iothubtransporthttp)
 
     TEST_SUITE_INITIALIZE(TestClassInitialize)
@@ -1693,6 +1907,13 @@ BEGIN_TEST_SUITE(iothubtransporthttp)
         memset(temp, '3', buffer11_size);
         buffer11 = temp;
 
+        unsigned int randomState = 12345;
+        for (size_t i = 0; i < buffer13_size; i++)
+        {
+            randomState = randomState * 1103515245 + 12345;
+            buffer13[i] = (unsigned char)((randomState >> 24) & 0xFF);
+        }
+
     }
 
     TEST_SUITE_CLEANUP(TestClassCleanup)
@@ -1774,6 +1995,31 @@ BEGIN_TEST_SUITE(iothubtransporthttp)
 	   whenShallVECTOR_find_if_fail = 0;
 
        last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest = NULL;
+
+       lastAuthorizationHeaderValue[0] = '\0';
+       countAuthorizationHeaderReplaced = 0;
+       currentGetTimeValue = TEST_GET_TIME_VALUE;
+       countSentRelativePaths = 0;
+
+       pipelineOnOpenComplete = NULL;
+       pipelineOnBytesReceived = NULL;
+       pipelineOnError = NULL;
+       pipelineCallbackContext = NULL;
+       pipelineSentBytes[0] = '\0';
+       pipelineSentSize = 0;
+       countPipelineSends = 0;
+       countPipelineXioCreate = 0;
+       countPipelineXioDestroy = 0;
+       countPipelineTrustedCerts = 0;
+       lastPipelineTrustedCerts[0] = '\0';
+       countSendComplete = 0;
+       lastSendCompleteHandle = NULL;
+       lastSendCompleteResult = IOTHUB_BATCHSTATE_FAILED;
+       countConnectionReady = 0;
+       deviceRequestResult = HTTPAPIEX_OK;
+       deviceToUnregisterOnSendComplete = NULL;
+       countPolls = 0;
+       lastPolledRelativePath[0] = '\0';
     }
 
 
@@ -4007,87 +4253,1163 @@ BEGIN_TEST_SUITE(iothubtransporthttp)
 		auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
 		auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
 
-		mocks.ResetAllCalls();
+		mocks.ResetAllCalls();
+
+		STRICT_EXPECTED_CALL(mocks, VECTOR_find_if(IGNORED_PTR_ARG, IGNORED_PTR_ARG, devHandle))
+			.IgnoreArgument(1)
+			.IgnoreArgument(2)
+			.SetFailReturn((void_ptr)NULL);
+
+		///act
+		IoTHubTransportHttp_Unsubscribe(devHandle);
+
+		///assert
+		mocks.AssertActualAndExpectedCalls();
+
+		///cleanup
+		IoTHubTransportHttp_Destroy(handle);
+	}
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_049: [ If handle is NULL, then IoTHubTransportHttp_DoWork shall do nothing. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_NULL_handle_does_nothing)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+
+        ///act
+        IoTHubTransportHttp_DoWork(NULL, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+	//Tests_SRS_TRANSPORTMULTITHTTP_17_050: [ IoTHubTransportHttp_DoWork shall call loop through the device list. ]
+	//Tests_SRS_TRANSPORTMULTITHTTP_17_051: [IF the list is empty, then IoTHubTransportHttp_DoWork shall do nothing.]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_happy_path_with_no_devices)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+		STRICT_EXPECTED_CALL(mocks, VECTOR_size(IGNORED_PTR_ARG))
+			.IgnoreArgument(1);
+
+        /*no message work because DoWork_PullMessage is set to false by create*/
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+	//Tests_SRS_TRANSPORTMULTITHTTP_17_050: [ IoTHubTransportHttp_DoWork shall call loop through the device list. ]
+	//Tests_SRS_TRANSPORTMULTITHTTP_17_051: [IF the list is empty, then IoTHubTransportHttp_DoWork shall do nothing.]
+	TEST_FUNCTION(IoTHubTransportHttp_DoWork_happy_path_with_all_devices_unregistered )
+	{
+		///arrange
+		CIoTHubTransportHttpMocks mocks;
+		auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+		auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_DEVICE_KEY2, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+		auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+		(void)IoTHubTransportHttp_Unregister(devHandle1);
+		(void)IoTHubTransportHttp_Unregister(devHandle2);
+		mocks.ResetAllCalls();
+
+		STRICT_EXPECTED_CALL(mocks, VECTOR_size(IGNORED_PTR_ARG))
+			.IgnoreArgument(1);
+
+		/*no message work because DoWork_PullMessage is set to false by create*/
+
+		///act
+		IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+		///assert
+		mocks.AssertActualAndExpectedCalls();
+
+		///cleanup
+		IoTHubTransportHttp_Destroy(handle);
+	}
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_155: [ When "ReadySetScheduling" is true, IoTHubTransportHttp_DoWork shall read the time once. If time is not available, or the poll heap cannot be built, then IoTHubTransportHttp_DoWork shall visit every device as if the option was false. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReadySetScheduling_and_no_devices)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, get_time(NULL));
+        STRICT_EXPECTED_CALL(mocks, VECTOR_size(IGNORED_PTR_ARG))
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, get_difftime(TEST_GET_TIME_VALUE, 0));
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_156: [ Devices with pending events shall be served by deficit round robin: every round a device earns "SchedulingQuantum" bytes and sends its next event only when its earnings cover the size of that event. Devices with no pending events shall not keep their earnings. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_157: [ Only subscribed devices whose poll deadline (last GET time + "MinimumPollingTime", or now for the first GET) has passed shall execute the "ExecuteMessage" action, at most once per IoTHubTransportHttp_DoWork. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_186: [ Only the devices for which IoTHubTransportHttp_EventQueued has been called since they were last found without events shall be visited. Rounds in which no device would send shall be skipped by giving every visited device the earnings of these rounds at once. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReadySetScheduling_and_idle_unsubscribed_device_does_not_visit_the_device)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, get_time(NULL));
+        setupDoWorkLoopOnceForOneDevice(mocks); /*heap rebuild*/
+        STRICT_EXPECTED_CALL(mocks, get_difftime(TEST_GET_TIME_VALUE, 0));
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_156: [ Devices with pending events shall be served by deficit round robin: every round a device earns "SchedulingQuantum" bytes and sends its next event only when its earnings cover the size of that event. Devices with no pending events shall not keep their earnings. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_186: [ Only the devices for which IoTHubTransportHttp_EventQueued has been called since they were last found without events shall be visited. Rounds in which no device would send shall be skipped by giving every visited device the earnings of these rounds at once. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReadySetScheduling_sends_small_events_before_a_big_event)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_DEVICE_KEY2, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message5.entry)); /*costs a whole maximum message, that is 16 default quanta*/
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message1.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message2.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message3.entry));
+        IoTHubTransportHttp_EventQueued(devHandle1);
+        IoTHubTransportHttp_EventQueued(devHandle2);
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t countSentAfter3DoWorks = countSentRelativePaths;
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 3, countSentAfter3DoWorks);
+        ASSERT_ARE_EQUAL(size_t, 4, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID2 EVENT_ENDPOINT API_VERSION, sentRelativePaths[0]);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID2 EVENT_ENDPOINT API_VERSION, sentRelativePaths[1]);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID2 EVENT_ENDPOINT API_VERSION, sentRelativePaths[2]);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID EVENT_ENDPOINT API_VERSION, sentRelativePaths[3]); /*the skipped rounds are earned at once, the big event does not wait 16 DoWorks*/
+        ASSERT_IS_TRUE(BASEIMPLEMENTATION::DList_IsListEmpty(&waitingToSend) != 0);
+        ASSERT_IS_TRUE(BASEIMPLEMENTATION::DList_IsListEmpty(&waitingToSend2) != 0);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_185: [ IoTHubTransportHttp_EventQueued shall add the device at the end of the list of devices with pending events if it is not already in it. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_186: [ Only the devices for which IoTHubTransportHttp_EventQueued has been called since they were last found without events shall be visited. Rounds in which no device would send shall be skipped by giving every visited device the earnings of these rounds at once. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReadySetScheduling_serves_the_devices_in_the_order_their_events_were_queued)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_DEVICE_KEY2, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message2.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message3.entry));
+        IoTHubTransportHttp_EventQueued(devHandle2);
+        IoTHubTransportHttp_EventQueued(devHandle1);
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 3, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID2 EVENT_ENDPOINT API_VERSION, sentRelativePaths[0]);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID EVENT_ENDPOINT API_VERSION, sentRelativePaths[1]);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID EVENT_ENDPOINT API_VERSION, sentRelativePaths[2]);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_186: [ Only the devices for which IoTHubTransportHttp_EventQueued has been called since they were last found without events shall be visited. Rounds in which no device would send shall be skipped by giving every visited device the earnings of these rounds at once. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReadySetScheduling_forgets_a_device_without_events)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+        IoTHubTransportHttp_EventQueued(devHandle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE); /*the device is found without events*/
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, get_time(NULL));
+        STRICT_EXPECTED_CALL(mocks, get_difftime(TEST_GET_TIME_VALUE, 0));
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, 0, countSentRelativePaths);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_191: [ If the event callbacks changed the devices or the subscriptions, then IoTHubTransportHttp_DoWork shall rebuild the poll heap before polling. If the poll heap cannot be rebuilt, then no device shall poll during that IoTHubTransportHttp_DoWork. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReadySetScheduling_does_not_poll_a_device_unregistered_by_an_event_callback)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_DEVICE_KEY2, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+        (void)IoTHubTransportHttp_Subscribe(devHandle1);
+        (void)IoTHubTransportHttp_Subscribe(devHandle2);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE); /*builds the poll heap and polls both devices*/
+        currentGetTimeValue += 3600; /*both devices are due to poll again*/
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        IoTHubTransportHttp_EventQueued(devHandle1);
+        deviceToUnregisterOnSendComplete = devHandle2;
+        countPolls = 0;
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 1, countSendComplete);
+        ASSERT_ARE_EQUAL(size_t, 1, countPolls);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID MESSAGE_ENDPOINT_HTTP API_VERSION, lastPolledRelativePath);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_184: [ If handle is NULL, then IoTHubTransportHttp_EventQueued shall do nothing. ]
+    TEST_FUNCTION(IoTHubTransportHttp_EventQueued_with_NULL_handle_does_nothing)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+
+        ///act
+        IoTHubTransportHttp_EventQueued(NULL);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_185: [ IoTHubTransportHttp_EventQueued shall add the device at the end of the list of devices with pending events if it is not already in it. ]
+    TEST_FUNCTION(IoTHubTransportHttp_EventQueued_twice_adds_the_device_once)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreAllArguments();
+
+        ///act
+        IoTHubTransportHttp_EventQueued(devHandle);
+        IoTHubTransportHttp_EventQueued(devHandle);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_185: [ IoTHubTransportHttp_EventQueued shall add the device at the end of the list of devices with pending events if it is not already in it. ]
+    TEST_FUNCTION(IoTHubTransportHttp_Unregister_removes_a_device_with_queued_events)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        IoTHubTransportHttp_EventQueued(devHandle);
+
+        ///act
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 0, countSentRelativePaths);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_152: [ "ReadySetScheduling" ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_ReadySetScheduling_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "ReadySetScheduling", &thisIsTrue);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_154: [ If "SchedulingQuantum" is 0 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_SchedulingQuantum_0_fails)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        unsigned int quantum = 0;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "SchedulingQuantum", &quantum);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_158: ["ReuseRequestResources"]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_ReuseRequestResources_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "ReuseRequestResources", &thisIsTrue);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_159: [ When "ReuseRequestResources" is set, the content buffers of event requests and of message polls shall be created once per device and reused by the following requests. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReuseRequestResources_creates_the_event_content_buffer_once)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReuseRequestResources", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message2.entry));
+        mocks.ResetAllCalls();
+        currentBUFFER_new_call = 0;
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 2, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(size_t, 1, currentBUFFER_new_call);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_160: [ When "ReuseRequestResources" is set, the headers of a single event shall be the device's single event headers. They shall be recreated as a clone of the event HTTP request headers only when the message has a different set of property names, message id or correlation id than the previous message. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReuseRequestResources_reuses_the_single_event_headers_for_the_same_property_names)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReuseRequestResources", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message2.entry));
+        mocks.ResetAllCalls();
+        currentHTTPHeaders_Clone_call = 0;
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 2, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(size_t, 1, currentHTTPHeaders_Clone_call);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_160: [ When "ReuseRequestResources" is set, the headers of a single event shall be the device's single event headers. They shall be recreated as a clone of the event HTTP request headers only when the message has a different set of property names, message id or correlation id than the previous message. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReuseRequestResources_recreates_the_single_event_headers_for_other_property_names)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReuseRequestResources", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry)); /*no properties*/
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message6.entry)); /*1 property*/
+        mocks.ResetAllCalls();
+        currentHTTPHeaders_Clone_call = 0;
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 2, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(size_t, 2, currentHTTPHeaders_Clone_call);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_161: [ When "ReuseRequestResources" is set, the relative path of abandon, accept and reject requests shall be built in a buffer of the device that only grows, and the request headers shall be created once per device and only have the "If-Match" header replaced with the value of ETag by each request. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_ReuseRequestResources_creates_the_abandon_headers_once)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        unsigned int statusCode200 = 200;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReuseRequestResources", &thisIsTrue);
+        (void)IoTHubTransportHttp_Subscribe(devHandle);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, HTTPAPIEX_SAS_ExecuteRequest2(IGNORED_PTR_ARG, IGNORED_PTR_ARG, HTTPAPI_REQUEST_GET, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2)
+            .IgnoreArgument(4)
+            .IgnoreArgument(5)
+            .IgnoreArgument(6)
+            .IgnoreArgument(7)
+            .IgnoreArgument(8)
+            .IgnoreArgument(9)
+            .CopyOutArgumentBuffer(7, &statusCode200, sizeof(statusCode200))
+            .ExpectedTimesExactly(2);
+        STRICT_EXPECTED_CALL(mocks, HTTPHeaders_FindHeaderValue(IGNORED_PTR_ARG, "ETag"))
+            .IgnoreArgument(1)
+            .SetReturn(TEST_ETAG_VALUE)
+            .ExpectedTimesExactly(2);
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreAllArguments()
+            .SetReturn(IOTHUBMESSAGE_ABANDONED)
+            .ExpectedTimesExactly(2);
+        currentHTTPHeaders_Alloc_call = 0;
+        currentSTRING_construct_n_call = 0;
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        currentGetTimeValue += 2 * 1500; /*past the default MinimumPollingTime*/
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 2, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID MESSAGE_ENDPOINT_HTTP_ETAG TEST_ETAG_VALUE_UNQUOTED "/abandon" API_VERSION, sentRelativePaths[0]);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID MESSAGE_ENDPOINT_HTTP_ETAG TEST_ETAG_VALUE_UNQUOTED "/abandon" API_VERSION, sentRelativePaths[1]);
+        ASSERT_ARE_EQUAL(size_t, 3, currentHTTPHeaders_Alloc_call); /*the response headers of both GETs and the abandon headers once*/
+        ASSERT_ARE_EQUAL(size_t, 0, currentSTRING_construct_n_call); /*the relative path is not built in a STRING*/
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_162: [ The reusable request resources of a device shall be freed when the device is unregistered or the transport is destroyed. ]
+    TEST_FUNCTION(IoTHubTransportHttp_Unregister_with_ReuseRequestResources_frees_the_reused_resources)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "ReuseRequestResources", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, VECTOR_find_if(IGNORED_PTR_ARG, IGNORED_PTR_ARG, devHandle))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        setupUnregisterOneDevice(mocks);
+        STRICT_EXPECTED_CALL(mocks, BUFFER_delete(IGNORED_PTR_ARG)) /*the event content buffer*/
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, HTTPHeaders_Free(IGNORED_PTR_ARG)) /*the single event headers*/
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG)) /*the single event headers signature*/
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, VECTOR_erase(IGNORED_PTR_ARG, IGNORED_PTR_ARG, 1))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, gballoc_free(devHandle));
+
+        ///act
+        IoTHubTransportHttp_Unregister(devHandle);
+
+        ///assert
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_163: ["BatchCompression"]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_BatchCompression_false_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "BatchCompression", &thisIsFalse);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+#ifndef USE_HTTP_COMPRESSION
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_164: [ If the transport has not been built with USE_HTTP_COMPRESSION then setting "BatchCompression" to true shall fail and return IOTHUB_CLIENT_ERROR. ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_BatchCompression_true_without_compression_support_fails)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "BatchCompression", &thisIsTrue);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_ERROR, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+#else
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_163: ["BatchCompression"]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_BatchCompression_true_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "BatchCompression", &thisIsTrue);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+#endif
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_165: ["CompressionLevel"]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_CompressionLevel_9_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        int level = 9;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "CompressionLevel", &level);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_166: [ If "CompressionLevel" is not between 1 and 9 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_CompressionLevel_0_fails)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        int level = 0;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "CompressionLevel", &level);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_172: ["Pipelining"]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_Pipelining_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        bool usePipelining = true;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "Pipelining", &usePipelining);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_173: ["PipelineDepth"]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_PipelineDepth_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        unsigned int depth = 32;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "PipelineDepth", &depth);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_174: [ If "PipelineDepth" is 0 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_PipelineDepth_0_fails)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        unsigned int depth = 0;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "PipelineDepth", &depth);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_182: ["eagerConnect"]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_eagerConnect_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        bool eagerConnect = true;
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, VECTOR_size(IGNORED_PTR_ARG))
+            .IgnoreArgument(1);
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "eagerConnect", &eagerConnect);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_183: [ If "eagerConnect" is true, IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_ConnectionReady once for every registered device when the transport can carry its requests: without "Pipelining" when an HTTPAPIEX request has been answered (and again after a request failed and another one was answered), with "Pipelining" when the pipelined connection is open (and again after it is reopened). ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_190: [ Without "Pipelining", the connection shall be open once an HTTPAPIEX request of a device has been answered, that is HTTPAPIEX returned HTTPAPIEX_OK whatever the status code. No request shall be sent only to open the connection. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_eagerConnect_reports_ready_once_the_first_poll_is_answered)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_Subscribe(devHandle);
+        (void)IoTHubTransportHttp_SetOption(handle, "eagerConnect", &thisIsTrue);
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 1, countPolls); /*the poll opens the connection, no other request is sent*/
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID MESSAGE_ENDPOINT_HTTP API_VERSION, lastPolledRelativePath);
+        ASSERT_ARE_EQUAL(size_t, 1, countConnectionReady);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_183: [ If "eagerConnect" is true, IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_ConnectionReady once for every registered device when the transport can carry its requests: without "Pipelining" when an HTTPAPIEX request has been answered (and again after a request failed and another one was answered), with "Pipelining" when the pipelined connection is open (and again after it is reopened). ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_190: [ Without "Pipelining", the connection shall be open once an HTTPAPIEX request of a device has been answered, that is HTTPAPIEX returned HTTPAPIEX_OK whatever the status code. No request shall be sent only to open the connection. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_eagerConnect_does_not_report_ready_until_a_device_request_is_answered)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_Subscribe(devHandle);
+        (void)IoTHubTransportHttp_SetOption(handle, "eagerConnect", &thisIsTrue);
+        mocks.ResetAllCalls();
+        deviceRequestResult = HTTPAPIEX_ERROR;
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t countConnectionReadyAfterFailure = countConnectionReady;
+        deviceRequestResult = HTTPAPIEX_OK;
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 0, countConnectionReadyAfterFailure);
+        ASSERT_ARE_EQUAL(size_t, 2, countPolls); /*the failed poll is the first poll again*/
+        ASSERT_ARE_EQUAL(size_t, 1, countConnectionReady);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_190: [ Without "Pipelining", the connection shall be open once an HTTPAPIEX request of a device has been answered, that is HTTPAPIEX returned HTTPAPIEX_OK whatever the status code. No request shall be sent only to open the connection. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_eagerConnect_and_an_idle_device_sends_no_request)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "eagerConnect", &thisIsTrue);
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 0, countPolls);
+        ASSERT_ARE_EQUAL(size_t, 0, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(size_t, 0, countConnectionReady);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_183: [ If "eagerConnect" is true, IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_ConnectionReady once for every registered device when the transport can carry its requests: without "Pipelining" when an HTTPAPIEX request has been answered (and again after a request failed and another one was answered), with "Pipelining" when the pipelined connection is open (and again after it is reopened). ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_eagerConnect_and_no_devices_does_not_report_ready)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        (void)IoTHubTransportHttp_SetOption(handle, "eagerConnect", &thisIsTrue);
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 0, countConnectionReady);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_183: [ If "eagerConnect" is true, IoTHubTransportHttp_DoWork shall call IoTHubClient_LL_ConnectionReady once for every registered device when the transport can carry its requests: without "Pipelining" when an HTTPAPIEX request has been answered (and again after a request failed and another one was answered), with "Pipelining" when the pipelined connection is open (and again after it is reopened). ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_eagerConnect_and_Pipelining_reports_ready_when_the_pipelined_connection_opens)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        (void)IoTHubTransportHttp_SetOption(handle, "eagerConnect", &thisIsTrue);
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t countConnectionReadyWhileOpening = countConnectionReady;
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 0, countConnectionReadyWhileOpening);
+        ASSERT_ARE_EQUAL(size_t, 1, countConnectionReady);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_176: [ Requests shall be written as HTTP/1.1 requests with the "Host" header, an "Authorization" header with the device's token from the SAS token cache, the headers the non pipelined request would have and a "Content-Length" header. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_177: [ Responses shall be matched to requests in the order the requests have been sent. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_matches_the_responses_to_the_requests_in_order)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message2.entry));
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE); /*both events are sent without waiting*/
+        size_t countSendsBeforeResponses = countPipelineSends;
+        mocks.ResetAllCalls();
+
+        ///act
+        receiveOnPipeline("HTTP/1.1 204 No Content\r\n\r\nHTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 2, countSendsBeforeResponses);
+        ASSERT_IS_NOT_NULL(strstr(pipelineSentBytes, "POST /devices/" TEST_DEVICE_ID EVENT_ENDPOINT API_VERSION " HTTP/1.1\r\nHost: " TEST_IOTHUB_NAME "." TEST_IOTHUB_SUFFIX "\r\nAuthorization: SharedAccessSignature sr="));
+        ASSERT_IS_NOT_NULL(strstr(pipelineSentBytes, "POST /devices/" TEST_DEVICE_ID2 EVENT_ENDPOINT API_VERSION " HTTP/1.1\r\n"));
+        ASSERT_ARE_EQUAL(size_t, 1, countSendComplete);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_IOTHUB_CLIENT_LL_HANDLE, lastSendCompleteHandle);
+        ASSERT_ARE_EQUAL(int, (int)IOTHUB_BATCHSTATE_SUCCESS, (int)lastSendCompleteResult);
+        ASSERT_ARE_EQUAL(size_t, 3, countPipelineSends); /*the event refused by the 400 is sent again*/
+        ASSERT_ARE_EQUAL(size_t, 0, countPipelineXioDestroy);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle1);
+        IoTHubTransportHttp_Unregister(devHandle2);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_177: [ Responses shall be matched to requests in the order the requests have been sent. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_parses_a_response_received_one_byte_at_a_time)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        const char* response = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 201 Created\r\nContent-Length: 5\r\nConnection: keep-alive\r\n\r\nhello";
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        ///act
+        for (size_t i = 0; response[i] != '\0'; i++)
+        {
+            pipelineOnBytesReceived(pipelineCallbackContext, (const unsigned char*)response + i, 1);
+            if (i == 30)
+            {
+                /*half a status line is not a response*/
+                IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+                ASSERT_ARE_EQUAL(size_t, 0, countSendComplete);
+            }
+        }
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 1, countSendComplete);
+        ASSERT_ARE_EQUAL(int, (int)IOTHUB_BATCHSTATE_SUCCESS, (int)lastSendCompleteResult);
+        ASSERT_ARE_EQUAL(size_t, 0, countPipelineXioDestroy);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_177: [ Responses shall be matched to requests in the order the requests have been sent. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_reads_a_chunked_body_split_across_receives)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message2.entry));
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        ///act
+        /*the second chunk is made of line ends, that are data and not the end of a line*/
+        receiveOnPipeline("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel");
+        receiveOnPipeline("lo\r\n3;name=value\r\n\r\n\n\r\n0\r\nSome-Trailer: x\r\n\r\nHTTP/1.1 204 No Content\r\n\r\n");
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 2, countSendComplete);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_IOTHUB_CLIENT_LL_HANDLE2, lastSendCompleteHandle);
+        ASSERT_ARE_EQUAL(int, (int)IOTHUB_BATCHSTATE_SUCCESS, (int)lastSendCompleteResult);
+        ASSERT_ARE_EQUAL(size_t, 0, countPipelineXioDestroy);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle1);
+        IoTHubTransportHttp_Unregister(devHandle2);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_189: [ The body of a response that has neither a "Content-Length" header nor a chunked "Transfer-Encoding" shall end when the connection is closed; no other request shall be sent on the connection meanwhile and the connection shall then be opened again. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_reads_a_body_without_length_until_the_connection_closes)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        receiveOnPipeline("HTTP/1.1 200 OK\r\n\r\nthe body goes on");
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message2.entry));
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t countSendCompleteBeforeClose = countSendComplete;
+        size_t countSendsBeforeClose = countPipelineSends;
+        pipelineOnError(pipelineCallbackContext);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 0, countSendCompleteBeforeClose);
+        ASSERT_ARE_EQUAL(size_t, 1, countSendsBeforeClose); /*the event of the second device would be lost with the connection*/
+        ASSERT_ARE_EQUAL(size_t, 1, countSendComplete);
+        ASSERT_ARE_EQUAL(void_ptr, TEST_IOTHUB_CLIENT_LL_HANDLE, lastSendCompleteHandle);
+        ASSERT_ARE_EQUAL(int, (int)IOTHUB_BATCHSTATE_SUCCESS, (int)lastSendCompleteResult);
+        ASSERT_ARE_EQUAL(size_t, 1, countPipelineXioDestroy);
+        ASSERT_IS_FALSE(BASEIMPLEMENTATION::DList_IsListEmpty(&waitingToSend2) != 0);
 
-		STRICT_EXPECTED_CALL(mocks, VECTOR_find_if(IGNORED_PTR_ARG, IGNORED_PTR_ARG, devHandle))
-			.IgnoreArgument(1)
-			.IgnoreArgument(2)
-			.SetFailReturn((void_ptr)NULL);
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle1);
+        IoTHubTransportHttp_Unregister(devHandle2);
+        IoTHubTransportHttp_Destroy(handle);
+    }
 
-		///act
-		IoTHubTransportHttp_Unsubscribe(devHandle);
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_179: [ On a connection error, a response timeout or a "Connection: close" response, the requests waiting for their response shall be abandoned: their events shall be put back at the beginning of waitingToSend in their original order. The connection shall be opened again after 5 seconds. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_puts_the_event_back_and_reconnects_after_an_invalid_status_line)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
 
-		///assert
-		mocks.AssertActualAndExpectedCalls();
+        ///act
+        receiveOnPipeline("HTTP/2 204\r\n\r\n");
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        bool isEventBack = (BASEIMPLEMENTATION::DList_IsListEmpty(&waitingToSend) == 0);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t countXioCreateBeforeDelay = countPipelineXioCreate;
+        currentGetTimeValue += 5;
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
-		///cleanup
-		IoTHubTransportHttp_Destroy(handle);
-	}
+        ///assert
+        ASSERT_IS_TRUE(isEventBack);
+        ASSERT_ARE_EQUAL(size_t, 0, countSendComplete);
+        ASSERT_ARE_EQUAL(size_t, 1, countPipelineXioDestroy);
+        ASSERT_ARE_EQUAL(size_t, 1, countXioCreateBeforeDelay);
+        ASSERT_ARE_EQUAL(size_t, 2, countPipelineXioCreate);
+        ASSERT_ARE_EQUAL(size_t, 2, countPipelineSends); /*the same event, on the new connection*/
 
-    //Tests_SRS_TRANSPORTMULTITHTTP_17_049: [ If handle is NULL, then IoTHubTransportHttp_DoWork shall do nothing. ]
-    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_NULL_handle_does_nothing)
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_179: [ On a connection error, a response timeout or a "Connection: close" response, the requests waiting for their response shall be abandoned: their events shall be put back at the beginning of waitingToSend in their original order. The connection shall be opened again after 5 seconds. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_puts_the_event_back_on_a_connection_error)
     {
         ///arrange
         CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
 
         ///act
-        IoTHubTransportHttp_DoWork(NULL, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        pipelineOnError(pipelineCallbackContext);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
         ///assert
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, 0, countSendComplete);
+        ASSERT_ARE_EQUAL(size_t, 1, countPipelineXioDestroy);
+        ASSERT_ARE_EQUAL(size_t, 1, countPipelineSends);
+        ASSERT_IS_TRUE(BASEIMPLEMENTATION::DList_IsListEmpty(&waitingToSend) == 0);
+        ASSERT_ARE_EQUAL(void_ptr, &(message1.entry), waitingToSend.Flink);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
     }
 
-	//Tests_SRS_TRANSPORTMULTITHTTP_17_050: [ IoTHubTransportHttp_DoWork shall call loop through the device list. ]
-	//Tests_SRS_TRANSPORTMULTITHTTP_17_051: [IF the list is empty, then IoTHubTransportHttp_DoWork shall do nothing.]
-    TEST_FUNCTION(IoTHubTransportHttp_DoWork_happy_path_with_no_devices)
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_179: [ On a connection error, a response timeout or a "Connection: close" response, the requests waiting for their response shall be abandoned: their events shall be put back at the beginning of waitingToSend in their original order. The connection shall be opened again after 5 seconds. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_opens_the_connection_again_after_it_failed_to_open)
     {
         ///arrange
         CIoTHubTransportHttpMocks mocks;
         auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-		STRICT_EXPECTED_CALL(mocks, VECTOR_size(IGNORED_PTR_ARG))
-			.IgnoreArgument(1);
+        ///act
+        pipelineOnOpenComplete(pipelineCallbackContext, IO_OPEN_ERROR);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        currentGetTimeValue += 4;
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t countXioCreateBeforeDelay = countPipelineXioCreate;
+        currentGetTimeValue += 1;
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
-        /*no message work because DoWork_PullMessage is set to false by create*/
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 1, countXioCreateBeforeDelay);
+        ASSERT_ARE_EQUAL(size_t, 2, countPipelineXioCreate);
+        ASSERT_ARE_EQUAL(size_t, 1, countPipelineXioDestroy);
+        ASSERT_ARE_EQUAL(size_t, 1, countPipelineSends);
+
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_175: [ The pipelined connection shall be a TLS connection to the host name on port 443 created with the platform's default TLS IO, opened by _DoWork. The last "TrustedCerts" given to IoTHubTransportHttp_SetOption, before or after "Pipelining", shall be passed to it every time it is created. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_passes_TrustedCerts_given_before_Pipelining_to_every_connection)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "TrustedCerts", "someCertificates");
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        mocks.ResetAllCalls();
 
         ///act
         IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t countTrustedCertsOnFirstConnection = countPipelineTrustedCerts;
+        pipelineOnOpenComplete(pipelineCallbackContext, IO_OPEN_ERROR);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        currentGetTimeValue += 5;
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
         ///assert
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, 1, countTrustedCertsOnFirstConnection);
+        ASSERT_ARE_EQUAL(size_t, 2, countPipelineXioCreate);
+        ASSERT_ARE_EQUAL(size_t, 2, countPipelineTrustedCerts);
+        ASSERT_ARE_EQUAL(char_ptr, "someCertificates", lastPipelineTrustedCerts);
 
         ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
         IoTHubTransportHttp_Destroy(handle);
     }
 
-	//Tests_SRS_TRANSPORTMULTITHTTP_17_050: [ IoTHubTransportHttp_DoWork shall call loop through the device list. ]
-	//Tests_SRS_TRANSPORTMULTITHTTP_17_051: [IF the list is empty, then IoTHubTransportHttp_DoWork shall do nothing.]
-	TEST_FUNCTION(IoTHubTransportHttp_DoWork_happy_path_with_all_devices_unregistered )
-	{
-		///arrange
-		CIoTHubTransportHttpMocks mocks;
-		auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
-		auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_DEVICE_KEY2, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
-		auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
-		(void)IoTHubTransportHttp_Unregister(devHandle1);
-		(void)IoTHubTransportHttp_Unregister(devHandle2);
-		mocks.ResetAllCalls();
-
-		STRICT_EXPECTED_CALL(mocks, VECTOR_size(IGNORED_PTR_ARG))
-			.IgnoreArgument(1);
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_178: [ Responses shall be processed as by the non pipelined _DoWork, except that abandon, accept and reject requests shall be sent on the pipelined connection without waiting for their response. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_188: [ Abandon, accept and reject requests shall only have the "Host", "Authorization", "User-Agent", "If-Match" and "Content-Length" headers. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_Pipelining_sends_the_accept_with_its_own_headers)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "Pipelining", &thisIsTrue);
+        (void)IoTHubTransportHttp_Subscribe(devHandle);
+        openPipelinedConnection(handle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE); /*sends the GET*/
+        size_t sentSizeBeforeAccept = pipelineSentSize;
+        mocks.ResetAllCalls();
 
-		/*no message work because DoWork_PullMessage is set to false by create*/
+        STRICT_EXPECTED_CALL(mocks, HTTPHeaders_FindHeaderValue(IGNORED_PTR_ARG, "ETag"))
+            .IgnoreArgument(1)
+            .SetReturn(TEST_ETAG_VALUE);
 
-		///act
-		IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        ///act
+        receiveOnPipeline("HTTP/1.1 200 OK\r\nETag: " TEST_ETAG_VALUE "\r\nContent-Length: 5\r\n\r\nhello");
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
-		///assert
-		mocks.AssertActualAndExpectedCalls();
+        ///assert
+        const char* accept = pipelineSentBytes + sentSizeBeforeAccept;
+        ASSERT_IS_NOT_NULL(strstr(pipelineSentBytes, "GET /devices/" TEST_DEVICE_ID));
+        ASSERT_ARE_EQUAL(int, 0, strncmp(accept, "DELETE /devices/" TEST_DEVICE_ID MESSAGE_ENDPOINT_HTTP_ETAG TEST_ETAG_VALUE_UNQUOTED API_VERSION " HTTP/1.1\r\n", strlen("DELETE /devices/" TEST_DEVICE_ID MESSAGE_ENDPOINT_HTTP_ETAG TEST_ETAG_VALUE_UNQUOTED API_VERSION " HTTP/1.1\r\n")));
+        ASSERT_IS_NOT_NULL(strstr(accept, "\r\nUser-Agent: "));
+        ASSERT_IS_NOT_NULL(strstr(accept, "\r\nIf-Match: " TEST_ETAG_VALUE "\r\n"));
+        ASSERT_IS_NOT_NULL(strstr(accept, "\r\nContent-Length: 0\r\n\r\n"));
+        ASSERT_IS_NULL(strstr(accept, "Content-Type"));
 
-		///cleanup
-		IoTHubTransportHttp_Destroy(handle);
-	}
+        ///cleanup
+        IoTHubTransportHttp_Unregister(devHandle);
+        IoTHubTransportHttp_Destroy(handle);
+    }
 
 	//Tests_SRS_TRANSPORTMULTITHTTP_17_060: [ If the list is empty then IoTHubTransportHttp_DoWork shall proceed to the following action. ]
 	//Tests_SRS_TRANSPORTMULTITHTTP_17_083: [ If device is not subscribed then _DoWork shall advance to the next action. ]
@@ -8009,6 +9331,7 @@ BEGIN_TEST_SUITE(iothubtransporthttp)
         ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Unsubscribe, (void*)IoTHubTransportHttp_Unsubscribe);
         ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_DoWork, (void*)IoTHubTransportHttp_DoWork);
         ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_GetSendStatus, (void*)IoTHubTransportHttp_GetSendStatus);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_EventQueued, (void*)IoTHubTransportHttp_EventQueued);
         ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_SetOption, (void*)IoTHubTransportHttp_SetOption);
 
         ///cleanup
@@ -10927,6 +12250,166 @@ BEGIN_TEST_SUITE(iothubtransporthttp)
         IoTHubTransportHttp_Destroy(handle);
     }
 
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_117: [ If optionName is an option handled by IoTHubTransportHttp then it shall be set. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_144: [ "SasTokenCache" ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_SasTokenCache_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "SasTokenCache", &thisIsTrue);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_145: [ "SasTokenLifetime" ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_SasTokenLifetime_succeeds)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        unsigned int lifetime = 600;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "SasTokenLifetime", &lifetime);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_146: [ If "SasTokenLifetime" is 0 then IoTHubTransportHttp_SetOption shall return IOTHUB_CLIENT_INVALID_ARG. ]
+    TEST_FUNCTION(IoTHubTransportHttp_SetOption_SasTokenLifetime_0_fails)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        unsigned int lifetime = 0;
+        mocks.ResetAllCalls();
+
+        ///act
+        auto result = IoTHubTransportHttp_SetOption(handle, "SasTokenLifetime", &lifetime);
+
+        ///assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
+        mocks.AssertActualAndExpectedCalls();
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_147: [ The first time a token is needed, the transport shall decode the device key and compute the SHA-256 states after absorbing (key XOR ipad) and (key XOR opad). These states shall be reused for every later token of the device. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_149: [ The token shall be reused until a renewal time chosen at random between 1/2 and 3/4 of its lifetime. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_SasTokenCache_reuses_the_token_within_its_lifetime)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "SasTokenCache", &thisIsTrue);
+        (void)IoTHubTransportHttp_Subscribe(devHandle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        char firstToken[sizeof(lastAuthorizationHeaderValue)];
+        (void)strcpy(firstToken, lastAuthorizationHeaderValue);
+        size_t signaturesSoFar = currentBase64_Encode_Bytes_call;
+        /*next poll is due, but the token is still far from its earliest renewal time (lifetime/2)*/
+        currentGetTimeValue = TEST_GET_TIME_VALUE + TEST_DEFAULT_GETMINIMUMPOLLINGTIME + 1;
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 2, countAuthorizationHeaderReplaced);
+        ASSERT_ARE_EQUAL(char_ptr, firstToken, lastAuthorizationHeaderValue);
+        ASSERT_ARE_EQUAL(size_t, signaturesSoFar, currentBase64_Encode_Bytes_call);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_149: [ The token shall be reused until a renewal time chosen at random between 1/2 and 3/4 of its lifetime. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_SasTokenCache_renews_the_token_after_its_renewal_time)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        unsigned int lifetime = 3600;
+        (void)IoTHubTransportHttp_SetOption(handle, "SasTokenCache", &thisIsTrue);
+        (void)IoTHubTransportHttp_SetOption(handle, "SasTokenLifetime", &lifetime);
+        (void)IoTHubTransportHttp_Subscribe(devHandle);
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        char firstToken[sizeof(lastAuthorizationHeaderValue)];
+        (void)strcpy(firstToken, lastAuthorizationHeaderValue);
+        size_t signaturesSoFar = currentBase64_Encode_Bytes_call;
+        /*the latest possible renewal time is 3/4 of the lifetime*/
+        currentGetTimeValue = TEST_GET_TIME_VALUE + lifetime * 3 / 4 + 1;
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        char expectedExpiry[64];
+        (void)sprintf(expectedExpiry, "&se=%lu&", (unsigned long)(currentGetTimeValue + lifetime));
+        ASSERT_ARE_EQUAL(size_t, 2, countAuthorizationHeaderReplaced);
+        ASSERT_ARE_NOT_EQUAL(int, 0, strcmp(firstToken, lastAuthorizationHeaderValue));
+        ASSERT_IS_NOT_NULL(strstr(lastAuthorizationHeaderValue, expectedExpiry));
+        ASSERT_ARE_EQUAL(size_t, signaturesSoFar + 1, currentBase64_Encode_Bytes_call);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_148: [ The token shall have the same format as the one produced by SASToken_Create for the scope hostname + "/devices/" + URL_ENCODED(deviceId) and an empty key name. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_SasTokenCache_produces_the_SASToken_Create_token)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_SAS_TOKEN_CACHE_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        (void)IoTHubTransportHttp_SetOption(handle, "SasTokenCache", &thisIsTrue);
+        (void)IoTHubTransportHttp_Subscribe(devHandle);
+
+        /*SASToken_Create: sig = URL_ENCODE(BASE64(HMAC-SHA256(BASE64_DECODE(key), scope + "\n" + expiry))). URL_EncodeString is the identity in these tests*/
+        char scope[256];
+        char expiry[32];
+        char toSign[512];
+        uint8_t digest[USHAMaxHashSize];
+        (void)sprintf(scope, "%s.%s/devices/%s", TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_DEVICE_ID);
+        (void)sprintf(expiry, "%lu", (unsigned long)(TEST_GET_TIME_VALUE + 3600));
+        (void)sprintf(toSign, "%s\n%s", scope, expiry);
+        BUFFER_HANDLE decodedKey = BASEIMPLEMENTATION::Base64_Decoder(TEST_SAS_TOKEN_CACHE_DEVICE_KEY);
+        ASSERT_ARE_EQUAL(int, shaSuccess, hmac(SHA256, (const unsigned char*)toSign, (int)strlen(toSign), BASEIMPLEMENTATION::BUFFER_u_char(decodedKey), (int)BASEIMPLEMENTATION::BUFFER_length(decodedKey), digest));
+        STRING_HANDLE signature = BASEIMPLEMENTATION::Base64_Encode_Bytes(digest, SHA256HashSize);
+        char expectedToken[sizeof(lastAuthorizationHeaderValue)];
+        (void)sprintf(expectedToken, "SharedAccessSignature sr=%s&sig=%s&se=%s&skn=", scope, BASEIMPLEMENTATION::STRING_c_str(signature), expiry);
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 1, countAuthorizationHeaderReplaced);
+        ASSERT_ARE_EQUAL(char_ptr, expectedToken, lastAuthorizationHeaderValue);
+
+        ///cleanup
+        BASEIMPLEMENTATION::STRING_delete(signature);
+        BASEIMPLEMENTATION::BUFFER_delete(decodedKey);
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
     //Tests_SRS_TRANSPORTMULTITHTTP_17_096: [ If IoTHubClient_LL_MessageCallback returns IOTHUBMESSAGE_ABANDONED then _DoWork shall "abandon" the message. ]
     TEST_FUNCTION(IoTHubTransportHttp_DoWork_happy_path_with_empty_waitingToSend_and_1_service_message_with_abandon_succeeds)
     {
@@ -14224,5 +15707,117 @@ BEGIN_TEST_SUITE(iothubtransporthttp)
         IoTHubTransportHttp_Destroy(handle);
     }
 
+#ifdef USE_HTTP_COMPRESSION
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_167: [ When "BatchCompression" is true, every item added to the JSON payload shall also be given to the gzip stream of the transport, so that a compressed copy of the payload is built at the same time. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_BatchCompression_sends_the_gzip_of_the_batch)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        char inflated[1024];
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        ENABLE_BATCHING();
+        (void)IoTHubTransportHttp_SetOption(handle, "BatchCompression", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message6.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message7.entry));
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, 1, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID EVENT_ENDPOINT API_VERSION, sentRelativePaths[0]);
+        ASSERT_IS_NOT_NULL(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest);
+        ASSERT_ARE_EQUAL(size_t, sizeof(TEST_2_ITEM_STRING) - 1, gunzip(BASEIMPLEMENTATION::BUFFER_u_char(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest), BASEIMPLEMENTATION::BUFFER_length(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest), inflated, sizeof(inflated)));
+        ASSERT_ARE_EQUAL(char_ptr, TEST_2_ITEM_STRING, inflated);
+        ASSERT_IS_TRUE(BASEIMPLEMENTATION::DList_IsListEmpty(&waitingToSend) != 0);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_169: [ If the compressed payload is not smaller than 90% of the JSON payload, the JSON payload shall be sent instead when it fits the message size limit, and the next 16 batches of the device shall not be compressed. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_187: [ The gzip stream and its output buffer shall be created once per transport, by the first batch that is compressed, and be used by the batches of every device. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_BatchCompression_compresses_the_batch_of_a_device_with_the_stream_used_by_another_device)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        char inflated[1024];
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle1 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        auto devHandle2 = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID2, TEST_DEVICE_KEY2, TEST_IOTHUB_CLIENT_LL_HANDLE2, TEST_CONFIG2.waitingToSend);
+        ENABLE_BATCHING();
+        (void)IoTHubTransportHttp_SetOption(handle, "BatchCompression", &thisIsTrue);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message1.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(message2.entry));
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE); /*the first device creates the compressor, 2 small items do not compress well so its JSON is sent*/
+        size_t firstContentSize = BASEIMPLEMENTATION::BUFFER_length(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest);
+        int firstContentCompare = memcmp("[{\"body\":\"MQ==\"},{\"body\":\"MjI=\"}]", BASEIMPLEMENTATION::BUFFER_u_char(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest), firstContentSize);
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message6.entry));
+        BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend2, &(message7.entry));
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        ASSERT_ARE_EQUAL(size_t, sizeof("[{\"body\":\"MQ==\"},{\"body\":\"MjI=\"}]") - 1, firstContentSize);
+        ASSERT_ARE_EQUAL(int, 0, firstContentCompare);
+        ASSERT_ARE_EQUAL(size_t, 2, countSentRelativePaths);
+        ASSERT_ARE_EQUAL(char_ptr, "/devices/" TEST_DEVICE_ID2 EVENT_ENDPOINT API_VERSION, sentRelativePaths[1]);
+        ASSERT_ARE_EQUAL(size_t, sizeof(TEST_2_ITEM_STRING) - 1, gunzip(BASEIMPLEMENTATION::BUFFER_u_char(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest), BASEIMPLEMENTATION::BUFFER_length(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest), inflated, sizeof(inflated)));
+        ASSERT_ARE_EQUAL(char_ptr, TEST_2_ITEM_STRING, inflated);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+    }
+
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_168: [ When the batch is compressed, the message size limit shall apply to the compressed bytes: an item shall be added to the batch only if the compressed size so far plus the largest size deflate can produce for the not yet flushed bytes and the item is within the limit. ]
+    //Tests_SRS_TRANSPORTMULTITHTTP_17_192: [ The compressed payload shall only be complete when deflate with Z_FINISH returns Z_STREAM_END. Otherwise the output buffer, which is as big as the message size limit, is full and the compressed payload cannot be completed. ]
+    TEST_FUNCTION(IoTHubTransportHttp_DoWork_with_BatchCompression_and_incompressible_items_sends_a_complete_gzip_within_the_limit)
+    {
+        ///arrange
+        CIoTHubTransportHttpMocks mocks;
+        const size_t inflatedCapacity = TEST_INCOMPRESSIBLE_MESSAGES_COUNT * (2 * buffer13_size);
+        char* inflated = (char*)malloc(inflatedCapacity);
+        auto handle = IoTHubTransportHttp_Create(&TEST_CONFIG);
+        auto devHandle = IoTHubTransportHttp_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_CONFIG.waitingToSend);
+        ENABLE_BATCHING();
+        (void)IoTHubTransportHttp_SetOption(handle, "BatchCompression", &thisIsTrue);
+        for (size_t i = 0; i < TEST_INCOMPRESSIBLE_MESSAGES_COUNT; i++)
+        {
+            incompressibleMessages[i].messageHandle = TEST_IOTHUB_MESSAGE_HANDLE_13;
+            incompressibleMessages[i].callback = NULL;
+            incompressibleMessages[i].context = NULL;
+            BASEIMPLEMENTATION::DList_InsertTailList(&waitingToSend, &(incompressibleMessages[i].entry));
+        }
+        mocks.ResetAllCalls();
+
+        ///act
+        IoTHubTransportHttp_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        ///assert
+        size_t countNotSent = 0;
+        for (PDLIST_ENTRY entry = waitingToSend.Flink; entry != &waitingToSend; entry = entry->Flink)
+        {
+            countNotSent++;
+        }
+        ASSERT_ARE_EQUAL(size_t, 1, countSentRelativePaths);
+        ASSERT_IS_NOT_NULL(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest);
+        ASSERT_IS_TRUE(BASEIMPLEMENTATION::BUFFER_length(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest) <= MAXIMUM_MESSAGE_SIZE);
+        size_t inflatedSize = gunzip(BASEIMPLEMENTATION::BUFFER_u_char(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest), BASEIMPLEMENTATION::BUFFER_length(last_BUFFER_HANDLE_to_HTTPAPIEX_ExecuteRequest), inflated, inflatedCapacity);
+        ASSERT_IS_TRUE(inflatedSize > MAXIMUM_MESSAGE_SIZE); /*the compressed payload carries more than the JSON payload could*/
+        ASSERT_IS_TRUE(inflated[0] == '[');
+        ASSERT_IS_TRUE(inflated[inflatedSize - 1] == ']');
+        ASSERT_IS_TRUE(countNotSent > 0);
+        ASSERT_IS_TRUE(countNotSent < TEST_INCOMPRESSIBLE_MESSAGES_COUNT);
+
+        ///cleanup
+        IoTHubTransportHttp_Destroy(handle);
+        free(inflated);
+    }
+#endif
+
     END_TEST_SUITE(iothubtransporthttp)
 
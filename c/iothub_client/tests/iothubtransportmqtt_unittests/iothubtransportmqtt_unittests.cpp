@@ -7,6 +7,7 @@
 #endif
 
 #include <cstddef>
+#include <cstring>
 
 #include "azure_c_shared_utility/sastoken.h"
 
@@ -27,10 +28,10 @@
 #include "azure_c_shared_utility/xio.h"
 #include "azure_c_shared_utility/tlsio.h"
 #include "azure_c_shared_utility/platform.h"
+#include "coalescingio.h"
 
 #include "azure_c_shared_utility/tickcounter.h"
 #include "azure_c_shared_utility/lock.h"
-#include "azure_c_shared_utility/string_tokenizer.h"
 
 #define GBALLOC_H
 extern "C" int gballoc_init(void);
@@ -48,6 +49,7 @@ static const char* TEST_PROTOCOL_GATEWAY_HOSTNAME = "ssl://thisIsAGatewayHostNam
 static const char* TEST_VERY_LONG_DEVICE_ID = "1234567890ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz1234567890ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz1234567890";
 static const char* TEST_MQTT_MESSAGE_TOPIC = "devices/thisIsDeviceID/messages/devicebound/#";
 static const char* TEST_MQTT_MSG_TOPIC = "devices/jebrandoDevice/messages/devicebound/iothub-ack=Full&%24.to=%2Fdevices%2FjebrandoDevice%2Fmessages%2FdeviceBound&%24.cid&%24.uid";
+static const char* TEST_MQTT_MSG_TOPIC_W_SYS_PROP = "devices/thisIsDeviceID/messages/devicebound/%24.mid=msg%2D1&%24.cid=corr%201&propName=PropValue";
 static const char* TEST_MQTT_MSG_TOPIC_W_1_PROP = "devices/thisIsDeviceID/messages/devicebound/iothub-ack=Full&propName=PropValue&DeviceInfo=smokeTest&%24.to=%2Fdevices%2FjebrandoDevice%2Fmessages%2FdeviceBound&%24.cid&%24.uid";
 static const char* TEST_MQTT_EVENT_TOPIC = "devices/thisIsDeviceID/messages/events/";
 static const char* TEST_MQTT_SAS_TOKEN = "thisIsIotHubName.thisIsIotHubSuffix/devices/thisIsDeviceID";
@@ -67,7 +69,6 @@ static const MQTT_MESSAGE_HANDLE TEST_MQTT_MESSAGE_HANDLE = (MQTT_MESSAGE_HANDLE
 static IO_INTERFACE_DESCRIPTION* TEST_IO_INTERFACE = (IO_INTERFACE_DESCRIPTION*)0x1125;
 static XIO_HANDLE TEST_XIO_HANDLE = (XIO_HANDLE)0x1126;
 
-static const STRING_TOKENIZER_HANDLE TEST_STRING_TOKENIZER_HANDLE = (STRING_TOKENIZER_HANDLE)0x1127;
 
 /*this is the default message and has type BYTEARRAY*/
 static IOTHUB_MESSAGE_HANDLE TEST_IOTHUB_MSG_BYTEARRAY = (IOTHUB_MESSAGE_HANDLE)0x01d1;
@@ -86,7 +87,6 @@ static IOTHUB_CLIENT_CONFIG g_iothubClientConfig = { 0 };
 static DLIST_ENTRY g_waitingToSend;
 
 static uint64_t g_current_ms;
-static size_t g_tokenizerIndex;
 
 #define TEST_TIME_T ((time_t)-1)
 
@@ -150,6 +150,10 @@ static ON_MQTT_MESSAGE_RECV_CALLBACK g_fnMqttMsgRecv;
 static ON_MQTT_OPERATION_CALLBACK g_fnMqttOperationCallback;
 static void* g_callbackCtx;
 static bool g_nullMapVariable;
+static size_t g_trustedCertsSetCount;
+static size_t g_publishCount;
+static size_t g_sendCompleteSucceededCount;
+static size_t g_sendCompleteFailedCount;
 
 TYPED_MOCK_CLASS(CIoTHubTransportMqttMocks, CGlobalMock)
 {
@@ -258,7 +262,18 @@ public:
     MOCK_STATIC_METHOD_2(, IOTHUBMESSAGE_DISPOSITION_RESULT, IoTHubClient_LL_MessageCallback, IOTHUB_CLIENT_LL_HANDLE, handle, IOTHUB_MESSAGE_HANDLE, message)
     MOCK_METHOD_END(IOTHUBMESSAGE_DISPOSITION_RESULT, IOTHUBMESSAGE_ACCEPTED)
 
+    MOCK_STATIC_METHOD_1(, void, IoTHubClient_LL_ConnectionReady, IOTHUB_CLIENT_LL_HANDLE, handle)
+    MOCK_VOID_METHOD_END()
+
     MOCK_STATIC_METHOD_3(, void, IoTHubClient_LL_SendComplete, IOTHUB_CLIENT_LL_HANDLE, handle, PDLIST_ENTRY, completed, IOTHUB_BATCHSTATE_RESULT, result2)
+        if (result2 == IOTHUB_BATCHSTATE_SUCCESS)
+        {
+            g_sendCompleteSucceededCount++;
+        }
+        else
+        {
+            g_sendCompleteFailedCount++;
+        }
     MOCK_VOID_METHOD_END()
 
     /* IoTHubMessage mocks */
@@ -315,6 +330,12 @@ public:
     MOCK_STATIC_METHOD_1(, MAP_HANDLE, IoTHubMessage_Properties, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle)
     MOCK_METHOD_END(MAP_HANDLE, TEST_MESSAGE_PROP_MAP)
 
+    MOCK_STATIC_METHOD_2(, IOTHUB_MESSAGE_RESULT, IoTHubMessage_SetMessageId, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle, const char*, messageId)
+    MOCK_METHOD_END(IOTHUB_MESSAGE_RESULT, IOTHUB_MESSAGE_OK)
+
+    MOCK_STATIC_METHOD_2(, IOTHUB_MESSAGE_RESULT, IoTHubMessage_SetCorrelationId, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle, const char*, correlationId)
+    MOCK_METHOD_END(IOTHUB_MESSAGE_RESULT, IOTHUB_MESSAGE_OK)
+
     MOCK_STATIC_METHOD_4(, MAP_RESULT, Map_GetInternals, MAP_HANDLE, handle, const char*const**, keys, const char*const**, values, size_t*, count);
         if (g_nullMapVariable)
         {
@@ -353,6 +374,7 @@ public:
     MOCK_METHOD_END(int, 0);
 
     MOCK_STATIC_METHOD_2(, int, mqtt_client_publish, MQTT_CLIENT_HANDLE, handle, MQTT_MESSAGE_HANDLE, msgHandle)
+        g_publishCount++;
     MOCK_METHOD_END(int, 0);
 
     MOCK_STATIC_METHOD_1(, void, mqtt_client_dowork, MQTT_CLIENT_HANDLE, handle)
@@ -373,42 +395,8 @@ public:
     MOCK_STATIC_METHOD_1(, void, mqttmessage_destroy, MQTT_MESSAGE_HANDLE, handle)
     MOCK_VOID_METHOD_END()
 
-    MOCK_STATIC_METHOD_1(, STRING_TOKENIZER_HANDLE, STRING_TOKENIZER_create, STRING_HANDLE, handle)
-    MOCK_METHOD_END(STRING_TOKENIZER_HANDLE, TEST_STRING_TOKENIZER_HANDLE);
-
-    MOCK_STATIC_METHOD_3(, int, STRING_TOKENIZER_get_next_token, STRING_TOKENIZER_HANDLE, t, STRING_HANDLE, output, const char*, delimiters)
-        const char* text = NULL;
-        switch (g_tokenizerIndex++)
-        {
-            case 0:
-                break;
-            case 1:
-                text = "devices/thisIsDeviceID/messages/devicebound/iothub-ack=Full";
-                break;
-            case 2:
-                text = "propname1=value2";
-                break;
-            case 3:
-                text = "propname2=value2";
-                break;
-            case 4:
-                text = "%24.to=%2Fdevices%2FjebrandoDevice%2Fmessages%2FdeviceBound&%24.cid";
-                break;
-            case 5:
-                text = "%24.cid";
-                break;
-            case 6:
-                text = ""; // Done
-                break;
-        }
-        if (text != NULL)
-        {
-            BASEIMPLEMENTATION::STRING_copy(output, text);
-        }
-    MOCK_METHOD_END(int, 0);
-
-    MOCK_STATIC_METHOD_1(, void, STRING_TOKENIZER_destroy, STRING_TOKENIZER_HANDLE, handle)
-    MOCK_VOID_METHOD_END()
+    MOCK_STATIC_METHOD_2(, int, mqttmessage_setIsDuplicateMsg, MQTT_MESSAGE_HANDLE, handle, bool, duplicateMsg)
+    MOCK_METHOD_END(int, 0)
 
     MOCK_STATIC_METHOD_4(, STRING_HANDLE, SASToken_Create, STRING_HANDLE, key, STRING_HANDLE, scope, STRING_HANDLE, keyName, size_t, expiry)
     MOCK_METHOD_END(STRING_HANDLE, BASEIMPLEMENTATION::STRING_construct(TEST_SAS_TOKEN) );
@@ -425,6 +413,9 @@ public:
     MOCK_STATIC_METHOD_0(, const IO_INTERFACE_DESCRIPTION*, platform_get_default_tlsio)
     MOCK_METHOD_END(const IO_INTERFACE_DESCRIPTION*, TEST_IO_INTERFACE)
 
+    MOCK_STATIC_METHOD_0(, const IO_INTERFACE_DESCRIPTION*, coalescingio_get_interface_description)
+    MOCK_METHOD_END(const IO_INTERFACE_DESCRIPTION*, TEST_IO_INTERFACE)
+
     MOCK_STATIC_METHOD_3(, XIO_HANDLE, xio_create, const IO_INTERFACE_DESCRIPTION*, io_interface_description, const void*, xio_create_parameters, LOGGER_LOG, logger_log)
     MOCK_METHOD_END(XIO_HANDLE, TEST_XIO_HANDLE);
 
@@ -432,8 +423,21 @@ public:
     MOCK_METHOD_END(int, 0);
 
     MOCK_STATIC_METHOD_3(, int, xio_setoption, XIO_HANDLE, xio, const char*, optionName, const void*, value)
+        if (optionName != NULL && strcmp(optionName, "TrustedCerts") == 0)
+        {
+            g_trustedCertsSetCount++;
+        }
     MOCK_METHOD_END(int, 0)
 
+    MOCK_STATIC_METHOD_5(, int, xio_open, XIO_HANDLE, xio, ON_IO_OPEN_COMPLETE, on_io_open_complete, ON_BYTES_RECEIVED, on_bytes_received, ON_IO_ERROR, on_io_error, void*, callback_context)
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_5(, int, xio_send, XIO_HANDLE, xio, const void*, buffer, size_t, size, ON_SEND_COMPLETE, on_send_complete, void*, callback_context)
+    MOCK_METHOD_END(int, 0)
+
+    MOCK_STATIC_METHOD_1(, void, xio_dowork, XIO_HANDLE, xio)
+    MOCK_VOID_METHOD_END()
+
     MOCK_STATIC_METHOD_1(, void, xio_destroy, XIO_HANDLE, ioHandle)
     MOCK_VOID_METHOD_END();
 
@@ -455,11 +459,15 @@ public:
 DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportMqttMocks, , const IO_INTERFACE_DESCRIPTION*, tlsio_schannel_get_interface_description);
 DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportMqttMocks, , const IO_INTERFACE_DESCRIPTION*, tlsio_openssl_get_interface_description);
 DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportMqttMocks, , const IO_INTERFACE_DESCRIPTION*, platform_get_default_tlsio);
+DECLARE_GLOBAL_MOCK_METHOD_0(CIoTHubTransportMqttMocks, , const IO_INTERFACE_DESCRIPTION*, coalescingio_get_interface_description);
 
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportMqttMocks, , XIO_HANDLE, xio_create, const IO_INTERFACE_DESCRIPTION*, io_interface_description, const void*, xio_create_parameters, LOGGER_LOG, logger_log);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , void, xio_destroy, XIO_HANDLE, ioHandle);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportMqttMocks, , int, xio_close, XIO_HANDLE, ioHandle, ON_IO_CLOSE_COMPLETE, on_io_close_complete, void*, callback_context);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportMqttMocks, , int, xio_setoption, XIO_HANDLE, xio, const char*, optionName, const void*, value);
+DECLARE_GLOBAL_MOCK_METHOD_5(CIoTHubTransportMqttMocks, , int, xio_open, XIO_HANDLE, xio, ON_IO_OPEN_COMPLETE, on_io_open_complete, ON_BYTES_RECEIVED, on_bytes_received, ON_IO_ERROR, on_io_error, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_5(CIoTHubTransportMqttMocks, , int, xio_send, XIO_HANDLE, xio, const void*, buffer, size_t, size, ON_SEND_COMPLETE, on_send_complete, void*, callback_context);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , void, xio_dowork, XIO_HANDLE, xio);
 
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , void, DList_InitializeListHead, PDLIST_ENTRY, listHead);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , int, DList_IsListEmpty, PDLIST_ENTRY, listHead);
@@ -490,6 +498,8 @@ DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , IOTHUBMESSAGE_CONTENT_
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , const char*, IoTHubMessage_GetString, IOTHUB_MESSAGE_HANDLE, handle);
 
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , MAP_HANDLE, IoTHubMessage_Properties, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportMqttMocks, , IOTHUB_MESSAGE_RESULT, IoTHubMessage_SetMessageId, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle, const char*, messageId);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportMqttMocks, , IOTHUB_MESSAGE_RESULT, IoTHubMessage_SetCorrelationId, IOTHUB_MESSAGE_HANDLE, iotHubMessageHandle, const char*, correlationId);
 
 DECLARE_GLOBAL_MOCK_METHOD_4(CIoTHubTransportMqttMocks, , MQTT_CLIENT_HANDLE, mqtt_client_init, ON_MQTT_MESSAGE_RECV_CALLBACK, msgRecv, ON_MQTT_OPERATION_CALLBACK, opCallback, void*, callbackCtx, LOGGER_LOG, logger);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportMqttMocks, , int, mqtt_client_connect, MQTT_CLIENT_HANDLE, handle, XIO_HANDLE, xioHandle, MQTT_CLIENT_OPTIONS*, mqttOptions);
@@ -505,10 +515,8 @@ DECLARE_GLOBAL_MOCK_METHOD_5(CIoTHubTransportMqttMocks, , MQTT_MESSAGE_HANDLE, m
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , const APP_PAYLOAD*, mqttmessage_getApplicationMsg, MQTT_MESSAGE_HANDLE, handle);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , const char*, mqttmessage_getTopicName, MQTT_MESSAGE_HANDLE, handle);
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , void, mqttmessage_destroy, MQTT_MESSAGE_HANDLE, handle);
+DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportMqttMocks, , int, mqttmessage_setIsDuplicateMsg, MQTT_MESSAGE_HANDLE, handle, bool, duplicateMsg);
 
-DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , STRING_TOKENIZER_HANDLE, STRING_TOKENIZER_create, STRING_HANDLE, handle);
-DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportMqttMocks, , int, STRING_TOKENIZER_get_next_token, STRING_TOKENIZER_HANDLE, t, STRING_HANDLE, output, const char*, delimiters);
-DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , void, STRING_TOKENIZER_destroy, STRING_TOKENIZER_HANDLE, handle);
 
 DECLARE_GLOBAL_MOCK_METHOD_4(CIoTHubTransportMqttMocks, , MAP_RESULT, Map_GetInternals, MAP_HANDLE, handle, const char*const**, keys, const char*const**, values, size_t*, count);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportMqttMocks, , MAP_RESULT, Map_AddOrUpdate, MAP_HANDLE, handle, const char*, key, const char*, value);
@@ -517,6 +525,7 @@ DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , void, Map_Destroy, MAP
 DECLARE_GLOBAL_MOCK_METHOD_4(CIoTHubTransportMqttMocks, , STRING_HANDLE, SASToken_Create, STRING_HANDLE, key, STRING_HANDLE, scope, STRING_HANDLE, keyName, size_t, expiry);
 
 DECLARE_GLOBAL_MOCK_METHOD_2(CIoTHubTransportMqttMocks, , IOTHUBMESSAGE_DISPOSITION_RESULT, IoTHubClient_LL_MessageCallback, IOTHUB_CLIENT_LL_HANDLE, handle, IOTHUB_MESSAGE_HANDLE, message);
+DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , void, IoTHubClient_LL_ConnectionReady, IOTHUB_CLIENT_LL_HANDLE, handle);
 DECLARE_GLOBAL_MOCK_METHOD_3(CIoTHubTransportMqttMocks, , void, IoTHubClient_LL_SendComplete, IOTHUB_CLIENT_LL_HANDLE, handle, PDLIST_ENTRY, completed, IOTHUB_BATCHSTATE_RESULT, result2);
 
 DECLARE_GLOBAL_MOCK_METHOD_1(CIoTHubTransportMqttMocks, , time_t, get_time, time_t*, currentTime);
@@ -577,8 +586,11 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
        g_callbackCtx = NULL;
 
        g_current_ms = 0;
-       g_tokenizerIndex = 0;
        g_nullMapVariable = true;
+       g_trustedCertsSetCount = 0;
+       g_publishCount = 0;
+       g_sendCompleteSucceededCount = 0;
+       g_sendCompleteFailedCount = 0;
 
        BASEIMPLEMENTATION::DList_InitializeListHead(&g_waitingToSend);
     }
@@ -604,6 +616,9 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         config->upperConfig = &g_iothubClientConfig;
     }
 
+#ifndef USE_MQTT_STATIC_POOLS
+    // These tests expect the allocations of the default build; the USE_MQTT_STATIC_POOLS build runs the pool tests at the end of the suite.
+
     /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_001: [If parameter config is NULL then IoTHubTransportMqtt_Create shall return NULL.] */
     TEST_FUNCTION(IoTHubTransportMqtt_Create_with_NULL_parameter_Succeed)
     {
@@ -1125,6 +1140,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
             .IgnoreArgument(2)
             .IgnoreArgument(3);
         EXPECTED_CALL(mocks, gballoc_free(NULL));
+        EXPECTED_CALL(mocks, gballoc_free(NULL));
         STRICT_EXPECTED_CALL(mocks, xio_destroy(TEST_XIO_HANDLE));
         STRICT_EXPECTED_CALL(mocks, tickcounter_destroy(TEST_COUNTER_HANDLE));
 
@@ -1175,6 +1191,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         STRICT_EXPECTED_CALL(mocks, mqtt_client_deinit(TEST_MQTT_CLIENT_HANDLE));
         EXPECTED_CALL(mocks, gballoc_free(NULL));
         EXPECTED_CALL(mocks, gballoc_free(NULL));
+        EXPECTED_CALL(mocks, gballoc_free(NULL));
         STRICT_EXPECTED_CALL(mocks, xio_destroy(TEST_XIO_HANDLE));
         STRICT_EXPECTED_CALL(mocks, tickcounter_destroy(TEST_COUNTER_HANDLE));
 
@@ -1208,7 +1225,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         STRICT_EXPECTED_CALL(mocks, mqtt_client_deinit(TEST_MQTT_CLIENT_HANDLE));
         STRICT_EXPECTED_CALL(mocks, mqtt_client_disconnect(TEST_MQTT_CLIENT_HANDLE));
         EXPECTED_CALL(mocks, xio_destroy(NULL));
-        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG)).ExpectedTimesExactly(2);
         STRICT_EXPECTED_CALL(mocks, tickcounter_destroy(TEST_COUNTER_HANDLE));
 
         // act
@@ -1358,6 +1375,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
             .IgnoreArgument(3);
         EXPECTED_CALL(mocks, STRING_c_str(NULL)).SetReturn(TEST_MQTT_MESSAGE_TOPIC);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE)).ExpectedAtLeastTimes(2);
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -1621,6 +1640,216 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_133: [If the option parameter is set to "eagerConnect" then the value shall be a bool_ptr and the value will determine if IoTHubClient_LL_ConnectionReady is called once the connection is ready.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_eagerConnect_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        bool eagerConnect = true;
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "eagerConnect", &eagerConnect);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_143: [If the option parameter is set to "telemetry_qos" then the value shall be an int_ptr of 0 or 1 selecting the QoS used to publish events; any other value shall return IOTHUB_CLIENT_INVALID_ARG.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_telemetry_qos_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        int qos = 0;
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "telemetry_qos", &qos);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_143: [If the option parameter is set to "telemetry_qos" then the value shall be an int_ptr of 0 or 1 selecting the QoS used to publish events; any other value shall return IOTHUB_CLIENT_INVALID_ARG.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_telemetry_qos_2_fails)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        int qos = 2;
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "telemetry_qos", &qos);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_153: [If the option parameter is set to "publish_cork_size" then the value shall be a size_t_ptr setting the number of bytes of MQTT packets collected into one write while IoTHubTransportMqtt_DoWork publishes; 0 disables the corking.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_publish_cork_size_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        size_t corkSize = 16 * 1024;
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "publish_cork_size", &corkSize);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_153: [If the option parameter is set to "publish_cork_size" then the value shall be a size_t_ptr setting the number of bytes of MQTT packets collected into one write while IoTHubTransportMqtt_DoWork publishes; 0 disables the corking.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_publish_cork_size_wraps_existing_io)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "AnOption", (void*)42);
+        mocks.ResetAllCalls();
+
+        size_t corkSize = 16 * 1024;
+        STRICT_EXPECTED_CALL(mocks, coalescingio_get_interface_description());
+        EXPECTED_CALL(mocks, xio_create(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "publish_cork_size", &corkSize);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_153: [If the option parameter is set to "publish_cork_size" then the value shall be a size_t_ptr setting the number of bytes of MQTT packets collected into one write while IoTHubTransportMqtt_DoWork publishes; 0 disables the corking.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_publish_cork_size_xio_create_fail)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "AnOption", (void*)42);
+        mocks.ResetAllCalls();
+
+        size_t corkSize = 16 * 1024;
+        STRICT_EXPECTED_CALL(mocks, coalescingio_get_interface_description());
+        EXPECTED_CALL(mocks, xio_create(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .SetReturn((XIO_HANDLE)NULL);
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "publish_cork_size", &corkSize);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_ERROR, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_138: [If the option parameter is set to "max_inflight_messages" or "max_inflight_bytes" then the value shall be a size_t_ptr limiting the unacknowledged publishes; 0 removes the limit.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_max_inflight_messages_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        size_t maxInflight = 10;
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "max_inflight_messages", &maxInflight);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_139: [If the option parameter is set to "messages_per_second" or "bytes_per_second" then the value shall be a size_t_ptr setting the token bucket rate for new publishes, starting with a full bucket; 0 disables pacing.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Setoption_messages_per_second_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        size_t messagesPerSecond = 100;
+
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+
+        // act
+        auto result = IoTHubTransportMqtt_SetOption(handle, "messages_per_second", &messagesPerSecond);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, result);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
     /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_038: [If the client is connected when the keepalive is set then IoTHubTransportMqtt_SetOption shall disconnect and reconnect with the specified keepalive value.] */
     TEST_FUNCTION(IoTHubTransportMqtt_Setoption_keepAlive_previous_connection_succeed)
     {
@@ -1819,9 +2048,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
             .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
         EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
 
         // act
@@ -1851,7 +2078,6 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
 
         const size_t propCount = 1;
         const char* TOPIC_PROPERTY_VALUE = "devices/thisIsDeviceID/messages/events/propKey1=propValue1";
-        const char* PROPERTY_VALUE = "propKey1=propValue1";
         const char* keys[propCount] = { "propKey1" };
         const char* values[propCount] = { "propValue1" };
 
@@ -1864,9 +2090,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
-            .ExpectedTimesExactly(2);
-        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
             .IgnoreArgument(2)
@@ -1885,15 +2110,10 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
             .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, STRING_concat(IGNORED_PTR_ARG, PROPERTY_VALUE))
-            .IgnoreArgument(1);
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
         STRICT_EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
             .CopyOutArgumentBuffer(2, &ppKeys, sizeof(ppKeys) )
             .CopyOutArgumentBuffer(3, &ppValues, sizeof(ppValues) )
             .CopyOutArgumentBuffer(4, &propCount, sizeof(propCount) );
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -1923,7 +2143,6 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         const size_t propCount = 2;
 
         const char* TOPIC_PROPERTY_VALUE = "devices/thisIsDeviceID/messages/events/propKey1=propValue1&propKey2=propValue2";
-        const char* PROPERTY_VALUE = "propKey1=propValue1&propKey2=propValue2";
 
         const char* keys[propCount] = { "propKey1", "propKey2" };
         const char* values[propCount] = { "propValue1", "propValue2" };
@@ -1936,10 +2155,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
-            .ExpectedTimesExactly(3);
-        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(2);
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
             .IgnoreArgument(2)
@@ -1958,14 +2175,10 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
             .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY)).SetReturn(TEST_MESSAGE_PROP_MAP);
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
         STRICT_EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
             .CopyOutArgumentBuffer(2, &ppKeys, sizeof(ppKeys))
             .CopyOutArgumentBuffer(3, &ppValues, sizeof(ppValues))
             .CopyOutArgumentBuffer(4, &propCount, sizeof(propCount));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_concat(IGNORED_PTR_ARG, IGNORED_PTR_ARG)).ExpectedTimesExactly(2);
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -1977,7 +2190,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_1_event_item_with_properties_STRING_concat_fail)
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_1_event_item_Map_GetInternals_fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -1990,47 +2203,33 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
 
-        g_nullMapVariable = false;
-
-        const size_t propCount = 1;
-        const char* TOPIC_PROPERTY_VALUE = "devices/thisIsDeviceID/messages/events/propKey1=propValue1";
-        const char* PROPERTY_VALUE = "propKey1=propValue1";
-        const char* keys[propCount] = { "propKey1" };
-        const char* values[propCount] = { "propValue1" };
-
-        const char* const** ppKeys = (const char* const**)&keys;
-        const char* const** ppValues = (const char* const**)&values;
-
         DList_InsertTailList(config.waitingToSend, &(message1.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG)).ExpectedTimesExactly(2);
-        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
             .IgnoreArgument(2)
             .IgnoreArgument(3);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
         EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
         EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
 
         EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
         EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_SUCCESS));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
+            .IgnoreArgument(2);
 
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, STRING_concat(IGNORED_PTR_ARG, PROPERTY_VALUE))
-            .IgnoreArgument(1)
-            .SetReturn(__LINE__);
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
         STRICT_EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .CopyOutArgumentBuffer(2, &ppKeys, sizeof(ppKeys))
-            .CopyOutArgumentBuffer(3, &ppValues, sizeof(ppValues))
-            .CopyOutArgumentBuffer(4, &propCount, sizeof(propCount));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
+            .IgnoreArgument(2)
+            .IgnoreArgument(3)
+            .IgnoreArgument(4)
+            .SetReturn(MAP_ERROR);
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2042,7 +2241,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_no_subscribe_succeeds)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_141: [IoTHubTransportMqtt_DoWork shall encode the event topic and the url encoded message properties into a buffer kept by the transport and only grow it when it is too small.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_1_event_item_with_reserved_chars_in_properties_url_encodes)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2050,19 +2250,51 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
-        CONNECT_ACK connack;
-        connack.isSessionPresent = false;
-        connack.returnCode = CONNECTION_ACCEPTED;
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
 
+        g_nullMapVariable = false;
 
-        //DList_InsertTailList(config.waitingToSend, &(message1.entry));
-        auto handle = IoTHubTransportMqtt_Create(&config);
+        const size_t propCount = 1;
+        const char* TOPIC_PROPERTY_VALUE = "devices/thisIsDeviceID/messages/events/prop%20Key=a%26b%3Dc";
+        const char* keys[propCount] = { "prop Key" };
+        const char* values[propCount] = { "a&b=c" };
 
+        const char* const** ppKeys = (const char* const**)&keys;
+        const char* const** ppValues = (const char* const**)&values;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
         mocks.ResetAllCalls();
 
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(3);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, TOPIC_PROPERTY_VALUE, DELIVER_AT_LEAST_ONCE, appMessage, appMsgSize))
+            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &ppKeys, sizeof(ppKeys))
+            .CopyOutArgumentBuffer(3, &ppValues, sizeof(ppValues))
+            .CopyOutArgumentBuffer(4, &propCount, sizeof(propCount));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2074,10 +2306,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_027: [IoTHubTransportMqtt_DoWork shall inspect the waitingToSend DLIST passed in config structure.] */
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_029: [IoTHubTransportMqtt_DoWork shall create a MQTT_MESSAGE_HANDLE and pass this to a call to mqtt_client_publish.] */
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_1_event_item_STRING_type_succeeds)
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_no_subscribe_succeeds)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2085,39 +2314,19 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
-        SUBSCRIBE_ACK suback;
-        suback.packetId = 1234;
-        suback.qosCount = 1;
-        suback.qosReturn = QosValue;
+        CONNECT_ACK connack;
+        connack.isSessionPresent = false;
+        connack.returnCode = CONNECTION_ACCEPTED;
 
-        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+
+        //DList_InsertTailList(config.waitingToSend, &(message1.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
         mocks.ResetAllCalls();
 
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString) ))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_STRING));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2129,41 +2338,56 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_033: [IoTHubTransportMqtt_DoWork shall iterate through the Waiting Acknowledge messages looking for any message that has been waiting longer than 2 min.]*/
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_no_resend_message_succeeds)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_134: [If "eagerConnect" is set, IoTHubTransportMqtt_DoWork shall call IoTHubClient_LL_ConnectionReady once per connection, when the transport is able to publish (after the subscription is acknowledged, if subscribed).] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_eagerConnect_reports_the_connection_ready_once_after_the_CONNACK)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
-        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
-        SUBSCRIBE_ACK suback;
-        suback.packetId = 1234;
-        suback.qosCount = 1;
-        suback.qosReturn = QosValue;
+        CONNECT_ACK connack;
+        connack.isSessionPresent = false;
+        connack.returnCode = CONNECTION_ACCEPTED;
+        bool eagerConnect = true;
 
-        DList_InsertTailList(config.waitingToSend, &(message2.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        (void)IoTHubTransportMqtt_SetOption(handle, "eagerConnect", &eagerConnect);
+
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_ConnectionReady(TEST_IOTHUB_CLIENT_LL_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE))
+            .ExpectedTimesExactly(2);
+
+        // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_134: [If "eagerConnect" is set, IoTHubTransportMqtt_DoWork shall call IoTHubClient_LL_ConnectionReady once per connection, when the transport is able to publish (after the subscription is acknowledged, if subscribed).] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_eagerConnect_does_not_report_the_connection_ready_before_the_CONNACK)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        bool eagerConnect = true;
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "eagerConnect", &eagerConnect);
         mocks.ResetAllCalls();
 
-        //EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
-        //STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
-        //STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
-        //STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
-        //    .IgnoreArgument(1)
-        //    .IgnoreArgument(2);
-        //STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
-        //    .IgnoreArgument(2);
-        //STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-        //    .IgnoreArgument(1)
-        //    .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
-            .IgnoreArgument(2);
+        SetupMocksForInitConnection(mocks);
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2175,8 +2399,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_033: [IoTHubTransportMqtt_DoWork shall iterate through the Waiting Acknowledge messages looking for any message that has been waiting longer than 2 min.]*/
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_resend_message_succeeds)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_162: [If the CONNACK reports a session present and the message topic subscription was acknowledged before, the transport shall not subscribe again and shall be ready to publish.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_reconnect_with_session_present_skips_subscribe)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2188,35 +2412,24 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.packetId = 1234;
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
+        CONNECT_ACK connack = { false, CONNECTION_ACCEPTED };
+        CONNECT_ACK sessionConnack = { true, CONNECTION_ACCEPTED };
 
-        DList_InsertTailList(config.waitingToSend, &(message2.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_Subscribe(handle);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &sessionConnack, g_callbackCtx);
         mocks.ResetAllCalls();
 
-        g_current_ms = 5*60*1000;
-
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
-            .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
             .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_STRING));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2228,8 +2441,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_034: [If IoTHubTransportMqtt_DoWork has resent the message two times then it shall fail the message] */
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_resend_max_recount_reached_message_succeeds)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_174: [On a transport error the subscription state shall be kept, so that a CONNACK reporting a session present does not subscribe again; only a CONNACK reporting no session shall clear it.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_reconnect_after_error_with_session_present_skips_subscribe)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2241,28 +2454,24 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.packetId = 1234;
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
+        CONNECT_ACK connack = { false, CONNECTION_ACCEPTED };
+        CONNECT_ACK sessionConnack = { true, CONNECTION_ACCEPTED };
 
-        DList_InsertTailList(config.waitingToSend, &(message2.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_Subscribe(handle);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
-        for (size_t index = 0; index < 3; index++)
-        {
-            IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
-            g_current_ms = 3 * index * 60 * 1000;
-        }
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_ERROR, NULL, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &sessionConnack, g_callbackCtx);
         mocks.ResetAllCalls();
 
-        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
-        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
         STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
             .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, gballoc_free(NULL));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2274,8 +2483,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_GetString_fails)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_163: [If the CONNACK reports no session present, the transport shall subscribe to the message topic again if it receives messages.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_reconnect_without_session_subscribes_again)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2287,15 +2496,24 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.packetId = 1234;
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
+        CONNECT_ACK connack = { false, CONNECTION_ACCEPTED };
 
-        DList_InsertTailList(config.waitingToSend, &(message2.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_Subscribe(handle);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING)).SetReturn((const char*)NULL);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_subscribe(TEST_MQTT_CLIENT_HANDLE, IGNORED_NUM_ARG, IGNORED_PTR_ARG, 1))
+            .IgnoreArgument(2)
+            .IgnoreArgument(3);
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
 
         // act
@@ -2307,9 +2525,10 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
-    
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_GetByteArray_Error_fail)
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_164: [On CONNACK every message in the Waiting Acknowledge list shall be due for resend, with its original packet id and topic, the next time IoTHubTransportMqtt_DoWork publishes.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_172: [A resent message shall be published with the DUP flag set.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_after_CONNACK_resends_unacked_message_with_its_packetId_and_the_DUP_flag)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2321,19 +2540,32 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.packetId = 1234;
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
+        CONNECT_ACK connack = { true, CONNECTION_ACCEPTED };
 
-        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreArgument(2)
-            .IgnoreArgument(3)
-            .SetReturn(IOTHUB_MESSAGE_ERROR);
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(1, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_setIsDuplicateMsg(TEST_MQTT_MESSAGE_HANDLE, true));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2345,8 +2577,9 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_mqtt_client_publish_fails)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_164: [On CONNACK every message in the Waiting Acknowledge list shall be due for resend, with its original packet id and topic, the next time IoTHubTransportMqtt_DoWork publishes.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_173: [The resend that follows a CONNACK shall not count as a resend of the message, and shall be done even for a message that has already been resent two times.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_after_CONNACK_resends_a_message_that_was_already_resent_two_times)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2358,40 +2591,35 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.packetId = 1234;
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
+        CONNECT_ACK connack = { true, CONNECTION_ACCEPTED };
 
-        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        // the timed resend is the last one allowed for the message
+        g_current_ms = 5 * 60 * 1000;
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreArgument(2)
-            .IgnoreArgument(3);
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, appMessage, appMsgSize))
-            .IgnoreArgument(1)
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(1, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
             .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_setIsDuplicateMsg(TEST_MQTT_MESSAGE_HANDLE, true));
         STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
-            .IgnoreArgument(2)
-            .SetReturn(__LINE__);
-        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreArgument(1)
             .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
             .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
-        EXPECTED_CALL(mocks, gballoc_free(NULL));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
         STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2403,8 +2631,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_mqttmessage_create_fails)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_173: [The resend that follows a CONNACK shall not count as a resend of the message, and shall be done even for a message that has already been resent two times.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_resend_after_CONNACK_is_not_counted_as_a_resend)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2416,37 +2644,1131 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.packetId = 1234;
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
+        CONNECT_ACK connack = { true, CONNECTION_ACCEPTED };
 
-        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
-        mocks.ResetAllCalls();
-
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        g_current_ms = 5 * 60 * 1000;
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(1, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_setIsDuplicateMsg(TEST_MQTT_MESSAGE_HANDLE, true));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_027: [IoTHubTransportMqtt_DoWork shall inspect the waitingToSend DLIST passed in config structure.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_029: [IoTHubTransportMqtt_DoWork shall create a MQTT_MESSAGE_HANDLE and pass this to a call to mqtt_client_publish.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_1_event_item_STRING_type_succeeds)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString) ))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_STRING));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_033: [IoTHubTransportMqtt_DoWork shall iterate through the Waiting Acknowledge messages, in resend deadline order, stopping at the first message whose deadline has not passed.]*/
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_no_resend_message_succeeds)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        //EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        //STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        //STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        //STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
+        //    .IgnoreArgument(1)
+        //    .IgnoreArgument(2);
+        //STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+        //    .IgnoreArgument(2);
+        //STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+        //    .IgnoreArgument(1)
+        //    .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_151: [If "publish_cork_size" is not 0, IoTHubTransportMqtt_DoWork shall cork the MQTT cork layer before publishing and uncork it, sending the collected packets in one write, once the Waiting Acknowledge and waitingToSend lists have been processed.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_publish_cork_corks_and_uncorks)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        size_t corkSize = 16 * 1024;
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "publish_cork_size", &corkSize);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, xio_setoption(TEST_XIO_HANDLE, COALESCINGIO_OPTION_HOLD_WRITES, IGNORED_PTR_ARG))
+            .IgnoreArgument(3)
+            .ExpectedTimesExactly(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_144: [If "telemetry_qos" is 0, IoTHubTransportMqtt_DoWork shall publish the message with DELIVER_AT_MOST_ONCE and complete it as soon as mqtt_client_publish returns, without adding it to the Waiting Acknowledge list.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_telemetry_qos_0_completes_without_ack)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        int qos = 0;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "telemetry_qos", &qos);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
         STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
             .IgnoreArgument(2)
             .IgnoreArgument(3);
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, appMessage, appMsgSize))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2)
-            .SetReturn( (MQTT_MESSAGE_HANDLE)NULL);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(0, TEST_MQTT_EVENT_TOPIC, DELIVER_AT_MOST_ONCE, appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
         EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreArgument(1)
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_SUCCESS))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_140: [IoTHubTransportMqtt_DoWork shall stop publishing new messages, leaving them in waitingToSend in order, while the in-flight window is full or the pacing token buckets are empty.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_inflight_window_full_does_not_publish)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        size_t maxInflight = 1;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "max_inflight_messages", &maxInflight);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_033: [IoTHubTransportMqtt_DoWork shall iterate through the Waiting Acknowledge messages, in resend deadline order, stopping at the first message whose deadline has not passed.]*/
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_resend_message_succeeds)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        g_current_ms = 5*60*1000;
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_setIsDuplicateMsg(TEST_MQTT_MESSAGE_HANDLE, true));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_145: [On PUBACK of a message that was sent only once, the transport shall update its smoothed round trip time and variance and derive the retransmit timeout from them, bounded between 1 s and 2 min.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_146: [Each send shall schedule the resend of the message at the retransmit timeout, doubled for every previous send of the same message and capped at 2 min.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_resend_uses_measured_round_trip)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        PUBLISH_ACK puback;
+        puback.packetId = 1;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        // 2 s round trip gives a retransmit timeout of 2 s + 4 * 1 s
+        g_current_ms = 2000;
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback, g_callbackCtx);
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        g_current_ms = 2000 + 6000 + 1;
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(2, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_setIsDuplicateMsg(TEST_MQTT_MESSAGE_HANDLE, true));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_145: [On PUBACK of a message that was sent only once, the transport shall update its smoothed round trip time and variance and derive the retransmit timeout from them, bounded between 1 s and 2 min.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_175: [A message resent after a CONNACK shall not be taken as sent only once, even though that resend is not counted as a resend of the message.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_PUBACK_of_a_message_resent_after_CONNACK_does_not_measure_the_round_trip)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+        CONNECT_ACK connack = { true, CONNECTION_ACCEPTED };
+
+        PUBLISH_ACK puback;
+        puback.packetId = 1;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        // the PUBACK may answer either send: taken as a 500 ms round trip it would give a retransmit timeout of 1.5 s
+        g_current_ms = 500;
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback, g_callbackCtx);
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        g_current_ms = 500 + 1500 + 1;
+
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_034: [If IoTHubTransportMqtt_DoWork has resent the message two times then it shall fail the message] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_resend_max_recount_reached_message_succeeds)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        for (size_t index = 0; index < 3; index++)
+        {
+            IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+            g_current_ms = 3 * index * 60 * 1000;
+        }
+        mocks.ResetAllCalls();
+
+        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, gballoc_free(NULL));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_168: [A message shall not be failed for lack of acknowledgement sooner than 2 min after it was first published, whatever the retransmit timeout: the last allowed send shall schedule its deadline no earlier than that.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_minimum_retransmit_timeout_accepts_a_PUBACK_after_3_seconds)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        PUBLISH_ACK puback1;
+        puback1.packetId = 1;
+        PUBLISH_ACK puback2;
+        puback2.packetId = 2;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        // an immediate PUBACK brings the retransmit timeout down to its 1 s minimum
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback1, g_callbackCtx);
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        // the resend after 1 s is the last one allowed
+        g_current_ms = 1000 + 1;
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_current_ms = 3000 + 500;
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG))
+            .IgnoreAllArguments();
+        STRICT_EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG))
+            .IgnoreAllArguments();
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreAllArguments();
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_SUCCESS))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, gballoc_free(NULL))
+            .IgnoreArgument(1);
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback2, g_callbackCtx);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_168: [A message shall not be failed for lack of acknowledgement sooner than 2 min after it was first published, whatever the retransmit timeout: the last allowed send shall schedule its deadline no earlier than that.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_with_minimum_retransmit_timeout_fails_the_message_2_minutes_after_its_first_publish)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        PUBLISH_ACK puback1;
+        puback1.packetId = 1;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback1, g_callbackCtx);
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_current_ms = 1000 + 1;
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        g_current_ms = 2 * 60 * 1000;
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, gballoc_free(NULL));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_GetString_fails)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING)).SetReturn((const char*)NULL);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+    
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_GetByteArray_Error_fail)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(3)
+            .SetReturn(IOTHUB_MESSAGE_ERROR);
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_mqtt_client_publish_fails)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(3);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, appMessage, appMsgSize))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .SetReturn(__LINE__);
+        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, gballoc_free(NULL));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_030: [IoTHubTransportMqtt_DoWork shall call mqtt_client_dowork everytime it is called if it is connected.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_mqttmessage_create_fails)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetByteArray(TEST_IOTHUB_MSG_BYTEARRAY, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(3);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(IGNORED_NUM_ARG, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, appMessage, appMsgSize))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2)
+            .SetReturn( (MQTT_MESSAGE_HANDLE)NULL);
+        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(1)
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
+            .IgnoreArgument(2);
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, gballoc_free(NULL));
+        EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+
+        // act
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_023: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_InvalidHandleArgument_fail)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        IOTHUB_CLIENT_STATUS status;
+
+        // act
+        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(NULL, &status);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_023: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_InvalidStatusArgument_fail)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        // act
+        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(handle, NULL);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_024: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_IDLE if there are currently no event items to be sent or being sent.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_empty_waitingToSend_and_empty_waitingforAck_success)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, DList_IsListEmpty(config.waitingToSend) );
+        STRICT_EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG) ).IgnoreArgument(1);
+
+        IOTHUB_CLIENT_STATUS status;
+
+        // act
+        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(handle, &status);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_STATUS, status, IOTHUB_CLIENT_SEND_STATUS_IDLE);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_025: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_BUSY if there are currently event items to be sent or being sent.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_waitingToSend_not_empty_success)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+
+        IOTHUB_MESSAGE_HANDLE eventMessageHandle = IoTHubMessage_CreateFromByteArray(IGNORED_PTR_ARG, IGNORED_NUM_ARG);
+        IOTHUB_MESSAGE_LIST newEntry;
+        newEntry.messageHandle = &newEntry;
+        DList_InsertTailList(config.waitingToSend, &(newEntry.entry));
+
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, DList_IsListEmpty(config.waitingToSend) );
+
+        IOTHUB_CLIENT_STATUS status;
+
+        // act
+        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(handle, &status);
+
+        // assert
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_STATUS, status, IOTHUB_CLIENT_SEND_STATUS_BUSY);
+
+        mocks.AssertActualAndExpectedCalls();
+
+        // cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+        IoTHubMessage_Destroy(eventMessageHandle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_022: [This function shall return a pointer to a structure of type TRANSPORT_PROVIDER having the following values for its fields: IoTHubTransport_Create = IoTHubTransportMqtt_Create
+    IoTHubTransport_Destroy = IoTHubTransportMqtt_Destroy
+    IoTHubTransport_Subscribe = IoTHubTransportMqtt_Subscribe
+    IoTHubTransport_Unsubscribe = IoTHubTransportMqtt_Unsubscribe
+    IoTHubTransport_DoWork = IoTHubTransportMqtt_DoWork
+    IoTHubTransport_SetOption = IoTHubTransportMqtt_SetOption] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Protocol_succeeds)
+    {
+        ///arrange
+
+        ///act
+        auto result = MQTT_Protocol();
+
+        ///assert
+        ASSERT_IS_NOT_NULL(result);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_SetOption, (void*)IoTHubTransportMqtt_SetOption);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Create, (void*)IoTHubTransportMqtt_Create);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Destroy, (void*)IoTHubTransportMqtt_Destroy);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Subscribe, (void*)IoTHubTransportMqtt_Subscribe);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Unsubscribe, (void*)IoTHubTransportMqtt_Unsubscribe);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_DoWork, (void*)IoTHubTransportMqtt_DoWork);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_GetSendStatus, (void*)IoTHubTransportMqtt_GetSendStatus);
+        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_SetDeviceOption, (void*)IoTHubTransportMqtt_SetDeviceOption);
+
+        ///cleanup
+    }
+
+    TEST_FUNCTION(IoTHubTransportMqtt_delivered_NULL_context_do_Nothing)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, xio_close(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .IgnoreArgument(3);
+
+        // act
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_ERROR, NULL, g_callbackCtx);
+
+        // assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_DISCONNECT_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        // act
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_CONN_ACK_NOT_CONNECTED_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        CONNECT_ACK connack;
+        connack.isSessionPresent = false;
+        connack.returnCode = CONN_REFUSED_BAD_USERNAME_PASSWORD;
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_disconnect(TEST_MQTT_CLIENT_HANDLE))
+            .IgnoreArgument(1);
+
+        // act
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_CONNACK_NULL_msgInfo_fail)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
+
+        // act
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, NULL, g_callbackCtx);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_PUBLISH_ACK_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        PUBLISH_ACK puback;
+        puback.packetId = 1;
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG))
+            .IgnoreAllArguments();
+        STRICT_EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG))
+            .IgnoreAllArguments();
+        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .IgnoreAllArguments();
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_SUCCESS))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, gballoc_free(NULL))
+            .IgnoreArgument(1);
+
+        // act
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback, g_callbackCtx);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_136: [On PUBACK the transport shall locate the acknowledged message by its packet id without scanning the Waiting Acknowledge list.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_PUBLISH_ACK_unknown_packetId_does_nothing)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        PUBLISH_ACK puback;
+        puback.packetId = 1 + 256;
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        // act
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback, g_callbackCtx);
+
+        //assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_137: [A resent message shall keep the packet id it was first published with.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_172: [A resent message shall be published with the DUP flag set.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_resend_message_keeps_packetId)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        g_current_ms = 5*60*1000;
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetContentType(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_GetString(TEST_IOTHUB_MSG_STRING));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_create(1, IGNORED_PTR_ARG, DELIVER_AT_LEAST_ONCE, (const uint8_t*)appMessageString, strlen(appMessageString)))
+            .IgnoreArgument(2);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_setIsDuplicateMsg(TEST_MQTT_MESSAGE_HANDLE, true));
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
             .IgnoreArgument(2);
         STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_FAILED))
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
             .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
-        EXPECTED_CALL(mocks, gballoc_free(NULL));
         EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_EVENT_TOPIC));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_destroy(TEST_MQTT_MESSAGE_HANDLE));
 
         // act
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
@@ -2458,8 +3780,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_023: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_InvalidHandleArgument_fail)
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_message_NULL_fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2467,24 +3788,21 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        mocks.ResetAllCalls();
 
-        IOTHUB_CLIENT_STATUS status;
+        mocks.ResetAllCalls();
 
         // act
-        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(NULL, &status);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(NULL, g_callbackCtx);
 
         // assert
-        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG);
-
         mocks.AssertActualAndExpectedCalls();
 
-        // cleanup
+        //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Test_SRS_IOTHUB_MQTT_TRANSPORT_07_023: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_INVALID_ARG if called with NULL parameter.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_InvalidStatusArgument_fail)
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_context_NULL_fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2492,22 +3810,44 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
+
         mocks.ResetAllCalls();
 
         // act
-        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(handle, NULL);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, NULL);
 
         // assert
-        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_INVALID_ARG);
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_Message_context_NULL_fail)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+
+        mocks.ResetAllCalls();
 
+        // act
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(NULL, NULL);
+
+        // assert
         mocks.AssertActualAndExpectedCalls();
 
-        // cleanup
+        //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_024: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_IDLE if there are currently no event items to be sent or being sent.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_empty_waitingToSend_and_empty_waitingforAck_success)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_148: [When a message is received the transport shall copy the topic properties once into its topic buffer and url decode each name and value in place.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_succeed)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2515,28 +3855,31 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, DList_IsListEmpty(config.waitingToSend) );
-        STRICT_EXPECTED_CALL(mocks, DList_IsListEmpty(IGNORED_PTR_ARG) ).IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE) );
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize) );
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
 
-        IOTHUB_CLIENT_STATUS status;
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
 
         // act
-        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(handle, &status);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
 
         // assert
-        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
-        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_STATUS, status, IOTHUB_CLIENT_SEND_STATUS_IDLE);
-
         mocks.AssertActualAndExpectedCalls();
 
-        // cleanup
+        //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_025: [IoTHubTransportMqtt_GetSendStatus shall return IOTHUB_CLIENT_OK and status IOTHUB_CLIENT_SEND_STATUS_BUSY if there are currently event items to be sent or being sent.] */
-    TEST_FUNCTION(IoTHubTransportMqtt_GetSendStatus_waitingToSend_not_empty_success)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_150: [Every other received property that has a value shall be added to the message properties with Map_AddOrUpdate.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_with_Properties_succeed)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2544,59 +3887,95 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
 
-        IOTHUB_MESSAGE_HANDLE eventMessageHandle = IoTHubMessage_CreateFromByteArray(IGNORED_PTR_ARG, IGNORED_NUM_ARG);
-        IOTHUB_MESSAGE_LIST newEntry;
-        newEntry.messageHandle = &newEntry;
-        DList_InsertTailList(config.waitingToSend, &(newEntry.entry));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, Map_AddOrUpdate(TEST_MESSAGE_PROP_MAP, "propName", "PropValue"));
+        STRICT_EXPECTED_CALL(mocks, Map_AddOrUpdate(TEST_MESSAGE_PROP_MAP, "DeviceInfo", "smokeTest"));
+
+        // act
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+
+        // assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_with_Properties_Map_AddorUpdate_fail)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, DList_IsListEmpty(config.waitingToSend) );
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
 
-        IOTHUB_CLIENT_STATUS status;
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        EXPECTED_CALL(mocks, Map_AddOrUpdate(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG)).SetReturn(MAP_ERROR);
 
         // act
-        IOTHUB_CLIENT_RESULT result = IoTHubTransportMqtt_GetSendStatus(handle, &status);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
 
         // assert
-        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, result, IOTHUB_CLIENT_OK);
-        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_STATUS, status, IOTHUB_CLIENT_SEND_STATUS_BUSY);
-
         mocks.AssertActualAndExpectedCalls();
 
-        // cleanup
+        //cleanup
         IoTHubTransportMqtt_Destroy(handle);
-        IoTHubMessage_Destroy(eventMessageHandle);
     }
 
-    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_022: [This function shall return a pointer to a structure of type TRANSPORT_PROVIDER having the following values for its fields: IoTHubTransport_Create = IoTHubTransportMqtt_Create
-    IoTHubTransport_Destroy = IoTHubTransportMqtt_Destroy
-    IoTHubTransport_Subscribe = IoTHubTransportMqtt_Subscribe
-    IoTHubTransport_Unsubscribe = IoTHubTransportMqtt_Unsubscribe
-    IoTHubTransport_DoWork = IoTHubTransportMqtt_DoWork
-    IoTHubTransport_SetOption = IoTHubTransportMqtt_SetOption] */
-    TEST_FUNCTION(IoTHubTransportMqtt_Protocol_succeeds)
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_topic_buffer_alloc_fail)
     {
-        ///arrange
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
-        ///act
-        auto result = MQTT_Protocol();
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
 
-        ///assert
-        ASSERT_IS_NOT_NULL(result);
-        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_SetOption, (void*)IoTHubTransportMqtt_SetOption);
-        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Create, (void*)IoTHubTransportMqtt_Create);
-        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Destroy, (void*)IoTHubTransportMqtt_Destroy);
-        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Subscribe, (void*)IoTHubTransportMqtt_Subscribe);
-        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_Unsubscribe, (void*)IoTHubTransportMqtt_Unsubscribe);
-        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_DoWork, (void*)IoTHubTransportMqtt_DoWork);
-        ASSERT_ARE_EQUAL(void_ptr, (void*)((TRANSPORT_PROVIDER*)result)->IoTHubTransport_GetSendStatus, (void*)IoTHubTransportMqtt_GetSendStatus);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
 
-        ///cleanup
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG)).SetReturn((void*)NULL);
+
+        // act
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+
+        // assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_delivered_NULL_context_do_Nothing)
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_IoTHubMessage_Properties_fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2604,15 +3983,55 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        mocks.ResetAllCalls();
+
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY)).SetReturn((MAP_HANDLE)NULL);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
+
+        // act
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+
+        // assert
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_149: [A received "$.mid" property shall be set with IoTHubMessage_SetMessageId and a received "$.cid" property with IoTHubMessage_SetCorrelationId; the other system properties shall not be added to the message properties.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_with_System_Properties_succeed)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, xio_close(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreArgument(2)
-            .IgnoreArgument(3);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_SYS_PROP);
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_SetMessageId(TEST_IOTHUB_MSG_BYTEARRAY, "msg-1"));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_SetCorrelationId(TEST_IOTHUB_MSG_BYTEARRAY, "corr 1"));
+        STRICT_EXPECTED_CALL(mocks, Map_AddOrUpdate(TEST_MESSAGE_PROP_MAP, "propName", "PropValue"));
 
         // act
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_ERROR, NULL, g_callbackCtx);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
 
         // assert
         mocks.AssertActualAndExpectedCalls();
@@ -2621,7 +4040,7 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_DISCONNECT_succeed)
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_SetMessageId_fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2629,75 +4048,104 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_SYS_PROP);
+        EXPECTED_CALL(mocks, gballoc_realloc(IGNORED_PTR_ARG, IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_SetMessageId(TEST_IOTHUB_MSG_BYTEARRAY, "msg-1"))
+            .SetReturn(IOTHUB_MESSAGE_ERROR);
+
         // act
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_DISCONNECT, NULL, g_callbackCtx);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
 
-        //assert
+        // assert
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_CONN_ACK_NOT_CONNECTED_succeed)
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_CreateIotHubMessage_Fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
-        CONNECT_ACK connack;
-        connack.isSessionPresent = false;
-        connack.returnCode = CONN_REFUSED_BAD_USERNAME_PASSWORD;
-
         auto handle = IoTHubTransportMqtt_Create(&config);
+
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqtt_client_disconnect(TEST_MQTT_CLIENT_HANDLE))
-            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize))
+            .SetReturn((IOTHUB_MESSAGE_HANDLE)NULL);
 
         // act
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, &connack, g_callbackCtx);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
 
-        //assert
+        // assert
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
-
-    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_CONNACK_NULL_msgInfo_fail)
+    
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_messagecallback_ABANDONED_fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
+
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
         auto handle = IoTHubTransportMqtt_Create(&config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY))
+            .SetReturn((IOTHUBMESSAGE_DISPOSITION_RESULT)IOTHUBMESSAGE_ABANDONED);
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
+
         // act
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_CONNACK, NULL, g_callbackCtx);
+        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
 
-        //assert
+        // assert
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MqttOpCompleteCallback_PUBLISH_ACK_succeed)
+    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_messagecallback_REJECTED_fail)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
-        PUBLISH_ACK puback;
-        puback.packetId = 1;
-
         QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
         SUBSCRIBE_ACK suback;
         suback.packetId = 1234;
@@ -2711,28 +4159,28 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, DList_RemoveEntryList(IGNORED_PTR_ARG))
-            .IgnoreAllArguments();
-        STRICT_EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG))
-            .IgnoreAllArguments();
-        STRICT_EXPECTED_CALL(mocks, DList_InsertTailList(IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .IgnoreAllArguments();
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_SendComplete(TEST_IOTHUB_CLIENT_LL_HANDLE, IGNORED_PTR_ARG, IOTHUB_BATCHSTATE_SUCCESS))
-            .IgnoreArgument(2);
-        STRICT_EXPECTED_CALL(mocks, gballoc_free(NULL))
-            .IgnoreArgument(1);
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
+        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY))
+            .SetReturn((IOTHUBMESSAGE_DISPOSITION_RESULT)IOTHUBMESSAGE_REJECTED);
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+
+        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE));
+        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
 
         // act
-        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback, g_callbackCtx);
+        ASSERT_IS_NOT_NULL( (void*)g_fnMqttMsgRecv);
+        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
 
-        //assert
+        // assert
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_message_NULL_fail)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_004: [ IoTHubTransportMqtt_Register shall return the TRANSPORT_LL_HANDLE as the IOTHUB_DEVICE_HANDLE. ]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_succeeds_returns_transport)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2740,21 +4188,25 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-
         mocks.ResetAllCalls();
 
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(NULL, g_callbackCtx);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
         // assert
+        ASSERT_IS_NOT_NULL(devHandle);
+        ASSERT_ARE_EQUAL(void_ptr, handle, devHandle);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_context_NULL_fail)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_004: [ IoTHubTransportMqtt_Register shall return the TRANSPORT_LL_HANDLE as the IOTHUB_DEVICE_HANDLE. ]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_twice_fails_second_time)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2762,21 +4214,26 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
         mocks.ResetAllCalls();
 
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, NULL);
+        auto devHandle2 = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
         // assert
+        ASSERT_IS_NULL(devHandle2);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_Message_context_NULL_fail)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_003: [ IoTHubTransportMqtt_Register shall return NULL if deviceId or deviceKey do not match the deviceId and deviceKey passed in during IoTHubTransportMqtt_Create.]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_deviceKey_mismatch_returns_null)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2784,21 +4241,24 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-
         mocks.ResetAllCalls();
 
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(NULL, NULL);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, "not the right device key", TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
         // assert
+        ASSERT_IS_NULL(devHandle);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_succeed)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_003: [ IoTHubTransportMqtt_Register shall return NULL if deviceId or deviceKey do not match the deviceId and deviceKey passed in during IoTHubTransportMqtt_Create.]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_deviceid_mismatch_returns_null)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2806,39 +4266,23 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE) );
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize) );
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
-
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC));
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_new());
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_destroy(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
         EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
 
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, "not a good id after all", TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
         // assert
+        ASSERT_IS_NULL(devHandle);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_with_Properties_succeed)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_002: [ IoTHubTransportMqtt_Register shall return NULL if deviceId, deviceKey or waitingToSend are NULL.]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_wts_null_returns_null)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2846,53 +4290,21 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        g_tokenizerIndex = 1;
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
-
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC_W_1_PROP));
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_new());
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_destroy(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2)
-            .ExpectedTimesExactly(5);
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(5);
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
-            .ExpectedTimesExactly(4);
-        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(4);
-        EXPECTED_CALL(mocks, Map_AddOrUpdate(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(2);
-
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, NULL);
 
         // assert
+        ASSERT_IS_NULL(devHandle);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_with_Properties_Map_AddorUpdate_fail)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_002: [ IoTHubTransportMqtt_Register shall return NULL if deviceId, deviceKey or waitingToSend are NULL.]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_devicekey_null_returns_null)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2900,51 +4312,22 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        g_tokenizerIndex = 1;
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
-
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC_W_1_PROP));
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_new());
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_destroy(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2)
-            .ExpectedTimesExactly(2);
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
-            .ExpectedTimesExactly(2);
-        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(2);
-        EXPECTED_CALL(mocks, Map_AddOrUpdate(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG)).SetReturn(MAP_ERROR);
 
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, NULL, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
         // assert
+        ASSERT_IS_NULL(devHandle);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_STRING_construct_fail)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_002: [ IoTHubTransportMqtt_Register shall return NULL if deviceId, deviceKey or waitingToSend are NULL.]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_devicename_null_returns_null)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2952,32 +4335,43 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        g_tokenizerIndex = 1;
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+        // act
+        auto devHandle = IoTHubTransportMqtt_Register(handle, NULL, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC_W_1_PROP));
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG)).SetReturn((STRING_TOKENIZER_HANDLE)NULL);
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
+        // assert
+        ASSERT_IS_NULL(devHandle);
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
+
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_001: [ IoTHubTransportMqtt_Register shall return NULL if the TRANSPORT_LL_HANDLE is NULL.]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_transport_null_returns_null)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.ResetAllCalls();
 
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        auto devHandle = IoTHubTransportMqtt_Register(NULL, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
         // assert
+        ASSERT_IS_NULL(devHandle);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_IoTHubMessage_Properties_fail)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_005: [ IoTHubTransportMqtt_Unregister shall return. ]
+    TEST_FUNCTION(IoTHubTransportMqtt_Unregister_succeeds)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -2985,25 +4379,13 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        g_tokenizerIndex = 1;
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
-        mocks.ResetAllCalls();
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+        mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC_W_1_PROP));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY)).SetReturn((MAP_HANDLE)NULL);
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_destroy(TEST_STRING_TOKENIZER_HANDLE));
 
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        IoTHubTransportMqtt_Unregister(devHandle);
 
         // assert
         mocks.AssertActualAndExpectedCalls();
@@ -3012,7 +4394,8 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_with_System_Properties_succeed)
+    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_004: [ IoTHubTransportMqtt_Register shall return the TRANSPORT_LL_HANDLE as the IOTHUB_DEVICE_HANDLE. ]
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_Unregister_Register_returns_handle)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
@@ -3020,82 +4403,94 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        g_tokenizerIndex = 1;
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        IoTHubTransportMqtt_Unregister(devHandle);
+
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+
+        // act
+        auto devHandle2 = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+
+        // assert
+        ASSERT_IS_NOT_NULL(devHandle2);
+        ASSERT_ARE_EQUAL(void_ptr, handle, devHandle2);
+        mocks.AssertActualAndExpectedCalls();
+
+        //cleanup
+        IoTHubTransportMqtt_Destroy(handle);
+    }
 
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE)).SetReturn(TEST_MQTT_MSG_TOPIC_W_1_PROP);
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC_W_1_PROP));
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_new());
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+    static void SetupDeviceHostConfig(IOTHUBTRANSPORT_CONFIG* config)
+    {
+        SetupIothubTransportConfig(config, NULL, NULL, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, NULL);
+        config->waitingToSend = NULL;
+    }
 
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2)
-            .ExpectedTimesExactly(6);
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(5);
-        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG))
-            .ExpectedTimesExactly(4);
-        EXPECTED_CALL(mocks, gballoc_free(IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(4);
-        EXPECTED_CALL(mocks, Map_AddOrUpdate(IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
-            .ExpectedTimesExactly(2);
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_154: [If the upperConfig's deviceId and deviceKey and the config's waitingToSend are all NULL then IoTHubTransportMqtt_Create shall create a device host for the iotHubName and iotHubSuffix, which runs one MQTT connection per device registered with IoTHubTransportMqtt_Register.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Create_device_host_succeeds)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        SetupDeviceHostConfig(&config);
 
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_destroy(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_IOTHUB_NAME));
+        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_IOTHUB_SUFFIX));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_create());
+        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
 
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        auto handle = IoTHubTransportMqtt_Create(&config);
 
         // assert
+        ASSERT_IS_NOT_NULL(handle);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_CreateIotHubMessage_Fail)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_155: [IoTHubTransportMqtt_Register on a device host shall create a transport for the device with its own MQTT connection, add it to the hosted devices and return it as the IOTHUB_DEVICE_HANDLE.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_156: [IoTHubTransportMqtt_Register on a device host shall return NULL if the deviceId is already hosted or the device transport cannot be created.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_device_host_creates_a_transport_per_device)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        SetupDeviceHostConfig(&config);
+        DLIST_ENTRY waitingToSend2;
+        BASEIMPLEMENTATION::DList_InitializeListHead(&waitingToSend2);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
 
-        mocks.ResetAllCalls();
-
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize))
-            .SetReturn((IOTHUB_MESSAGE_HANDLE)NULL);
-
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
+        auto devHandle2 = IoTHubTransportMqtt_Register(handle, "otherDevice", TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &waitingToSend2);
+        auto devHandle3 = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
 
         // assert
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_IS_NOT_NULL(devHandle);
+        ASSERT_IS_NOT_NULL(devHandle2);
+        ASSERT_IS_NULL(devHandle3);
+        ASSERT_ARE_NOT_EQUAL(void_ptr, handle, devHandle);
+        ASSERT_ARE_NOT_EQUAL(void_ptr, devHandle, devHandle2);
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
-    
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_messagecallback_ABANDONED_fail)
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_157: [IoTHubTransportMqtt_DoWork on a device host shall service a hosted device, or only the device of iotHubClientHandle when it is not NULL, when the device has messages waiting to be sent, had MQTT activity or work in progress on its previous pass, or has been idle for the "device_host_idle_poll_ms" interval.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_160: [If the option parameter is set to "device_host_idle_poll_ms" on a device host then the value shall be a size_t_ptr setting how often, in milliseconds, a hosted device without work in progress is serviced.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_device_host_skips_idle_device)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        SetupDeviceHostConfig(&config);
 
         QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
         SUBSCRIBE_ACK suback;
@@ -3103,49 +4498,35 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
 
-        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        size_t idlePoll = 1000;
+
         auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "device_host_idle_poll_ms", &idlePoll);
+        (void)IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, NULL);
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY))
-            .SetReturn((IOTHUBMESSAGE_DISPOSITION_RESULT)IOTHUBMESSAGE_ABANDONED);
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
-
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC));
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_new());
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
             .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_destroy(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
 
         // act
-        ASSERT_IS_NOT_NULL((void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, NULL);
 
-        // assert
+        //assert
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    TEST_FUNCTION(IoTHubTransportMqtt_MessageRecv_messagecallback_REJECTED_fail)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_157: [IoTHubTransportMqtt_DoWork on a device host shall service a hosted device, or only the device of iotHubClientHandle when it is not NULL, when the device has messages waiting to be sent, had MQTT activity or work in progress on its previous pass, or has been idle for the "device_host_idle_poll_ms" interval.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_device_host_services_device_after_idle_poll_interval)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        SetupDeviceHostConfig(&config);
 
         QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
         SUBSCRIBE_ACK suback;
@@ -3153,284 +4534,344 @@ BEGIN_TEST_SUITE(iothubtransportmqtt)
         suback.qosCount = 1;
         suback.qosReturn = QosValue;
 
-        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        size_t idlePoll = 1000;
+
         auto handle = IoTHubTransportMqtt_Create(&config);
+        (void)IoTHubTransportMqtt_SetOption(handle, "device_host_idle_poll_ms", &idlePoll);
+        (void)IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
         g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
-        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        IoTHubTransportMqtt_DoWork(handle, NULL);
+        g_current_ms = 1000;
         mocks.ResetAllCalls();
 
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getApplicationMsg(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_CreateFromByteArray(appMessage, appMsgSize));
-        STRICT_EXPECTED_CALL(mocks, IoTHubClient_LL_MessageCallback(TEST_IOTHUB_CLIENT_LL_HANDLE, TEST_IOTHUB_MSG_BYTEARRAY))
-            .SetReturn((IOTHUBMESSAGE_DISPOSITION_RESULT)IOTHUBMESSAGE_REJECTED);
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Destroy(TEST_IOTHUB_MSG_BYTEARRAY));
-
-        STRICT_EXPECTED_CALL(mocks, mqttmessage_getTopicName(TEST_MQTT_MESSAGE_HANDLE));
-        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_MQTT_MSG_TOPIC));
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_create(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, STRING_new());
-        STRICT_EXPECTED_CALL(mocks, STRING_TOKENIZER_get_next_token(IGNORED_PTR_ARG, IGNORED_PTR_ARG, "&"))
-            .IgnoreArgument(1)
-            .IgnoreArgument(2);
-        EXPECTED_CALL(mocks, STRING_TOKENIZER_destroy(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_delete(IGNORED_PTR_ARG));
-        STRICT_EXPECTED_CALL(mocks, IoTHubMessage_Properties(TEST_IOTHUB_MSG_BYTEARRAY));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2)
+            .ExpectedTimesExactly(2);
+        STRICT_EXPECTED_CALL(mocks, mqtt_client_dowork(TEST_MQTT_CLIENT_HANDLE));
 
         // act
-        ASSERT_IS_NOT_NULL( (void*)g_fnMqttMsgRecv);
-        g_fnMqttMsgRecv(TEST_MQTT_MESSAGE_HANDLE, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, NULL);
 
-        // assert
+        //assert
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_004: [ IoTHubTransportMqtt_Register shall return the TRANSPORT_LL_HANDLE as the IOTHUB_DEVICE_HANDLE. ]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_succeeds_returns_transport)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_158: [IoTHubTransportMqtt_Unregister on a hosted device shall remove it from its device host and destroy it.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Unregister_device_host_removes_device)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        SetupDeviceHostConfig(&config);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        mocks.ResetAllCalls();
-
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
 
         // act
-        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        IoTHubTransportMqtt_Unregister(devHandle);
 
         // assert
-        ASSERT_IS_NOT_NULL(devHandle);
-        ASSERT_ARE_EQUAL(void_ptr, handle, devHandle);
+        mocks.ResetAllCalls();
+        STRICT_EXPECTED_CALL(mocks, tickcounter_get_current_ms(TEST_COUNTER_HANDLE, IGNORED_PTR_ARG))
+            .IgnoreArgument(2);
+
+        IoTHubTransportMqtt_DoWork(handle, NULL);
+
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_004: [ IoTHubTransportMqtt_Register shall return the TRANSPORT_LL_HANDLE as the IOTHUB_DEVICE_HANDLE. ]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_twice_fails_second_time)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_171: [The transport of a hosted device shall be created with the protocolGatewayHostName given to the device host.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Create_device_host_with_protocol_gateway_succeeds)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
-
-        auto handle = IoTHubTransportMqtt_Create(&config);
-        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
-
-        mocks.ResetAllCalls();
+        SetupDeviceHostConfig(&config);
+        g_iothubClientConfig.protocolGatewayHostName = TEST_PROTOCOL_GATEWAY_HOSTNAME;
 
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        EXPECTED_CALL(mocks, gballoc_malloc(IGNORED_NUM_ARG));
+        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_IOTHUB_NAME));
+        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_IOTHUB_SUFFIX));
+        STRICT_EXPECTED_CALL(mocks, STRING_construct(TEST_PROTOCOL_GATEWAY_HOSTNAME));
+        STRICT_EXPECTED_CALL(mocks, tickcounter_create());
+        EXPECTED_CALL(mocks, DList_InitializeListHead(IGNORED_PTR_ARG));
 
         // act
-        auto devHandle2 = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        auto handle = IoTHubTransportMqtt_Create(&config);
+        mocks.AssertActualAndExpectedCalls();
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
 
         // assert
-        ASSERT_IS_NULL(devHandle2);
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_IS_NOT_NULL(handle);
+        ASSERT_IS_NOT_NULL(devHandle);
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_003: [ IoTHubTransportMqtt_Register shall return NULL if deviceId or deviceKey do not match the deviceId and deviceKey passed in during IoTHubTransportMqtt_Create.]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_deviceKey_mismatch_returns_null)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_169: [IoTHubTransportMqtt_SetOption on a device host shall keep a copy of the value of the MQTT transport options and of the "TrustedCerts", "x509certificate" and "x509privatekey" options, and IoTHubTransportMqtt_Register shall set them on every device it registers afterwards.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Register_device_host_sets_the_saved_options_on_new_devices)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        SetupDeviceHostConfig(&config);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        mocks.ResetAllCalls();
-
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        auto setOptionResult = IoTHubTransportMqtt_SetOption(handle, "TrustedCerts", "some certificates");
+        size_t certsSetBeforeRegister = g_trustedCertsSetCount;
 
         // act
-        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, "not the right device key", TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
+        size_t certsSetAfterFirstRegister = g_trustedCertsSetCount;
+        auto devHandle2 = IoTHubTransportMqtt_Register(handle, "otherDevice", TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
 
         // assert
-        ASSERT_IS_NULL(devHandle);
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, setOptionResult);
+        ASSERT_IS_NOT_NULL(devHandle);
+        ASSERT_IS_NOT_NULL(devHandle2);
+        ASSERT_ARE_EQUAL(size_t, 0, certsSetBeforeRegister);
+        ASSERT_ARE_EQUAL(size_t, 1, certsSetAfterFirstRegister);
+        ASSERT_ARE_EQUAL(size_t, 2, g_trustedCertsSetCount);
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_003: [ IoTHubTransportMqtt_Register shall return NULL if deviceId or deviceKey do not match the deviceId and deviceKey passed in during IoTHubTransportMqtt_Create.]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_deviceid_mismatch_returns_null)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_169: [IoTHubTransportMqtt_SetOption on a device host shall keep a copy of the value of the MQTT transport options and of the "TrustedCerts", "x509certificate" and "x509privatekey" options, and IoTHubTransportMqtt_Register shall set them on every device it registers afterwards.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_SetOption_device_host_invalid_telemetry_qos_fails)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        SetupDeviceHostConfig(&config);
+        int qos = 2;
 
         auto handle = IoTHubTransportMqtt_Create(&config);
         mocks.ResetAllCalls();
 
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-
         // act
-        auto devHandle = IoTHubTransportMqtt_Register(handle, "not a good id after all", TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        auto result = IoTHubTransportMqtt_SetOption(handle, "telemetry_qos", &qos);
 
         // assert
-        ASSERT_IS_NULL(devHandle);
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_INVALID_ARG, result);
         mocks.AssertActualAndExpectedCalls();
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_002: [ IoTHubTransportMqtt_Register shall return NULL if deviceId, deviceKey or waitingToSend are NULL.]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_wts_null_returns_null)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_170: [IoTHubTransportMqtt_SetDeviceOption shall set the option on the transport of the device, which is the hosted device's own transport on a device host, as IoTHubTransportMqtt_SetOption does.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_161: [IoTHubTransportMqtt_SetOption on a device host shall apply any other option to every device currently hosted and return the first failure, if any.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_SetDeviceOption_on_a_hosted_device_only_sets_that_device)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        SetupDeviceHostConfig(&config);
 
         auto handle = IoTHubTransportMqtt_Create(&config);
-        mocks.ResetAllCalls();
+        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
+        (void)IoTHubTransportMqtt_Register(handle, "otherDevice", TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, &g_waitingToSend);
 
         // act
-        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, NULL);
+        auto deviceResult = IoTHubTransportMqtt_SetDeviceOption(devHandle, "TrustedCerts", "some certificates");
+        size_t certsSetOnDevice = g_trustedCertsSetCount;
+        auto hostResult = IoTHubTransportMqtt_SetOption(handle, "TrustedCerts", "some certificates");
 
         // assert
-        ASSERT_IS_NULL(devHandle);
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, deviceResult);
+        ASSERT_ARE_EQUAL(IOTHUB_CLIENT_RESULT, IOTHUB_CLIENT_OK, hostResult);
+        ASSERT_ARE_EQUAL(size_t, 1, certsSetOnDevice);
+        ASSERT_ARE_EQUAL(size_t, 3, g_trustedCertsSetCount);
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
+#else
+    // iothubtransportmqtt_staticpools_unittests builds these with MQTT_MAX_INFLIGHT_MESSAGES=2 and MQTT_MAX_TOPIC_LENGTH=64
+    static TRANSPORT_LL_HANDLE CreateTransportReadyToPublish(IOTHUBTRANSPORT_CONFIG* config)
+    {
+        QOS_VALUE QosValue[] = { DELIVER_AT_LEAST_ONCE };
+        SUBSCRIBE_ACK suback;
+        suback.packetId = 1234;
+        suback.qosCount = 1;
+        suback.qosReturn = QosValue;
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_002: [ IoTHubTransportMqtt_Register shall return NULL if deviceId, deviceKey or waitingToSend are NULL.]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_devicekey_null_returns_null)
+        SetupIothubTransportConfig(config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        TRANSPORT_LL_HANDLE handle = IoTHubTransportMqtt_Create(config);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_SUBSCRIBE_ACK, &suback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        return handle;
+    }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_165: [When built with USE_MQTT_STATIC_POOLS, IoTHubTransportMqtt_Create shall allocate the topic buffer of MQTT_MAX_TOPIC_LENGTH bytes and MQTT_MAX_INFLIGHT_MESSAGES waiting acknowledge entries once, and IoTHubTransportMqtt_DoWork shall not allocate them per message.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_static_pools_publishes_without_allocating)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
-
-        auto handle = IoTHubTransportMqtt_Create(&config);
-        mocks.ResetAllCalls();
-
+        auto handle = CreateTransportReadyToPublish(&config);
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        size_t mallocCallsBeforeDoWork = currentmalloc_call;
 
         // act
-        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, NULL, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
         // assert
-        ASSERT_IS_NULL(devHandle);
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, 1, g_publishCount);
+        ASSERT_ARE_EQUAL(size_t, mallocCallsBeforeDoWork, currentmalloc_call);
+        ASSERT_ARE_NOT_EQUAL(int, 0, BASEIMPLEMENTATION::DList_IsListEmpty(config.waitingToSend));
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_002: [ IoTHubTransportMqtt_Register shall return NULL if deviceId, deviceKey or waitingToSend are NULL.]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_devicename_null_returns_null)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_166: [When built with USE_MQTT_STATIC_POOLS, IoTHubTransportMqtt_DoWork shall leave QoS 1 messages in waitingToSend while all MQTT_MAX_INFLIGHT_MESSAGES slots are waiting for acknowledgement.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_static_pools_exhausted_leaves_messages_in_waitingToSend)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
-
-        auto handle = IoTHubTransportMqtt_Create(&config);
-        mocks.ResetAllCalls();
+        IOTHUB_MESSAGE_LIST message3 = { TEST_IOTHUB_MSG_STRING, NULL, NULL, { NULL, NULL } };
+        auto handle = CreateTransportReadyToPublish(&config);
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        DList_InsertTailList(config.waitingToSend, &(message3.entry));
 
         // act
-        auto devHandle = IoTHubTransportMqtt_Register(handle, NULL, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
         // assert
-        ASSERT_IS_NULL(devHandle);
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, MQTT_MAX_INFLIGHT_MESSAGES, g_publishCount);
+        ASSERT_ARE_EQUAL(size_t, 0, g_sendCompleteFailedCount);
+        ASSERT_ARE_EQUAL(void_ptr, &(message3.entry), config.waitingToSend->Flink);
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_001: [ IoTHubTransportMqtt_Register shall return NULL if the TRANSPORT_LL_HANDLE is NULL.]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_transport_null_returns_null)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_165: [When built with USE_MQTT_STATIC_POOLS, IoTHubTransportMqtt_Create shall allocate the topic buffer of MQTT_MAX_TOPIC_LENGTH bytes and MQTT_MAX_INFLIGHT_MESSAGES waiting acknowledge entries once, and IoTHubTransportMqtt_DoWork shall not allocate them per message.] */
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_166: [When built with USE_MQTT_STATIC_POOLS, IoTHubTransportMqtt_DoWork shall leave QoS 1 messages in waitingToSend while all MQTT_MAX_INFLIGHT_MESSAGES slots are waiting for acknowledgement.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_static_pools_reuses_the_slot_of_an_acknowledged_message)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
-
-        auto handle = IoTHubTransportMqtt_Create(&config);
-        mocks.ResetAllCalls();
+        IOTHUB_MESSAGE_LIST message3 = { TEST_IOTHUB_MSG_STRING, NULL, NULL, { NULL, NULL } };
+        PUBLISH_ACK puback;
+        puback.packetId = 1;
+        auto handle = CreateTransportReadyToPublish(&config);
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        DList_InsertTailList(config.waitingToSend, &(message3.entry));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        size_t mallocCallsBeforePuback = currentmalloc_call;
 
         // act
-        auto devHandle = IoTHubTransportMqtt_Register(NULL, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        g_fnMqttOperationCallback(TEST_MQTT_CLIENT_HANDLE, MQTT_CLIENT_ON_PUBLISH_ACK, &puback, g_callbackCtx);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
         // assert
-        ASSERT_IS_NULL(devHandle);
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, 1, g_sendCompleteSucceededCount);
+        ASSERT_ARE_EQUAL(size_t, MQTT_MAX_INFLIGHT_MESSAGES + 1, g_publishCount);
+        ASSERT_ARE_EQUAL(size_t, mallocCallsBeforePuback, currentmalloc_call);
+        ASSERT_ARE_NOT_EQUAL(int, 0, BASEIMPLEMENTATION::DList_IsListEmpty(config.waitingToSend));
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_005: [ IoTHubTransportMqtt_Unregister shall return. ]
-    TEST_FUNCTION(IoTHubTransportMqtt_Unregister_succeeds)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_167: [When built with USE_MQTT_STATIC_POOLS, a topic longer than MQTT_MAX_TOPIC_LENGTH shall fail the message instead of growing the topic buffer.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_static_pools_topic_longer_than_the_limit_fails_the_message)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
+        auto handle = CreateTransportReadyToPublish(&config);
 
-        auto handle = IoTHubTransportMqtt_Create(&config);
-        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        g_nullMapVariable = false;
+        char longValue[MQTT_MAX_TOPIC_LENGTH + 1];
+        (void)memset(longValue, 'a', MQTT_MAX_TOPIC_LENGTH);
+        longValue[MQTT_MAX_TOPIC_LENGTH] = '\0';
 
-        mocks.ResetAllCalls();
+        const size_t propCount = 1;
+        const char* keys[propCount] = { "propKey1" };
+        const char* values[propCount] = { longValue };
+        const char* const** ppKeys = (const char* const**)&keys;
+        const char* const** ppValues = (const char* const**)&values;
 
+        EXPECTED_CALL(mocks, Map_GetInternals(TEST_MESSAGE_PROP_MAP, IGNORED_PTR_ARG, IGNORED_PTR_ARG, IGNORED_PTR_ARG))
+            .CopyOutArgumentBuffer(2, &ppKeys, sizeof(ppKeys))
+            .CopyOutArgumentBuffer(3, &ppValues, sizeof(ppValues))
+            .CopyOutArgumentBuffer(4, &propCount, sizeof(propCount));
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        size_t mallocCallsBeforeDoWork = currentmalloc_call;
 
         // act
-        IoTHubTransportMqtt_Unregister(devHandle);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
         // assert
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, 0, g_publishCount);
+        ASSERT_ARE_EQUAL(size_t, 1, g_sendCompleteFailedCount);
+        ASSERT_ARE_EQUAL(size_t, mallocCallsBeforeDoWork, currentmalloc_call);
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
 
-    // Tests_SRS_IOTHUB_MQTT_TRANSPORT_17_004: [ IoTHubTransportMqtt_Register shall return the TRANSPORT_LL_HANDLE as the IOTHUB_DEVICE_HANDLE. ]
-    TEST_FUNCTION(IoTHubTransportMqtt_Register_Unregister_Register_returns_handle)
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_165: [When built with USE_MQTT_STATIC_POOLS, IoTHubTransportMqtt_Create shall allocate the topic buffer of MQTT_MAX_TOPIC_LENGTH bytes and MQTT_MAX_INFLIGHT_MESSAGES waiting acknowledge entries once, and IoTHubTransportMqtt_DoWork shall not allocate them per message.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_DoWork_static_pools_failed_resend_returns_the_slot)
     {
         // arrange
         CIoTHubTransportMqttMocks mocks;
         IOTHUBTRANSPORT_CONFIG config = { 0 };
-        SetupIothubTransportConfig(&config, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_NAME, TEST_IOTHUB_SUFFIX, TEST_PROTOCOL_GATEWAY_HOSTNAME);
-
-        auto handle = IoTHubTransportMqtt_Create(&config);
-        auto devHandle = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
-        IoTHubTransportMqtt_Unregister(devHandle);
-
-        mocks.ResetAllCalls();
+        IOTHUB_MESSAGE_LIST message3 = { TEST_IOTHUB_MSG_STRING, NULL, NULL, { NULL, NULL } };
+        auto handle = CreateTransportReadyToPublish(&config);
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
-        EXPECTED_CALL(mocks, STRING_c_str(IGNORED_PTR_ARG));
+        g_current_ms = 5 * 60 * 1000;
+        EXPECTED_CALL(mocks, mqtt_client_publish(TEST_MQTT_CLIENT_HANDLE, IGNORED_PTR_ARG))
+            .SetReturn(__LINE__);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message3.entry));
 
         // act
-        auto devHandle2 = IoTHubTransportMqtt_Register(handle, TEST_DEVICE_ID, TEST_DEVICE_KEY, TEST_IOTHUB_CLIENT_LL_HANDLE, config.waitingToSend);
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
 
         // assert
-        ASSERT_IS_NOT_NULL(devHandle2);
-        ASSERT_ARE_EQUAL(void_ptr, handle, devHandle2);
-        mocks.AssertActualAndExpectedCalls();
+        ASSERT_ARE_EQUAL(size_t, 1, g_sendCompleteFailedCount);
+        ASSERT_ARE_EQUAL(size_t, 4, g_publishCount); // the first send, the failed resend and the 2 messages using both slots
+        ASSERT_ARE_NOT_EQUAL(int, 0, BASEIMPLEMENTATION::DList_IsListEmpty(config.waitingToSend));
 
         //cleanup
         IoTHubTransportMqtt_Destroy(handle);
     }
+
+    /* Tests_SRS_IOTHUB_MQTT_TRANSPORT_07_014: [IoTHubTransportMqtt_Destroy shall free all the resources currently in use.] */
+    TEST_FUNCTION(IoTHubTransportMqtt_Destroy_static_pools_fails_the_messages_in_flight)
+    {
+        // arrange
+        CIoTHubTransportMqttMocks mocks;
+        IOTHUBTRANSPORT_CONFIG config = { 0 };
+        auto handle = CreateTransportReadyToPublish(&config);
+        DList_InsertTailList(config.waitingToSend, &(message1.entry));
+        DList_InsertTailList(config.waitingToSend, &(message2.entry));
+        IoTHubTransportMqtt_DoWork(handle, TEST_IOTHUB_CLIENT_LL_HANDLE);
+
+        // act
+        IoTHubTransportMqtt_Destroy(handle);
+
+        // assert
+        ASSERT_ARE_EQUAL(size_t, MQTT_MAX_INFLIGHT_MESSAGES, g_sendCompleteFailedCount);
+    }
+#endif
 END_TEST_SUITE(iothubtransportmqtt)